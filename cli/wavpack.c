@@ -202,7 +202,13 @@ static const char *help =
 "                             value between -1.0 and 1.0; negative values move noise\n"
 "                             lower in freq, positive values move noise higher\n"
 "                             in freq, use '0' for no shaping (white noise)\n"
+"    --seek-table            store a table of block positions at the end of the\n"
+"                             file so that players can seek directly to any block\n"
 "    -t                      copy input file's time stamp to output file(s)\n"
+"    --threads[=n]           use worker threads for encoding (n = 1 to 15,\n"
+"                             default = 4; output is identical to no threads);\n"
+"                             one block is encoded at a time, so more than one\n"
+"                             thread per stereo pair only helps with -x\n"
 "    --use-dns               force use of dynamic noise shaping (hybrid mode only)\n"
 "    -v                      verify output file integrity after write (no pipes)\n"
 "    --version               write the version to stdout\n"
@@ -388,6 +394,8 @@ int main (int argc, char **argv)
                 config.flags |= CONFIG_MERGE_BLOCKS;
             else if (!strcmp (long_option, "pair-unassigned-chans"))    // --pair-unassigned-chans
                 config.flags |= CONFIG_PAIR_UNDEF_CHANS;
+            else if (!strcmp (long_option, "seek-table"))               // --seek-table
+                config.flags |= CONFIG_SEEK_TABLE;
             else if (!strcmp (long_option, "import-id3"))               // --import-id3
                 import_id3 = 1;
             else if (!strcmp (long_option, "no-utf8-convert"))          // --no-utf8-convert
@@ -483,6 +491,18 @@ int main (int argc, char **argv)
                         config.qmode |= QMODE_SIGNED_BYTES;
                 }
             }
+            else if (!strncmp (long_option, "threads", 7)) {            // --threads
+                if (*long_param) {
+                    config.worker_threads = strtol (long_param, NULL, 10);
+
+                    if (config.worker_threads < 1 || config.worker_threads > 15) {
+                        error_line ("invalid number of threads!");
+                        ++error_count;
+                    }
+                }
+                else
+                    config.worker_threads = 4;
+            }
             else if (!strncmp (long_option, "blocksize", 9)) {          // --blocksize
                 config.block_samples = strtol (long_param, NULL, 10);
 
@@ -1918,6 +1938,11 @@ static int pack_file (char *infilename, char *outfilename, char *out2filename, c
     if (result == WAVPACK_NO_ERROR && (loc_config.flags & CONFIG_MD5_CHECKSUM))
         WavpackStoreMD5Sum (wpc, md5_digest);
 
+    // and the seek table (which must come after all the audio)
+
+    if (result == WAVPACK_NO_ERROR && (loc_config.flags & CONFIG_SEEK_TABLE))
+        WavpackStoreSeekTable (wpc);
+
     // if everything went well, and we're not ignoring length or encoding raw
     // pcm, read past any required data chunk padding and then try to read anything
     // else that might be appended to the audio data and write that to the WavPack
@@ -2311,6 +2336,7 @@ static int pack_audio (WavpackContext *wpc, FILE *infile, int qmode, unsigned ch
     MD5_CTX md5_context;
     int32_t quantize_bit_mask = 0;
     double fquantize_scale = 1.0, fquantize_iscale = 1.0;
+    int packed_input = 0;
 
     // don't use an absurd amount of memory just because we have an absurd number of channels
 
@@ -2335,6 +2361,19 @@ static int pack_audio (WavpackContext *wpc, FILE *infile, int qmode, unsigned ch
         }
     }
 
+    // Signed little-endian 16-bit and 24-bit PCM (by far the most common formats) can be handed
+    // directly to the library, which unpacks it straight into its stream buffers. The 16-bit
+    // version takes native shorts, so this only works for that on little-endian machines.
+
+    if (!quantize_bit_mask && !(qmode & (QMODE_BIG_ENDIAN | QMODE_UNSIGNED_WORDS)) &&
+        !(WavpackGetMode (wpc) & MODE_FLOAT)) {
+            static const uint16_t endian_test = 1;
+
+            if (WavpackGetBytesPerSample (wpc) == 3 ||
+                (WavpackGetBytesPerSample (wpc) == 2 && *(const unsigned char *) &endian_test))
+                    packed_input = WavpackGetBytesPerSample (wpc);
+    }
+
     while (1) {
         uint32_t bytes_to_read, bytes_read = 0;
         int32_t sample_count;
@@ -2371,7 +2410,7 @@ static int pack_audio (WavpackContext *wpc, FILE *infile, int qmode, unsigned ch
         if (!sample_count)
             break;
 
-        if (sample_count) {
+        if (sample_count && !packed_input) {
             int bps = WavpackGetBytesPerSample (wpc);
 
             load_samples (sample_buffer, input_buffer, qmode, bps, sample_count * WavpackGetNumChannels (wpc));
@@ -2404,11 +2443,13 @@ static int pack_audio (WavpackContext *wpc, FILE *infile, int qmode, unsigned ch
             }
         }
 
-        if (!WavpackPackSamples (wpc, sample_buffer, sample_count)) {
-            error_line ("%s", WavpackGetErrorMessage (wpc));
-            free (sample_buffer);
-            free (input_buffer);
-            return WAVPACK_HARD_ERROR;
+        if (!(packed_input == 2 ? WavpackPackSamplesInt16 (wpc, (int16_t *) input_buffer, sample_count) :
+            packed_input == 3 ? WavpackPackSamplesInt24 (wpc, input_buffer, sample_count) :
+            WavpackPackSamples (wpc, sample_buffer, sample_count))) {
+                error_line ("%s", WavpackGetErrorMessage (wpc));
+                free (sample_buffer);
+                free (input_buffer);
+                return WAVPACK_HARD_ERROR;
         }
 
         if (check_break ()) {
@@ -2926,6 +2967,9 @@ static int repack_file (char *infilename, char *outfilename, char *out2filename,
         }
     }
 
+    if (result == WAVPACK_NO_ERROR && (loc_config.flags & CONFIG_SEEK_TABLE))
+        WavpackStoreSeekTable (outfile);
+
     // this is where we deal with a trailer (i.e., trailing wrapper) if there is one
 
     if (result == WAVPACK_NO_ERROR && WavpackGetWrapperBytes (infile)) {
@@ -3718,6 +3762,9 @@ static void make_settings_string (char *settings, WavpackConfig *config)
     if (config->flags & CONFIG_PAIR_UNDEF_CHANS)
         strcat (settings, " --pair-unassigned-chans");
 
+    if (config->flags & CONFIG_SEEK_TABLE)
+        strcat (settings, " --seek-table");
+
     if (allow_huge_tags)
         strcat (settings, " --allow-huge-tags");
 }
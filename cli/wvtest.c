@@ -16,6 +16,10 @@
 #include <ctype.h>
 #include <math.h>
 #include <pthread.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "wavpack.h"
 #include "utils.h"                  // for PACKAGE_VERSION, etc.
@@ -47,6 +51,10 @@ static const char *usage =
 "          --no-floats         = skip the float modes\n"
 "          --no-lossy          = skip the lossy modes\n"
 "          --no-speeds         = skip the speed modes (fast, high, etc.)\n"
+"          --threads=n         = use n worker threads to encode & decode (0 to 15, default = 0)\n"
+"                                and verify results against single-threaded operation\n"
+"          --arena=n           = serve all library allocations from an n megabyte arena\n"
+"                                and verify that everything is returned to it at the end\n"
 "          --help              = display this message\n"
 "          --version           = write the version to stdout\n"
 "          --write=n[-n][,...] = write specific test(s) (or range(s)) to disk\n\n"
@@ -75,7 +83,7 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
 
 #define NUM_WRITE_RANGES 10
 static struct { int start, stop; } write_ranges [NUM_WRITE_RANGES];
-int number_of_ranges;
+int number_of_ranges, worker_threads;
 
 enum generator_type { noise, tone };
 
@@ -97,6 +105,16 @@ struct audio_generator {
 };
 
 static int seeking_test (char *filename, uint32_t test_count);
+static int probe_batch_test (char **filenames, int count);
+static int unpack_formats_test (char *filename);
+static int range_read_test (WavpackContext *wpc, unsigned char *chunked_md5, uint32_t chunk_samples, uint32_t total_chunks);
+static int seek_index_test (char *filename, unsigned char *chunked_md5, uint32_t chunk_samples, uint32_t total_chunks);
+static int remote_stats_test (char *filename, unsigned char *md5_expected);
+static void *load_file_image (const char *filename, const char *suffix, size_t *size);
+typedef WavpackContext *(*file_opener) (FILE *wv_file, FILE *wvc_file, char *error, int flags, int count, int32_t size);
+static WavpackContext *open_file_pair (const char *filename, char *error, int flags, file_opener opener, int count, int32_t size);
+static WavpackContext *open_file_prefetch (FILE *wv_file, FILE *wvc_file, char *error, int flags, int depth, int32_t buffer_size);
+static WavpackContext *open_file_remote (FILE *wv_file, FILE *wvc_file, char *error, int flags, int num_pages, int32_t page_size);
 static void tone_generator_init (struct audio_generator *cxt, int sample_rate, int low_freq, int high_freq);
 static void noise_generator_init (struct audio_generator *cxt, float factor);
 static void audio_generator_run (struct audio_generator *cxt, float *samples, int num_samples);
@@ -105,6 +123,7 @@ static void truncate_float_samples (float *samples, int num_samples, int bits);
 static void float_to_integer_samples (float *samples, int num_samples, int bits);
 static void float_to_32bit_integer_samples (float *samples, int num_samples);
 static void *store_samples (void *dst, int32_t *src, int qmode, int bps, int count);
+static int pack_samples_alternate (WavpackContext *wpc, WavpackConfig *config, int32_t *samples, uint32_t sample_count, int entry, int32_t *temp);
 static double frandom (void);
 
 typedef struct {
@@ -113,6 +132,7 @@ typedef struct {
     int push_back, done, error, empty_waits, full_waits;
     pthread_cond_t cond_read, cond_write;
     pthread_mutex_t mutex;
+    MD5_CTX md5_written;
     FILE *file;
 } StreamingFile;
 
@@ -120,7 +140,7 @@ typedef struct {
     StreamingFile *wv_stream, *wvc_stream;
     unsigned char md5_decoded [16];
     uint32_t sample_count;
-    int num_errors;
+    int num_errors, open_flags;
 } WavpackDecoder;
 
 static void initialize_stream (StreamingFile *ws, int buffer_size);
@@ -135,7 +155,8 @@ static WavpackStreamReader freader;
 int main (argc, argv) int argc; char **argv;
 {
     int wpconfig_flags = CONFIG_MD5_CHECKSUM | CONFIG_OPTIMIZE_MONO, test_flags = 0, base_minutes = 2, res;
-    int seektest = 0;
+    int seektest = 0, arena_megabytes = 0;
+    WavpackArena *arena = NULL;
 
     // loop through command-line arguments
 
@@ -186,6 +207,22 @@ int main (argc, argv) int argc; char **argv;
             else if (!strcmp (long_option, "no-decode")) {              // --no-decode
                 test_flags |= TEST_FLAG_NO_DECODE;
             }
+            else if (!strncmp (long_option, "threads", 7)) {            // --threads=n
+                worker_threads = strtol (long_param, &long_param, 10);
+
+                if (*long_param || worker_threads < 0 || worker_threads > 15) {
+                    printf ("invalid number of worker threads!\n");
+                    return 1;
+                }
+            }
+            else if (!strncmp (long_option, "arena", 5)) {              // --arena=n
+                arena_megabytes = strtol (long_param, &long_param, 10);
+
+                if (*long_param || arena_megabytes <= 0 || arena_megabytes > 2048) {
+                    printf ("invalid arena size!\n");
+                    return 1;
+                }
+            }
             else if (!strncmp (long_option, "write", 5)) {              // --write
                 for (number_of_ranges = 0; *long_param && isdigit (*long_param) && number_of_ranges < NUM_WRITE_RANGES;) {
                     write_ranges [number_of_ranges].start = strtol (long_param, &long_param, 10);
@@ -245,9 +282,24 @@ int main (argc, argv) int argc; char **argv;
         return 1;
     }
 
+    if (arena_megabytes) {
+        WavpackAllocator allocator;
+
+        if (!(arena = WavpackArenaCreate (NULL, (size_t) arena_megabytes << 20))) {
+            printf ("can't allocate arena!\n");
+            return 1;
+        }
+
+        WavpackArenaGetAllocator (arena, &allocator);
+        WavpackSetAllocator (&allocator);
+    }
+
     if (seektest) {
+        if ((res = probe_batch_test (argv + 1, argc - 1)))
+            goto done;
+
         while (--argc)
-            if ((res = seeking_test (*++argv, seektest)))
+            if ((res = seeking_test (*++argv, seektest)) || (res = unpack_formats_test (*argv)))
                 break;
     }
     else {
@@ -274,6 +326,21 @@ int main (argc, argv) int argc; char **argv;
     }
 
 done:
+    if (arena) {
+        size_t used, peak, overflows;
+
+        WavpackSetAllocator (NULL);
+        WavpackArenaGetStats (arena, &used, &peak, &overflows);
+        printf ("\narena: peak usage %lu bytes, %lu allocations overflowed\n", (unsigned long) peak, (unsigned long) overflows);
+
+        if (used) {
+            printf ("%lu bytes were never returned to the arena!\n", (unsigned long) used);
+            res = 1;
+        }
+
+        WavpackArenaDestroy (arena);
+    }
+
     if (res)
         printf ("\ntest failed!\n\n");
     else
@@ -282,22 +349,260 @@ done:
     return res;
 }
 
+// Probe all the seek test files at once with WavpackProbeBatch() (using several threads) and
+// make sure that each result matches probing the file by itself with WavpackProbe().
+
+static int probe_batch_test (char **filenames, int count)
+{
+    WavpackProbeInfo *batch_info = malloc (count * sizeof (WavpackProbeInfo)), single_info;
+    int num_threads = worker_threads ? worker_threads : 4, probed, i;
+
+    if (!batch_info) {
+        printf ("probe_batch_test(): can't allocate memory!\n");
+        return -1;
+    }
+
+    probed = WavpackProbeBatch ((const char **) filenames, count, batch_info, OPEN_ALT_TYPES, num_threads);
+
+    for (i = 0; i < count; ++i) {
+        WavpackProbe (filenames [i], &single_info, NULL, OPEN_ALT_TYPES);
+
+        if (memcmp (&single_info, batch_info + i, sizeof (single_info))) {
+            printf ("probe_batch_test(): batch probe of \"%s\" doesn't match!\n", filenames [i]);
+            free (batch_info);
+            return -1;
+        }
+
+        if (!single_info.sample_rate)
+            probed++;
+    }
+
+    free (batch_info);
+
+    if (probed != count) {
+        printf ("probe_batch_test(): batch probe returned wrong count!\n");
+        return -1;
+    }
+
+    printf ("\nbatch probe of %d files with %d threads matches\n", count, num_threads);
+    return 0;
+}
+
+// Decode the file with each of the alternate unpacking functions (that return the final sample
+// formats, or planar samples), in random (odd) sized chunks and with worker threads (if specified),
+// and verify that every chunk is identical to what WavpackUnpackSamples() returns after the
+// reference conversion (or after de-interleaving).
+// The reference is decoded in lockstep by a second context (without threads). Multichannel files
+// are also tested with OPEN_2CH_MAX, and DSD files are decoded as PCM.
+
+#define UNPACK_FORMAT_INT16     0
+#define UNPACK_FORMAT_INT24     1
+#define UNPACK_FORMAT_FLOAT32   2
+#define UNPACK_FORMAT_PLANAR    3
+#define NUM_UNPACK_FORMATS      4
+
+#define MAX_FORMAT_CHUNK        50000
+
+static int unpack_format_test (char *filename, int format, int open_flags);
+static void convert_reference (int format, int32_t *src, unsigned char *dst, int count, int bps, int float_data);
+
+static int unpack_formats_test (char *filename)
+{
+    int max_2ch, format, passes = 0;
+    WavpackProbeInfo info;
+
+    WavpackProbe (filename, &info, NULL, OPEN_ALT_TYPES);
+
+    for (max_2ch = 0; max_2ch <= (info.num_channels > 2); ++max_2ch)
+        for (format = 0; format < NUM_UNPACK_FORMATS; ++format, ++passes)
+            if (unpack_format_test (filename, format, max_2ch ? OPEN_2CH_MAX : 0))
+                return -1;
+
+    printf ("result: %d passes of alternate unpacking formats match\n", passes);
+    return 0;
+}
+
+static int unpack_format_test (char *filename, int format, int open_flags)
+{
+    int32_t *ref_buffer, *test_buffer, **channels, num_chans, bps, float_data, norm_delta, result = 0, i;
+    WavpackContext *wpc, *ref_wpc;
+    unsigned char *ref_converted;
+    char error [80];
+
+    open_flags |= OPEN_WVC | OPEN_DSD_AS_PCM | OPEN_ALT_TYPES;
+    wpc = WavpackOpenFileInput (filename, error, open_flags | (worker_threads << OPEN_THREADS_SHFT), 0);
+    ref_wpc = WavpackOpenFileInput (filename, error, open_flags, 0);
+
+    if (!wpc || !ref_wpc) {
+        printf ("unpack_format_test(): error \"%s\" opening input file \"%s\"\n", error, filename);
+        return -1;
+    }
+
+    num_chans = WavpackGetReducedChannels (ref_wpc);
+    bps = WavpackGetBytesPerSample (ref_wpc);
+    float_data = (WavpackGetMode (ref_wpc) & MODE_FLOAT) != 0;
+    norm_delta = 127 - WavpackGetFloatNormExp (ref_wpc);
+    ref_buffer = malloc (MAX_FORMAT_CHUNK * num_chans * sizeof (int32_t));
+    test_buffer = malloc (MAX_FORMAT_CHUNK * num_chans * sizeof (int32_t));
+    ref_converted = malloc (MAX_FORMAT_CHUNK * num_chans * sizeof (int32_t));
+    channels = malloc (num_chans * sizeof (*channels));
+
+    if (!ref_buffer || !test_buffer || !ref_converted || !channels) {
+        printf ("unpack_format_test(): can't allocate memory!\n");
+        exit (-1);
+    }
+
+    for (i = 0; i < num_chans; ++i)
+        channels [i] = test_buffer + i * MAX_FORMAT_CHUNK;
+
+    while (1) {
+        uint32_t chunk_samples = frandom () < 0.25 ? 1 + frandom () * (MAX_FORMAT_CHUNK - 1) : 1 + frandom () * 2000;
+        uint32_t ref_count = WavpackUnpackSamples (ref_wpc, ref_buffer, chunk_samples), count;
+        int sample_size = format == UNPACK_FORMAT_INT16 ? 2 : format == UNPACK_FORMAT_INT24 ? 3 : 4;
+
+        if (format == UNPACK_FORMAT_INT16)
+            count = WavpackUnpackSamplesInt16 (wpc, (int16_t *) test_buffer, chunk_samples);
+        else if (format == UNPACK_FORMAT_INT24)
+            count = WavpackUnpackSamplesInt24 (wpc, (unsigned char *) test_buffer, chunk_samples);
+        else if (format == UNPACK_FORMAT_FLOAT32)
+            count = WavpackUnpackSamplesFloat32 (wpc, (float *) test_buffer, chunk_samples);
+        else
+            count = WavpackUnpackSamplesPlanar (wpc, channels, chunk_samples);
+
+        if (count != ref_count) {
+            printf ("unpack_format_test(): format %d returned %u samples, not %u!\n", format, count, ref_count);
+            result = -1;
+            break;
+        }
+
+        if (!count)
+            break;
+
+        if (format == UNPACK_FORMAT_PLANAR) {
+            int32_t *ref_channel = (int32_t *) ref_converted;
+            uint32_t j;
+
+            for (i = 0; i < num_chans; ++i) {
+                for (j = 0; j < count; ++j)
+                    ref_channel [j] = ref_buffer [j * num_chans + i];
+
+                if (memcmp (channels [i], ref_channel, count * sizeof (int32_t)))
+                    break;
+            }
+
+            if (i < num_chans) {
+                printf ("unpack_format_test(): planar samples of channel %d don't match!\n", i + 1);
+                result = -1;
+                break;
+            }
+
+            continue;
+        }
+
+        if (float_data)
+            WavpackFloatNormalize (ref_buffer, count * num_chans, norm_delta);
+
+        convert_reference (format, ref_buffer, ref_converted, count * num_chans, bps, float_data);
+
+        if (memcmp (test_buffer, ref_converted, count * num_chans * sample_size)) {
+            printf ("unpack_format_test(): format %d samples don't match!\n", format);
+            result = -1;
+            break;
+        }
+    }
+
+    if (!result && WavpackGetNumErrors (wpc) != WavpackGetNumErrors (ref_wpc)) {
+        printf ("unpack_format_test(): format %d reported %d errors, not %d!\n", format,
+            WavpackGetNumErrors (wpc), WavpackGetNumErrors (ref_wpc));
+        result = -1;
+    }
+
+    free (channels);
+    free (ref_converted);
+    free (test_buffer);
+    free (ref_buffer);
+    WavpackCloseFile (ref_wpc);
+    WavpackCloseFile (wpc);
+    return result;
+}
+
+// Convert the samples from WavpackUnpackSamples() to the specified format. Integers are shifted
+// to the new width and floats are scaled, rounded and clipped to integers exactly as the library
+// does it (because a rounding difference of an exact half would otherwise be a mismatch).
+
+static void convert_reference (int format, int32_t *src, unsigned char *dst, int count, int bps, int float_data)
+{
+    int bits = format == UNPACK_FORMAT_INT16 ? 16 : 24, i;
+
+    for (i = 0; i < count; ++i)
+        if (format == UNPACK_FORMAT_FLOAT32) {
+            float value;
+
+            if (float_data)
+                memcpy (&value, src + i, sizeof (value));
+            else
+                value = (float) src [i] / (float) (1U << (bps * 8 - 1));
+
+            memcpy (dst + i * sizeof (value), &value, sizeof (value));
+        }
+        else {
+            int32_t value;
+
+            if (float_data) {
+                float fvalue, scale = (float) (1 << (bits - 1));
+
+                memcpy (&fvalue, src + i, sizeof (fvalue));
+                fvalue *= scale;
+                value = fvalue >= scale - 1.0f ? (int32_t) scale - 1 : fvalue <= -scale ? -(int32_t) scale :
+                    (int32_t)(fvalue < 0.0f ? fvalue - 0.5f : fvalue + 0.5f);
+            }
+            else if (bps * 8 > bits)
+                value = src [i] >> (bps * 8 - bits);
+            else
+                value = src [i] << (bits - bps * 8);
+
+            if (format == UNPACK_FORMAT_INT16) {
+                int16_t value16 = (int16_t) value;
+
+                memcpy (dst + i * 2, &value16, 2);
+            }
+            else {
+                dst [i * 3] = (unsigned char) value;
+                dst [i * 3 + 1] = (unsigned char) (value >> 8);
+                dst [i * 3 + 2] = (unsigned char) (value >> 16);
+            }
+        }
+}
+
 // Function to stress-test the WavpackSeekSample() API. Given the specified WavPack file, perform
 // the specified number of seektest runs on that file. For each test run, a different, random
 // seek interval is chosen. Note that MD5 sums are calculated for each chunk interval so we
 // actually verify that every sample decoded is correct. For each test run, we decode the entire
 // file 4 times over, on average.
 
+// The seeking test also exercises the block cache by attaching one (half the time) whenever the
+// file is opened. The cache is deliberately small (so that frames are discarded and reloaded)
+// and is shared by all the opens of the file, so later opens will find frames cached earlier.
+
+#define SEEK_TEST_CACHE_BYTES (4 * 1024 * 1024)
+
 static int seeking_test (char *filename, uint32_t test_count)
 {
+    WavpackBlockCache *block_cache = WavpackBlockCacheCreate (SEEK_TEST_CACHE_BYTES);
     char error [80];
-    WavpackContext *wpc = WavpackOpenFileInput (filename, error, OPEN_WVC | OPEN_DSD_NATIVE | OPEN_ALT_TYPES, 0);
+    WavpackContext *wpc = WavpackOpenFileInput (filename, error, OPEN_WVC | OPEN_DSD_NATIVE | OPEN_ALT_TYPES |
+        (worker_threads << OPEN_THREADS_SHFT), 0);
+    int64_t cache_hits, cache_misses;
     int64_t min_chunk_size = 256, total_samples, sample_count = 0;
+    void *wv_image = NULL, *wvc_image = NULL;
+    size_t wv_image_size = 0, wvc_image_size = 0;
+    int wv_fd = -1, wvc_fd = -1;
     char md5_string1 [] = "????????????????????????????????";
     char md5_string2 [] = "????????????????????????????????";
     int32_t *decoded_samples, num_chans, bps, test_index, qmode;
     unsigned char md5_initial [16], md5_stored [16];
     MD5_CTX md5_global, md5_local;
+    WavpackProbeInfo probe_info;
     unsigned char *chunked_md5;
 
     printf ("\n-------------------- file: %s %s--------------------\n",
@@ -308,6 +613,9 @@ static int seeking_test (char *filename, uint32_t test_count)
         return -1;
     }
 
+    if (frandom () < 0.5)
+        WavpackAttachBlockCache (wpc, block_cache, filename);
+
     num_chans = WavpackGetNumChannels (wpc);
     total_samples = WavpackGetNumSamples64 (wpc);
     bps = WavpackGetBytesPerSample (wpc);
@@ -323,6 +631,22 @@ static int seeking_test (char *filename, uint32_t test_count)
         return -1;
     }
 
+    // a probe of the file should agree with what we got from opening it
+
+    if (!WavpackProbe (filename, &probe_info, error, OPEN_ALT_TYPES)) {
+        printf ("seeking_test(): error \"%s\" probing input file \"%s\"\n", error, filename);
+        return -1;
+    }
+
+    if (probe_info.total_samples != total_samples || probe_info.num_channels != num_chans ||
+        probe_info.bytes_per_sample != bps || probe_info.qualify_mode != qmode ||
+        probe_info.sample_rate != WavpackGetSampleRate (wpc) ||
+        probe_info.md5_read != WavpackGetMD5Sum (wpc, md5_stored) ||
+        (probe_info.md5_read && memcmp (probe_info.md5_sum, md5_stored, sizeof (md5_stored)))) {
+            printf ("seeking_test(): probe of file doesn't match!\n");
+            return -1;
+    }
+
     // For very short files, reduce the minimum chunk size
 
     while (min_chunk_size > 1 && total_samples / min_chunk_size < 256)
@@ -401,6 +725,10 @@ static int seeking_test (char *filename, uint32_t test_count)
                     printf ("seeking_test(): MD5 does not match MD5 stored in file!\n");
                     return -1;
                 }
+
+            if (seek_index_test (filename, chunked_md5, chunk_samples, total_chunks) ||
+                remote_stats_test (filename, md5_initial))
+                    return -1;
         }
         else {
             unsigned char md5_subsequent [16];
@@ -414,16 +742,52 @@ static int seeking_test (char *filename, uint32_t test_count)
         }
 
         // Half the time, reopen the file. This lets us catch errors caused by seeking to locations
-        // that have never been decoded (at least not for this open call).
+        // that have never been decoded (at least not for this open call). Otherwise, the seek index
+        // has been filled in by decoding the whole file, and when we reopen we sometimes have the
+        // whole index built up front instead. We also sometimes map the file(s) into memory, or
+        // read them into memory ourselves and open them from there, or open them from file
+        // descriptors (which we keep open and reuse), or read them through the prefetcher
+        // (with random readahead settings) or the range request reader (with random pages).
 
         if (frandom() < 0.5) {
+            int open_flags = OPEN_WVC | OPEN_DSD_NATIVE | OPEN_ALT_TYPES |
+                (frandom() < 0.5 ? OPEN_SEEK_INDEX : 0) | (worker_threads << OPEN_THREADS_SHFT);
+
             WavpackCloseFile (wpc);
-            wpc = WavpackOpenFileInput (filename, error, OPEN_WVC | OPEN_DSD_NATIVE | OPEN_ALT_TYPES, 0);
+
+            if (frandom() < 0.25 && (wv_image || (wv_image = load_file_image (filename, "", &wv_image_size)))) {
+                if (!wvc_image)
+                    wvc_image = load_file_image (filename, "c", &wvc_image_size);
+
+                wpc = WavpackOpenFileInputMemory (wv_image, wv_image_size, wvc_image, wvc_image_size, error, open_flags, 0);
+            }
+#ifndef _WIN32
+            else if (frandom() < 0.33 && (wv_fd != -1 || (wv_fd = open (filename, O_RDONLY)) != -1)) {
+                if (wvc_fd == -1) {
+                    char *filename_c = malloc (strlen (filename) + 2);
+
+                    strcat (strcpy (filename_c, filename), "c");
+                    wvc_fd = open (filename_c, O_RDONLY);
+                    free (filename_c);
+                }
+
+                wpc = WavpackOpenFileInputFd (wv_fd, wvc_fd, error, open_flags, 0);
+            }
+#endif
+            else if (frandom() < 0.33)
+                wpc = open_file_pair (filename, error, open_flags, open_file_prefetch, (int) (frandom() * 8.0), (int32_t) (frandom() * 65536.0));
+            else if (frandom() < 0.5)
+                wpc = open_file_pair (filename, error, open_flags, open_file_remote, (int) (frandom() * 16.0), (int32_t) (frandom() * 65536.0));
+            else
+                wpc = WavpackOpenFileInput (filename, error, open_flags | (frandom() < 0.5 ? OPEN_MMAP : 0), 0);
 
             if (!wpc) {
                 printf ("seeking_test(): error \"%s\" reopening input file \"%s\"\n", error, filename);
                 return -1;
             }
+
+            if (frandom () < 0.5)
+                WavpackAttachBlockCache (wpc, block_cache, filename);
         }
 
         chunk_count *= 4;       // decode each chunk 4 times, on average
@@ -492,6 +856,9 @@ static int seeking_test (char *filename, uint32_t test_count)
 
         printf ("\nresult: %u successful seeks on %u-sample boundaries\n", seek_count, chunk_samples);
 
+        if (range_read_test (wpc, chunked_md5, chunk_samples, total_chunks))
+            return -1;
+
         if (!WavpackSeekSample (wpc, 0)) {
             printf ("seeking_test(): rewind error!\n");
             return -1;
@@ -502,6 +869,538 @@ static int seeking_test (char *filename, uint32_t test_count)
     }
 
     WavpackCloseFile (wpc);
+    free (wvc_image);
+    free (wv_image);
+#ifndef _WIN32
+    if (wvc_fd != -1) close (wvc_fd);
+    if (wv_fd != -1) close (wv_fd);
+#endif
+    WavpackBlockCacheGetStats (block_cache, &cache_hits, &cache_misses, NULL);
+    WavpackBlockCacheDestroy (block_cache);
+
+    if (cache_hits || cache_misses)
+        printf ("block cache: %lld hits, %lld misses\n", (long long int) cache_hits, (long long int) cache_misses);
+
+    return 0;
+}
+
+// Test the saved seek index functions. We build the complete index for the file, check that every
+// chunk is found in it, and save it (as the file's name with ".wvsi" appended) and load it into a
+// freshly opened context, where every lookup must match and where seeks to random chunks (which
+// now come directly from the loaded index) must decode to the chunk MD5 sums from seeking_test().
+// Then we verify that an index with the wrong file length or sample count is rejected, and that
+// an index with one entry pointing at the wrong block is discarded when it is used for a seek (by
+// retry_without_index()) and the seek still lands on the correct audio. The header and entry
+// offsets used to alter the saved index are from the file format in open_filename.c.
+
+#define SEEK_INDEX_HEADER_BYTES     48
+#define SEEK_INDEX_ENTRY_BYTES      28
+#define SEEK_INDEX_FILELEN          16
+#define SEEK_INDEX_TOTAL_SAMPLES    32
+#define SEEK_INDEX_ENTRY_INDEX      0
+#define SEEK_INDEX_ENTRY_FILEPOS    8
+#define SEEK_INDEX_TEST_SEEKS       100
+
+static int64_t get_int64_le (unsigned char *ptr)
+{
+    int64_t value;
+
+    memcpy (&value, ptr, sizeof (value));
+    WavpackLittleEndianToNative (&value, "D");
+    return value;
+}
+
+static void put_int64_le (unsigned char *ptr, int64_t value)
+{
+    WavpackNativeToLittleEndian (&value, "D");
+    memcpy (ptr, &value, sizeof (value));
+}
+
+static int write_file_image (const char *filename, void *image, size_t size)
+{
+    FILE *file = fopen (filename, "wb");
+    int result;
+
+    if (!file)
+        return FALSE;
+
+    result = fwrite (image, 1, size, file) == size;
+    return !fclose (file) && result;
+}
+
+static int decode_chunk_matches (WavpackContext *wpc, int32_t *decoded_samples, unsigned char *chunked_md5, uint32_t chunk_samples, uint32_t chunk)
+{
+    int num_chans = WavpackGetNumChannels (wpc), bps = WavpackGetBytesPerSample (wpc), qmode = WavpackGetQualifyMode (wpc);
+    unsigned char md5_chunk [16];
+    MD5_CTX md5_local;
+    uint32_t samples;
+
+    if (!WavpackSeekSample64 (wpc, (int64_t) chunk * chunk_samples) ||
+        !(samples = WavpackUnpackSamples (wpc, decoded_samples, chunk_samples)))
+            return FALSE;
+
+    store_samples (decoded_samples, decoded_samples, qmode, bps, samples * num_chans);
+    MD5_Init (&md5_local);
+    MD5_Update (&md5_local, (unsigned char *) decoded_samples, bps * samples * num_chans);
+    MD5_Final (md5_chunk, &md5_local);
+
+    return !memcmp (chunked_md5 + chunk * 16, md5_chunk, sizeof (md5_chunk));
+}
+
+static int seek_index_test (char *filename, unsigned char *chunked_md5, uint32_t chunk_samples, uint32_t total_chunks)
+{
+    int open_flags = OPEN_WVC | OPEN_DSD_NATIVE | OPEN_ALT_TYPES | (worker_threads << OPEN_THREADS_SHFT);
+    char *index_name = malloc (strlen (filename) + 6), error [80];
+    WavpackContext *built_wpc = NULL, *loaded_wpc = NULL;
+    unsigned char *image = NULL, *altered = NULL;
+    uint32_t chunk, num_entries, entry, block_samples1, block_samples2;
+    int64_t block_index1, block_index2, sample;
+    int32_t *decoded_samples = NULL;
+    size_t image_size = 0;
+    int result = -1, i;
+
+    strcat (strcpy (index_name, filename), ".wvsi");
+
+    if (!(built_wpc = WavpackOpenFileInput (filename, error, open_flags, 0)) || !WavpackBuildSeekIndex (built_wpc)) {
+        printf ("seek_index_test(): can't open file or build the seek index!\n");
+        goto done;
+    }
+
+    decoded_samples = malloc (sizeof (int32_t) * chunk_samples * WavpackGetNumChannels (built_wpc));
+
+    for (chunk = 0; chunk < total_chunks; ++chunk) {
+        sample = (int64_t) chunk * chunk_samples;
+
+        if (WavpackLookupSeekIndex (built_wpc, sample, &block_index1, &block_samples1) < 0 ||
+            sample < block_index1 || sample >= block_index1 + block_samples1) {
+                printf ("seek_index_test(): sample %lld not found in the seek index!\n", (long long int) sample);
+                goto done;
+        }
+    }
+
+    if (WavpackLookupSeekIndex (built_wpc, WavpackGetNumSamples64 (built_wpc), NULL, NULL) != -1) {
+        printf ("seek_index_test(): sample past the end found in the seek index!\n");
+        goto done;
+    }
+
+    if (!WavpackSaveSeekIndex (built_wpc, index_name) || !(image = load_file_image (index_name, "", &image_size)) ||
+        image_size < SEEK_INDEX_HEADER_BYTES || !(altered = malloc (image_size))) {
+            printf ("seek_index_test(): can't save the seek index to \"%s\"!\n", index_name);
+            goto done;
+    }
+
+    num_entries = (uint32_t) (image_size - SEEK_INDEX_HEADER_BYTES) / SEEK_INDEX_ENTRY_BYTES;
+
+    // load the index into a new context and verify that it matches and that seeks from it work
+
+    if (!(loaded_wpc = WavpackOpenFileInput (filename, error, open_flags, 0)) || !WavpackLoadSeekIndex (loaded_wpc, index_name)) {
+        printf ("seek_index_test(): can't load the saved seek index!\n");
+        goto done;
+    }
+
+    for (chunk = 0; chunk < total_chunks; ++chunk) {
+        sample = (int64_t) chunk * chunk_samples;
+
+        if (WavpackLookupSeekIndex (built_wpc, sample, &block_index1, &block_samples1) !=
+            WavpackLookupSeekIndex (loaded_wpc, sample, &block_index2, &block_samples2) ||
+            block_index1 != block_index2 || block_samples1 != block_samples2) {
+                printf ("seek_index_test(): loaded seek index doesn't match at sample %lld!\n", (long long int) sample);
+                goto done;
+        }
+    }
+
+    for (i = 0; i < SEEK_INDEX_TEST_SEEKS; ++i) {
+        chunk = (uint32_t) floor (frandom () * total_chunks);
+        if (chunk == total_chunks) chunk--;
+
+        if (!decode_chunk_matches (loaded_wpc, decoded_samples, chunked_md5, chunk_samples, chunk)) {
+            printf ("seek_index_test(): seek+decode error at %lld with loaded index!\n", (long long int) chunk * chunk_samples);
+            goto done;
+        }
+    }
+
+    WavpackCloseFile (loaded_wpc);
+    loaded_wpc = NULL;
+
+    // an index saved for a different file (length or sample count) must be rejected
+
+    for (i = 0; i < 2; ++i) {
+        int offset = i ? SEEK_INDEX_TOTAL_SAMPLES : SEEK_INDEX_FILELEN;
+
+        memcpy (altered, image, image_size);
+        put_int64_le (altered + offset, get_int64_le (altered + offset) + 1);
+
+        if (!write_file_image (index_name, altered, image_size) ||
+            !(loaded_wpc = WavpackOpenFileInput (filename, error, open_flags, 0))) {
+                printf ("seek_index_test(): can't write altered seek index or reopen file!\n");
+                goto done;
+        }
+
+        if (WavpackLoadSeekIndex (loaded_wpc, index_name)) {
+            printf ("seek_index_test(): seek index with wrong %s was accepted!\n", i ? "sample count" : "file length");
+            goto done;
+        }
+
+        WavpackCloseFile (loaded_wpc);
+        loaded_wpc = NULL;
+    }
+
+    // point one entry (not the first) at the following block instead, which still passes the checks
+    // when loading, and seek to a chunk that starts in the block it should point to (after decoding
+    // the first chunk so that the seek doesn't simply continue in the current block); the seek must
+    // be correct and the entry must then be back in the index with the correct position
+
+    for (entry = num_entries / 2, sample = -1; entry && entry + 1 < num_entries && sample == -1; ++entry) {
+        unsigned char *entry_ptr = image + SEEK_INDEX_HEADER_BYTES + entry * SEEK_INDEX_ENTRY_BYTES;
+        int64_t block_index = get_int64_le (entry_ptr + SEEK_INDEX_ENTRY_INDEX);
+        int64_t next_index = get_int64_le (entry_ptr + SEEK_INDEX_ENTRY_BYTES + SEEK_INDEX_ENTRY_INDEX);
+
+        chunk = (uint32_t) ((block_index + chunk_samples - 1) / chunk_samples);
+
+        if ((int64_t) chunk * chunk_samples < next_index) {
+            sample = (int64_t) chunk * chunk_samples;
+            memcpy (altered, image, image_size);
+            memcpy (altered + (entry_ptr - image) + SEEK_INDEX_ENTRY_FILEPOS, entry_ptr + SEEK_INDEX_ENTRY_BYTES + SEEK_INDEX_ENTRY_FILEPOS, 8);
+        }
+    }
+
+    if (sample != -1) {
+        if (!write_file_image (index_name, altered, image_size) ||
+            !(loaded_wpc = WavpackOpenFileInput (filename, error, open_flags, 0)) ||
+            !WavpackLoadSeekIndex (loaded_wpc, index_name)) {
+                printf ("seek_index_test(): can't load seek index with wrong entry!\n");
+                goto done;
+        }
+
+        if (!decode_chunk_matches (loaded_wpc, decoded_samples, chunked_md5, chunk_samples, 0) ||
+            !decode_chunk_matches (loaded_wpc, decoded_samples, chunked_md5, chunk_samples, chunk) ||
+            WavpackLookupSeekIndex (loaded_wpc, sample, NULL, NULL) != WavpackLookupSeekIndex (built_wpc, sample, NULL, NULL)) {
+                printf ("seek_index_test(): didn't recover from seek index with wrong entry!\n");
+                goto done;
+        }
+    }
+
+    printf ("seek index of %u entries saved, loaded and verified\n", num_entries);
+    result = 0;
+
+done:
+    if (loaded_wpc) WavpackCloseFile (loaded_wpc);
+    if (built_wpc) WavpackCloseFile (built_wpc);
+    remove (index_name);
+    free (decoded_samples);
+    free (index_name);
+    free (altered);
+    free (image);
+    return result;
+}
+
+// Read the specified file (with the suffix appended to its name) into memory for testing
+// WavpackOpenFileInputMemory(). Returns NULL if the file does not exist or can't be read.
+
+static void *load_file_image (const char *filename, const char *suffix, size_t *size)
+{
+    char *name = malloc (strlen (filename) + strlen (suffix) + 1);
+    unsigned char *image = NULL;
+    FILE *file;
+    long length;
+
+    strcat (strcpy (name, filename), suffix);
+    file = fopen (name, "rb");
+    free (name);
+
+    if (!file)
+        return NULL;
+
+    if (!fseek (file, 0, SEEK_END) && (length = ftell (file)) > 0 && !fseek (file, 0, SEEK_SET) &&
+        (image = malloc (length)) != NULL) {
+            if (fread (image, 1, length, file) == (size_t) length)
+                *size = length;
+            else {
+                free (image);
+                image = NULL;
+            }
+    }
+
+    fclose (file);
+    return image;
+}
+
+// Open the specified file (and its correction file, if present) with stdio and pass them to
+// the specified function, which opens them with one of the reader wrappers below (and which
+// is responsible for closing them). The count and size are passed to it also.
+
+static WavpackContext *open_file_pair (const char *filename, char *error, int flags, file_opener opener, int count, int32_t size)
+{
+    char *filename_c = malloc (strlen (filename) + 2);
+    FILE *wv_file = fopen (filename, "rb"), *wvc_file;
+
+    strcat (strcpy (filename_c, filename), "c");
+    wvc_file = fopen (filename_c, "rb");
+    free (filename_c);
+
+    if (!wv_file) {
+        strcpy (error, "can't open file!");
+
+        if (wvc_file)
+            fclose (wvc_file);
+
+        return NULL;
+    }
+
+    return opener (wv_file, wvc_file, error, flags, count, size);
+}
+
+// A minimal stdio reader for testing WavpackOpenFileInputPrefetch(), which is opened with
+// random small buffer sizes and readahead depths so that the buffers are refilled and
+// discarded often.
+
+static int32_t file_read_bytes (void *id, void *data, int32_t bcount)
+{
+    return (int32_t) fread (data, 1, bcount, (FILE *) id);
+}
+
+static int64_t file_get_pos (void *id)
+{
+    return ftell ((FILE *) id);
+}
+
+static int file_set_pos_abs (void *id, int64_t pos)
+{
+    return fseek ((FILE *) id, (long) pos, SEEK_SET);
+}
+
+static int file_set_pos_rel (void *id, int64_t delta, int mode)
+{
+    return fseek ((FILE *) id, (long) delta, mode);
+}
+
+static int file_push_back_byte (void *id, int c)
+{
+    return ungetc (c, (FILE *) id);
+}
+
+static int64_t file_get_length (void *id)
+{
+    FILE *file = (FILE *) id;
+    long pos = ftell (file), length;
+
+    fseek (file, 0, SEEK_END);
+    length = ftell (file);
+    fseek (file, pos, SEEK_SET);
+    return length;
+}
+
+static int file_can_seek (void *id)
+{
+    return 1;
+}
+
+static int file_close (void *id)
+{
+    return fclose ((FILE *) id);
+}
+
+static WavpackStreamReader64 file_reader = {
+    file_read_bytes, NULL, file_get_pos, file_set_pos_abs, file_set_pos_rel,
+    file_push_back_byte, file_get_length, file_can_seek, NULL, file_close
+};
+
+static WavpackContext *open_file_prefetch (FILE *wv_file, FILE *wvc_file, char *error, int flags, int depth, int32_t buffer_size)
+{
+    return WavpackOpenFileInputPrefetch (&file_reader, wv_file, wvc_file, error, flags, 0, depth, buffer_size);
+}
+
+// A stand-in for a range request backend for testing WavpackOpenFileInputRemote(), which
+// reads from local files, and a function to open files with it.
+
+static int32_t file_read_range (void *id, int64_t position, void *data, int32_t bcount)
+{
+    if (fseek ((FILE *) id, (long) position, SEEK_SET))
+        return -1;
+
+    return (int32_t) fread (data, 1, bcount, (FILE *) id);
+}
+
+static WavpackRemoteReader file_remote_reader = {
+    file_read_range, file_get_length, file_close
+};
+
+static WavpackContext *open_file_remote (FILE *wv_file, FILE *wvc_file, char *error, int flags, int num_pages, int32_t page_size)
+{
+    return WavpackOpenFileInputRemote (&file_remote_reader, wv_file, wvc_file, error, flags, 0, num_pages, page_size);
+}
+
+// Decode the file sequentially through the range request reader (with the default page and
+// cache sizes) and verify the MD5 sum of the audio, and that the requests were combined as
+// intended. No request is for more than half the cache, so streaming a file takes one request
+// for each half-cache of it. Opening a file can also scan its last megabyte (if the number of
+// samples is not in the first block), and we allow for reading that and for a few more requests
+// for each file (the first page, the partial requests at the ends, and ramping up to the full
+// request size both at the end and the start). The bytes fetched can only be more than the file
+// size(s) by the end scan and a few pages that were dropped from the cache and read again.
+
+#define REMOTE_TEST_PAGE_SIZE           (64 * 1024)
+#define REMOTE_TEST_NUM_PAGES           16
+#define REMOTE_TEST_SCAN_BYTES          (1024 * 1024)
+#define REMOTE_TEST_EXTRA_REQUESTS      12
+#define REMOTE_TEST_EXTRA_PAGES         4
+
+static int remote_stats_test (char *filename, unsigned char *md5_expected)
+{
+    int open_flags = OPEN_WVC | OPEN_DSD_NATIVE | OPEN_ALT_TYPES | (worker_threads << OPEN_THREADS_SHFT);
+    int64_t requests, bytes, max_requests, max_bytes;
+    int num_files;
+    char error [80];
+    WavpackContext *wpc = open_file_pair (filename, error, open_flags, open_file_remote, REMOTE_TEST_NUM_PAGES, REMOTE_TEST_PAGE_SIZE);
+    int num_chans, bps, qmode, samples;
+    unsigned char md5_decoded [16];
+    int32_t *decoded_samples;
+    MD5_CTX md5_context;
+
+    if (!wpc) {
+        printf ("remote_stats_test(): error \"%s\" opening input file \"%s\"\n", error, filename);
+        return -1;
+    }
+
+    num_chans = WavpackGetNumChannels (wpc);
+    bps = WavpackGetBytesPerSample (wpc);
+    qmode = WavpackGetQualifyMode (wpc);
+    decoded_samples = malloc (sizeof (int32_t) * 4096 * num_chans);
+    MD5_Init (&md5_context);
+
+    while ((samples = WavpackUnpackSamples (wpc, decoded_samples, 4096))) {
+        store_samples (decoded_samples, decoded_samples, qmode, bps, samples * num_chans);
+        MD5_Update (&md5_context, (unsigned char *) decoded_samples, bps * samples * num_chans);
+    }
+
+    MD5_Final (md5_decoded, &md5_context);
+    free (decoded_samples);
+
+    if (!WavpackGetRemoteStats (wpc, &requests, &bytes) || memcmp (md5_decoded, md5_expected, sizeof (md5_decoded))) {
+        printf ("remote_stats_test(): remote decode doesn't match!\n");
+        WavpackCloseFile (wpc);
+        return -1;
+    }
+
+    num_files = (WavpackGetMode (wpc) & MODE_WVC) ? 2 : 1;
+    max_requests = (WavpackGetFileSize64 (wpc) + REMOTE_TEST_SCAN_BYTES * num_files) /
+        (REMOTE_TEST_PAGE_SIZE * (REMOTE_TEST_NUM_PAGES / 2)) + REMOTE_TEST_EXTRA_REQUESTS * num_files;
+    max_bytes = WavpackGetFileSize64 (wpc) + (REMOTE_TEST_SCAN_BYTES + REMOTE_TEST_PAGE_SIZE * REMOTE_TEST_EXTRA_PAGES) * num_files;
+
+    printf ("remote decode took %lld requests for %lld bytes (limits %lld and %lld)\n", (long long int) requests,
+        (long long int) bytes, (long long int) max_requests, (long long int) max_bytes);
+
+    if (requests > max_requests || bytes > max_bytes) {
+            printf ("remote_stats_test(): too many requests or bytes fetched!\n");
+            WavpackCloseFile (wpc);
+            return -1;
+    }
+
+    WavpackCloseFile (wpc);
+    return 0;
+}
+
+// Verify WavpackReadRange() by having several threads read chunks from the same context
+// at the same time and checking them against the chunk MD5 sums from seeking_test(). Each
+// thread reads runs of consecutive chunks starting at random places, so that we test both
+// continuing decoders and seeking ones. The chunk lists are generated up front so that
+// the test is still repeatable.
+
+#define RANGE_TEST_THREADS 4
+
+typedef struct {
+    WavpackContext *wpc;
+    unsigned char *chunked_md5;
+    uint32_t chunk_samples, total_chunks, *chunks, num_chunks;
+    int errors;
+} RangeReadThread;
+
+static void *range_read_thread (void *param)
+{
+    RangeReadThread *rrt = (RangeReadThread *) param;
+    int num_chans = WavpackGetNumChannels (rrt->wpc), bps = WavpackGetBytesPerSample (rrt->wpc);
+    int qmode = WavpackGetQualifyMode (rrt->wpc);
+    int64_t total_samples = WavpackGetNumSamples64 (rrt->wpc);
+    int32_t *decoded_samples = malloc (sizeof (int32_t) * rrt->chunk_samples * num_chans);
+    uint32_t i;
+
+    for (i = 0; decoded_samples && i < rrt->num_chunks; ++i) {
+        int64_t start_sample = (int64_t) rrt->chunks [i] * rrt->chunk_samples;
+        uint32_t expected = total_samples - start_sample < rrt->chunk_samples ? (uint32_t) (total_samples - start_sample) : rrt->chunk_samples;
+        uint32_t samples = WavpackReadRange (rrt->wpc, start_sample, rrt->chunk_samples, decoded_samples);
+        unsigned char md5_chunk [16];
+        MD5_CTX md5_local;
+
+        if (samples != expected) {
+            rrt->errors++;
+            break;
+        }
+
+        store_samples (decoded_samples, decoded_samples, qmode, bps, samples * num_chans);
+        MD5_Init (&md5_local);
+        MD5_Update (&md5_local, (unsigned char *) decoded_samples, bps * samples * num_chans);
+        MD5_Final (md5_chunk, &md5_local);
+
+        if (memcmp (rrt->chunked_md5 + rrt->chunks [i] * 16, md5_chunk, sizeof (md5_chunk))) {
+            rrt->errors++;
+            break;
+        }
+    }
+
+    if (!decoded_samples)
+        rrt->errors++;
+
+    free (decoded_samples);
+    return NULL;
+}
+
+static int range_read_test (WavpackContext *wpc, unsigned char *chunked_md5, uint32_t chunk_samples, uint32_t total_chunks)
+{
+    RangeReadThread threads [RANGE_TEST_THREADS];
+    pthread_t pthreads [RANGE_TEST_THREADS];
+    int ti, errors = 0;
+
+    for (ti = 0; ti < RANGE_TEST_THREADS; ++ti) {
+        RangeReadThread *rrt = threads + ti;
+        uint32_t chunk = 0, i;
+
+        rrt->wpc = wpc;
+        rrt->chunked_md5 = chunked_md5;
+        rrt->chunk_samples = chunk_samples;
+        rrt->total_chunks = total_chunks;
+        rrt->num_chunks = total_chunks < 256 ? total_chunks : 256;
+        rrt->chunks = malloc (rrt->num_chunks * sizeof (uint32_t));
+        rrt->errors = 0;
+
+        if (!rrt->chunks) {
+            printf ("range_read_test(): can't allocate memory!\n");
+            return -1;
+        }
+
+        for (i = 0; i < rrt->num_chunks; ++i) {
+            if (!i || chunk == total_chunks || frandom () < 0.25)
+                chunk = floor (frandom () * total_chunks);
+
+            if (chunk == total_chunks) chunk--;
+            rrt->chunks [i] = chunk++;
+        }
+    }
+
+    for (ti = 0; ti < RANGE_TEST_THREADS; ++ti)
+        pthread_create (&pthreads [ti], NULL, range_read_thread, (void *) &threads [ti]);
+
+    for (ti = 0; ti < RANGE_TEST_THREADS; ++ti) {
+        pthread_join (pthreads [ti], NULL);
+        errors += threads [ti].errors;
+        free (threads [ti].chunks);
+    }
+
+    if (errors) {
+        printf ("range_read_test(): %d threads reported read errors!\n", errors);
+        return -1;
+    }
+
+    printf ("result: %u ranges successfully read by %d threads\n", threads [0].num_chunks * RANGE_TEST_THREADS, RANGE_TEST_THREADS);
     return 0;
 }
 
@@ -669,20 +1568,20 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
 {
     static int test_number;
 
-    float sequencing_angle = 0.0, speed = 60.0, width = 200.0, *source, *destin, ratio, bps;
+    float sequencing_angle = 0.0, speed = 60.0, width = 200.0, *source, *destin, *convert, ratio, bps;
     int lossless = !(wpconfig_flags & CONFIG_HYBRID_FLAG) || ((wpconfig_flags & CONFIG_CREATE_WVC) && !(test_flags & TEST_FLAG_IGNORE_WVC));
     char md5_string1 [] = "????????????????????????????????";
     char md5_string2 [] = "????????????????????????????????";
     uint32_t total_encoded_bytes, total_encoded_samples;
     struct audio_generator generators [NUM_GENERATORS];
-    int seconds = 0, samples = 0, wc = 0, chan_mask;
+    int seconds = 0, samples = 0, wc = 0, chan_mask, pack_entry = 0;
     char *filename = NULL, mode_string [32] = "-";
     struct audio_channel *channels;
-    pthread_t pthread;
-    WavpackContext *out_wpc;
+    pthread_t pthread, ref_pthread;
+    WavpackContext *out_wpc, *ref_wpc = NULL;
     WavpackConfig wpconfig;
-    StreamingFile wv_stream, wvc_stream;
-    WavpackDecoder wv_decoder;
+    StreamingFile wv_stream, wvc_stream, ref_wv_stream, ref_wvc_stream;
+    WavpackDecoder wv_decoder, ref_decoder;
     unsigned char md5_encoded [16];
     MD5_CTX md5_context;
     void *term_value;
@@ -707,14 +1606,18 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
 
     CLEAR (wpconfig);
     CLEAR (wv_decoder);
+    CLEAR (ref_decoder);
     CLEAR (wv_stream);
     CLEAR (wvc_stream);
+    CLEAR (ref_wv_stream);
+    CLEAR (ref_wvc_stream);
 
     channels = malloc (num_chans * sizeof (*channels));
     source = malloc (ENCODE_SAMPLES * sizeof (*source));
     destin = malloc (ENCODE_SAMPLES * num_chans * sizeof (*destin));
+    convert = malloc (ENCODE_SAMPLES * num_chans * sizeof (*convert));
 
-    if (!channels || !source || !destin) {
+    if (!channels || !source || !destin || !convert) {
         printf ("run_test(): can't allocate memory!\n");
         exit (-1);
     }
@@ -758,6 +1661,7 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
     if (!(test_flags & TEST_FLAG_NO_DECODE)) {
         initialize_stream (&wv_stream, BUFFER_SIZE);
         wv_decoder.wv_stream = &wv_stream;
+        wv_decoder.open_flags = worker_threads << OPEN_THREADS_SHFT;
     }
     else
         initialize_stream (&wv_stream, 0);
@@ -813,9 +1717,35 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
 
     out_wpc = WavpackOpenFileOutput (write_block, &wv_stream, (wpconfig_flags & CONFIG_CREATE_WVC) ? &wvc_stream : NULL);
 
-    if (!(test_flags & TEST_FLAG_NO_DECODE))
+    // when using worker threads, we also encode with a regular (single-threaded) encoder so that we can
+    // verify that the output is identical (including any correction file), and decode that output with
+    // a regular decoder to verify that the threaded decoder produces the same audio and error count
+
+    if (worker_threads) {
+        if (!(test_flags & TEST_FLAG_NO_DECODE)) {
+            initialize_stream (&ref_wv_stream, BUFFER_SIZE);
+            ref_decoder.wv_stream = &ref_wv_stream;
+        }
+        else
+            initialize_stream (&ref_wv_stream, 0);
+
+        if ((wpconfig_flags & CONFIG_CREATE_WVC) && !(test_flags & (TEST_FLAG_IGNORE_WVC | TEST_FLAG_NO_DECODE))) {
+            initialize_stream (&ref_wvc_stream, BUFFER_SIZE);
+            ref_decoder.wvc_stream = &ref_wvc_stream;
+        }
+        else
+            initialize_stream (&ref_wvc_stream, 0);
+
+        ref_wpc = WavpackOpenFileOutput (write_block, &ref_wv_stream, (wpconfig_flags & CONFIG_CREATE_WVC) ? &ref_wvc_stream : NULL);
+    }
+
+    if (!(test_flags & TEST_FLAG_NO_DECODE)) {
         pthread_create (&pthread, NULL, decode_thread, (void *) &wv_decoder);
 
+        if (ref_wpc)
+            pthread_create (&ref_pthread, NULL, decode_thread, (void *) &ref_decoder);
+    }
+
     if (test_flags & (TEST_FLAG_FLOAT_DATA | TEST_FLAG_STORE_INT32_AS_FLOAT)) {
         wpconfig.float_norm_exp = 127;
         wpconfig.bytes_per_sample = 4;
@@ -836,6 +1766,7 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
     wpconfig.num_channels = num_chans;
     wpconfig.channel_mask = chan_mask;
     wpconfig.flags = wpconfig_flags;
+    wpconfig.worker_threads = worker_threads;
 
     if (wpconfig_flags & CONFIG_HYBRID_FLAG) {
         if (wpconfig_flags & CONFIG_CREATE_WVC) {
@@ -857,6 +1788,12 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
     WavpackSetConfiguration64 (out_wpc, &wpconfig, -1, NULL);
     WavpackPackInit (out_wpc);
 
+    if (ref_wpc) {
+        wpconfig.worker_threads = 0;
+        WavpackSetConfiguration64 (ref_wpc, &wpconfig, -1, NULL);
+        WavpackPackInit (ref_wpc);
+    }
+
     while (seconds < num_seconds) {
 
         double translated_angle = cos (sequencing_angle) * 100.0;
@@ -903,7 +1840,14 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
             }
         }
 
-	WavpackPackSamples (out_wpc, (int32_t *) destin, ENCODE_SAMPLES);
+        // the encoder under test gets the samples through each of the packing functions in turn (the
+        // reference encoder always gets longs) so that the output and MD5 checks cover all of them
+
+        pack_samples_alternate (out_wpc, &wpconfig, (int32_t *) destin, ENCODE_SAMPLES, pack_entry++, (int32_t *) convert);
+
+        if (ref_wpc)
+            WavpackPackSamples (ref_wpc, (int32_t *) destin, ENCODE_SAMPLES);
+
         store_samples (destin, (int32_t *) destin, 0, wpconfig.bytes_per_sample, ENCODE_SAMPLES * num_chans);
         MD5_Update (&md5_context, (unsigned char *) destin, wpconfig.bytes_per_sample * ENCODE_SAMPLES * num_chans);
 
@@ -940,9 +1884,21 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
 
     WavpackCloseFile (out_wpc);
 
+    if (ref_wpc) {
+        WavpackFlushSamples (ref_wpc);
+
+        if (wpconfig.flags & CONFIG_MD5_CHECKSUM) {
+            WavpackStoreMD5Sum (ref_wpc, md5_encoded);
+            WavpackFlushSamples (ref_wpc);
+        }
+
+        WavpackCloseFile (ref_wpc);
+    }
+
     free (channels);
     free (source);
     free (destin);
+    free (convert);
 
     if ((wpconfig_flags & CONFIG_CREATE_WVC) && !(test_flags & TEST_FLAG_IGNORE_WVC))
         total_encoded_bytes = wv_stream.bytes_written + wvc_stream.bytes_written;
@@ -956,6 +1912,11 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
     flush_stream (&wv_stream);
     flush_stream (&wvc_stream);
 
+    if (worker_threads) {
+        flush_stream (&ref_wv_stream);
+        flush_stream (&ref_wvc_stream);
+    }
+
     if (!(test_flags & TEST_FLAG_NO_DECODE)) {
         pthread_join (pthread, &term_value);
 
@@ -963,6 +1924,15 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
             printf ("decode_thread() returned error %d\n", (int) (long) term_value);
             return 1;
         }
+
+        if (worker_threads) {
+            pthread_join (ref_pthread, &term_value);
+
+            if (term_value) {
+                printf ("decode_thread() returned error %d\n", (int) (long) term_value);
+                return 1;
+            }
+        }
     }
 
     if (!(test_flags & TEST_FLAG_NO_DECODE)) {
@@ -983,6 +1953,38 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
         }
     }
 
+    if (worker_threads) {
+        unsigned char md5_threaded [16], md5_reference [16];
+
+        MD5_Final (md5_threaded, &wv_stream.md5_written);
+        MD5_Final (md5_reference, &ref_wv_stream.md5_written);
+
+        if (wv_stream.bytes_written != ref_wv_stream.bytes_written || memcmp (md5_threaded, md5_reference, sizeof (md5_threaded))) {
+            printf ("\nthreaded encoder output does not match regular encoder!\n");
+            return 1;
+        }
+
+        if (wpconfig_flags & CONFIG_CREATE_WVC) {
+            MD5_Final (md5_threaded, &wvc_stream.md5_written);
+            MD5_Final (md5_reference, &ref_wvc_stream.md5_written);
+
+            if (wvc_stream.bytes_written != ref_wvc_stream.bytes_written || memcmp (md5_threaded, md5_reference, sizeof (md5_threaded))) {
+                printf ("\nthreaded encoder correction output does not match regular encoder!\n");
+                return 1;
+            }
+        }
+
+        if (!(test_flags & TEST_FLAG_NO_DECODE) && (wv_decoder.num_errors != ref_decoder.num_errors ||
+            wv_decoder.sample_count != ref_decoder.sample_count ||
+            memcmp (wv_decoder.md5_decoded, ref_decoder.md5_decoded, sizeof (wv_decoder.md5_decoded)))) {
+                printf ("\nthreaded decoder output does not match regular decoder!\n");
+                return 1;
+        }
+
+        free_stream (&ref_wv_stream);
+        free_stream (&ref_wvc_stream);
+    }
+
     free_stream (&wv_stream);
     free_stream (&wvc_stream);
 
@@ -991,6 +1993,62 @@ static int run_test (int wpconfig_flags, int test_flags, int bits, int num_chans
     return 0;
 }
 
+// Pack the specified samples (longs, or floats for floating-point configurations) with one of the
+// packing functions, selected by "entry" (modulo 4): the longs themselves, planar longs, 32-bit floats
+// or the native packed 16-bit or 24-bit integers. The samples are converted exactly into "temp" as
+// required, and when a format can't hold them exactly (e.g., floats for 32-bit integers) the longs
+// are used instead.
+
+static int pack_samples_alternate (WavpackContext *wpc, WavpackConfig *config, int32_t *samples, uint32_t sample_count, int entry, int32_t *temp)
+{
+    int num_chans = config->num_channels, bps = config->bytes_per_sample, chan;
+    uint32_t count = sample_count * num_chans, i;
+
+    switch (entry & 3) {
+        case 1: {
+            int32_t *planes [8];
+
+            for (chan = 0; chan < num_chans; ++chan)
+                for (planes [chan] = temp + chan * sample_count, i = 0; i < sample_count; ++i)
+                    planes [chan] [i] = samples [i * num_chans + chan];
+
+            return WavpackPackSamplesPlanar (wpc, planes, sample_count);
+        }
+
+        case 2:
+            if (config->float_norm_exp)
+                return WavpackPackSamplesFloat32 (wpc, (float *) samples, sample_count);
+
+            if (bps <= 3) {
+                float scale = 1.0f / (float) (1 << (bps * 8 - 1));
+
+                for (i = 0; i < count; ++i)
+                    ((float *) temp) [i] = (float) samples [i] * scale;
+
+                return WavpackPackSamplesFloat32 (wpc, (float *) temp, sample_count);
+            }
+
+            break;
+
+        case 3:
+            if (!config->float_norm_exp && bps == 2) {
+                for (i = 0; i < count; ++i)
+                    ((int16_t *) temp) [i] = (int16_t) samples [i];
+
+                return WavpackPackSamplesInt16 (wpc, (int16_t *) temp, sample_count);
+            }
+
+            if (!config->float_norm_exp && bps == 3) {
+                store_samples (temp, samples, 0, 3, count);
+                return WavpackPackSamplesInt24 (wpc, (unsigned char *) temp, sample_count);
+            }
+
+            break;
+    }
+
+    return WavpackPackSamples (wpc, samples, sample_count);
+}
+
 // Thread / function that opens a virtual WavPack file, decodes it and calculates the MD5 hash of the
 // decoded audio data.
 
@@ -1000,7 +2058,7 @@ static void *decode_thread (void *threadid)
 {
     WavpackDecoder *wd = (WavpackDecoder *) threadid;
     char error [80];
-    WavpackContext *wpc = WavpackOpenFileInputEx (&freader, wd->wv_stream, wd->wvc_stream, error, 0, 0);
+    WavpackContext *wpc = WavpackOpenFileInputEx (&freader, wd->wv_stream, wd->wvc_stream, error, wd->open_flags, 0);
     int32_t *decoded_samples, num_chans, bps;
     MD5_CTX md5_context;
 
@@ -1058,6 +2116,7 @@ static int write_block (void *id, void *data, int32_t length)
         ws->first_block_size = length;
 
     ws->bytes_written += length;
+    MD5_Update (&ws->md5_written, data, length);
 
     if (ws->file && !ws->error) {
         if (!fwrite (data, 1, length, ws->file)) {
@@ -1196,6 +2255,8 @@ static WavpackStreamReader freader = {
 
 static void initialize_stream (StreamingFile *ws, int buffer_size)
 {
+    MD5_Init (&ws->md5_written);
+
     if (buffer_size) {
         ws->buffer_base = malloc (ws->buffer_size = buffer_size);
         ws->buffer_head = ws->buffer_tail = ws->buffer_base;
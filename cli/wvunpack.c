@@ -157,6 +157,8 @@ static const char *help =
 "                          start decoding at specified sample/time\n"
 "                           (specifying a '-' makes sample/time relative to end)\n"
 "    -t                    copy input file's time stamp to output file(s)\n"
+"    --threads[=n]         use worker threads for decoding (n = 1 to 15,\n"
+"                           default = 4; output is identical to no threads)\n"
 "    --until=[+|-][sample|hh:mm:ss.ss]\n"
 "                          stop decoding at specified sample/time\n"
 "                           (adding '+' makes sample/time relative to '--skip'\n"
@@ -207,7 +209,8 @@ static struct {
 int debug_logging_mode;
 
 static int overwrite_all, delete_source, raw_decode, normalize_floats, no_utf8_convert, no_audio_decode, file_info,
-    summary, ignore_wvc, quiet_mode, calc_md5, copy_time, blind_decode, decode_format, format_specified, caf_be, set_console_title;
+    summary, ignore_wvc, quiet_mode, calc_md5, copy_time, blind_decode, decode_format, format_specified, caf_be, set_console_title,
+    worker_threads;
 
 static int num_files, file_index, outbuf_k;
 
@@ -319,6 +322,18 @@ int main(int argc, char **argv)
                     ++error_count;
                 }
             }
+            else if (!strncmp (long_option, "threads", 7)) {            // --threads
+                if (*long_param) {
+                    worker_threads = strtol (long_param, NULL, 10);
+
+                    if (worker_threads < 1 || worker_threads > 15) {
+                        error_line ("invalid number of threads!");
+                        ++error_count;
+                    }
+                }
+                else
+                    worker_threads = 4;
+            }
             else if (!strncmp (long_option, "until", 5)) {              // --until
                 parse_sample_time_index (&until, long_param);
 
@@ -1507,6 +1522,9 @@ static int unpack_file (char *infilename, char *outfilename, int add_extension)
     else
         open_flags |= OPEN_DSD_NATIVE | OPEN_ALT_TYPES;
 
+    if (worker_threads && !no_audio_decode)
+        open_flags |= worker_threads << OPEN_THREADS_SHFT;
+
     wpc = WavpackOpenFileInput (infilename, error, open_flags, 0);
 
     if (!wpc) {
@@ -1975,7 +1993,7 @@ static int unpack_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsigned
     unsigned char *output_buffer = NULL, *output_pointer = NULL, *new_channel_order = NULL;
     int bps = WavpackGetBytesPerSample (wpc), num_channels = WavpackGetNumChannels (wpc);
     int64_t until_samples_total = *sample_count, total_unpacked_samples = 0;
-    int bytes_per_sample = bps * num_channels, result = WAVPACK_NO_ERROR;
+    int bytes_per_sample = bps * num_channels, result = WAVPACK_NO_ERROR, packed_output = 0;
     uint32_t output_buffer_size = 0, bcount;
     double progress = -1.0;
     int32_t *temp_buffer;
@@ -2012,9 +2030,22 @@ static int unpack_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsigned
         }
     }
 
+    // Signed little-endian 16-bit and 24-bit PCM (by far the most common formats) can be returned
+    // by the library in its final form, directly into the output buffer. The 16-bit version returns
+    // native shorts, so this only works for that on little-endian machines.
+
+    if (!new_channel_order && !(qmode & (QMODE_BIG_ENDIAN | QMODE_UNSIGNED_WORDS)) &&
+        !(WavpackGetMode (wpc) & MODE_FLOAT)) {
+            static const uint16_t endian_test = 1;
+
+            if (bps == 3 || (bps == 2 && *(const unsigned char *) &endian_test))
+                packed_output = bps;
+    }
+
     temp_buffer = malloc (TEMP_BUFFER_SAMPLES * num_channels * sizeof (temp_buffer [0]));
 
     while (result == WAVPACK_NO_ERROR) {
+        unsigned char *packed_buffer = output_buffer ? output_pointer : (unsigned char *) temp_buffer;
         uint32_t samples_to_unpack, samples_unpacked;
 
         if (output_buffer) {
@@ -2029,14 +2060,22 @@ static int unpack_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsigned
         if (until_samples_total && samples_to_unpack > until_samples_total - total_unpacked_samples)
             samples_to_unpack = (uint32_t) (until_samples_total - total_unpacked_samples);
 
-        samples_unpacked = WavpackUnpackSamples (wpc, temp_buffer, samples_to_unpack);
+        if (packed_output == 2)
+            samples_unpacked = WavpackUnpackSamplesInt16 (wpc, (int16_t *) packed_buffer, samples_to_unpack);
+        else if (packed_output == 3)
+            samples_unpacked = WavpackUnpackSamplesInt24 (wpc, packed_buffer, samples_to_unpack);
+        else
+            samples_unpacked = WavpackUnpackSamples (wpc, temp_buffer, samples_to_unpack);
+
         total_unpacked_samples += samples_unpacked;
 
         if (new_channel_order)
             unreorder_channels (temp_buffer, new_channel_order, num_channels, samples_unpacked);
 
         if (output_buffer) {
-            if (samples_unpacked)
+            if (packed_output)
+                output_pointer += samples_unpacked * bytes_per_sample;
+            else if (samples_unpacked)
                 output_pointer = store_samples (output_pointer, temp_buffer, qmode, bps, samples_unpacked * num_channels);
 
             if (!samples_unpacked || (output_buffer_size - (output_pointer - output_buffer)) < (uint32_t) bytes_per_sample) {
@@ -2053,8 +2092,12 @@ static int unpack_audio (WavpackContext *wpc, FILE *outfile, int qmode, unsigned
         }
 
         if (md5_digest && samples_unpacked) {
-            store_samples (temp_buffer, temp_buffer, qmode, bps, samples_unpacked * num_channels);
-            MD5_Update (&md5_context, (unsigned char *) temp_buffer, bps * samples_unpacked * num_channels);
+            if (packed_output)
+                MD5_Update (&md5_context, packed_buffer, bytes_per_sample * samples_unpacked);
+            else {
+                store_samples (temp_buffer, temp_buffer, qmode, bps, samples_unpacked * num_channels);
+                MD5_Update (&md5_context, (unsigned char *) temp_buffer, bps * samples_unpacked * num_channels);
+            }
         }
 
         if (!samples_unpacked)
@@ -15,6 +15,7 @@
 // functions in "wputils.c" to read and write WavPack files and streams.
 
 #include <sys/types.h>
+#include <stddef.h>
 
 #if defined(_MSC_VER) && _MSC_VER < 1600
 typedef unsigned __int64 uint64_t;
@@ -180,6 +181,7 @@ typedef struct {
 #define ID_ALT_MD5_CHECKSUM     (ID_OPTIONAL_DATA | 0x9)
 #define ID_NEW_CONFIG_BLOCK     (ID_OPTIONAL_DATA | 0xa)
 #define ID_CHANNEL_IDENTITIES   (ID_OPTIONAL_DATA | 0xb)
+#define ID_SEEK_TABLE           (ID_OPTIONAL_DATA | 0xc)
 #define ID_BLOCK_CHECKSUM       (ID_OPTIONAL_DATA | 0xf)
 
 ///////////////////////// WavPack Configuration ///////////////////////////////
@@ -196,6 +198,7 @@ typedef struct {
     unsigned char md5_checksum [16], md5_read;
     int num_tag_strings;                // this field is not used
     char **tag_strings;                 // this field is not used
+    int worker_threads;                 // encode threads (0 = none, 1-15; see pack_utils.c)
 } WavpackConfig;
 
 #define CONFIG_HYBRID_FLAG      8       // hybrid mode
@@ -219,6 +222,7 @@ typedef struct {
 #define CONFIG_MD5_CHECKSUM     0x8000000 // store MD5 signature
 #define CONFIG_MERGE_BLOCKS     0x10000000 // merge blocks of equal redundancy (for lossyWAV)
 #define CONFIG_PAIR_UNDEF_CHANS 0x20000000 // encode undefined channels in stereo pairs
+#define CONFIG_SEEK_TABLE       0x40000000 // store a seek table at the end of the file
 #define CONFIG_OPTIMIZE_MONO    0x80000000 // optimize for mono streams posing as stereo
 
 // The lower 8 bits of qmode indicate the use of new features in version 5 that (presently)
@@ -278,8 +282,52 @@ typedef struct {
     int (*close)(void *id);                                     // new function to close file
 } WavpackStreamReader64;
 
+// Callbacks for reading files with range requests (see WavpackOpenFileInputRemote()),
+// where each call to read_range() is one request. It returns the number of bytes read
+// (which is only less than requested at the end of the file) or -1 for an error.
+
+typedef struct {
+    int32_t (*read_range)(void *id, int64_t position, void *data, int32_t bcount);
+    int64_t (*get_length)(void *id);
+    int (*close)(void *id);                                     // optional
+} WavpackRemoteReader;
+
 typedef int (*WavpackBlockOutput)(void *id, void *data, int32_t bcount);
 
+// Memory allocation functions that may be substituted for the C runtime's with
+// WavpackSetAllocator() (for all allocations made by the library). The "user"
+// pointer is passed back to each function. The realloc function must accept
+// a NULL pointer, but the free function is never called with NULL.
+
+typedef struct {
+    void *(*malloc_func)(void *user, size_t size);
+    void *(*realloc_func)(void *user, void *ptr, size_t size);
+    void (*free_func)(void *user, void *ptr);
+    void *user;
+} WavpackAllocator;
+
+typedef struct WavpackArena WavpackArena;
+
+// Cache of decoded audio that can be shared by any number of open files
+
+typedef struct WavpackBlockCache WavpackBlockCache;
+
+// Information about a file returned by WavpackProbe() without opening it. The
+// values are what the corresponding functions would return if the file were
+// opened with OPEN_TAGS | OPEN_DSD_NATIVE (and OPEN_ALT_TYPES, if specified),
+// except that MODE_WVC is never set because correction files are not probed.
+
+typedef struct {
+    int64_t total_samples;              // -1 if unknown
+    uint32_t sample_rate;               // zero if the probe failed
+    int32_t channel_mask;
+    int num_channels, bits_per_sample, bytes_per_sample;
+    int mode, qualify_mode, version;
+    int md5_read;                       // md5_sum is valid (MODE_MD5 can be set without it)
+    unsigned char md5_sum [16];
+    char tag_type;                      // 0 = none, 'A' = APEv2, 'T' = ID3v1 (only)
+} WavpackProbeInfo;
+
 //////////////////////////// function prototypes /////////////////////////////
 
 typedef struct WavpackContext WavpackContext;
@@ -298,6 +346,16 @@ WavpackContext *WavpackOpenRawDecoder (
 WavpackContext *WavpackOpenFileInputEx64 (WavpackStreamReader64 *reader, void *wv_id, void *wvc_id, char *error, int flags, int norm_offset);
 WavpackContext *WavpackOpenFileInputEx (WavpackStreamReader *reader, void *wv_id, void *wvc_id, char *error, int flags, int norm_offset);
 WavpackContext *WavpackOpenFileInput (const char *infilename, char *error, int flags, int norm_offset);
+WavpackContext *WavpackOpenFileInputMemory (const void *wv_data, size_t wv_size, const void *wvc_data, size_t wvc_size,
+    char *error, int flags, int norm_offset);
+WavpackContext *WavpackOpenFileInputFd (int wv_fd, int wvc_fd, char *error, int flags, int norm_offset);
+WavpackContext *WavpackOpenFileInputPrefetch (WavpackStreamReader64 *reader, void *wv_id, void *wvc_id,
+    char *error, int flags, int norm_offset, int depth, int32_t buffer_size);
+WavpackContext *WavpackOpenFileInputRemote (WavpackRemoteReader *reader, void *wv_id, void *wvc_id,
+    char *error, int flags, int norm_offset, int num_pages, int32_t page_size);
+int WavpackProbe (const char *filename, WavpackProbeInfo *info, char *error, int flags);
+int WavpackProbeEx64 (WavpackStreamReader64 *reader, void *id, WavpackProbeInfo *info, char *error, int flags);
+int WavpackProbeBatch (const char **filenames, int count, WavpackProbeInfo *info, int flags, int num_threads);
 
 #define OPEN_WVC        0x1     // open/read "correction" file
 #define OPEN_TAGS       0x2     // read ID3v1 / APEv2 tags (seekable file)
@@ -317,6 +375,10 @@ WavpackContext *WavpackOpenFileInput (const char *infilename, char *error, int f
 #define OPEN_ALT_TYPES  0x400   // application is aware of alternate file types & qmode
                                 // (just affects retrieving wrappers & MD5 checksums)
 #define OPEN_NO_CHECKSUM 0x800  // don't verify block checksums before decoding
+#define OPEN_THREADS_SHFT 12   // specify number of additional worker threads here for
+#define OPEN_THREADS_MASK 0xF000 // decode; 0 to disable, otherwise 1-15 added threads
+#define OPEN_SEEK_INDEX 0x10000 // scan the whole file on open to build the seek index
+#define OPEN_MMAP       0x20000 // map the file(s) into memory and decode blocks in place
 
 int WavpackGetMode (WavpackContext *wpc);
 
@@ -342,6 +404,10 @@ int WavpackGetVersion (WavpackContext *wpc);
 char *WavpackGetFileExtension (WavpackContext *wpc);
 unsigned char WavpackGetFileFormat (WavpackContext *wpc);
 uint32_t WavpackUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint32_t samples);
+uint32_t WavpackUnpackSamplesInt16 (WavpackContext *wpc, int16_t *buffer, uint32_t samples);
+uint32_t WavpackUnpackSamplesInt24 (WavpackContext *wpc, unsigned char *buffer, uint32_t samples);
+uint32_t WavpackUnpackSamplesFloat32 (WavpackContext *wpc, float *buffer, uint32_t samples);
+uint32_t WavpackUnpackSamplesPlanar (WavpackContext *wpc, int32_t **channels, uint32_t samples);
 uint32_t WavpackGetNumSamples (WavpackContext *wpc);
 int64_t WavpackGetNumSamples64 (WavpackContext *wpc);
 uint32_t WavpackGetNumSamplesInFrame (WavpackContext *wpc);
@@ -351,6 +417,16 @@ int WavpackGetNumErrors (WavpackContext *wpc);
 int WavpackLossyBlocks (WavpackContext *wpc);
 int WavpackSeekSample (WavpackContext *wpc, uint32_t sample);
 int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample);
+int WavpackBuildSeekIndex (WavpackContext *wpc);
+int64_t WavpackLookupSeekIndex (WavpackContext *wpc, int64_t sample, int64_t *block_index, uint32_t *block_samples);
+int WavpackSaveSeekIndex (WavpackContext *wpc, const char *filename);
+int WavpackLoadSeekIndex (WavpackContext *wpc, const char *filename);
+uint32_t WavpackReadRange (WavpackContext *wpc, int64_t start_sample, uint32_t sample_count, int32_t *buffer);
+WavpackBlockCache *WavpackBlockCacheCreate (size_t max_bytes);
+int WavpackAttachBlockCache (WavpackContext *wpc, WavpackBlockCache *cache, const char *file_id);
+void WavpackBlockCacheGetStats (WavpackBlockCache *cache, int64_t *hits, int64_t *misses, size_t *bytes_used);
+void WavpackBlockCacheDestroy (WavpackBlockCache *cache);
+int WavpackGetRemoteStats (WavpackContext *wpc, int64_t *requests, int64_t *bytes);
 WavpackContext *WavpackCloseFile (WavpackContext *wpc);
 uint32_t WavpackGetSampleRate (WavpackContext *wpc);
 uint32_t WavpackGetNativeSampleRate (WavpackContext *wpc);
@@ -398,8 +474,13 @@ int WavpackSetConfiguration64 (WavpackContext *wpc, WavpackConfig *config, int64
 int WavpackSetChannelLayout (WavpackContext *wpc, uint32_t layout_tag, const unsigned char *reorder);
 int WavpackAddWrapper (WavpackContext *wpc, void *data, uint32_t bcount);
 int WavpackStoreMD5Sum (WavpackContext *wpc, unsigned char data [16]);
+int WavpackStoreSeekTable (WavpackContext *wpc);
 int WavpackPackInit (WavpackContext *wpc);
 int WavpackPackSamples (WavpackContext *wpc, int32_t *sample_buffer, uint32_t sample_count);
+int WavpackPackSamplesInt16 (WavpackContext *wpc, const int16_t *sample_buffer, uint32_t sample_count);
+int WavpackPackSamplesInt24 (WavpackContext *wpc, const unsigned char *sample_buffer, uint32_t sample_count);
+int WavpackPackSamplesFloat32 (WavpackContext *wpc, const float *sample_buffer, uint32_t sample_count);
+int WavpackPackSamplesPlanar (WavpackContext *wpc, int32_t **channels, uint32_t sample_count);
 int WavpackFlushSamples (WavpackContext *wpc);
 void WavpackUpdateNumSamples (WavpackContext *wpc, void *first_block);
 void *WavpackGetWrapperLocation (void *first_block, uint32_t *size);
@@ -415,6 +496,12 @@ void WavpackNativeToBigEndian (void *data, char *format);
 uint32_t WavpackGetLibraryVersion (void);
 const char *WavpackGetLibraryVersionString (void);
 
+void WavpackSetAllocator (const WavpackAllocator *allocator);
+WavpackArena *WavpackArenaCreate (void *memory, size_t bytes);
+void WavpackArenaGetAllocator (WavpackArena *arena, WavpackAllocator *allocator);
+void WavpackArenaGetStats (WavpackArena *arena, size_t *used, size_t *peak, size_t *overflows);
+void WavpackArenaDestroy (WavpackArena *arena);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,372 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** WAVPACK ****                            //
+//                  Hybrid Lossless Wavefile Compressor                   //
+//              Copyright (c) 1998 - 2024 David Bryant.                   //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// block_cache.c
+
+// This module provides an optional cache of decoded audio that can be shared by
+// any number of contexts (and threads) in a process. Each entry holds one
+// complete decoded "frame" (the set of blocks for one multichannel sequence)
+// keyed by the file it came from and its first sample. Entries are kept in a
+// hash table and a least-recently-used list, and the oldest entries not in use
+// are discarded when the memory budget is exceeded. The decoder looks frames up
+// (and stores the ones it decodes) when it reaches the start of a new frame,
+// and seeks look them up through the seek index (see unpack_utils.c and
+// unpack_seek.c). Files are identified by a string supplied by the application
+// (e.g., the pathname) combined with the options that affect the decoded audio.
+// The cache's memory comes from the C runtime (and not the library's allocator)
+// because it outlives the contexts that use it.
+
+#ifndef NO_SEEKING
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+typedef struct {
+    char *file_id;
+    uint32_t options, hash;
+} CacheFile;
+
+struct WavpackBlockCache {
+    CachedFrame **buckets, *lru_head, *lru_tail;    // most recently used frame at head
+    uint32_t num_buckets, num_frames, num_files, max_files;
+    CacheFile *files;
+    size_t max_bytes, used_bytes;
+    int64_t hits, misses;
+    void *mutex;
+};
+
+#define INITIAL_BUCKETS 256
+
+// Create a cache that will hold up to "max_bytes" of decoded audio (plus a small
+// amount of overhead). Returns NULL if the cache could not be created.
+
+WavpackBlockCache *WavpackBlockCacheCreate (size_t max_bytes)
+{
+    WavpackBlockCache *cache = (WavpackBlockCache *) calloc (1, sizeof (WavpackBlockCache));
+
+    if (!cache)
+        return NULL;
+
+    if (!(cache->buckets = (CachedFrame **) calloc (cache->num_buckets = INITIAL_BUCKETS, sizeof (CachedFrame *)))) {
+        free (cache);
+        return NULL;
+    }
+
+    cache->max_bytes = max_bytes;
+    cache->mutex = workers_mutex_create ();
+    return cache;
+}
+
+// Destroy the cache (after all the contexts it's attached to have been closed).
+
+void WavpackBlockCacheDestroy (WavpackBlockCache *cache)
+{
+    if (cache) {
+        CachedFrame *frame;
+        uint32_t i;
+
+        while ((frame = cache->lru_head) != NULL) {
+            cache->lru_head = frame->lru_next;
+            free (frame);
+        }
+
+        for (i = 0; i < cache->num_files; ++i)
+            free (cache->files [i].file_id);
+
+        workers_mutex_destroy (cache->mutex);
+        free (cache->files);
+        free (cache->buckets);
+        free (cache);
+    }
+}
+
+// Return the number of lookups that found (and didn't find) the requested audio and
+// the number of bytes currently held (any of the pointers may be NULL).
+
+void WavpackBlockCacheGetStats (WavpackBlockCache *cache, int64_t *hits, int64_t *misses, size_t *bytes_used)
+{
+    workers_mutex_lock (cache->mutex);
+
+    if (hits) *hits = cache->hits;
+    if (misses) *misses = cache->misses;
+    if (bytes_used) *bytes_used = cache->used_bytes;
+
+    workers_mutex_unlock (cache->mutex);
+}
+
+// Use the specified cache for the open file, which "file_id" (usually the pathname)
+// must uniquely identify among all the files using the cache. This should be called
+// right after opening (and before any range reads). The cache is not available for
+// files opened with worker threads or OPEN_STREAMING, for unseekable files, or for
+// pre-4.0 files, and FALSE is returned for those.
+
+int WavpackAttachBlockCache (WavpackContext *wpc, WavpackBlockCache *cache, const char *file_id)
+{
+    uint32_t options, hash = 0, i;
+    const char *cp;
+
+    if (!cache || !file_id || wpc->workers || wpc->stream3 || !wpc->streams || (wpc->open_flags & OPEN_STREAMING) ||
+        !wpc->reader->can_seek (wpc->wv_in) || (wpc->wvc_flag && !wpc->reader->can_seek (wpc->wvc_in)))
+            return FALSE;
+
+    // these are the options that change the decoded audio for a given file
+
+    options = (wpc->wvc_flag ? 1 : 0) | (wpc->reduced_channels << 1) |
+        ((wpc->open_flags & OPEN_NORMALIZE) ? (((uint32_t) wpc->norm_offset & 0xffff) << 8) | 0x80 : 0);
+
+    for (cp = file_id; *cp; ++cp)
+        hash = hash * 31 + (unsigned char) *cp;
+
+    workers_mutex_lock (cache->mutex);
+
+    for (i = 0; i < cache->num_files; ++i)
+        if (cache->files [i].hash == hash && cache->files [i].options == options && !strcmp (cache->files [i].file_id, file_id))
+            break;
+
+    if (i == cache->num_files) {
+        if (cache->num_files == cache->max_files) {
+            uint32_t max_files = cache->max_files ? cache->max_files * 2 : 16;
+            CacheFile *files = (CacheFile *) realloc (cache->files, max_files * sizeof (CacheFile));
+
+            if (!files) {
+                workers_mutex_unlock (cache->mutex);
+                return FALSE;
+            }
+
+            cache->files = files;
+            cache->max_files = max_files;
+        }
+
+        if (!(cache->files [i].file_id = (char *) malloc (strlen (file_id) + 1))) {
+            workers_mutex_unlock (cache->mutex);
+            return FALSE;
+        }
+
+        strcpy (cache->files [i].file_id, file_id);
+        cache->files [i].options = options;
+        cache->files [i].hash = hash;
+        cache->num_files++;
+    }
+
+    workers_mutex_unlock (cache->mutex);
+
+    block_cache_release (wpc);
+    wpc->block_cache = cache;
+    wpc->cache_file = i;
+    return TRUE;
+}
+
+static uint32_t frame_hash (WavpackBlockCache *cache, uint32_t file_num, int64_t block_index)
+{
+    uint64_t key = ((uint64_t) block_index * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t) file_num * 0xC2B2AE3D27D4EB4FULL);
+
+    return (uint32_t) (key >> 32) & (cache->num_buckets - 1);
+}
+
+static void lru_unlink (WavpackBlockCache *cache, CachedFrame *frame)
+{
+    if (frame->lru_prev)
+        frame->lru_prev->lru_next = frame->lru_next;
+    else
+        cache->lru_head = frame->lru_next;
+
+    if (frame->lru_next)
+        frame->lru_next->lru_prev = frame->lru_prev;
+    else
+        cache->lru_tail = frame->lru_prev;
+}
+
+static void lru_push (WavpackBlockCache *cache, CachedFrame *frame)
+{
+    frame->lru_prev = NULL;
+
+    if ((frame->lru_next = cache->lru_head) != NULL)
+        cache->lru_head->lru_prev = frame;
+    else
+        cache->lru_tail = frame;
+
+    cache->lru_head = frame;
+}
+
+// Look up the frame starting at "block_index" for the context's file. If it's found
+// it's moved to the front of the LRU list and returned with its reference count
+// incremented (which prevents it from being discarded until block_cache_release()).
+
+CachedFrame *block_cache_lookup (WavpackContext *wpc, int64_t block_index)
+{
+    WavpackBlockCache *cache = (WavpackBlockCache *) wpc->block_cache;
+    CachedFrame *frame;
+
+    workers_mutex_lock (cache->mutex);
+    frame = cache->buckets [frame_hash (cache, wpc->cache_file, block_index)];
+
+    while (frame && (frame->file_num != wpc->cache_file || frame->block_index != block_index))
+        frame = frame->hash_next;
+
+    if (frame) {
+        lru_unlink (cache, frame);
+        lru_push (cache, frame);
+        frame->ref_count++;
+        cache->hits++;
+    }
+    else
+        cache->misses++;
+
+    workers_mutex_unlock (cache->mutex);
+    return frame;
+}
+
+// Allocate a new frame (not yet in the cache) big enough for the specified number of
+// samples. It's returned with a reference, so it's freed by block_cache_release() if
+// it's never inserted.
+
+CachedFrame *block_cache_alloc (WavpackContext *wpc, uint32_t num_samples)
+{
+    int num_channels = wpc->reduced_channels ? wpc->reduced_channels : wpc->config.num_channels;
+    size_t bytes = sizeof (CachedFrame) + (size_t) num_samples * num_channels * sizeof (int32_t);
+    CachedFrame *frame = (CachedFrame *) malloc (bytes);
+
+    if (frame) {
+        memset (frame, 0, sizeof (CachedFrame));
+        frame->samples = (int32_t *) (frame + 1);
+        frame->file_num = wpc->cache_file;
+        frame->bytes = bytes;
+        frame->ref_count = 1;
+    }
+
+    return frame;
+}
+
+// Insert a completely decoded frame into the cache (if it fits) and discard the least
+// recently used frames that aren't in use until we're back within the budget. If
+// another context has inserted the same frame in the meantime, this one is freed and
+// that one is returned instead (with a reference).
+
+CachedFrame *block_cache_insert (WavpackContext *wpc, CachedFrame *frame)
+{
+    WavpackBlockCache *cache = (WavpackBlockCache *) wpc->block_cache;
+    CachedFrame *existing, *victim;
+    uint32_t bucket;
+
+    if (frame->bytes > cache->max_bytes)
+        return frame;
+
+    workers_mutex_lock (cache->mutex);
+    bucket = frame_hash (cache, frame->file_num, frame->block_index);
+
+    for (existing = cache->buckets [bucket]; existing; existing = existing->hash_next)
+        if (existing->file_num == frame->file_num && existing->block_index == frame->block_index) {
+            existing->ref_count++;
+            workers_mutex_unlock (cache->mutex);
+            free (frame);
+            return existing;
+        }
+
+    frame->hash_next = cache->buckets [bucket];
+    cache->buckets [bucket] = frame;
+    lru_push (cache, frame);
+    frame->in_cache = TRUE;
+    cache->used_bytes += frame->bytes;
+    cache->num_frames++;
+
+    for (victim = cache->lru_tail; victim && cache->used_bytes > cache->max_bytes; ) {
+        CachedFrame *prev = victim->lru_prev, **link;
+
+        if (!victim->ref_count) {
+            link = &cache->buckets [frame_hash (cache, victim->file_num, victim->block_index)];
+
+            while (*link != victim)
+                link = &(*link)->hash_next;
+
+            *link = victim->hash_next;
+            lru_unlink (cache, victim);
+            cache->used_bytes -= victim->bytes;
+            cache->num_frames--;
+            free (victim);
+        }
+
+        victim = prev;
+    }
+
+    // keep the chains short by doubling the table when it gets full
+
+    if (cache->num_frames > cache->num_buckets) {
+        CachedFrame **buckets = (CachedFrame **) calloc (cache->num_buckets * 2, sizeof (CachedFrame *));
+
+        if (buckets) {
+            free (cache->buckets);
+            cache->buckets = buckets;
+            cache->num_buckets *= 2;
+
+            for (victim = cache->lru_head; victim; victim = victim->lru_next) {
+                bucket = frame_hash (cache, victim->file_num, victim->block_index);
+                victim->hash_next = buckets [bucket];
+                buckets [bucket] = victim;
+            }
+        }
+    }
+
+    workers_mutex_unlock (cache->mutex);
+    return frame;
+}
+
+// Release the context's reference to the frame it's returning audio from (if any),
+// freeing it if it never made it into the cache.
+
+void block_cache_release (WavpackContext *wpc)
+{
+    CachedFrame *frame = (CachedFrame *) wpc->cache_frame;
+
+    if (!frame)
+        return;
+
+    wpc->cache_frame = NULL;
+
+    if (frame->in_cache) {
+        WavpackBlockCache *cache = (WavpackBlockCache *) wpc->block_cache;
+
+        workers_mutex_lock (cache->mutex);
+        frame->ref_count--;
+        workers_mutex_unlock (cache->mutex);
+    }
+    else
+        free (frame);
+}
+
+// Make the specified frame (which the caller holds a reference to) the one the context
+// is returning audio from, starting at "sample". The loaded blocks are released (so that
+// the seek code will reload the first block of the frame if it needs it) and, if
+// requested, the file positions are moved to the end of the frame (as though it had just
+// been decoded) where the decoder will look for the next frame.
+
+void use_cached_frame (WavpackContext *wpc, CachedFrame *frame, int64_t sample, int reposition)
+{
+    WavpackStream *wps;
+
+    block_cache_release (wpc);
+    free_streams (wpc);
+    wps = wpc->streams [0];
+    wps->wphdr = frame->wphdr;
+    wps->sample_index = sample;
+    wps->init_done = FALSE;
+    wpc->filepos = frame->filepos;
+    wpc->cache_frame = frame;
+
+    if (reposition) {
+        wpc->reader->set_pos_abs (wpc->wv_in, frame->endpos);
+
+        if (wpc->wvc_flag) {
+            wpc->file2pos = frame->file2pos;
+            wpc->reader->set_pos_abs (wpc->wvc_in, frame->end2pos);
+        }
+    }
+}
+
+#endif
@@ -189,6 +189,9 @@ int WavpackGetNumErrors (WavpackContext *wpc)
 
 int WavpackLossyBlocks (WavpackContext *wpc)
 {
+    if (wpc && wpc->pack_pipeline)
+        pack_finish_pending (wpc);
+
     return wpc ? wpc->lossy_blocks : 0;
 }
 
@@ -362,15 +365,36 @@ WavpackContext *WavpackCloseFile (WavpackContext *wpc)
     if (wpc->close_callback)
         wpc->close_callback (wpc);
 
+    if (wpc->pack_pipeline)
+        free_pack_pipeline (wpc);
+
+    if (wpc->read_ahead)
+        free_read_ahead (wpc);
+
+#ifndef NO_SEEKING
+    if (wpc->range_readers)
+        free_range_readers (wpc);
+
+    block_cache_release (wpc);
+#endif
+
+    if (wpc->workers)
+        workers_destroy (wpc->workers);
+
     if (wpc->streams) {
         free_streams (wpc);
 
         if (wpc->streams [0])
-            free (wpc->streams [0]);
+            wp_free (wpc->streams [0]);
 
-        free (wpc->streams);
+        wp_free (wpc->streams);
     }
 
+    free_spare_buffers (wpc);
+
+    if (wpc->seek_index)
+        wp_free (wpc->seek_index);
+
 #ifdef ENABLE_LEGACY
     if (wpc->stream3)
         free_stream3 (wpc);
@@ -389,16 +413,16 @@ WavpackContext *WavpackCloseFile (WavpackContext *wpc)
 
         for (i = 0; i < wpc->metacount; ++i)
             if (wpc->metadata [i].data)
-                free (wpc->metadata [i].data);
+                wp_free (wpc->metadata [i].data);
 
-        free (wpc->metadata);
+        wp_free (wpc->metadata);
     }
 
     if (wpc->channel_identities)
-        free (wpc->channel_identities);
+        wp_free (wpc->channel_identities);
 
     if (wpc->channel_reordering)
-        free (wpc->channel_reordering);
+        wp_free (wpc->channel_reordering);
 
 #ifndef NO_TAGS
     free_tag (&wpc->m_tag);
@@ -409,7 +433,13 @@ WavpackContext *WavpackCloseFile (WavpackContext *wpc)
         decimate_dsd_destroy (wpc->decimation_context);
 #endif
 
-    free (wpc);
+    if (wpc->convert_buffer)
+        wp_free (wpc->convert_buffer);
+
+    if (wpc->temp_buffer)
+        wp_free (wpc->temp_buffer);
+
+    wp_free (wpc);
 
     return NULL;
 }
@@ -432,7 +462,7 @@ unsigned char *WavpackGetWrapperData (WavpackContext *wpc)
 void WavpackFreeWrapper (WavpackContext *wpc)
 {
     if (wpc && wpc->wrapper_data) {
-        free (wpc->wrapper_data);
+        wp_free (wpc->wrapper_data);
         wpc->wrapper_data = NULL;
         wpc->wrapper_bytes = 0;
     }
@@ -521,73 +551,283 @@ int WavpackGetReducedChannels (WavpackContext *wpc)
         return 2;
 }
 
-// Free all memory allocated for raw WavPack blocks (for all allocated streams)
-// and free all additional streams. This does not free the default stream ([0])
-// which is always kept around.
+// Release all memory allocated for raw WavPack blocks (for all allocated streams)
+// and release all additional streams. This does not free the default stream ([0])
+// which is always kept around. Block buffers and streams go to the context's spare
+// lists so that decoding the following blocks does not need to allocate again.
 
 void free_streams (WavpackContext *wpc)
 {
     int si = wpc->num_streams;
 
     while (si--) {
-        if (wpc->streams [si]->blockbuff) {
-            free (wpc->streams [si]->blockbuff);
-            wpc->streams [si]->blockbuff = NULL;
-        }
+        free_single_stream (wpc, wpc->streams [si]);
 
-        if (wpc->streams [si]->block2buff) {
-            free (wpc->streams [si]->block2buff);
-            wpc->streams [si]->block2buff = NULL;
+        if (si) {
+            wpc->num_streams--;
+            release_stream (wpc, wpc->streams [si]);
+            wpc->streams [si] = NULL;
         }
+    }
 
-        if (wpc->streams [si]->sample_buffer) {
-            free (wpc->streams [si]->sample_buffer);
-            wpc->streams [si]->sample_buffer = NULL;
-        }
+    wpc->current_stream = 0;
+}
 
-        if (wpc->streams [si]->dc.shaping_data) {
-            free (wpc->streams [si]->dc.shaping_data);
-            wpc->streams [si]->dc.shaping_data = NULL;
-        }
+// These functions maintain the seek index, which maps sample indexes to the file
+// positions of the blocks containing them (see unpack_seek.c). The encoder also
+// uses this to collect the positions of the blocks it writes (for the seek table).
+
+// Return the index of the last entry starting at or before the specified
+// sample, or -1 if there are none.
+
+int32_t seek_index_find (WavpackContext *wpc, int64_t sample)
+{
+    int32_t low = 0, high = wpc->seek_index_count;
+
+    while (low < high) {
+        int32_t mid = (low + high) >> 1;
+
+        if (wpc->seek_index [mid].block_index <= sample)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low - 1;
+}
+
+// Add a block to the seek index. Blocks already indexed are ignored (except to fill
+// in an unknown correction file position) as are any that would overlap existing
+// entries, which might happen with damaged files.
+
+void seek_index_add (WavpackContext *wpc, int64_t block_index, uint32_t block_samples, int64_t filepos, int64_t file2pos)
+{
+    int32_t index = seek_index_find (wpc, block_index);
+    SeekIndexEntry *entry;
+
+    if (index >= 0 && wpc->seek_index [index].block_index + wpc->seek_index [index].block_samples > block_index) {
+        entry = wpc->seek_index + index;
+
+        if (entry->block_index == block_index && entry->block_samples == block_samples &&
+            entry->filepos == filepos && entry->file2pos == -1)
+                entry->file2pos = file2pos;
+
+        return;
+    }
+
+    if (++index < wpc->seek_index_count && block_index + block_samples > wpc->seek_index [index].block_index)
+        return;
+
+    if (wpc->seek_index_count == wpc->seek_index_size) {
+        int32_t new_size = wpc->seek_index_size ? wpc->seek_index_size * 2 : 256;
+        SeekIndexEntry *new_index;
+
+        if (new_size > MAX_SEEK_INDEX_ENTRIES ||
+            !(new_index = (SeekIndexEntry *)wp_realloc (wpc->seek_index, new_size * sizeof (SeekIndexEntry))))
+                return;
+
+        wpc->seek_index = new_index;
+        wpc->seek_index_size = new_size;
+    }
+
+    entry = wpc->seek_index + index;
+    memmove (entry + 1, entry, (wpc->seek_index_count++ - index) * sizeof (SeekIndexEntry));
+    entry->block_index = block_index;
+    entry->block_samples = block_samples;
+    entry->filepos = filepos;
+    entry->file2pos = file2pos;
+}
+
+// Release all the memory allocated for the raw WavPack blocks and tables of a
+// single stream (but not the stream itself).
+
+void free_single_stream (WavpackContext *wpc, WavpackStream *wps)
+{
+    if (wps->blockbuff) {
+        release_block_buffer (wpc, wps->blockbuff);
+        wps->blockbuff = NULL;
+    }
+
+    if (wps->block2buff) {
+        release_block_buffer (wpc, wps->block2buff);
+        wps->block2buff = NULL;
+    }
+
+    if (wps->sample_buffer) {
+        wp_free (wps->sample_buffer);
+        wps->sample_buffer = NULL;
+    }
+
+    if (wps->dc.shaping_data) {
+        wp_free (wps->dc.shaping_data);
+        wps->dc.shaping_data = NULL;
+    }
 
 #ifdef ENABLE_DSD
-        free_dsd_tables (wpc->streams [si]);
+    free_dsd_tables (wps);
 #endif
+}
 
-        if (si) {
-            wpc->num_streams--;
-            free (wpc->streams [si]);
-            wpc->streams [si] = NULL;
+// Get a buffer for a raw WavPack block of the specified size (including the
+// header). Buffers released with release_block_buffer() are reused whenever
+// one is large enough, and new buffers are allocated with some headroom, so
+// once the largest blocks of a file have been seen no more allocations occur.
+// The allocated size is stored just in front of the returned buffer.
+
+#define BUFFER_HEADER_SIZE 8
+
+unsigned char *get_block_buffer (WavpackContext *wpc, uint32_t size)
+{
+    unsigned char *buffer;
+    int i;
+
+    for (i = wpc->num_spare_buffers - 1; i >= 0; --i)
+        if (*(uint32_t *) wpc->spare_buffers [i] >= size) {
+            buffer = (unsigned char *) wpc->spare_buffers [i];
+            wpc->spare_buffers [i] = wpc->spare_buffers [--wpc->num_spare_buffers];
+            return buffer + BUFFER_HEADER_SIZE;
         }
+
+    // nothing large enough, so discard a spare (which must be too small) to keep the list useful
+
+    if (wpc->num_spare_buffers)
+        wp_free (wpc->spare_buffers [--wpc->num_spare_buffers]);
+
+    size += size >> 3;
+    buffer = (unsigned char *) wp_malloc (size + BUFFER_HEADER_SIZE);
+
+    if (!buffer)
+        return NULL;
+
+    *(uint32_t *) buffer = size;
+    return buffer + BUFFER_HEADER_SIZE;
+}
+
+void release_block_buffer (WavpackContext *wpc, unsigned char *buffer)
+{
+    if (is_memory_block (wpc, buffer))
+        return;
+
+    buffer -= BUFFER_HEADER_SIZE;
+
+    if (wpc->num_spare_buffers < MAX_SPARE_BUFFERS)
+        wpc->spare_buffers [wpc->num_spare_buffers++] = buffer;
+    else
+        wp_free (buffer);
+}
+
+// Get a buffer holding the complete raw block whose header has just been read
+// from the specified file (with read_next_header()) and read the rest of the
+// block into it. If the file is in memory this is normally just a pointer to
+// the block in place (see open_memory.c). Returns 0 on success, 1 if no buffer
+// could be allocated, or 2 if the block could not be completely read (in which
+// case the buffer is still returned so that it can be released).
+
+int read_block_buffer (WavpackContext *wpc, void *id, WavpackHeader *wphdr, unsigned char **buffer)
+{
+    if ((*buffer = memory_block (wpc, id, wphdr)) != NULL)
+        return 0;
+
+    if (!(*buffer = get_block_buffer (wpc, wphdr->ckSize + 8)))
+        return 1;
+
+    memcpy (*buffer, wphdr, sizeof (WavpackHeader));
+
+    if (wpc->reader->read_bytes (id, *buffer + sizeof (WavpackHeader), wphdr->ckSize - 24) != wphdr->ckSize - 24)
+        return 2;
+
+    return 0;
+}
+
+// Store the (possibly modified) native header of a raw block at the beginning
+// of its buffer, where the metadata parsing expects it. A block being used in
+// place in memory must not be written, so if its header actually changes (the
+// block index is adjusted or a corrupt block is rendered harmless) it is first
+// copied into a regular buffer (only as far as the new header covers). In the
+// unlikely event that no buffer is available the block is left as it was.
+
+void store_block_header (WavpackContext *wpc, unsigned char **buffer, WavpackHeader *wphdr)
+{
+    if (is_memory_block (wpc, *buffer)) {
+        uint32_t bytes = ((WavpackHeader *) *buffer)->ckSize;
+        unsigned char *copy;
+
+        if (!memcmp (*buffer, wphdr, sizeof (WavpackHeader)))
+            return;
+
+        if (bytes > wphdr->ckSize)
+            bytes = wphdr->ckSize;
+
+        if (!(copy = get_block_buffer (wpc, wphdr->ckSize + 8)))
+            return;
+
+        memcpy (copy, *buffer, bytes + 8);
+        *buffer = copy;
     }
 
-    wpc->current_stream = 0;
+    memcpy (*buffer, wphdr, sizeof (WavpackHeader));
+}
+
+// Get a cleared stream for decoding, using a released one if available.
+
+WavpackStream *get_spare_stream (WavpackContext *wpc)
+{
+    WavpackStream *wps;
+
+    if (wpc->num_spare_streams)
+        wps = wpc->spare_streams [--wpc->num_spare_streams];
+    else if (!(wps = (WavpackStream *) wp_malloc (sizeof (WavpackStream))))
+        return NULL;
+
+    CLEAR (*wps);
+    return wps;
+}
+
+// Put an extra stream (already emptied with free_single_stream()) on the spare list.
+
+void release_stream (WavpackContext *wpc, WavpackStream *wps)
+{
+    if (wpc->num_spare_streams < MAX_SPARE_BUFFERS)
+        wpc->spare_streams [wpc->num_spare_streams++] = wps;
+    else
+        wp_free (wps);
+}
+
+// Free everything on the context's spare lists (only on close).
+
+void free_spare_buffers (WavpackContext *wpc)
+{
+    while (wpc->num_spare_buffers)
+        wp_free (wpc->spare_buffers [--wpc->num_spare_buffers]);
+
+    while (wpc->num_spare_streams)
+        wp_free (wpc->spare_streams [--wpc->num_spare_streams]);
 }
 
 void free_dsd_tables (WavpackStream *wps)
 {
     if (wps->dsd.probabilities) {
-        free (wps->dsd.probabilities);
+        wp_free (wps->dsd.probabilities);
         wps->dsd.probabilities = NULL;
     }
 
     if (wps->dsd.summed_probabilities) {
-        free (wps->dsd.summed_probabilities);
+        wp_free (wps->dsd.summed_probabilities);
         wps->dsd.summed_probabilities = NULL;
     }
 
     if (wps->dsd.lookup_buffer) {
-        free (wps->dsd.lookup_buffer);
+        wp_free (wps->dsd.lookup_buffer);
         wps->dsd.lookup_buffer = NULL;
     }
 
     if (wps->dsd.value_lookup) {
-        free (wps->dsd.value_lookup);
+        wp_free (wps->dsd.value_lookup);
         wps->dsd.value_lookup = NULL;
     }
 
     if (wps->dsd.ptable) {
-        free (wps->dsd.ptable);
+        wp_free (wps->dsd.ptable);
         wps->dsd.ptable = NULL;
     }
 }
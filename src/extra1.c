@@ -46,11 +46,27 @@
     void PACK_DECORR_MONO_PASS_CONT (int32_t *out_buffer, int32_t *in_buffer,  struct decorr_pass *dpp, int32_t sample_count);
 #endif
 
+// When a pool of worker threads is available, the candidate terms at each level of the
+// recursive search, and the swaps of adjacent terms in the sort, are tried in parallel
+// (see extra2.c for the details).
+
+#define MAX_TRIALS 10       // terms 1 to 8 and 17 & 18
+
+typedef struct {
+    WorkerJob job;
+    struct decorr_pass dps [MAX_NTERMS];
+    int32_t *samples, *outsamples, *tempsamples;
+    uint32_t num_samples, bits;
+    int depth, num_terms, log_limit;
+} DecorrTrial;
+
 typedef struct {
     int32_t *sampleptrs [MAX_NTERMS+2];
     struct decorr_pass dps [MAX_NTERMS];
     int nterms, log_limit;
     uint32_t best_bits;
+    DecorrTrial *trials;
+    void *workers;
 } WavpackExtraInfo;
 
 static void decorr_mono_pass (int32_t *in_samples, int32_t *out_samples, uint32_t num_samples, struct decorr_pass *dpp, int dir)
@@ -224,21 +240,30 @@ static int log2overhead (int first_term, int num_terms)
 #endif
 }
 
-static void recurse_mono (WavpackContext *wpc, WavpackExtraInfo *info, int depth, int delta, uint32_t input_bits)
+// Try a single candidate configuration (this is executed on the worker threads).
+
+static void mono_trial (void *param)
 {
-    WavpackStream *wps = wpc->streams [wpc->current_stream];
-    int term, branches = ((wpc->config.extra_flags & EXTRA_BRANCHES) >> 6) - depth;
-    int32_t *samples, *outsamples;
-    uint32_t term_bits [22], bits;
+    DecorrTrial *dt = (DecorrTrial *) param;
 
-    if (branches < 1 || depth + 1 == info->nterms)
-        branches = 1;
+    decorr_mono_buffer (dt->samples, dt->outsamples, dt->num_samples, dt->dps, dt->depth);
+    dt->bits = LOG2BUFFER (dt->outsamples, dt->num_samples, dt->log_limit);
 
-    CLEAR (term_bits);
-    samples = info->sampleptrs [depth];
-    outsamples = info->sampleptrs [depth + 1];
+    if (dt->bits != (uint32_t) -1)
+        dt->bits += log2overhead (dt->dps [0].term, dt->depth + 1);
+}
+
+// Try all the candidate terms at the specified depth in parallel and then evaluate the
+// results in the same order as recurse_mono() would have, leaving the same state.
+
+static void recurse_mono_trials (WavpackContext *wpc, WavpackExtraInfo *info, int depth, int delta, int branches, uint32_t *term_bits)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    int num_trials = 0, term, ti;
 
     for (term = 1; term <= 18; ++term) {
+        DecorrTrial *dt = info->trials + num_trials;
+
         if (term == 17 && branches == 1 && depth + 1 < info->nterms)
             continue;
 
@@ -248,23 +273,84 @@ static void recurse_mono (WavpackContext *wpc, WavpackExtraInfo *info, int depth
         if ((wpc->config.flags & CONFIG_FAST_FLAG) && (term > 4 && term < 17))
             continue;
 
-        info->dps [depth].term = term;
-        info->dps [depth].delta = delta;
-        decorr_mono_buffer (samples, outsamples, wps->wphdr.block_samples, info->dps, depth);
-        bits = LOG2BUFFER (outsamples, wps->wphdr.block_samples, info->log_limit);
+        memcpy (dt->dps, info->dps, sizeof (info->dps [0]) * (depth + 1));
+        dt->dps [depth].term = term;
+        dt->dps [depth].delta = delta;
+        dt->samples = info->sampleptrs [depth];
+        dt->num_samples = wps->wphdr.block_samples;
+        dt->depth = depth;
+        dt->log_limit = info->log_limit;
+        dt->job.function = mono_trial;
+        dt->job.param = dt;
+        workers_submit (info->workers, &dt->job);
+        num_trials++;
+    }
 
-        if (bits != (uint32_t) -1)
-            bits += log2overhead (info->dps [0].term, depth + 1);
+    for (ti = 0; ti < num_trials; ++ti) {
+        DecorrTrial *dt = info->trials + ti;
 
-        if (bits < info->best_bits) {
-            info->best_bits = bits;
+        workers_wait (info->workers, &dt->job);
+
+        if (dt->bits < info->best_bits) {
+            info->best_bits = dt->bits;
             CLEAR (wps->decorr_passes);
-            memcpy (wps->decorr_passes, info->dps, sizeof (info->dps [0]) * (depth + 1));
-            memcpy (info->sampleptrs [info->nterms + 1], info->sampleptrs [depth + 1], wps->wphdr.block_samples * 4);
+            memcpy (wps->decorr_passes, dt->dps, sizeof (dt->dps [0]) * (depth + 1));
+            memcpy (info->sampleptrs [info->nterms + 1], dt->outsamples, wps->wphdr.block_samples * 4);
         }
 
-        term_bits [term + 3] = bits;
+        term_bits [dt->dps [depth].term + 3] = dt->bits;
+    }
+
+    if (num_trials) {
+        info->dps [depth] = info->trials [num_trials - 1].dps [depth];
+        memcpy (info->sampleptrs [depth + 1], info->trials [num_trials - 1].outsamples, wps->wphdr.block_samples * 4);
     }
+}
+
+static void recurse_mono (WavpackContext *wpc, WavpackExtraInfo *info, int depth, int delta, uint32_t input_bits)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    int term, branches = ((wps->extra_flags & EXTRA_BRANCHES) >> 6) - depth;
+    int32_t *samples, *outsamples;
+    uint32_t term_bits [22], bits;
+
+    if (branches < 1 || depth + 1 == info->nterms)
+        branches = 1;
+
+    CLEAR (term_bits);
+    samples = info->sampleptrs [depth];
+    outsamples = info->sampleptrs [depth + 1];
+
+    if (info->trials)
+        recurse_mono_trials (wpc, info, depth, delta, branches, term_bits);
+    else
+        for (term = 1; term <= 18; ++term) {
+            if (term == 17 && branches == 1 && depth + 1 < info->nterms)
+                continue;
+
+            if (term > 8 && term < 17)
+                continue;
+
+            if ((wpc->config.flags & CONFIG_FAST_FLAG) && (term > 4 && term < 17))
+                continue;
+
+            info->dps [depth].term = term;
+            info->dps [depth].delta = delta;
+            decorr_mono_buffer (samples, outsamples, wps->wphdr.block_samples, info->dps, depth);
+            bits = LOG2BUFFER (outsamples, wps->wphdr.block_samples, info->log_limit);
+
+            if (bits != (uint32_t) -1)
+                bits += log2overhead (info->dps [0].term, depth + 1);
+
+            if (bits < info->best_bits) {
+                info->best_bits = bits;
+                CLEAR (wps->decorr_passes);
+                memcpy (wps->decorr_passes, info->dps, sizeof (info->dps [0]) * (depth + 1));
+                memcpy (info->sampleptrs [info->nterms + 1], info->sampleptrs [depth + 1], wps->wphdr.block_samples * 4);
+            }
+
+            term_bits [term + 3] = bits;
+        }
 
     while (depth + 1 < info->nterms && branches--) {
         uint32_t local_best_bits = input_bits;
@@ -357,12 +443,107 @@ static void delta_mono (WavpackContext *wpc, WavpackExtraInfo *info)
     }
 }
 
+// Try swapping a pair of adjacent terms (this is also executed on the worker threads).
+
+static void mono_sort_trial (void *param)
+{
+    DecorrTrial *dt = (DecorrTrial *) param;
+    int32_t *samples = dt->samples;
+    int i;
+
+    for (i = dt->depth; i < dt->num_terms; ++i) {
+        int32_t *outsamples = ((dt->num_terms - i) & 1) ? dt->outsamples : dt->tempsamples;
+
+        decorr_mono_buffer (samples, outsamples, dt->num_samples, dt->dps, i);
+        samples = outsamples;
+    }
+
+    dt->bits = LOG2BUFFER (dt->outsamples, dt->num_samples, dt->log_limit);
+}
+
+// Make one pass of sort_mono() with the swaps tried in parallel, and return TRUE if any
+// swap was taken (see sort_stereo_trials() in extra2.c for the details).
+
+static int sort_mono_trials (WavpackContext *wpc, WavpackExtraInfo *info)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    uint32_t num_samples = wps->wphdr.block_samples;
+    int num_terms = 0, reversed = FALSE, ri = 0;
+
+    while (num_terms < info->nterms && wps->decorr_passes [num_terms].term)
+        num_terms++;
+
+    memcpy (info->dps, wps->decorr_passes, sizeof (wps->decorr_passes));
+
+    while (ri + 1 < num_terms) {
+        int num_trials = 0, taken = -1, ti;
+
+        for (; ri + 1 < num_terms && num_trials < MAX_TRIALS; ++ri) {
+            if (info->dps [ri].term != info->dps [ri+1].term) {
+                DecorrTrial *dt = info->trials + num_trials++;
+
+                memcpy (dt->dps, info->dps, sizeof (info->dps));
+                dt->dps [ri] = info->dps [ri+1];
+                dt->dps [ri+1] = info->dps [ri];
+                dt->samples = info->sampleptrs [ri];
+                dt->num_samples = num_samples;
+                dt->depth = ri;
+                dt->num_terms = num_terms;
+                dt->log_limit = info->log_limit;
+                dt->job.function = mono_sort_trial;
+                dt->job.param = dt;
+                workers_submit (info->workers, &dt->job);
+            }
+
+            decorr_mono_buffer (info->sampleptrs [ri], info->sampleptrs [ri+1], num_samples, info->dps, ri);
+        }
+
+        for (ti = 0; ti < num_trials; ++ti) {
+            DecorrTrial *dt = info->trials + ti;
+            uint32_t bits;
+
+            workers_wait (info->workers, &dt->job);
+
+            if (taken >= 0)
+                continue;
+
+            bits = dt->bits;
+
+            if (bits != (uint32_t) -1)
+                bits += log2overhead (wps->decorr_passes [0].term, num_terms);
+
+            if (bits < info->best_bits) {
+                taken = ti;
+                reversed = TRUE;
+                info->best_bits = bits;
+                CLEAR (wps->decorr_passes);
+                memcpy (wps->decorr_passes, dt->dps, sizeof (dt->dps [0]) * num_terms);
+                memcpy (info->sampleptrs [info->nterms + 1], dt->outsamples, num_samples * 4);
+            }
+        }
+
+        if (taken >= 0) {
+            memcpy (info->dps, info->trials [taken].dps, sizeof (info->dps));
+            ri = info->trials [taken].depth;
+            decorr_mono_buffer (info->sampleptrs [ri], info->sampleptrs [ri+1], num_samples, info->dps, ri);
+            ri++;
+        }
+    }
+
+    return reversed;
+}
+
 static void sort_mono (WavpackContext *wpc, WavpackExtraInfo *info)
 {
     WavpackStream *wps = wpc->streams [wpc->current_stream];
     int reversed = TRUE;
     uint32_t bits;
 
+    if (info->trials) {
+        while (sort_mono_trials (wpc, info));
+        return;
+    }
+
     while (reversed) {
         int ri, i;
 
@@ -424,14 +605,33 @@ static void analyze_mono (WavpackContext *wpc, int32_t *samples, int do_samples)
 #endif
 
     if (wpc->config.flags & (CONFIG_HIGH_FLAG | CONFIG_VERY_HIGH_FLAG))
-        wpc->config.extra_flags = xtable [wpc->config.xmode - 4];
+        wps->extra_flags = xtable [wpc->config.xmode - 4];
     else
-        wpc->config.extra_flags = xtable [wpc->config.xmode - 3];
+        wps->extra_flags = xtable [wpc->config.xmode - 3];
 
     info.nterms = wps->num_terms;
+    info.workers = wpc->extra_workers;
+    info.trials = NULL;
 
     for (i = 0; i < info.nterms + 2; ++i)
-        info.sampleptrs [i] = malloc (wps->wphdr.block_samples * 4);
+        info.sampleptrs [i] = wp_malloc (wps->wphdr.block_samples * 4);
+
+    // if we have worker threads to help with the recursive search (and the sort), allocate
+    // the trials (with the second buffer for the sort trials in the same allocation)
+
+    if ((wps->extra_flags & EXTRA_BRANCHES) && workers_count (info.workers) > 1 &&
+        (info.trials = (DecorrTrial *)wp_malloc (MAX_TRIALS * sizeof (DecorrTrial))) != NULL)
+            for (i = 0; i < MAX_TRIALS; ++i)
+                if ((info.trials [i].outsamples = wp_malloc (wps->wphdr.block_samples * 8)) != NULL)
+                    info.trials [i].tempsamples = info.trials [i].outsamples + wps->wphdr.block_samples;
+                else {
+                    while (i--)
+                        wp_free (info.trials [i].outsamples);
+
+                    wp_free (info.trials);
+                    info.trials = NULL;
+                    break;
+                }
 
     memcpy (info.dps, wps->decorr_passes, sizeof (info.dps));
     memcpy (info.sampleptrs [0], samples, wps->wphdr.block_samples * 4);
@@ -443,23 +643,23 @@ static void analyze_mono (WavpackContext *wpc, int32_t *samples, int do_samples)
     info.best_bits += log2overhead (info.dps [0].term, i);
     memcpy (info.sampleptrs [info.nterms + 1], info.sampleptrs [i], wps->wphdr.block_samples * 4);
 
-    if (wpc->config.extra_flags & EXTRA_BRANCHES)
+    if (wps->extra_flags & EXTRA_BRANCHES)
         recurse_mono (wpc, &info, 0, (int) floor (wps->delta_decay + 0.5),
             LOG2BUFFER (info.sampleptrs [0], wps->wphdr.block_samples, 0));
 
-    if (wpc->config.extra_flags & EXTRA_SORT_FIRST)
+    if (wps->extra_flags & EXTRA_SORT_FIRST)
         sort_mono (wpc, &info);
 
-    if (wpc->config.extra_flags & EXTRA_TRY_DELTAS) {
+    if (wps->extra_flags & EXTRA_TRY_DELTAS) {
         delta_mono (wpc, &info);
 
-        if ((wpc->config.extra_flags & EXTRA_ADJUST_DELTAS) && wps->decorr_passes [0].term)
+        if ((wps->extra_flags & EXTRA_ADJUST_DELTAS) && wps->decorr_passes [0].term)
             wps->delta_decay = (float)((wps->delta_decay * 2.0 + wps->decorr_passes [0].delta) / 3.0);
         else
             wps->delta_decay = 2.0;
     }
 
-    if (wpc->config.extra_flags & EXTRA_SORT_LAST)
+    if (wps->extra_flags & EXTRA_SORT_LAST)
         sort_mono (wpc, &info);
 
     if (do_samples)
@@ -472,7 +672,14 @@ static void analyze_mono (WavpackContext *wpc, int32_t *samples, int do_samples)
     wps->num_terms = i;
 
     for (i = 0; i < info.nterms + 2; ++i)
-        free (info.sampleptrs [i]);
+        wp_free (info.sampleptrs [i]);
+
+    if (info.trials) {
+        for (i = 0; i < MAX_TRIALS; ++i)
+            wp_free (info.trials [i].outsamples);
+
+        wp_free (info.trials);
+    }
 }
 
 static void mono_add_noise (WavpackStream *wps, int32_t *lptr, int32_t *rptr)
@@ -554,9 +761,9 @@ void execute_mono (WavpackContext *wpc, int32_t *samples, int no_history, int do
 #endif
 
     CLEAR (save_decorr_passes);
-    temp_buffer [0] = malloc (buf_size);
-    temp_buffer [1] = malloc (buf_size);
-    best_buffer = malloc (buf_size);
+    temp_buffer [0] = wp_malloc (buf_size);
+    temp_buffer [1] = wp_malloc (buf_size);
+    best_buffer = wp_malloc (buf_size);
 
     if (wps->num_passes > 1 && (wps->wphdr.flags & HYBRID_FLAG)) {
         CLEAR (temp_decorr_pass);
@@ -576,7 +783,7 @@ void execute_mono (WavpackContext *wpc, int32_t *samples, int no_history, int do
             num_samples > 2048 ? 2048 : num_samples, &temp_decorr_pass, -1);
 
         decorr_mono_pass (temp_buffer [0], temp_buffer [1], num_samples, &temp_decorr_pass, 1);
-        noisy_buffer = malloc (buf_size);
+        noisy_buffer = wp_malloc (buf_size);
         memcpy (noisy_buffer, samples, buf_size);
         mono_add_noise (wps, noisy_buffer, temp_buffer [1]);
         no_history = 1;
@@ -670,11 +877,11 @@ void execute_mono (WavpackContext *wpc, int32_t *samples, int no_history, int do
         scan_word (wps, best_buffer, num_samples, -1);
 
     if (noisy_buffer)
-        free (noisy_buffer);
+        wp_free (noisy_buffer);
 
-    free (temp_buffer [1]);
-    free (temp_buffer [0]);
-    free (best_buffer);
+    wp_free (temp_buffer [1]);
+    wp_free (temp_buffer [0]);
+    wp_free (best_buffer);
 
 #ifdef EXTRA_DUMP
     if (1) {
@@ -54,11 +54,29 @@
     void PACK_DECORR_STEREO_PASS_CONT_REV (struct decorr_pass *dpp, int32_t *in_buffer, int32_t *out_buffer, int32_t sample_count);
 #endif
 
+// When a pool of worker threads is available, the candidate terms at each level of the
+// recursive search, and the swaps of adjacent terms in the sort, are tried in parallel
+// (each with its own copy of the decorrelation passes and output buffers) and then the
+// results are evaluated in the original order, so the configuration chosen is exactly
+// the same as when they are tried one by one.
+
+#define MAX_TRIALS 13       // terms -3 to 8 (except 0) and 17 & 18
+
+typedef struct {
+    WorkerJob job;
+    struct decorr_pass dps [MAX_NTERMS];
+    int32_t *samples, *outsamples, *tempsamples, num_samples;
+    int depth, num_terms, log_limit;
+    uint32_t bits;
+} DecorrTrial;
+
 typedef struct {
     int32_t *sampleptrs [MAX_NTERMS+2];
     struct decorr_pass dps [MAX_NTERMS];
     int nterms, log_limit;
     uint32_t best_bits;
+    DecorrTrial *trials;
+    void *workers;
 } WavpackExtraInfo;
 
 static void decorr_stereo_pass (int32_t *in_samples, int32_t *out_samples, int32_t num_samples, struct decorr_pass *dpp, int dir)
@@ -324,9 +342,9 @@ static void reverse_decorr (struct decorr_pass *dpp)
     }
 }
 
-static void decorr_stereo_buffer (WavpackExtraInfo *info, int32_t *samples, int32_t *outsamples, int32_t num_samples, int tindex)
+static void decorr_stereo_buffer (int32_t *samples, int32_t *outsamples, int32_t num_samples, struct decorr_pass *dps, int tindex)
 {
-    struct decorr_pass dp, *dppi = info->dps + tindex;
+    struct decorr_pass dp, *dppi = dps + tindex;
     int delta = dppi->delta, pre_delta;
     int term = dppi->term;
 
@@ -383,21 +401,30 @@ static int log2overhead (int first_term, int num_terms)
 #endif
 }
 
-static void recurse_stereo (WavpackContext *wpc, WavpackExtraInfo *info, int depth, int delta, uint32_t input_bits)
+// Try a single candidate configuration (this is executed on the worker threads).
+
+static void stereo_trial (void *param)
 {
-    WavpackStream *wps = wpc->streams [wpc->current_stream];
-    int term, branches = ((wpc->config.extra_flags & EXTRA_BRANCHES) >> 6) - depth;
-    int32_t *samples, *outsamples;
-    uint32_t term_bits [22], bits;
+    DecorrTrial *dt = (DecorrTrial *) param;
 
-    if (branches < 1 || depth + 1 == info->nterms)
-        branches = 1;
+    decorr_stereo_buffer (dt->samples, dt->outsamples, dt->num_samples, dt->dps, dt->depth);
+    dt->bits = LOG2BUFFER (dt->outsamples, dt->num_samples * 2, dt->log_limit);
 
-    CLEAR (term_bits);
-    samples = info->sampleptrs [depth];
-    outsamples = info->sampleptrs [depth + 1];
+    if (dt->bits != (uint32_t) -1)
+        dt->bits += log2overhead (dt->dps [0].term, dt->depth + 1);
+}
+
+// Try all the candidate terms at the specified depth in parallel and then evaluate the
+// results in the same order as recurse_stereo() would have, leaving the same state.
+
+static void recurse_stereo_trials (WavpackContext *wpc, WavpackExtraInfo *info, int depth, int delta, int branches, uint32_t *term_bits)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    int num_trials = 0, term, ti;
 
     for (term = -3; term <= 18; ++term) {
+        DecorrTrial *dt = info->trials + num_trials;
+
         if (!term || (term > 8 && term < 17))
             continue;
 
@@ -411,23 +438,88 @@ static void recurse_stereo (WavpackContext *wpc, WavpackExtraInfo *info, int dep
         if ((wpc->config.flags & CONFIG_FAST_FLAG) && (term > 4 && term < 17))
             continue;
 
-        info->dps [depth].term = term;
-        info->dps [depth].delta = delta;
-        decorr_stereo_buffer (info, samples, outsamples, wps->wphdr.block_samples, depth);
-        bits = LOG2BUFFER (outsamples, wps->wphdr.block_samples * 2, info->log_limit);
+        memcpy (dt->dps, info->dps, sizeof (info->dps [0]) * (depth + 1));
+        dt->dps [depth].term = term;
+        dt->dps [depth].delta = delta;
+        dt->samples = info->sampleptrs [depth];
+        dt->num_samples = wps->wphdr.block_samples;
+        dt->depth = depth;
+        dt->log_limit = info->log_limit;
+        dt->job.function = stereo_trial;
+        dt->job.param = dt;
+        workers_submit (info->workers, &dt->job);
+        num_trials++;
+    }
 
-        if (bits != (uint32_t) -1)
-            bits += log2overhead (info->dps [0].term, depth + 1);
+    for (ti = 0; ti < num_trials; ++ti) {
+        DecorrTrial *dt = info->trials + ti;
 
-        if (bits < info->best_bits) {
-            info->best_bits = bits;
+        workers_wait (info->workers, &dt->job);
+
+        if (dt->bits < info->best_bits) {
+            info->best_bits = dt->bits;
             CLEAR (wps->decorr_passes);
-            memcpy (wps->decorr_passes, info->dps, sizeof (info->dps [0]) * (depth + 1));
-            memcpy (info->sampleptrs [info->nterms + 1], info->sampleptrs [depth + 1], wps->wphdr.block_samples * 8);
+            memcpy (wps->decorr_passes, dt->dps, sizeof (dt->dps [0]) * (depth + 1));
+            memcpy (info->sampleptrs [info->nterms + 1], dt->outsamples, wps->wphdr.block_samples * 8);
         }
 
-        term_bits [term + 3] = bits;
+        term_bits [dt->dps [depth].term + 3] = dt->bits;
+    }
+
+    if (num_trials) {
+        info->dps [depth] = info->trials [num_trials - 1].dps [depth];
+        memcpy (info->sampleptrs [depth + 1], info->trials [num_trials - 1].outsamples, wps->wphdr.block_samples * 8);
     }
+}
+
+static void recurse_stereo (WavpackContext *wpc, WavpackExtraInfo *info, int depth, int delta, uint32_t input_bits)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    int term, branches = ((wps->extra_flags & EXTRA_BRANCHES) >> 6) - depth;
+    int32_t *samples, *outsamples;
+    uint32_t term_bits [22], bits;
+
+    if (branches < 1 || depth + 1 == info->nterms)
+        branches = 1;
+
+    CLEAR (term_bits);
+    samples = info->sampleptrs [depth];
+    outsamples = info->sampleptrs [depth + 1];
+
+    if (info->trials)
+        recurse_stereo_trials (wpc, info, depth, delta, branches, term_bits);
+    else
+        for (term = -3; term <= 18; ++term) {
+            if (!term || (term > 8 && term < 17))
+                continue;
+
+            if (term == 17 && branches == 1 && depth + 1 < info->nterms)
+                continue;
+
+            if (term == -1 || term == -2)
+                if (!(wps->wphdr.flags & CROSS_DECORR))
+                    continue;
+
+            if ((wpc->config.flags & CONFIG_FAST_FLAG) && (term > 4 && term < 17))
+                continue;
+
+            info->dps [depth].term = term;
+            info->dps [depth].delta = delta;
+            decorr_stereo_buffer (samples, outsamples, wps->wphdr.block_samples, info->dps, depth);
+            bits = LOG2BUFFER (outsamples, wps->wphdr.block_samples * 2, info->log_limit);
+
+            if (bits != (uint32_t) -1)
+                bits += log2overhead (info->dps [0].term, depth + 1);
+
+            if (bits < info->best_bits) {
+                info->best_bits = bits;
+                CLEAR (wps->decorr_passes);
+                memcpy (wps->decorr_passes, info->dps, sizeof (info->dps [0]) * (depth + 1));
+                memcpy (info->sampleptrs [info->nterms + 1], info->sampleptrs [depth + 1], wps->wphdr.block_samples * 8);
+            }
+
+            term_bits [term + 3] = bits;
+        }
 
     while (depth + 1 < info->nterms && branches--) {
         uint32_t local_best_bits = input_bits;
@@ -447,7 +539,7 @@ static void recurse_stereo (WavpackContext *wpc, WavpackExtraInfo *info, int dep
 
         info->dps [depth].term = best_term;
         info->dps [depth].delta = delta;
-        decorr_stereo_buffer (info, samples, outsamples, wps->wphdr.block_samples, depth);
+        decorr_stereo_buffer (samples, outsamples, wps->wphdr.block_samples, info->dps, depth);
 
 //      if (log2buffer (outsamples, wps->wphdr.block_samples * 2, 0) != local_best_bits)
 //          error_line ("data doesn't match!");
@@ -477,7 +569,7 @@ static void delta_stereo (WavpackContext *wpc, WavpackExtraInfo *info)
         for (i = 0; i < info->nterms && wps->decorr_passes [i].term; ++i) {
             info->dps [i].term = wps->decorr_passes [i].term;
             info->dps [i].delta = d;
-            decorr_stereo_buffer (info, info->sampleptrs [i], info->sampleptrs [i+1], wps->wphdr.block_samples, i);
+            decorr_stereo_buffer (info->sampleptrs [i], info->sampleptrs [i+1], wps->wphdr.block_samples, info->dps, i);
         }
 
         bits = LOG2BUFFER (info->sampleptrs [i], wps->wphdr.block_samples * 2, info->log_limit);
@@ -502,7 +594,7 @@ static void delta_stereo (WavpackContext *wpc, WavpackExtraInfo *info)
         for (i = 0; i < info->nterms && wps->decorr_passes [i].term; ++i) {
             info->dps [i].term = wps->decorr_passes [i].term;
             info->dps [i].delta = d;
-            decorr_stereo_buffer (info, info->sampleptrs [i], info->sampleptrs [i+1], wps->wphdr.block_samples, i);
+            decorr_stereo_buffer (info->sampleptrs [i], info->sampleptrs [i+1], wps->wphdr.block_samples, info->dps, i);
         }
 
         bits = LOG2BUFFER (info->sampleptrs [i], wps->wphdr.block_samples * 2, info->log_limit);
@@ -521,12 +613,114 @@ static void delta_stereo (WavpackContext *wpc, WavpackExtraInfo *info)
     }
 }
 
+// Try swapping a pair of adjacent terms, which means redoing the passes from the first of
+// them to the end, alternating between the two buffers so that the result ends up in
+// outsamples (this is also executed on the worker threads). The overhead is added later.
+
+static void stereo_sort_trial (void *param)
+{
+    DecorrTrial *dt = (DecorrTrial *) param;
+    int32_t *samples = dt->samples;
+    int i;
+
+    for (i = dt->depth; i < dt->num_terms; ++i) {
+        int32_t *outsamples = ((dt->num_terms - i) & 1) ? dt->outsamples : dt->tempsamples;
+
+        decorr_stereo_buffer (samples, outsamples, dt->num_samples, dt->dps, i);
+        samples = outsamples;
+    }
+
+    dt->bits = LOG2BUFFER (dt->outsamples, dt->num_samples * 2, dt->log_limit);
+}
+
+// Make one pass of sort_stereo() with the swaps tried in parallel. Each swap is submitted
+// while the unswapped pass is done here to get the input for the next one (as is done
+// after a rejected swap), and then the results are evaluated in order. When a swap is
+// taken, the ones after it are discarded and tried again with the new configuration.
+// Returns TRUE if any swap was taken.
+
+static int sort_stereo_trials (WavpackContext *wpc, WavpackExtraInfo *info)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    int32_t num_samples = wps->wphdr.block_samples;
+    int num_terms = 0, reversed = FALSE, ri = 0;
+
+    while (num_terms < info->nterms && wps->decorr_passes [num_terms].term)
+        num_terms++;
+
+    memcpy (info->dps, wps->decorr_passes, sizeof (wps->decorr_passes));
+
+    while (ri + 1 < num_terms) {
+        int num_trials = 0, taken = -1, ti;
+
+        for (; ri + 1 < num_terms && num_trials < MAX_TRIALS; ++ri) {
+            if (info->dps [ri].term != info->dps [ri+1].term) {
+                DecorrTrial *dt = info->trials + num_trials++;
+
+                memcpy (dt->dps, info->dps, sizeof (info->dps));
+                dt->dps [ri] = info->dps [ri+1];
+                dt->dps [ri+1] = info->dps [ri];
+                dt->samples = info->sampleptrs [ri];
+                dt->num_samples = num_samples;
+                dt->depth = ri;
+                dt->num_terms = num_terms;
+                dt->log_limit = info->log_limit;
+                dt->job.function = stereo_sort_trial;
+                dt->job.param = dt;
+                workers_submit (info->workers, &dt->job);
+            }
+
+            decorr_stereo_buffer (info->sampleptrs [ri], info->sampleptrs [ri+1], num_samples, info->dps, ri);
+        }
+
+        for (ti = 0; ti < num_trials; ++ti) {
+            DecorrTrial *dt = info->trials + ti;
+            uint32_t bits;
+
+            workers_wait (info->workers, &dt->job);
+
+            if (taken >= 0)
+                continue;
+
+            bits = dt->bits;
+
+            if (bits != (uint32_t) -1)
+                bits += log2overhead (wps->decorr_passes [0].term, num_terms);
+
+            if (bits < info->best_bits) {
+                taken = ti;
+                reversed = TRUE;
+                info->best_bits = bits;
+                CLEAR (wps->decorr_passes);
+                memcpy (wps->decorr_passes, dt->dps, sizeof (dt->dps [0]) * num_terms);
+                memcpy (info->sampleptrs [info->nterms + 1], dt->outsamples, num_samples * 8);
+            }
+        }
+
+        // the trials are all done, so now we can redo the swapped pass to continue from there
+
+        if (taken >= 0) {
+            memcpy (info->dps, info->trials [taken].dps, sizeof (info->dps));
+            ri = info->trials [taken].depth;
+            decorr_stereo_buffer (info->sampleptrs [ri], info->sampleptrs [ri+1], num_samples, info->dps, ri);
+            ri++;
+        }
+    }
+
+    return reversed;
+}
+
 static void sort_stereo (WavpackContext *wpc, WavpackExtraInfo *info)
 {
     WavpackStream *wps = wpc->streams [wpc->current_stream];
     int reversed = TRUE;
     uint32_t bits;
 
+    if (info->trials) {
+        while (sort_stereo_trials (wpc, info));
+        return;
+    }
+
     while (reversed) {
         int ri, i;
 
@@ -539,7 +733,7 @@ static void sort_stereo (WavpackContext *wpc, WavpackExtraInfo *info)
                 break;
 
             if (wps->decorr_passes [ri].term == wps->decorr_passes [ri+1].term) {
-                decorr_stereo_buffer (info, info->sampleptrs [ri], info->sampleptrs [ri+1], wps->wphdr.block_samples, ri);
+                decorr_stereo_buffer (info->sampleptrs [ri], info->sampleptrs [ri+1], wps->wphdr.block_samples, info->dps, ri);
                 continue;
             }
 
@@ -547,7 +741,7 @@ static void sort_stereo (WavpackContext *wpc, WavpackExtraInfo *info)
             info->dps [ri+1] = wps->decorr_passes [ri];
 
             for (i = ri; i < info->nterms && wps->decorr_passes [i].term; ++i)
-                decorr_stereo_buffer (info, info->sampleptrs [i], info->sampleptrs [i+1], wps->wphdr.block_samples, i);
+                decorr_stereo_buffer (info->sampleptrs [i], info->sampleptrs [i+1], wps->wphdr.block_samples, info->dps, i);
 
             bits = LOG2BUFFER (info->sampleptrs [i], wps->wphdr.block_samples * 2, info->log_limit);
 
@@ -564,7 +758,7 @@ static void sort_stereo (WavpackContext *wpc, WavpackExtraInfo *info)
             else {
                 info->dps [ri] = wps->decorr_passes [ri];
                 info->dps [ri+1] = wps->decorr_passes [ri+1];
-                decorr_stereo_buffer (info, info->sampleptrs [ri], info->sampleptrs [ri+1], wps->wphdr.block_samples, ri);
+                decorr_stereo_buffer (info->sampleptrs [ri], info->sampleptrs [ri+1], wps->wphdr.block_samples, info->dps, ri);
             }
         }
     }
@@ -588,14 +782,33 @@ static void analyze_stereo (WavpackContext *wpc, int32_t *samples, int do_sample
 #endif
 
     if (wpc->config.flags & (CONFIG_HIGH_FLAG | CONFIG_VERY_HIGH_FLAG))
-        wpc->config.extra_flags = xtable [wpc->config.xmode - 4];
+        wps->extra_flags = xtable [wpc->config.xmode - 4];
     else
-        wpc->config.extra_flags = xtable [wpc->config.xmode - 3];
+        wps->extra_flags = xtable [wpc->config.xmode - 3];
 
     info.nterms = wps->num_terms;
+    info.workers = wpc->extra_workers;
+    info.trials = NULL;
 
     for (i = 0; i < info.nterms + 2; ++i)
-        info.sampleptrs [i] = malloc (wps->wphdr.block_samples * 8);
+        info.sampleptrs [i] = wp_malloc (wps->wphdr.block_samples * 8);
+
+    // if we have worker threads to help with the recursive search (and the sort), allocate
+    // the trials (the sort trials need a second buffer, which is in the same allocation)
+
+    if ((wps->extra_flags & EXTRA_BRANCHES) && workers_count (info.workers) > 1 &&
+        (info.trials = (DecorrTrial *)wp_malloc (MAX_TRIALS * sizeof (DecorrTrial))) != NULL)
+            for (i = 0; i < MAX_TRIALS; ++i)
+                if ((info.trials [i].outsamples = wp_malloc (wps->wphdr.block_samples * 16)) != NULL)
+                    info.trials [i].tempsamples = info.trials [i].outsamples + wps->wphdr.block_samples * 2;
+                else {
+                    while (i--)
+                        wp_free (info.trials [i].outsamples);
+
+                    wp_free (info.trials);
+                    info.trials = NULL;
+                    break;
+                }
 
     memcpy (info.dps, wps->decorr_passes, sizeof (info.dps));
     memcpy (info.sampleptrs [0], samples, wps->wphdr.block_samples * 8);
@@ -607,23 +820,23 @@ static void analyze_stereo (WavpackContext *wpc, int32_t *samples, int do_sample
     info.best_bits += log2overhead (info.dps [0].term, i);
     memcpy (info.sampleptrs [info.nterms + 1], info.sampleptrs [i], wps->wphdr.block_samples * 8);
 
-    if (wpc->config.extra_flags & EXTRA_BRANCHES)
+    if (wps->extra_flags & EXTRA_BRANCHES)
         recurse_stereo (wpc, &info, 0, (int) floor (wps->delta_decay + 0.5),
             LOG2BUFFER (info.sampleptrs [0], wps->wphdr.block_samples * 2, 0));
 
-    if (wpc->config.extra_flags & EXTRA_SORT_FIRST)
+    if (wps->extra_flags & EXTRA_SORT_FIRST)
         sort_stereo (wpc, &info);
 
-    if (wpc->config.extra_flags & EXTRA_TRY_DELTAS) {
+    if (wps->extra_flags & EXTRA_TRY_DELTAS) {
         delta_stereo (wpc, &info);
 
-        if ((wpc->config.extra_flags & EXTRA_ADJUST_DELTAS) && wps->decorr_passes [0].term)
+        if ((wps->extra_flags & EXTRA_ADJUST_DELTAS) && wps->decorr_passes [0].term)
             wps->delta_decay = (float)((wps->delta_decay * 2.0 + wps->decorr_passes [0].delta) / 3.0);
         else
             wps->delta_decay = 2.0;
     }
 
-    if (wpc->config.extra_flags & EXTRA_SORT_LAST)
+    if (wps->extra_flags & EXTRA_SORT_LAST)
         sort_stereo (wpc, &info);
 
     if (do_samples)
@@ -636,7 +849,14 @@ static void analyze_stereo (WavpackContext *wpc, int32_t *samples, int do_sample
     wps->num_terms = i;
 
     for (i = 0; i < info.nterms + 2; ++i)
-        free (info.sampleptrs [i]);
+        wp_free (info.sampleptrs [i]);
+
+    if (info.trials) {
+        for (i = 0; i < MAX_TRIALS; ++i)
+            wp_free (info.trials [i].outsamples);
+
+        wp_free (info.trials);
+    }
 }
 
 static void stereo_add_noise (WavpackStream *wps, int32_t *lptr, int32_t *rptr)
@@ -744,9 +964,9 @@ void execute_stereo (WavpackContext *wpc, int32_t *samples, int no_history, int
     }
 
     CLEAR (save_decorr_passes);
-    temp_buffer [0] = malloc (buf_size);
-    temp_buffer [1] = malloc (buf_size);
-    best_buffer = malloc (buf_size);
+    temp_buffer [0] = wp_malloc (buf_size);
+    temp_buffer [1] = wp_malloc (buf_size);
+    best_buffer = wp_malloc (buf_size);
 
     if (wps->num_passes > 1 && (wps->wphdr.flags & HYBRID_FLAG)) {
         CLEAR (temp_decorr_pass);
@@ -766,7 +986,7 @@ void execute_stereo (WavpackContext *wpc, int32_t *samples, int no_history, int
             num_samples > 2048 ? 2048 : num_samples, &temp_decorr_pass, -1);
 
         decorr_stereo_pass (temp_buffer [0], temp_buffer [1], num_samples, &temp_decorr_pass, 1);
-        noisy_buffer = malloc (buf_size);
+        noisy_buffer = wp_malloc (buf_size);
         memcpy (noisy_buffer, samples, buf_size);
         stereo_add_noise (wps, noisy_buffer, temp_buffer [1]);
         no_history = 1;
@@ -801,7 +1021,7 @@ void execute_stereo (WavpackContext *wpc, int32_t *samples, int no_history, int
                 if (!js_buffer) {
                     int32_t *lptr, cnt = num_samples;
 
-                    lptr = js_buffer = malloc (buf_size);
+                    lptr = js_buffer = wp_malloc (buf_size);
                     memcpy (js_buffer, noisy_buffer ? noisy_buffer : samples, buf_size);
 
                     while (cnt--) {
@@ -891,14 +1111,14 @@ void execute_stereo (WavpackContext *wpc, int32_t *samples, int no_history, int
     }
 
     if (noisy_buffer)
-        free (noisy_buffer);
+        wp_free (noisy_buffer);
 
     if (js_buffer)
-        free (js_buffer);
+        wp_free (js_buffer);
 
-    free (temp_buffer [1]);
-    free (temp_buffer [0]);
-    free (best_buffer);
+    wp_free (temp_buffer [1]);
+    wp_free (temp_buffer [0]);
+    wp_free (best_buffer);
 
 #ifdef EXTRA_DUMP
     if (1) {
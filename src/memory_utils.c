@@ -0,0 +1,267 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** WAVPACK ****                            //
+//                  Hybrid Lossless Wavefile Compressor                   //
+//              Copyright (c) 1998 - 2024 David Bryant.                   //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// memory_utils.c
+
+// This module provides the functions that the rest of the library uses for
+// all its dynamic memory (wp_malloc(), wp_free(), etc.) so that applications
+// can substitute their own allocator with WavpackSetAllocator(). It also
+// provides a simple arena allocator that can be installed that way: memory is
+// carved from a single preallocated region into power-of-two size classes and
+// freed chunks are kept on per-class lists for reuse, so once a file has been
+// opened and the first few blocks processed, steady-state encoding and decoding
+// is served entirely from the lists (without ever calling the C runtime).
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+static WavpackAllocator allocator;
+
+// Install the specified allocator for all subsequent allocations made by the
+// library (for every context), or restore the C runtime functions if NULL is
+// passed (or the functions are NULL). Because memory must be freed with the
+// allocator that supplied it, this must not be called while any contexts are
+// open.
+
+void WavpackSetAllocator (const WavpackAllocator *new_allocator)
+{
+    if (new_allocator && new_allocator->malloc_func && new_allocator->realloc_func && new_allocator->free_func)
+        allocator = *new_allocator;
+    else
+        CLEAR (allocator);
+}
+
+void *wp_malloc (size_t size)
+{
+    return allocator.malloc_func ? allocator.malloc_func (allocator.user, size) : malloc (size);
+}
+
+void *wp_calloc (size_t num, size_t size)
+{
+    void *ptr;
+
+    if (size && num > (size_t) -1 / size)
+        return NULL;
+
+    if ((ptr = wp_malloc (num * size)) != NULL)
+        memset (ptr, 0, num * size);
+
+    return ptr;
+}
+
+void *wp_realloc (void *ptr, size_t size)
+{
+    return allocator.realloc_func ? allocator.realloc_func (allocator.user, ptr, size) : realloc (ptr, size);
+}
+
+void wp_free (void *ptr)
+{
+    if (ptr) {
+        if (allocator.free_func)
+            allocator.free_func (allocator.user, ptr);
+        else
+            free (ptr);
+    }
+}
+
+char *wp_strdup (const char *string)
+{
+    size_t length = strlen (string) + 1;
+    char *copy = wp_malloc (length);
+
+    if (copy)
+        memcpy (copy, string, length);
+
+    return copy;
+}
+
+//////////////////////////////////// arena allocator ////////////////////////////////////
+
+// Each chunk is preceded by a 16-byte header (to maintain alignment) holding its size
+// class, or ARENA_OVERFLOW (followed by the size) for chunks that had to come from the
+// C runtime because the arena was exhausted. Free chunks store their list link in place
+// of their data.
+
+#define ARENA_HEADER_SIZE   16
+#define ARENA_MIN_SHIFT     5       // smallest chunk is 32 bytes (including header)
+#define ARENA_OVERFLOW      0xffffffff
+
+struct WavpackArena {
+    unsigned char *memory, *next, *end;
+    void *free_lists [sizeof (size_t) * 8], *mutex;
+    size_t used, peak, overflows;
+    int free_memory;
+};
+
+// Create an arena using the specified memory (which must remain valid until the
+// arena is destroyed) or, if "memory" is NULL, allocating the specified number of
+// bytes from the C runtime. Returns NULL if the arena could not be created.
+
+WavpackArena *WavpackArenaCreate (void *memory, size_t bytes)
+{
+    WavpackArena *arena = (WavpackArena *) calloc (1, sizeof (WavpackArena));
+
+    if (!arena)
+        return NULL;
+
+    if (!memory) {
+        if (!(memory = malloc (bytes))) {
+            free (arena);
+            return NULL;
+        }
+
+        arena->free_memory = TRUE;
+    }
+
+    arena->memory = (unsigned char *) memory;
+    arena->next = arena->memory + ((ARENA_HEADER_SIZE - ((size_t) arena->memory & (ARENA_HEADER_SIZE - 1))) & (ARENA_HEADER_SIZE - 1));
+    arena->end = arena->memory + bytes;
+    arena->mutex = workers_mutex_create ();
+
+    if (arena->next > arena->end)
+        arena->next = arena->end;
+
+    return arena;
+}
+
+// Destroy the arena (after WavpackSetAllocator() has been used to remove it and
+// all the contexts that were using it have been closed).
+
+void WavpackArenaDestroy (WavpackArena *arena)
+{
+    if (arena) {
+        workers_mutex_destroy (arena->mutex);
+
+        if (arena->free_memory)
+            free (arena->memory);
+
+        free (arena);
+    }
+}
+
+static void *arena_malloc (void *user, size_t size)
+{
+    WavpackArena *arena = user;
+    size_t chunk_size = (size_t) 1 << ARENA_MIN_SHIFT;
+    unsigned char *chunk = NULL;
+    uint32_t size_class = 0;
+
+    if (size > (size_t) -1 / 2 - ARENA_HEADER_SIZE)
+        return NULL;
+
+    while (chunk_size < size + ARENA_HEADER_SIZE) {
+        chunk_size <<= 1;
+        size_class++;
+    }
+
+    workers_mutex_lock (arena->mutex);
+
+    if (arena->free_lists [size_class]) {
+        chunk = arena->free_lists [size_class];
+        arena->free_lists [size_class] = * (void **) (chunk + ARENA_HEADER_SIZE);
+    }
+    else if ((size_t) (arena->end - arena->next) >= chunk_size) {
+        chunk = arena->next;
+        arena->next += chunk_size;
+    }
+
+    if (chunk) {
+        if ((arena->used += chunk_size) > arena->peak)
+            arena->peak = arena->used;
+    }
+    else
+        arena->overflows++;
+
+    workers_mutex_unlock (arena->mutex);
+
+    // if the arena is exhausted we fall back to the C runtime (tagging the chunk as such)
+
+    if (!chunk) {
+        if (!(chunk = malloc (size + ARENA_HEADER_SIZE)))
+            return NULL;
+
+        * (size_t *) (chunk + sizeof (size_t)) = size;
+        size_class = ARENA_OVERFLOW;
+    }
+
+    * (uint32_t *) chunk = size_class;
+    return chunk + ARENA_HEADER_SIZE;
+}
+
+static void arena_free (void *user, void *ptr)
+{
+    WavpackArena *arena = user;
+    unsigned char *chunk = (unsigned char *) ptr - ARENA_HEADER_SIZE;
+    uint32_t size_class = * (uint32_t *) chunk;
+
+    if (size_class == ARENA_OVERFLOW) {
+        free (chunk);
+        return;
+    }
+
+    workers_mutex_lock (arena->mutex);
+    * (void **) ptr = arena->free_lists [size_class];
+    arena->free_lists [size_class] = chunk;
+    arena->used -= (size_t) 1 << (size_class + ARENA_MIN_SHIFT);
+    workers_mutex_unlock (arena->mutex);
+}
+
+static void *arena_realloc (void *user, void *ptr, size_t size)
+{
+    unsigned char *chunk = (unsigned char *) ptr - ARENA_HEADER_SIZE;
+    size_t capacity;
+    void *new_ptr;
+
+    if (!ptr)
+        return arena_malloc (user, size);
+
+    if (* (uint32_t *) chunk == ARENA_OVERFLOW)
+        capacity = * (size_t *) (chunk + sizeof (size_t));
+    else
+        capacity = ((size_t) 1 << (* (uint32_t *) chunk + ARENA_MIN_SHIFT)) - ARENA_HEADER_SIZE;
+
+    // if the chunk is already large enough there's nothing to do, otherwise move it
+
+    if (size <= capacity)
+        return ptr;
+
+    if (!(new_ptr = arena_malloc (user, size)))
+        return NULL;
+
+    memcpy (new_ptr, ptr, capacity);
+    arena_free (user, ptr);
+    return new_ptr;
+}
+
+// Fill in an allocator structure that serves the library's memory requests from
+// the specified arena (to be installed with WavpackSetAllocator()).
+
+void WavpackArenaGetAllocator (WavpackArena *arena, WavpackAllocator *arena_allocator)
+{
+    arena_allocator->malloc_func = arena_malloc;
+    arena_allocator->realloc_func = arena_realloc;
+    arena_allocator->free_func = arena_free;
+    arena_allocator->user = arena;
+}
+
+// Return the number of bytes of the arena currently in use (including chunk overhead),
+// the largest number ever in use, and the number of requests that could not be served
+// from the arena and went to the C runtime instead (any of the pointers may be NULL).
+
+void WavpackArenaGetStats (WavpackArena *arena, size_t *used, size_t *peak, size_t *overflows)
+{
+    workers_mutex_lock (arena->mutex);
+
+    if (used) *used = arena->used;
+    if (peak) *peak = arena->peak;
+    if (overflows) *overflows = arena->overflows;
+
+    workers_mutex_unlock (arena->mutex);
+}
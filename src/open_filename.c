@@ -62,6 +62,14 @@ static FILE *fopen_utf8 (const char *filename_utf8, const char *mode_utf8);
 #define ftell ftello
 #endif
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_PREAD
+#include <errno.h>
+#endif
+
 static int32_t read_bytes (void *id, void *data, int32_t bcount)
 {
     return (int32_t) fread (data, 1, bcount, (FILE*) id);
@@ -192,6 +200,43 @@ static WavpackStreamReader64 freader = {
     push_back_byte, get_length, can_seek, truncate_here, close_stream
 };
 
+#ifdef HAVE_MMAP
+
+// With OPEN_MMAP, files are mapped into memory and read with the memory reader
+// (see open_memory.c) so that the decoder can use the raw blocks in place. The
+// mapping is read-only and does not need the file to remain open. Note that if
+// the file is truncated while mapped, accessing the missing part will fault.
+
+static void unmap_file (void *data, int64_t size)
+{
+    munmap (data, (size_t) size);
+}
+
+// Map the specified (regular) file and return a memory reader id for it, or
+// NULL if that's not possible (in which case the file is simply read normally).
+
+static void *map_file (FILE *file)
+{
+    struct stat statbuf;
+    void *data, *id;
+
+    if (fstat (fileno (file), &statbuf) || !S_ISREG (statbuf.st_mode) ||
+        statbuf.st_size <= 0 || (uint64_t) statbuf.st_size > (size_t) -1)
+            return NULL;
+
+    data = mmap (NULL, (size_t) statbuf.st_size, PROT_READ, MAP_PRIVATE, fileno (file), 0);
+
+    if (data == MAP_FAILED)
+        return NULL;
+
+    if (!(id = open_memory_file (data, statbuf.st_size, unmap_file)))
+        munmap (data, (size_t) statbuf.st_size);
+
+    return id;
+}
+
+#endif
+
 // This function attempts to open the specified WavPack file for reading. If
 // this fails for any reason then an appropriate message is copied to "error"
 // (which must accept 80 characters) and NULL is returned, otherwise a
@@ -208,6 +253,8 @@ static WavpackStreamReader64 freader = {
 // OPEN_STREAMING:  blindly unpacks blocks w/o regard to header file position
 // OPEN_EDIT_TAGS:  allow editing of tags (file must be writable)
 // OPEN_FILE_UTF8:  assume infilename is UTF-8 encoded (Windows only)
+// OPEN_MMAP:  map the file(s) into memory and decode blocks in place (where
+//   available, and not with OPEN_EDIT_TAGS or stdin; otherwise ignored)
 
 // Version 4.2 of the WavPack library adds the OPEN_STREAMING flag. This is
 // essentially a "raw" mode where the library will simply decode any blocks
@@ -248,19 +295,420 @@ WavpackContext *WavpackOpenFileInput (const char *infilename, char *error, int f
     }
 
     if (*infilename != '-' && (flags & OPEN_WVC)) {
-        char *in2filename = malloc (strlen (infilename) + 10);
+        char *in2filename = wp_malloc (strlen (infilename) + 10);
 
         strcpy (in2filename, infilename);
         strcat (in2filename, "c");
         wvc_id = fopen_func (in2filename, "rb");
-        free (in2filename);
+        wp_free (in2filename);
     }
     else
         wvc_id = NULL;
 
+#ifdef HAVE_MMAP
+    // both files must be mapped (so there's just one reader), otherwise we quietly read them normally
+
+    if ((flags & OPEN_MMAP) && *infilename != '-' && !(flags & OPEN_EDIT_TAGS)) {
+        void *wv_map = map_file (wv_id), *wvc_map = NULL;
+
+        if (wv_map && (!wvc_id || (wvc_map = map_file (wvc_id)))) {
+            fclose (wv_id);
+
+            if (wvc_id)
+                fclose (wvc_id);
+
+            return WavpackOpenFileInputEx64 (&memory_reader, wv_map, wvc_map, error, flags, norm_offset);
+        }
+
+        if (wv_map)
+            memory_reader.close (wv_map);
+    }
+#endif
+
     return WavpackOpenFileInputEx64 (&freader, wv_id, wvc_id, error, flags, norm_offset);
 }
 
+// Get the basic information about the specified WavPack file without opening
+// it (see WavpackProbeEx64() in open_probe.c). The "flags" are the same as for
+// WavpackOpenFileInput(), although only OPEN_ALT_TYPES, OPEN_NO_CHECKSUM and
+// OPEN_FILE_UTF8 have any effect. Returns TRUE on success.
+
+int WavpackProbe (const char *filename, WavpackProbeInfo *info, char *error, int flags)
+{
+    FILE *(*fopen_func)(const char *, const char *) = fopen;
+    FILE *file;
+    int result;
+
+#ifdef _WIN32
+    if (flags & OPEN_FILE_UTF8)
+        fopen_func = fopen_utf8;
+#endif
+
+    if (*filename == '-' || (file = fopen_func (filename, "rb")) == NULL) {
+        CLEAR (*info);
+        info->total_samples = -1;
+        if (error) strcpy (error, "can't open file");
+        return FALSE;
+    }
+
+    result = WavpackProbeEx64 (&freader, file, info, error, flags);
+    fclose (file);
+    return result;
+}
+
+#ifdef HAVE_PREAD
+
+// These functions implement a reader for POSIX file descriptors that uses pread()
+// and pwrite() at explicit positions, so that there's no stdio buffering or locking
+// and the descriptor's own file offset is never used (or changed). This means that
+// any number of contexts (in any threads) can read the same descriptor at once.
+//
+// The reader also watches its access pattern and passes it on with posix_fadvise().
+// Every read that continues where the last one ended raises a score and every jump
+// lowers it by more, so when decoding straight through the score climbs and
+// sequential access is advised (for more aggressive readahead), and when reads keep
+// jumping around (i.e., seeking) it falls and random access is advised (so that no
+// readahead is wasted). Between the two thresholds the advice is left as it is, so
+// that it doesn't change back and forth on a mixed pattern. The advice applies to
+// the whole descriptor, so with shared descriptors the most recent advice wins.
+
+#define FD_SCORE_MAX        32      // the score counts contiguous reads (up to this)
+#define FD_SCORE_JUMP       8       // and loses this much for every jump
+#define FD_SCORE_SEQUENTIAL 24      // at or above this sequential access is advised
+#define FD_SCORE_RANDOM     8       // and below this random access
+
+typedef struct {
+    int fd, advice, score;
+    int64_t position, last_end;     // current position and the end of the last read
+} FdFile;
+
+static void fd_access_hint (FdFile *file)
+{
+#ifdef HAVE_POSIX_FADVISE
+    int advice = file->advice;
+
+    if (file->position == file->last_end) {
+        if (file->score < FD_SCORE_MAX)
+            file->score++;
+    }
+    else if ((file->score -= FD_SCORE_JUMP) < 0)
+        file->score = 0;
+
+    if (file->score >= FD_SCORE_SEQUENTIAL)
+        advice = POSIX_FADV_SEQUENTIAL;
+    else if (file->score < FD_SCORE_RANDOM)
+        advice = POSIX_FADV_RANDOM;
+
+    if (advice != file->advice) {
+        posix_fadvise (file->fd, 0, 0, advice);
+        file->advice = advice;
+    }
+#endif
+}
+
+static int32_t fd_read_bytes (void *id, void *data, int32_t bcount)
+{
+    FdFile *file = (FdFile *) id;
+    int32_t bytes_read = 0;
+    ssize_t result;
+
+    fd_access_hint (file);
+
+    while (bytes_read < bcount) {
+        result = pread (file->fd, (char *) data + bytes_read, bcount - bytes_read, file->position + bytes_read);
+
+        if (result > 0)
+            bytes_read += (int32_t) result;
+        else if (!result || errno != EINTR)
+            break;
+    }
+
+    file->last_end = file->position += bytes_read;
+    return bytes_read;
+}
+
+static int32_t fd_write_bytes (void *id, void *data, int32_t bcount)
+{
+    FdFile *file = (FdFile *) id;
+    int32_t bytes_written = 0;
+    ssize_t result;
+
+    while (bytes_written < bcount) {
+        result = pwrite (file->fd, (char *) data + bytes_written, bcount - bytes_written, file->position + bytes_written);
+
+        if (result > 0)
+            bytes_written += (int32_t) result;
+        else if (!result || errno != EINTR)
+            break;
+    }
+
+    file->position += bytes_written;
+    return bytes_written;
+}
+
+static int64_t fd_get_pos (void *id)
+{
+    return ((FdFile *) id)->position;
+}
+
+static int fd_set_pos_abs (void *id, int64_t pos)
+{
+    if (pos < 0)
+        return -1;
+
+    ((FdFile *) id)->position = pos;
+    return 0;
+}
+
+static int64_t fd_get_length (void *id)
+{
+    struct stat statbuf;
+
+    if (fstat (((FdFile *) id)->fd, &statbuf) || !S_ISREG(statbuf.st_mode))
+        return 0;
+
+    return statbuf.st_size;
+}
+
+static int fd_set_pos_rel (void *id, int64_t delta, int mode)
+{
+    FdFile *file = (FdFile *) id;
+
+    if (mode == SEEK_SET)
+        return fd_set_pos_abs (id, delta);
+    else if (mode == SEEK_CUR)
+        return fd_set_pos_abs (id, file->position + delta);
+    else if (mode == SEEK_END)
+        return fd_set_pos_abs (id, fd_get_length (id) + delta);
+    else
+        return -1;
+}
+
+// the byte pushed back is always the one just read, so we just back up (and this
+// doesn't count as a jump)
+
+static int fd_push_back_byte (void *id, int c)
+{
+    FdFile *file = (FdFile *) id;
+
+    if (file->position <= 0)
+        return EOF;
+
+    file->last_end = --file->position;
+    return c;
+}
+
+static int fd_can_seek (void *id)
+{
+    return 1;       // checked when opened
+}
+
+static int fd_truncate_here (void *id)
+{
+    FdFile *file = (FdFile *) id;
+
+    return ftruncate (file->fd, file->position);
+}
+
+// the descriptors belong to the caller, so we only free our own state
+
+static int fd_close (void *id)
+{
+    wp_free (id);
+    return 0;
+}
+
+static WavpackStreamReader64 fdreader = {
+    fd_read_bytes, fd_write_bytes, fd_get_pos, fd_set_pos_abs, fd_set_pos_rel,
+    fd_push_back_byte, fd_get_length, fd_can_seek, fd_truncate_here, fd_close
+};
+
+static FdFile *open_fd_file (int fd)
+{
+    FdFile *file;
+
+    if (lseek (fd, 0, SEEK_CUR) == -1 || !(file = (FdFile *)wp_calloc (1, sizeof (FdFile))))
+        return NULL;
+
+    file->fd = fd;
+#ifdef HAVE_POSIX_FADVISE
+    file->advice = POSIX_FADV_NORMAL;
+    file->score = FD_SCORE_RANDOM;
+#endif
+    return file;
+}
+
+#endif
+
+// This function opens a WavPack file for reading from an open POSIX file descriptor
+// (and optionally another one for the correction file, or -1 for none), and is
+// otherwise identical to WavpackOpenFileInput() (except that OPEN_WVC is implied by
+// supplying "wvc_fd", and OPEN_MMAP is ignored). The descriptors must refer to
+// seekable files open for reading (and writing, for OPEN_EDIT_TAGS), and are not
+// closed by WavpackCloseFile(). Because they are only accessed at explicit
+// positions, the same descriptors may be used by any number of contexts at once.
+// This is not available on systems without pread() (where NULL is returned).
+
+WavpackContext *WavpackOpenFileInputFd (int wv_fd, int wvc_fd, char *error, int flags, int norm_offset)
+{
+#ifdef HAVE_PREAD
+    FdFile *wv_file, *wvc_file = NULL;
+
+    if (!(wv_file = open_fd_file (wv_fd)) || (wvc_fd != -1 && !(wvc_file = open_fd_file (wvc_fd)))) {
+        if (error) strcpy (error, "can't read file descriptor (must be seekable)");
+        wp_free (wv_file);
+        return NULL;
+    }
+
+    return WavpackOpenFileInputEx64 (&fdreader, wv_file, wvc_file, error, wvc_file ? flags | OPEN_WVC : flags, norm_offset);
+#else
+    if (error) strcpy (error, "file descriptors are not supported on this system");
+    return NULL;
+#endif
+}
+
+#ifndef NO_SEEKING
+
+// These functions save the seek index of an open file (see unpack_seek.c) to a
+// separate file and load it again, so that an application that repeatedly opens
+// the same large files can seek directly to any block without searching (or
+// scanning the file first). The index file holds the sizes of the file(s) and
+// the total number of samples, and is rejected if these do not match the file
+// it is loaded for. The entries are simply added to any already in the index.
+
+typedef struct {
+    char ckID [4];                  // "wvsi"
+    uint32_t version, num_entries, reserved;
+    int64_t filelen, file2len, total_samples, initial_index;
+} SeekIndexHeader;
+
+#define SeekIndexHeaderFormat "4LLLDDDD"
+#define SEEK_INDEX_VERSION 1
+
+int WavpackSaveSeekIndex (WavpackContext *wpc, const char *filename)
+{
+    FILE *(*fopen_func)(const char *, const char *) = fopen;
+    unsigned char entry_data [SEEK_INDEX_ENTRY_BYTES];
+    SeekIndexHeader header;
+    SeekIndexEntry entry;
+    int32_t i;
+    FILE *file;
+
+    if (!wpc->seek_index_count)
+        return FALSE;
+
+#ifdef _WIN32
+    if (wpc->open_flags & OPEN_FILE_UTF8)
+        fopen_func = fopen_utf8;
+#endif
+
+    if ((file = fopen_func (filename, "wb")) == NULL)
+        return FALSE;
+
+    CLEAR (header);
+    memcpy (header.ckID, "wvsi", 4);
+    header.version = SEEK_INDEX_VERSION;
+    header.num_entries = wpc->seek_index_count;
+    header.filelen = wpc->filelen;
+    header.file2len = wpc->wvc_flag ? wpc->file2len : 0;
+    header.total_samples = wpc->total_samples;
+    header.initial_index = wpc->initial_index;
+    WavpackNativeToLittleEndian (&header, SeekIndexHeaderFormat);
+
+    if (fwrite (&header, sizeof (header), 1, file) != 1) {
+        fclose (file);
+        return FALSE;
+    }
+
+    for (i = 0; i < wpc->seek_index_count; ++i) {
+        entry = wpc->seek_index [i];
+        WavpackNativeToLittleEndian (&entry, SeekIndexEntryFormat);
+        memcpy (entry_data, &entry, SEEK_INDEX_ENTRY_BYTES);
+
+        if (fwrite (entry_data, SEEK_INDEX_ENTRY_BYTES, 1, file) != 1) {
+            fclose (file);
+            return FALSE;
+        }
+    }
+
+    return !fclose (file);
+}
+
+int WavpackLoadSeekIndex (WavpackContext *wpc, const char *filename)
+{
+    FILE *(*fopen_func)(const char *, const char *) = fopen;
+    int64_t file2len = wpc->wvc_flag ? wpc->file2len : 0, next_index = 0;
+    SeekIndexEntry *entries = NULL;
+    SeekIndexHeader header;
+    uint32_t i;
+    FILE *file;
+
+    if (wpc->stream3 || wpc->total_samples == -1 || (wpc->open_flags & OPEN_STREAMING))
+        return FALSE;
+
+#ifdef _WIN32
+    if (wpc->open_flags & OPEN_FILE_UTF8)
+        fopen_func = fopen_utf8;
+#endif
+
+    if ((file = fopen_func (filename, "rb")) == NULL)
+        return FALSE;
+
+    if (fread (&header, sizeof (header), 1, file) != 1 || strncmp (header.ckID, "wvsi", 4)) {
+        fclose (file);
+        return FALSE;
+    }
+
+    WavpackLittleEndianToNative (&header, SeekIndexHeaderFormat);
+
+    if (header.version != SEEK_INDEX_VERSION || !header.num_entries || header.num_entries > MAX_SEEK_INDEX_ENTRIES ||
+        header.filelen != wpc->filelen || header.total_samples != wpc->total_samples ||
+        header.initial_index != wpc->initial_index ||
+        !(entries = (SeekIndexEntry *)wp_malloc (header.num_entries * sizeof (SeekIndexEntry)))) {
+            fclose (file);
+            return FALSE;
+    }
+
+    // read and check all the entries before adding any of them
+
+    for (i = 0; i < header.num_entries; ++i) {
+        SeekIndexEntry *entry = entries + i;
+
+        if (fread (entry, SEEK_INDEX_ENTRY_BYTES, 1, file) != 1)
+            break;
+
+        WavpackLittleEndianToNative (entry, SeekIndexEntryFormat);
+
+        if (!entry->block_samples || entry->block_index < next_index ||
+            entry->block_index + entry->block_samples > wpc->total_samples ||
+            entry->filepos < 0 || entry->filepos > wpc->filelen - (int64_t) sizeof (WavpackHeader))
+                break;
+
+        // correction file positions are only used if the same correction file is open
+
+        if (header.file2len != file2len || !file2len || entry->file2pos < 0 ||
+            entry->file2pos > file2len - (int64_t) sizeof (WavpackHeader))
+                entry->file2pos = -1;
+
+        next_index = entry->block_index + entry->block_samples;
+    }
+
+    fclose (file);
+
+    if (i < header.num_entries) {
+        wp_free (entries);
+        return FALSE;
+    }
+
+    for (i = 0; i < header.num_entries; ++i)
+        seek_index_add (wpc, entries [i].block_index, entries [i].block_samples, entries [i].filepos, entries [i].file2pos);
+
+    wp_free (entries);
+    return TRUE;
+}
+
+#endif
+
 #ifdef _WIN32
 
 // The following code Copyright (c) 2004-2012 LoRd_MuldeR <mulder2@gmx.de>
@@ -272,7 +720,7 @@ static wchar_t *utf8_to_utf16(const char *input)
 	int BuffSize = 0, Result = 0;
 
 	BuffSize = MultiByteToWideChar(CP_UTF8, 0, input, -1, NULL, 0);
-	Buffer = (wchar_t*) malloc(sizeof(wchar_t) * BuffSize);
+	Buffer = (wchar_t*) wp_malloc(sizeof(wchar_t) * BuffSize);
 	if(Buffer)
 	{
 		Result = MultiByteToWideChar(CP_UTF8, 0, input, -1, Buffer, BuffSize);
@@ -293,8 +741,8 @@ static FILE *fopen_utf8(const char *filename_utf8, const char *mode_utf8)
 		ret = _wfopen(filename_utf16, mode_utf16);
 	}
 
-	if(filename_utf16) free(filename_utf16);
-	if(mode_utf16) free(mode_utf16);
+	if(filename_utf16) wp_free(filename_utf16);
+	if(mode_utf16) wp_free(mode_utf16);
 
 	return ret;
 }
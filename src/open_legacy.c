@@ -72,7 +72,7 @@ static int trans_can_seek (void *id)
 
 static int trans_close_stream (void *id)
 {
-    free (id);
+    wp_free (id);
     return 0;
 }
 
@@ -99,13 +99,13 @@ WavpackContext *WavpackOpenFileInputEx (WavpackStreamReader *reader, void *wv_id
         flags |= OPEN_NO_CHECKSUM;
 
     if (wv_id) {
-        trans_wv = (WavpackReaderTranslator *)malloc (sizeof (WavpackReaderTranslator));
+        trans_wv = (WavpackReaderTranslator *)wp_malloc (sizeof (WavpackReaderTranslator));
         trans_wv->reader = reader;
         trans_wv->id = wv_id;
     }
 
     if (wvc_id) {
-        trans_wvc = (WavpackReaderTranslator *)malloc (sizeof (WavpackReaderTranslator));
+        trans_wvc = (WavpackReaderTranslator *)wp_malloc (sizeof (WavpackReaderTranslator));
         trans_wvc->reader = reader;
         trans_wvc->id = wvc_id;
     }
@@ -0,0 +1,200 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** WAVPACK ****                            //
+//                  Hybrid Lossless Wavefile Compressor                   //
+//              Copyright (c) 1998 - 2024 David Bryant.                   //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// open_memory.c
+
+// This module provides a reader for WavPack files that are entirely in memory
+// (either supplied by the application to WavpackOpenFileInputMemory() or files
+// mapped with OPEN_MMAP, see open_filename.c). Besides copying data like any
+// other reader, it lets the decoder use the raw blocks right where they are in
+// memory instead of reading them into block buffers, so that the only copies
+// of the compressed audio are the ones made (if any) to get the file into
+// memory in the first place.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "wavpack_local.h"
+
+typedef struct {
+    const unsigned char *data;
+    int64_t size, position;
+    void (*release) (void *data, int64_t size);     // called on close (e.g., to unmap the file)
+} MemoryFile;
+
+static int32_t memory_read_bytes (void *id, void *data, int32_t bcount)
+{
+    MemoryFile *file = (MemoryFile *) id;
+
+    if (bcount <= 0 || file->position < 0 || file->position >= file->size)
+        return 0;
+
+    if (bcount > file->size - file->position)
+        bcount = (int32_t) (file->size - file->position);
+
+    memcpy (data, file->data + file->position, bcount);
+    file->position += bcount;
+    return bcount;
+}
+
+static int64_t memory_get_pos (void *id)
+{
+    return ((MemoryFile *) id)->position;
+}
+
+static int memory_set_pos_abs (void *id, int64_t pos)
+{
+    if (pos < 0)
+        return -1;
+
+    ((MemoryFile *) id)->position = pos;
+    return 0;
+}
+
+static int memory_set_pos_rel (void *id, int64_t delta, int mode)
+{
+    MemoryFile *file = (MemoryFile *) id;
+
+    if (mode == SEEK_SET)
+        return memory_set_pos_abs (id, delta);
+    else if (mode == SEEK_CUR)
+        return memory_set_pos_abs (id, file->position + delta);
+    else if (mode == SEEK_END)
+        return memory_set_pos_abs (id, file->size + delta);
+    else
+        return -1;
+}
+
+// the only byte ever pushed back is the one just read, and it's still there
+
+static int memory_push_back_byte (void *id, int c)
+{
+    MemoryFile *file = (MemoryFile *) id;
+
+    if (file->position <= 0)
+        return EOF;
+
+    file->position--;
+    return c;
+}
+
+static int64_t memory_get_length (void *id)
+{
+    return ((MemoryFile *) id)->size;
+}
+
+static int memory_can_seek (void *id)
+{
+    return 1;
+}
+
+static int memory_close (void *id)
+{
+    MemoryFile *file = (MemoryFile *) id;
+
+    if (file->release)
+        file->release ((void *) file->data, file->size);
+
+    wp_free (file);
+    return 0;
+}
+
+WavpackStreamReader64 memory_reader = {
+    memory_read_bytes, NULL, memory_get_pos, memory_set_pos_abs, memory_set_pos_rel,
+    memory_push_back_byte, memory_get_length, memory_can_seek, NULL, memory_close
+};
+
+// Create a file id for the memory reader for the specified data, which must remain
+// valid until the file is closed. If "release" is not NULL it is called with the
+// data when the file is closed. Returns NULL if the memory is not available.
+
+void *open_memory_file (const void *data, int64_t size, void (*release) (void *data, int64_t size))
+{
+    MemoryFile *file = (MemoryFile *)wp_calloc (1, sizeof (MemoryFile));
+
+    if (file) {
+        file->data = (const unsigned char *) data;
+        file->size = size;
+        file->release = release;
+    }
+
+    return file;
+}
+
+// This function opens a WavPack file (and optionally its correction file) that is
+// already completely in memory, and is otherwise identical to WavpackOpenFileInput()
+// (with the same "flags" except that OPEN_WVC is implied by supplying "wvc_data" and
+// OPEN_EDIT_TAGS is not allowed). The data is never modified or copied as a whole,
+// and the blocks are decoded (and seeking is done) right from the caller's memory,
+// which must therefore remain valid and unchanged until the file is closed.
+
+WavpackContext *WavpackOpenFileInputMemory (const void *wv_data, size_t wv_size, const void *wvc_data, size_t wvc_size, char *error, int flags, int norm_offset)
+{
+    void *wv_id, *wvc_id = NULL;
+
+    if (flags & OPEN_EDIT_TAGS) {
+        if (error) strcpy (error, "can't edit tags of files in memory!");
+        return NULL;
+    }
+
+    if (!(wv_id = open_memory_file (wv_data, wv_size, NULL)) ||
+        (wvc_data && !(wvc_id = open_memory_file (wvc_data, wvc_size, NULL)))) {
+            if (error) strcpy (error, "can't allocate memory");
+            wp_free (wv_id);
+            return NULL;
+    }
+
+    return WavpackOpenFileInputEx64 (&memory_reader, wv_id, wvc_id, error, wvc_id ? flags | OPEN_WVC : flags, norm_offset);
+}
+
+// Return a pointer to the raw block whose header has just been read (with
+// read_next_header()) from the specified file and skip over the rest of the
+// block, or return NULL if the block cannot be used in place (in which case
+// nothing is changed). This requires that the whole block is in the file, that
+// it's aligned for the bitstreams, and that its header is already exactly as the
+// decoder expects it (i.e., we are on a little-endian machine). Note that the
+// block is only ever read through this pointer, never written.
+
+unsigned char *memory_block (WavpackContext *wpc, void *id, WavpackHeader *wphdr)
+{
+    MemoryFile *file = (MemoryFile *) id;
+    const unsigned char *block;
+
+    if (wpc->reader != &memory_reader || file->position < (int64_t) sizeof (WavpackHeader) ||
+        file->size - file->position < wphdr->ckSize - 24)
+            return NULL;
+
+    block = file->data + file->position - sizeof (WavpackHeader);
+
+    if (((size_t) block & 1) || memcmp (block, wphdr, sizeof (WavpackHeader)))
+        return NULL;
+
+    file->position += wphdr->ckSize - 24;
+    return (unsigned char *) block;
+}
+
+// Return TRUE if the specified block buffer points into one of the context's files
+// (so it was returned by memory_block() and must not be freed or written).
+
+int is_memory_block (WavpackContext *wpc, unsigned char *buffer)
+{
+    MemoryFile *file;
+
+    if (wpc->reader != &memory_reader)
+        return FALSE;
+
+    file = (MemoryFile *) wpc->wv_in;
+
+    if (buffer >= file->data && buffer < file->data + file->size)
+        return TRUE;
+
+    file = (MemoryFile *) wpc->wvc_in;
+
+    return file && buffer >= file->data && buffer < file->data + file->size;
+}
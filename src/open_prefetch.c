@@ -0,0 +1,401 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** WAVPACK ****                            //
+//                  Hybrid Lossless Wavefile Compressor                   //
+//              Copyright (c) 1998 - 2024 David Bryant.                   //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// open_prefetch.c
+
+// This module provides WavpackOpenFileInputPrefetch(), which opens a file through
+// a reader that wraps the application's reader and reads ahead of the decoder on
+// a background thread, so that on slow or high-latency storage the I/O overlaps
+// with the decoding instead of alternating with it. Each file (the .wv and the
+// .wvc are handled at the same time) has a ring of large aligned buffers, each of
+// which is filled by a job on the same single worker thread (see workers.c) at a
+// position aligned to the buffer size. The readahead starts with one buffer after
+// every seek and doubles with every buffer consumed (up to the configured depth),
+// so that sequential decoding soon keeps the whole ring busy while seeking doesn't
+// waste much I/O. A read outside the ring simply discards it (cancelling the
+// buffers that have not been started) and starts over at the new position.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "wavpack_local.h"
+
+#define PREFETCH_ALIGNMENT      4096
+#define PREFETCH_DEFAULT_SIZE   (256 * 1024)
+#define PREFETCH_MAX_SIZE       (16 * 1024 * 1024)
+#define PREFETCH_DEFAULT_DEPTH  4
+#define PREFETCH_MAX_DEPTH      64
+
+struct prefetch_file;
+
+typedef struct {
+    WorkerJob job;
+    struct prefetch_file *file;
+    unsigned char *memory, *data;   // as allocated, and aligned
+    int64_t position;               // where the data comes from in the file
+    int32_t bytes;                  // how much was actually read (set by the job)
+    int cancelled;                  // protected by the file's mutex (the job might be starting)
+} PrefetchBuffer;
+
+struct prefetcher;
+
+typedef struct prefetch_file {
+    struct prefetcher *shared;
+    void *id;                       // the wrapped reader's file id
+    void *mutex;                    // held while the wrapped reader is accessing the file
+    PrefetchBuffer *ring;
+    int head, count, window;        // oldest buffer, number outstanding, current readahead
+    int64_t position, next_fetch, length;
+} PrefetchFile;
+
+typedef struct prefetcher {
+    WavpackStreamReader64 *reader;
+    void *workers;
+    int depth, open_files;
+    int32_t buffer_size;
+    PrefetchFile wv, wvc;
+} Prefetcher;
+
+// This is the job that fills a buffer, and it runs on the worker thread (unless the
+// decoder needs the buffer before the thread gets to it, in which case it's run
+// directly by workers_wait() and the thread might be starting the next one at the
+// same time). The file's lock ensures that the wrapped reader is only ever accessed
+// by one thread at a time for each file.
+
+static void fetch_buffer (void *param)
+{
+    PrefetchBuffer *buffer = (PrefetchBuffer *) param;
+    PrefetchFile *file = buffer->file;
+    WavpackStreamReader64 *reader = file->shared->reader;
+
+    buffer->bytes = 0;
+    workers_mutex_lock (file->mutex);
+
+    if (!buffer->cancelled && !reader->set_pos_abs (file->id, buffer->position)) {
+        buffer->bytes = reader->read_bytes (file->id, buffer->data, file->shared->buffer_size);
+
+        if (buffer->bytes < 0)
+            buffer->bytes = 0;
+    }
+
+    workers_mutex_unlock (file->mutex);
+}
+
+// Submit buffers until the current readahead is reached (but never past the end of the file).
+
+static void fill_ring (PrefetchFile *file)
+{
+    Prefetcher *pf = file->shared;
+
+    while (file->count < file->window && file->next_fetch < file->length) {
+        PrefetchBuffer *buffer = file->ring + (file->head + file->count++) % pf->depth;
+
+        buffer->position = file->next_fetch;
+        buffer->cancelled = FALSE;
+        file->next_fetch += pf->buffer_size;
+        workers_submit (pf->workers, &buffer->job);
+    }
+}
+
+// Remove the oldest buffer from the ring, waiting for it (or cancelling it first).
+
+static void retire_buffer (PrefetchFile *file, int cancel)
+{
+    Prefetcher *pf = file->shared;
+    PrefetchBuffer *buffer = file->ring + file->head;
+
+    if (cancel) {
+        workers_mutex_lock (file->mutex);
+        buffer->cancelled = TRUE;
+        workers_mutex_unlock (file->mutex);
+    }
+
+    workers_wait (pf->workers, &buffer->job);
+    file->head = (file->head + 1) % pf->depth;
+    file->count--;
+}
+
+static void discard_ring (PrefetchFile *file)
+{
+    while (file->count)
+        retire_buffer (file, TRUE);
+}
+
+static int32_t prefetch_read_bytes (void *id, void *data, int32_t bcount)
+{
+    PrefetchFile *file = (PrefetchFile *) id;
+    Prefetcher *pf = file->shared;
+    int32_t bytes_read = 0;
+
+    while (bytes_read < bcount) {
+        PrefetchBuffer *buffer;
+        int32_t offset, bytes;
+
+        // skip any buffers that we've moved past, and start over if we're not in the ring at all
+
+        while (file->count && file->position >= file->ring [file->head].position + pf->buffer_size)
+            retire_buffer (file, TRUE);
+
+        if (!file->count || file->position < file->ring [file->head].position) {
+            discard_ring (file);
+            file->next_fetch = file->position - file->position % pf->buffer_size;
+            file->window = 1;
+        }
+
+        fill_ring (file);
+
+        if (!file->count)
+            break;
+
+        buffer = file->ring + file->head;
+        workers_wait (pf->workers, &buffer->job);
+        offset = (int32_t) (file->position - buffer->position);
+
+        if (offset >= buffer->bytes)
+            break;          // short read, so that's the end of the file (or an error)
+
+        bytes = buffer->bytes - offset;
+
+        if (bytes > bcount - bytes_read)
+            bytes = bcount - bytes_read;
+
+        memcpy ((unsigned char *) data + bytes_read, buffer->data + offset, bytes);
+        file->position += bytes;
+        bytes_read += bytes;
+
+        // if we've finished the buffer, we're reading sequentially so increase the readahead
+
+        if (file->position == buffer->position + pf->buffer_size) {
+            retire_buffer (file, FALSE);
+
+            if ((file->window *= 2) > pf->depth)
+                file->window = pf->depth;
+
+            fill_ring (file);
+        }
+    }
+
+    return bytes_read;
+}
+
+// Writing (to edit tags) goes straight to the file, after discarding the ring.
+
+static int32_t prefetch_write_bytes (void *id, void *data, int32_t bcount)
+{
+    PrefetchFile *file = (PrefetchFile *) id;
+    WavpackStreamReader64 *reader = file->shared->reader;
+    int32_t bytes_written;
+
+    discard_ring (file);
+
+    if (!reader->write_bytes || reader->set_pos_abs (file->id, file->position))
+        return 0;
+
+    if ((bytes_written = reader->write_bytes (file->id, data, bcount)) > 0)
+        file->position += bytes_written;
+
+    file->length = reader->get_length (file->id);
+    return bytes_written;
+}
+
+static int prefetch_truncate_here (void *id)
+{
+    PrefetchFile *file = (PrefetchFile *) id;
+    WavpackStreamReader64 *reader = file->shared->reader;
+    int result;
+
+    discard_ring (file);
+
+    if (!reader->truncate_here || reader->set_pos_abs (file->id, file->position))
+        return -1;
+
+    result = reader->truncate_here (file->id);
+    file->length = reader->get_length (file->id);
+    return result;
+}
+
+static int64_t prefetch_get_pos (void *id)
+{
+    return ((PrefetchFile *) id)->position;
+}
+
+static int prefetch_set_pos_abs (void *id, int64_t pos)
+{
+    if (pos < 0)
+        return -1;
+
+    ((PrefetchFile *) id)->position = pos;
+    return 0;
+}
+
+static int prefetch_set_pos_rel (void *id, int64_t delta, int mode)
+{
+    PrefetchFile *file = (PrefetchFile *) id;
+
+    if (mode == SEEK_SET)
+        return prefetch_set_pos_abs (id, delta);
+    else if (mode == SEEK_CUR)
+        return prefetch_set_pos_abs (id, file->position + delta);
+    else if (mode == SEEK_END)
+        return prefetch_set_pos_abs (id, file->length + delta);
+    else
+        return -1;
+}
+
+// the byte pushed back is always the one just read, so we just back up
+
+static int prefetch_push_back_byte (void *id, int c)
+{
+    PrefetchFile *file = (PrefetchFile *) id;
+
+    if (file->position <= 0)
+        return EOF;
+
+    file->position--;
+    return c;
+}
+
+// The length is read when the file is opened (and after writes) because the wrapped
+// reader must not be called while the worker thread might be using it.
+
+static int64_t prefetch_get_length (void *id)
+{
+    return ((PrefetchFile *) id)->length;
+}
+
+static int prefetch_can_seek (void *id)
+{
+    return 1;       // only seekable files are prefetched
+}
+
+static void free_prefetch_file (PrefetchFile *file)
+{
+    int i;
+
+    if (file->ring) {
+        for (i = 0; i < file->shared->depth; ++i)
+            wp_free (file->ring [i].memory);
+
+        wp_free (file->ring);
+        file->ring = NULL;
+    }
+
+    workers_mutex_destroy (file->mutex);
+    file->mutex = NULL;
+}
+
+static void free_prefetcher (Prefetcher *pf)
+{
+    workers_destroy (pf->workers);
+    free_prefetch_file (&pf->wv);
+    free_prefetch_file (&pf->wvc);
+    wp_free (pf);
+}
+
+// The two files are closed separately, and the shared thread is stopped (and
+// everything freed) when the last one is closed.
+
+static int prefetch_close (void *id)
+{
+    PrefetchFile *file = (PrefetchFile *) id;
+    Prefetcher *pf = file->shared;
+    int result = 0;
+
+    discard_ring (file);
+
+    if (pf->reader->close)
+        result = pf->reader->close (file->id);
+
+    free_prefetch_file (file);
+
+    if (!--pf->open_files)
+        free_prefetcher (pf);
+
+    return result;
+}
+
+static WavpackStreamReader64 prefetch_reader = {
+    prefetch_read_bytes, prefetch_write_bytes, prefetch_get_pos, prefetch_set_pos_abs, prefetch_set_pos_rel,
+    prefetch_push_back_byte, prefetch_get_length, prefetch_can_seek, prefetch_truncate_here, prefetch_close
+};
+
+static int init_prefetch_file (Prefetcher *pf, PrefetchFile *file, void *id)
+{
+    int i;
+
+    file->shared = pf;
+    file->id = id;
+    file->length = pf->reader->get_length (id);
+
+#ifdef ENABLE_THREADS
+    if (!(file->mutex = workers_mutex_create ()))
+        return FALSE;
+#endif
+
+    if (!(file->ring = (PrefetchBuffer *)wp_calloc (pf->depth, sizeof (PrefetchBuffer))))
+        return FALSE;
+
+    for (i = 0; i < pf->depth; ++i) {
+        PrefetchBuffer *buffer = file->ring + i;
+
+        if (!(buffer->memory = (unsigned char *)wp_malloc (pf->buffer_size + PREFETCH_ALIGNMENT)))
+            return FALSE;
+
+        buffer->data = buffer->memory + ((PREFETCH_ALIGNMENT - ((size_t) buffer->memory & (PREFETCH_ALIGNMENT - 1))) & (PREFETCH_ALIGNMENT - 1));
+        buffer->file = file;
+        buffer->job.function = fetch_buffer;
+        buffer->job.param = buffer;
+    }
+
+    return TRUE;
+}
+
+// This function opens a WavPack file through the specified reader exactly like
+// WavpackOpenFileInputEx64(), except that the file(s) are read ahead of the decoder
+// on a background thread, with up to "depth" buffers of "buffer_size" bytes for each
+// file (zero selects the defaults of 4 and 256K). Because the thread accesses the
+// files while the decoder is running, the reader must allow its .wv and .wvc files to
+// be accessed from different threads at the same time (as separate stdio files or
+// descriptors would), although each file is only accessed by one thread at a time.
+// If the library was built without threads, or a file is not seekable, or the
+// prefetching cannot be set up, the file is simply opened without it.
+
+WavpackContext *WavpackOpenFileInputPrefetch (WavpackStreamReader64 *reader, void *wv_id, void *wvc_id,
+    char *error, int flags, int norm_offset, int depth, int32_t buffer_size)
+{
+    Prefetcher *pf;
+
+    if (depth <= 0)
+        depth = PREFETCH_DEFAULT_DEPTH;
+    else if (depth > PREFETCH_MAX_DEPTH)
+        depth = PREFETCH_MAX_DEPTH;
+
+    if (buffer_size <= 0)
+        buffer_size = PREFETCH_DEFAULT_SIZE;
+    else if (buffer_size > PREFETCH_MAX_SIZE)
+        buffer_size = PREFETCH_MAX_SIZE;
+    else
+        buffer_size = (buffer_size + PREFETCH_ALIGNMENT - 1) & ~(PREFETCH_ALIGNMENT - 1);
+
+    if (!reader->can_seek (wv_id) || (wvc_id && !reader->can_seek (wvc_id)) ||
+        !(pf = (Prefetcher *)wp_calloc (1, sizeof (Prefetcher))))
+            return WavpackOpenFileInputEx64 (reader, wv_id, wvc_id, error, flags, norm_offset);
+
+    pf->reader = reader;
+    pf->depth = depth;
+    pf->buffer_size = buffer_size;
+    pf->open_files = wvc_id ? 2 : 1;
+
+    if (!(pf->workers = workers_create (1)) || !init_prefetch_file (pf, &pf->wv, wv_id) || (wvc_id && !init_prefetch_file (pf, &pf->wvc, wvc_id))) {
+            free_prefetcher (pf);
+            return WavpackOpenFileInputEx64 (reader, wv_id, wvc_id, error, flags, norm_offset);
+    }
+
+    return WavpackOpenFileInputEx64 (&prefetch_reader, &pf->wv, wvc_id ? &pf->wvc : NULL, error, flags, norm_offset);
+}
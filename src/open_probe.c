@@ -0,0 +1,394 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** WAVPACK ****                            //
+//                  Hybrid Lossless Wavefile Compressor                   //
+//              Copyright (c) 1998 - 2024 David Bryant.                   //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// open_probe.c
+
+// This module provides WavpackProbeEx64() and WavpackProbeBatch(), which get the
+// basic information about files (format, length, MD5 sum and tag presence) for
+// applications that scan large numbers of them, at a small fraction of the cost
+// of opening them. Opening a file allocates and initializes the decoder, reads
+// the end of the file (with many small reads) to find the length and then reads
+// the tags. A probe instead uses just a context on the stack and reads the first
+// block(s) and then the end of the file with a single read, from which the tags
+// are found and the blocks are parsed in memory. Only in unusual cases (a tag
+// larger than that read, or a file of unknown length with very large blocks) is
+// a second read needed. WavpackProbe() (for filenames) is in open_filename.c.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+#define PROBE_TAIL_BYTES    65536
+#define PROBE_SCAN_BYTES    1048576         // same as seek_eof_information()
+
+// Read up to "*bytes" bytes just before the position "end" into a new buffer, and
+// return it (with "*bytes" set to how much is in it), or NULL if the read fails.
+
+static unsigned char *read_tail (WavpackStreamReader64 *reader, void *id, int64_t end, int32_t *bytes)
+{
+    unsigned char *tail;
+
+    if (*bytes > end)
+        *bytes = (int32_t) end;
+
+    if (*bytes <= 0 || !(tail = (unsigned char *)wp_malloc (*bytes)))
+        return NULL;
+
+    if (reader->set_pos_abs (id, end - *bytes) || reader->read_bytes (id, tail, *bytes) != *bytes) {
+        wp_free (tail);
+        return NULL;
+    }
+
+    return tail;
+}
+
+// Find the tags at the end of the specified tail of the file (in the same places that
+// load_tag() looks, except the discouraged APEv2 tag at the beginning of the file) and
+// return their total length. The length of an APEv2 tag comes from its footer, so it
+// may be longer than the tail.
+
+static int64_t find_tags (unsigned char *tail, int32_t bytes, char *tag_type)
+{
+    int32_t id3_bytes = 0;
+    APE_Tag_Hdr ape_tag_hdr;
+
+    *tag_type = 0;
+
+    if (bytes >= (int32_t) sizeof (ID3_Tag) && !strncmp ((char *) tail + bytes - sizeof (ID3_Tag), "TAG", 3)) {
+        id3_bytes = sizeof (ID3_Tag);
+        *tag_type = 'T';
+    }
+
+    if (bytes >= id3_bytes + (int32_t) sizeof (APE_Tag_Hdr)) {
+        memcpy (&ape_tag_hdr, tail + bytes - id3_bytes - sizeof (APE_Tag_Hdr), sizeof (APE_Tag_Hdr));
+
+        if (!strncmp (ape_tag_hdr.ID, "APETAGEX", 8)) {
+            WavpackLittleEndianToNative (&ape_tag_hdr, APE_Tag_Hdr_Format);
+
+            if (ape_tag_hdr.version == 2000 && ape_tag_hdr.item_count &&
+                ape_tag_hdr.length > (int) sizeof (ape_tag_hdr) &&
+                ape_tag_hdr.length <= APE_TAG_MAX_LENGTH &&
+                !(ape_tag_hdr.flags & APE_TAG_THIS_IS_HEADER)) {
+                    *tag_type = 'A';
+                    return id3_bytes + ape_tag_hdr.length +
+                        ((ape_tag_hdr.flags & APE_TAG_CONTAINS_HEADER) ? sizeof (APE_Tag_Hdr) : 0);
+            }
+        }
+    }
+
+    return id3_bytes;
+}
+
+// Parse the blocks in the specified part of the file (which is in memory), reading
+// any MD5 sum and setting "*final_index" from the last block with audio (if any).
+// Like seek_eof_information(), the scan starts with the first block header found,
+// and blocks that extend past the end of the buffer are ignored. Returns the number
+// of (valid) blocks found.
+
+static int scan_tail (WavpackContext *wpc, unsigned char *tail, int32_t bytes, int64_t *final_index)
+{
+    WavpackStreamReader64 *reader = wpc->reader;
+    void *id = wpc->wv_in;
+    unsigned char *blockbuff;
+    WavpackHeader wphdr;
+    int blocks = 0;
+
+    if (!(wpc->wv_in = open_memory_file (tail, bytes, NULL))) {
+        wpc->wv_in = id;
+        return 0;
+    }
+
+    wpc->reader = &memory_reader;
+
+    while (read_next_header (wpc->reader, wpc->wv_in, &wphdr) != (uint32_t) -1) {
+        int64_t pos = wpc->reader->get_pos (wpc->wv_in);
+
+        if (wphdr.ckSize - 24 > bytes - pos)
+            break;
+
+        if (read_block_buffer (wpc, wpc->wv_in, &wphdr, &blockbuff)) {
+            if (blockbuff)
+                release_block_buffer (wpc, blockbuff);
+
+            break;
+        }
+
+        // if this wasn't really a block, continue looking right after where it seemed to start
+
+        if (WavpackVerifySingleBlock (blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
+            if (wphdr.block_samples)
+                *final_index = GET_BLOCK_INDEX (wphdr) + wphdr.block_samples;
+
+            read_file_metadata (wpc, blockbuff, TRUE);
+            blocks++;
+        }
+        else
+            wpc->reader->set_pos_abs (wpc->wv_in, pos - sizeof (WavpackHeader) + 1);
+
+        release_block_buffer (wpc, blockbuff);
+    }
+
+    memory_reader.close (wpc->wv_in);
+    wpc->reader = reader;
+    wpc->wv_in = id;
+    return blocks;
+}
+
+static int probe_failed (WavpackContext *wpc, char *error, char *message)
+{
+    if (error) strcpy (error, message);
+    free_spare_buffers (wpc);
+    wp_free (wpc->channel_reordering);
+    return FALSE;
+}
+
+// Get the basic information about a WavPack file that's accessed through the
+// specified reader (which is left wherever the probe stopped reading). The
+// "flags" are the same as for opening the file, but only OPEN_ALT_TYPES and
+// OPEN_NO_CHECKSUM have any effect. Returns TRUE on success, otherwise FALSE
+// (with a message in "error", if not NULL) and the info's sample_rate is zero.
+// Pre-4.0 files can't be probed (and just fail), so they must be opened.
+
+int WavpackProbeEx64 (WavpackStreamReader64 *reader, void *id, WavpackProbeInfo *info, char *error, int flags)
+{
+    WavpackContext context, *wpc = &context;
+    int64_t initial_index = 0, final_index = -1;
+    unsigned char *blockbuff;
+    WavpackHeader wphdr;
+    int num_blocks = 0;
+
+    CLEAR (*info);
+    info->total_samples = -1;
+
+    CLEAR (context);
+    wpc->reader = reader;
+    wpc->wv_in = id;
+    wpc->total_samples = -1;
+    wpc->max_streams = OLD_MAX_STREAMS;
+    wpc->open_flags = flags & (OPEN_ALT_TYPES | OPEN_NO_CHECKSUM);
+
+    // read up to the first block with audio exactly like WavpackOpenFileInputEx64(), but
+    // just for the metadata
+
+    while (1) {
+        int result;
+
+        if (read_next_header (reader, id, &wphdr) == (uint32_t) -1 || (!wphdr.block_samples && num_blocks++ > 16))
+            return probe_failed (wpc, error, "not compatible with this version of WavPack file!");
+
+        if ((result = read_block_buffer (wpc, id, &wphdr, &blockbuff)) != 0) {
+            if (blockbuff)
+                release_block_buffer (wpc, blockbuff);
+
+            return probe_failed (wpc, error, result == 1 ? "can't allocate memory" : "can't read all of WavPack file!");
+        }
+
+        if (!WavpackVerifySingleBlock (blockbuff, !(flags & OPEN_NO_CHECKSUM))) {
+            release_block_buffer (wpc, blockbuff);
+            continue;
+        }
+
+        result = read_file_metadata (wpc, blockbuff, FALSE);
+        release_block_buffer (wpc, blockbuff);
+
+        if (!result)
+            return probe_failed (wpc, error, "not compatible with this version of WavPack file!");
+
+        if (wphdr.block_samples)
+            break;
+
+        if (wpc->total_samples == -1 && !GET_BLOCK_INDEX (wphdr) && GET_TOTAL_SAMPLES (wphdr))
+            wpc->total_samples = GET_TOTAL_SAMPLES (wphdr);
+    }
+
+    if (wpc->total_samples == -1) {
+        if (GET_BLOCK_INDEX (wphdr) || GET_TOTAL_SAMPLES (wphdr) == -1)
+            initial_index = GET_BLOCK_INDEX (wphdr);
+        else
+            wpc->total_samples = GET_TOTAL_SAMPLES (wphdr);
+    }
+
+    // Now read the end of the file for the tags, the MD5 sum (which is in the final block)
+    // and, if required, the end of the audio. If no complete block was in that read (because
+    // of the tags or large blocks), or the MD5 sum or the end of the audio is still required,
+    // we read a few blocks' worth before the tags (based on the size of the first block).
+
+    if (reader->can_seek (id)) {
+        int64_t audio_end = reader->get_length (id), tag_length = 0;
+        int32_t bytes = PROBE_TAIL_BYTES, scanned = 0;
+        unsigned char *tail = read_tail (reader, id, audio_end, &bytes);
+        int blocks = 0;
+
+        if (tail) {
+            audio_end -= tag_length = find_tags (tail, bytes, &info->tag_type);
+
+            if (tag_length < bytes)
+                blocks = scan_tail (wpc, tail, scanned = bytes - (int32_t) tag_length, &final_index);
+
+            wp_free (tail);
+        }
+
+        if (audio_end > scanned && (!blocks || (final_index == -1 && wpc->total_samples == -1) ||
+            ((wpc->config.flags & CONFIG_MD5_CHECKSUM) && !wpc->config.md5_read))) {
+                bytes = wphdr.ckSize < (PROBE_SCAN_BYTES - PROBE_TAIL_BYTES) / 3 ?
+                    PROBE_TAIL_BYTES + (wphdr.ckSize + 8) * 3 : PROBE_SCAN_BYTES;
+
+                if ((tail = read_tail (reader, id, audio_end, &bytes)) != NULL) {
+                    scan_tail (wpc, tail, bytes, &final_index);
+                    wp_free (tail);
+                }
+        }
+    }
+
+    if (wpc->total_samples == -1 && final_index != -1)
+        wpc->total_samples = final_index - initial_index;
+
+    // fill in the configuration from the header as WavpackOpenFileInputEx64() does
+
+    wpc->config.flags &= ~0xff;
+    wpc->config.flags |= wphdr.flags & 0xff;
+
+    if (!wpc->config.num_channels) {
+        wpc->config.num_channels = (wphdr.flags & MONO_FLAG) ? 1 : 2;
+        wpc->config.channel_mask = 0x5 - wpc->config.num_channels;
+    }
+
+    if (wphdr.flags & DSD_FLAG) {
+        wpc->config.bytes_per_sample = 1;
+        wpc->config.bits_per_sample = 8;
+    }
+    else {
+        wpc->config.bytes_per_sample = (wphdr.flags & BYTES_STORED) + 1;
+        wpc->config.bits_per_sample = (wpc->config.bytes_per_sample * 8) -
+            ((wphdr.flags & SHIFT_MASK) >> SHIFT_LSB);
+    }
+
+    if (!wpc->config.sample_rate) {
+        if ((wphdr.flags & SRATE_MASK) == SRATE_MASK)
+            wpc->config.sample_rate = 44100;
+        else
+            wpc->config.sample_rate = sample_rates [(wphdr.flags & SRATE_MASK) >> SRATE_LSB];
+    }
+
+    info->total_samples = wpc->total_samples;
+    info->sample_rate = WavpackGetSampleRate (wpc);
+    info->channel_mask = WavpackGetChannelMask (wpc);
+    info->num_channels = WavpackGetNumChannels (wpc);
+    info->bits_per_sample = WavpackGetBitsPerSample (wpc);
+    info->bytes_per_sample = WavpackGetBytesPerSample (wpc);
+    info->qualify_mode = WavpackGetQualifyMode (wpc);
+    info->version = WavpackGetVersion (wpc);
+
+    // WavpackGetMode() needs the stream header for these two (and the tag for the others)
+
+    info->mode = WavpackGetMode (wpc);
+
+    if ((info->mode & MODE_HIGH) && wphdr.version < 0x405)
+        info->mode |= MODE_VERY_HIGH;
+
+    if ((wpc->config.flags & CONFIG_HYBRID_FLAG) && (wpc->config.flags & CONFIG_DYNAMIC_SHAPING) && wphdr.version >= 0x407)
+        info->mode |= MODE_DNS;
+
+    if (info->tag_type)
+        info->mode |= (info->tag_type == 'A') ? (MODE_VALID_TAG | MODE_APETAG) : MODE_VALID_TAG;
+
+    if ((info->md5_read = wpc->config.md5_read) != 0)
+        memcpy (info->md5_sum, wpc->config.md5_checksum, sizeof (info->md5_sum));
+
+    free_spare_buffers (wpc);
+    wp_free (wpc->channel_reordering);
+    return TRUE;
+}
+
+// WavpackProbeBatch() runs the same job on each thread (the calling thread included),
+// and the jobs simply take the next file from the list until there are none left.
+
+typedef struct {
+    const char **filenames;
+    WavpackProbeInfo *info;
+    int count, flags, next;
+    void *mutex;
+} ProbeBatch;
+
+static void probe_files (void *param)
+{
+    ProbeBatch *batch = (ProbeBatch *) param;
+
+    while (1) {
+        int index;
+
+        workers_mutex_lock (batch->mutex);
+        index = batch->next < batch->count ? batch->next++ : -1;
+        workers_mutex_unlock (batch->mutex);
+
+        if (index == -1)
+            break;
+
+        WavpackProbe (batch->filenames [index], batch->info + index, NULL, batch->flags);
+    }
+}
+
+// Probe the specified files (with WavpackProbe()) into the corresponding entries
+// of the "info" array using up to "num_threads" threads (including the caller's).
+// Returns the number of files successfully probed (a failed file's sample_rate is
+// zero). If the library was built without threads (or they can't be started) the
+// files are just probed one at a time.
+
+int WavpackProbeBatch (const char **filenames, int count, WavpackProbeInfo *info, int flags, int num_threads)
+{
+    WorkerJob *jobs = NULL;
+    void *workers = NULL;
+    ProbeBatch batch;
+    int probed = 0, i;
+
+    CLEAR (batch);
+    batch.filenames = filenames;
+    batch.info = info;
+    batch.count = count;
+    batch.flags = flags;
+
+    if (num_threads > count)
+        num_threads = count;
+
+    // the calling thread probes files too (rather than just waiting for the workers),
+    // so we start (and submit jobs for) one less worker thread than requested
+
+#ifdef ENABLE_THREADS
+    if (num_threads > 1 && (jobs = (WorkerJob *)wp_calloc (num_threads - 1, sizeof (WorkerJob))) &&
+        (batch.mutex = workers_mutex_create ()) && !(workers = workers_create (num_threads - 1))) {
+            workers_mutex_destroy (batch.mutex);
+            batch.mutex = NULL;
+    }
+#endif
+
+    if (workers)
+        for (i = 0; i < num_threads - 1; ++i) {
+            jobs [i].function = probe_files;
+            jobs [i].param = &batch;
+            workers_submit (workers, jobs + i);
+        }
+
+    probe_files (&batch);
+
+    if (workers) {
+        for (i = 0; i < num_threads - 1; ++i)
+            workers_wait (workers, jobs + i);
+
+        workers_destroy (workers);
+    }
+
+    workers_mutex_destroy (batch.mutex);
+    wp_free (jobs);
+
+    for (i = 0; i < count; ++i)
+        if (info [i].sample_rate)
+            probed++;
+
+    return probed;
+}
@@ -107,10 +107,10 @@ static int raw_close_stream (void *id)
     if (rcxt) {
         for (i = 0; i < rcxt->num_segments; ++i)
             if (rcxt->segments [i].sptr && rcxt->segments [i].free_required)
-                free (rcxt->segments [i].sptr);
+                wp_free (rcxt->segments [i].sptr);
 
-        if (rcxt->segments) free (rcxt->segments);
-        free (rcxt);
+        if (rcxt->segments) wp_free (rcxt->segments);
+        wp_free (rcxt);
     }
 
     return 0;
@@ -147,11 +147,11 @@ WavpackContext *WavpackOpenRawDecoder (
         unsigned char *ccp = corr_data;
         int msi = 0, csi = 0;
 
-        raw_wv = malloc (sizeof (WavpackRawContext));
+        raw_wv = wp_malloc (sizeof (WavpackRawContext));
         memset (raw_wv, 0, sizeof (WavpackRawContext));
 
         if (corr_data && corr_size) {
-            raw_wvc = malloc (sizeof (WavpackRawContext));
+            raw_wvc = wp_malloc (sizeof (WavpackRawContext));
             memset (raw_wvc, 0, sizeof (WavpackRawContext));
         }
 
@@ -199,7 +199,7 @@ WavpackContext *WavpackOpenRawDecoder (
                 return NULL;
             }
             else {
-                WavpackHeader *wphdr = malloc (sizeof (WavpackHeader));
+                WavpackHeader *wphdr = wp_malloc (sizeof (WavpackHeader));
                 memset (wphdr, 0, sizeof (WavpackHeader));
                 memcpy (wphdr->ckID, "wvpk", 4);
                 wphdr->ckSize = sizeof (WavpackHeader) - 8 + block_size;
@@ -211,7 +211,7 @@ WavpackContext *WavpackOpenRawDecoder (
                 WavpackLittleEndianToNative (wphdr, WavpackHeaderFormat);
 
                 raw_wv->num_segments += 2;
-                raw_wv->segments = realloc (raw_wv->segments, sizeof (RawSegment) * raw_wv->num_segments);
+                raw_wv->segments = wp_realloc (raw_wv->segments, sizeof (RawSegment) * raw_wv->num_segments);
                 raw_wv->segments [msi].dptr = raw_wv->segments [msi].sptr = (unsigned char *) wphdr;
                 raw_wv->segments [msi].eptr = raw_wv->segments [msi].dptr + sizeof (WavpackHeader);
                 raw_wv->segments [msi++].free_required = 1;
@@ -246,7 +246,7 @@ WavpackContext *WavpackOpenRawDecoder (
                     return NULL;
                 }
                 else {
-                    WavpackHeader *wphdr = malloc (sizeof (WavpackHeader));
+                    WavpackHeader *wphdr = wp_malloc (sizeof (WavpackHeader));
                     memset (wphdr, 0, sizeof (WavpackHeader));
                     memcpy (wphdr->ckID, "wvpk", 4);
                     wphdr->ckSize = sizeof (WavpackHeader) - 8 + block_size;
@@ -258,7 +258,7 @@ WavpackContext *WavpackOpenRawDecoder (
                     WavpackLittleEndianToNative (wphdr, WavpackHeaderFormat);
 
                     raw_wvc->num_segments += 2;
-                    raw_wvc->segments = realloc (raw_wvc->segments, sizeof (RawSegment) * raw_wvc->num_segments);
+                    raw_wvc->segments = wp_realloc (raw_wvc->segments, sizeof (RawSegment) * raw_wvc->num_segments);
                     raw_wvc->segments [csi].dptr = raw_wvc->segments [csi].sptr = (unsigned char *) wphdr;
                     raw_wvc->segments [csi].eptr = raw_wvc->segments [csi].dptr + sizeof (WavpackHeader);
                     raw_wvc->segments [csi++].free_required = 1;
@@ -280,20 +280,20 @@ WavpackContext *WavpackOpenRawDecoder (
     }
     else {      // the case of WavPack blocks with headers is much easier...
         if (main_data) {
-            raw_wv = malloc (sizeof (WavpackRawContext));
+            raw_wv = wp_malloc (sizeof (WavpackRawContext));
             memset (raw_wv, 0, sizeof (WavpackRawContext));
             raw_wv->num_segments = 1;
-            raw_wv->segments = malloc (sizeof (RawSegment) * raw_wv->num_segments);
+            raw_wv->segments = wp_malloc (sizeof (RawSegment) * raw_wv->num_segments);
             raw_wv->segments [0].dptr = raw_wv->segments [0].sptr = main_data;
             raw_wv->segments [0].eptr = raw_wv->segments [0].dptr + main_size;
             raw_wv->segments [0].free_required = 0;
         }
 
         if (corr_data && corr_size) {
-            raw_wvc = malloc (sizeof (WavpackRawContext));
+            raw_wvc = wp_malloc (sizeof (WavpackRawContext));
             memset (raw_wvc, 0, sizeof (WavpackRawContext));
             raw_wvc->num_segments = 1;
-            raw_wvc->segments = malloc (sizeof (RawSegment) * raw_wvc->num_segments);
+            raw_wvc->segments = wp_malloc (sizeof (RawSegment) * raw_wvc->num_segments);
             raw_wvc->segments [0].dptr = raw_wvc->segments [0].sptr = corr_data;
             raw_wvc->segments [0].eptr = raw_wvc->segments [0].dptr + corr_size;
             raw_wvc->segments [0].free_required = 0;
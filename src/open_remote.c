@@ -0,0 +1,369 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** WAVPACK ****                            //
+//                  Hybrid Lossless Wavefile Compressor                   //
+//              Copyright (c) 1998 - 2024 David Bryant.                   //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// open_remote.c
+
+// This module provides WavpackOpenFileInputRemote(), which opens files that are
+// accessed with range requests (e.g., HTTP or object storage), where each access
+// is a round trip and costs the same whether it's a few bytes or a few hundred
+// kilobytes. The library normally reads files with many small reads (headers,
+// then blocks a few KB at a time, and the end of the file and the tags on open),
+// so this reader turns them into requests for whole aligned "pages" that are kept
+// in a small LRU cache. A read that needs several missing pages gets them with one
+// request, and when the requests move forward through the file (like decoding or
+// the scan of the end of the file on open) each one asks for twice as many pages
+// as the last one (up to half the cache), so that streaming a file takes very few
+// requests and seeking doesn't fetch much that isn't used.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "wavpack_local.h"
+
+#define REMOTE_PAGE_ALIGNMENT   4096
+#define REMOTE_DEFAULT_PAGE     (64 * 1024)
+#define REMOTE_MAX_PAGE         (16 * 1024 * 1024)
+#define REMOTE_DEFAULT_PAGES    16
+#define REMOTE_MAX_PAGES        1024
+#define REMOTE_MAX_REQUEST      (64 * 1024 * 1024)
+
+typedef struct {
+    unsigned char *data;
+    int64_t page;                   // page number in the file, or -1 if unused
+    int32_t bytes;                  // only less than the page size at the end of the file
+    uint32_t last_used;
+} RemotePage;
+
+typedef struct {
+    WavpackRemoteReader *reader;
+    void *id;
+    RemotePage *pages;
+    unsigned char *staging;         // one request's worth of pages, before they're cached
+    int num_pages, max_run, run;    // size of cache, largest request, and last request (in pages)
+    int32_t page_size;
+    uint32_t clock;
+    int64_t position, length, next_page, requests, bytes_fetched;
+} RemoteFile;
+
+static RemotePage *find_page (RemoteFile *file, int64_t page)
+{
+    int i;
+
+    for (i = 0; i < file->num_pages; ++i)
+        if (file->pages [i].page == page) {
+            file->pages [i].last_used = ++file->clock;
+            return file->pages + i;
+        }
+
+    return NULL;
+}
+
+static RemotePage *oldest_page (RemoteFile *file)
+{
+    RemotePage *oldest = file->pages;
+    int i;
+
+    for (i = 1; i < file->num_pages; ++i)
+        if (file->pages [i].page == -1 || file->pages [i].last_used < oldest->last_used) {
+            oldest = file->pages + i;
+
+            if (oldest->page == -1)
+                break;
+        }
+
+    return oldest;
+}
+
+// Fetch the specified page with one request, along with as many following pages as
+// the request size calls for (stopping at the end of the file or at a page that's
+// already cached), and return it (or NULL if the request fails). Requests that are
+// not too far ahead of the last one are considered to be moving forward through the
+// file, and are doubled in size (the region between them is skipped, so this also
+// works for reading just the headers of blocks that are smaller than the pages).
+
+static RemotePage *fetch_pages (RemoteFile *file, int64_t first_page, int64_t last_page)
+{
+    int64_t total_pages = (file->length + file->page_size - 1) / file->page_size, position;
+    int count = (int) (last_page - first_page + 1), i;
+    int32_t bytes, request;
+
+    if (file->run && first_page >= file->next_page && first_page < file->next_page + file->max_run) {
+        if ((file->run *= 2) > file->max_run)
+            file->run = file->max_run;
+    }
+    else
+        file->run = 1;
+
+    if (count < file->run)
+        count = file->run;
+    else if (count > file->max_run)
+        count = file->max_run;
+
+    if (count > total_pages - first_page)
+        count = (int) (total_pages - first_page);
+
+    for (i = 1; i < count; ++i)
+        if (find_page (file, first_page + i)) {
+            count = i;
+            break;
+        }
+
+    position = first_page * file->page_size;
+    request = (int32_t) ((file->length - position < (int64_t) count * file->page_size) ?
+        file->length - position : (int64_t) count * file->page_size);
+
+    file->requests++;
+    bytes = file->reader->read_range (file->id, position, file->staging, request);
+
+    if (bytes <= 0)
+        return NULL;
+
+    file->bytes_fetched += bytes;
+    file->next_page = first_page + count;
+
+    // the first page goes in last so that it's the most recently used one (and is returned)
+
+    for (i = count; i--;)
+        if (bytes > i * file->page_size) {
+            RemotePage *page = oldest_page (file);
+
+            page->page = first_page + i;
+            page->bytes = bytes - i * file->page_size;
+
+            if (page->bytes > file->page_size)
+                page->bytes = file->page_size;
+
+            memcpy (page->data, file->staging + i * file->page_size, page->bytes);
+            page->last_used = ++file->clock;
+
+            if (!i)
+                return page;
+        }
+
+    return NULL;
+}
+
+static int32_t remote_read_bytes (void *id, void *data, int32_t bcount)
+{
+    RemoteFile *file = (RemoteFile *) id;
+    int32_t bytes_read = 0;
+
+    while (bytes_read < bcount && file->position < file->length) {
+        int64_t page_number = file->position / file->page_size;
+        RemotePage *page = find_page (file, page_number);
+        int32_t offset, bytes;
+
+        if (!page && !(page = fetch_pages (file, page_number, (file->position + bcount - bytes_read - 1) / file->page_size)))
+            break;
+
+        offset = (int32_t) (file->position - page_number * file->page_size);
+
+        if (offset >= page->bytes)
+            break;
+
+        bytes = page->bytes - offset;
+
+        if (bytes > bcount - bytes_read)
+            bytes = bcount - bytes_read;
+
+        memcpy ((unsigned char *) data + bytes_read, page->data + offset, bytes);
+        file->position += bytes;
+        bytes_read += bytes;
+    }
+
+    return bytes_read;
+}
+
+static int64_t remote_get_pos (void *id)
+{
+    return ((RemoteFile *) id)->position;
+}
+
+static int remote_set_pos_abs (void *id, int64_t pos)
+{
+    if (pos < 0)
+        return -1;
+
+    ((RemoteFile *) id)->position = pos;
+    return 0;
+}
+
+static int remote_set_pos_rel (void *id, int64_t delta, int mode)
+{
+    RemoteFile *file = (RemoteFile *) id;
+
+    if (mode == SEEK_SET)
+        return remote_set_pos_abs (id, delta);
+    else if (mode == SEEK_CUR)
+        return remote_set_pos_abs (id, file->position + delta);
+    else if (mode == SEEK_END)
+        return remote_set_pos_abs (id, file->length + delta);
+    else
+        return -1;
+}
+
+// the byte pushed back is always the one just read, so we just back up
+
+static int remote_push_back_byte (void *id, int c)
+{
+    RemoteFile *file = (RemoteFile *) id;
+
+    if (file->position <= 0)
+        return EOF;
+
+    file->position--;
+    return c;
+}
+
+static int64_t remote_get_length (void *id)
+{
+    return ((RemoteFile *) id)->length;
+}
+
+static int remote_can_seek (void *id)
+{
+    return 1;
+}
+
+static void free_remote_file (RemoteFile *file)
+{
+    int i;
+
+    if (file->pages) {
+        for (i = 0; i < file->num_pages; ++i)
+            wp_free (file->pages [i].data);
+
+        wp_free (file->pages);
+    }
+
+    wp_free (file->staging);
+    wp_free (file);
+}
+
+static int remote_close (void *id)
+{
+    RemoteFile *file = (RemoteFile *) id;
+    int result = 0;
+
+    if (file->reader->close)
+        result = file->reader->close (file->id);
+
+    free_remote_file (file);
+    return result;
+}
+
+static WavpackStreamReader64 remote_reader = {
+    remote_read_bytes, NULL, remote_get_pos, remote_set_pos_abs, remote_set_pos_rel,
+    remote_push_back_byte, remote_get_length, remote_can_seek, NULL, remote_close
+};
+
+static RemoteFile *open_remote_file (WavpackRemoteReader *reader, void *id, int num_pages, int32_t page_size)
+{
+    RemoteFile *file = (RemoteFile *)wp_calloc (1, sizeof (RemoteFile));
+    int i;
+
+    if (!file)
+        return NULL;
+
+    file->reader = reader;
+    file->id = id;
+    file->num_pages = num_pages;
+    file->max_run = num_pages / 2;
+
+    if (file->max_run > REMOTE_MAX_REQUEST / page_size)
+        file->max_run = REMOTE_MAX_REQUEST / page_size;
+
+    file->page_size = page_size;
+    file->length = reader->get_length (id);
+
+    if (!(file->pages = (RemotePage *)wp_calloc (num_pages, sizeof (RemotePage))) ||
+        !(file->staging = (unsigned char *)wp_malloc ((size_t) file->max_run * page_size))) {
+            free_remote_file (file);
+            return NULL;
+    }
+
+    for (i = 0; i < num_pages; ++i) {
+        file->pages [i].page = -1;
+
+        if (!(file->pages [i].data = (unsigned char *)wp_malloc (page_size))) {
+            free_remote_file (file);
+            return NULL;
+        }
+    }
+
+    return file;
+}
+
+// This function opens a WavPack file (and optionally its correction file) that is
+// accessed through the application's range reader, and is otherwise identical to
+// WavpackOpenFileInput() (with the same "flags" except that OPEN_WVC is implied by
+// supplying "wvc_id" and OPEN_EDIT_TAGS is not allowed). The files are read in
+// pages of "page_size" bytes (rounded up to 4K, zero for the default of 64K) and
+// "num_pages" of them are cached for each file (minimum 2, zero for the default of
+// 16), and no request is ever for more than half of the cache (or 64 MB). The
+// reader's close function (if any) is called for each file when the context is
+// closed (or if the open fails, except when the memory for the reader can't be
+// allocated).
+
+WavpackContext *WavpackOpenFileInputRemote (WavpackRemoteReader *reader, void *wv_id, void *wvc_id,
+    char *error, int flags, int norm_offset, int num_pages, int32_t page_size)
+{
+    RemoteFile *wv_file, *wvc_file = NULL;
+
+    if (flags & OPEN_EDIT_TAGS) {
+        if (error) strcpy (error, "can't edit tags of remote files!");
+        return NULL;
+    }
+
+    if (num_pages <= 0)
+        num_pages = REMOTE_DEFAULT_PAGES;
+    else if (num_pages < 2)
+        num_pages = 2;
+    else if (num_pages > REMOTE_MAX_PAGES)
+        num_pages = REMOTE_MAX_PAGES;
+
+    if (page_size <= 0)
+        page_size = REMOTE_DEFAULT_PAGE;
+    else if (page_size > REMOTE_MAX_PAGE)
+        page_size = REMOTE_MAX_PAGE;
+    else
+        page_size = (page_size + REMOTE_PAGE_ALIGNMENT - 1) & ~(REMOTE_PAGE_ALIGNMENT - 1);
+
+    if (!(wv_file = open_remote_file (reader, wv_id, num_pages, page_size)) ||
+        (wvc_id && !(wvc_file = open_remote_file (reader, wvc_id, num_pages, page_size)))) {
+            if (error) strcpy (error, "can't allocate memory");
+            if (wv_file) free_remote_file (wv_file);
+            return NULL;
+    }
+
+    return WavpackOpenFileInputEx64 (&remote_reader, wv_file, wvc_file, error, wvc_file ? flags | OPEN_WVC : flags, norm_offset);
+}
+
+// Return the number of range requests issued (and the number of bytes they returned)
+// for the files of a context opened with WavpackOpenFileInputRemote(), including
+// those made while opening. Returns FALSE (and zeros) for any other context.
+
+int WavpackGetRemoteStats (WavpackContext *wpc, int64_t *requests, int64_t *bytes)
+{
+    RemoteFile *wv_file, *wvc_file;
+
+    if (requests) *requests = 0;
+    if (bytes) *bytes = 0;
+
+    if (!wpc || wpc->reader != &remote_reader)
+        return FALSE;
+
+    wv_file = (RemoteFile *) wpc->wv_in;
+    wvc_file = (RemoteFile *) wpc->wvc_in;
+
+    if (requests) *requests = wv_file->requests + (wvc_file ? wvc_file->requests : 0);
+    if (bytes) *bytes = wv_file->bytes_fetched + (wvc_file ? wvc_file->bytes_fetched : 0);
+
+    return TRUE;
+}
@@ -33,11 +33,12 @@ static int seek_eof_information (WavpackContext *wpc, int64_t *final_index, int
 
 WavpackContext *WavpackOpenFileInputEx64 (WavpackStreamReader64 *reader, void *wv_id, void *wvc_id, char *error, int flags, int norm_offset)
 {
-    WavpackContext *wpc = (WavpackContext *)malloc (sizeof (WavpackContext));
+    WavpackContext *wpc = (WavpackContext *)wp_malloc (sizeof (WavpackContext));
     WavpackStream *wps;
     int num_blocks = 0;
     unsigned char first_byte;
     uint32_t bcount;
+    int result;
 
     if (!wpc) {
         if (error) strcpy (error, "can't allocate memory");
@@ -83,13 +84,13 @@ WavpackContext *WavpackOpenFileInputEx64 (WavpackStreamReader64 *reader, void *w
 #endif
     }
 
-    wpc->streams = (WavpackStream **)(malloc ((wpc->num_streams = 1) * sizeof (wpc->streams [0])));
+    wpc->streams = (WavpackStream **)(wp_malloc ((wpc->num_streams = 1) * sizeof (wpc->streams [0])));
     if (!wpc->streams) {
         if (error) strcpy (error, "can't allocate memory");
         return WavpackCloseFile (wpc);
     }
 
-    wpc->streams [0] = wps = (WavpackStream *)malloc (sizeof (WavpackStream));
+    wpc->streams [0] = wps = (WavpackStream *)wp_malloc (sizeof (WavpackStream));
     if (!wps) {
         if (error) strcpy (error, "can't allocate memory");
         return WavpackCloseFile (wpc);
@@ -108,22 +109,17 @@ WavpackContext *WavpackOpenFileInputEx64 (WavpackStreamReader64 *reader, void *w
         }
 
         wpc->filepos += bcount;
-        wps->blockbuff = (unsigned char *)malloc (wps->wphdr.ckSize + 8);
-        if (!wps->blockbuff) {
-            if (error) strcpy (error, "can't allocate memory");
-            return WavpackCloseFile (wpc);
-        }
-        memcpy (wps->blockbuff, &wps->wphdr, 32);
+        result = read_block_buffer (wpc, wpc->wv_in, &wps->wphdr, &wps->blockbuff);
 
-        if (wpc->reader->read_bytes (wpc->wv_in, wps->blockbuff + 32, wps->wphdr.ckSize - 24) != wps->wphdr.ckSize - 24) {
-            if (error) strcpy (error, "can't read all of WavPack file!");
+        if (result) {
+            if (error) strcpy (error, result == 1 ? "can't allocate memory" : "can't read all of WavPack file!");
             return WavpackCloseFile (wpc);
         }
 
         // if block does not verify, flag error, free buffer, and continue
         if (!WavpackVerifySingleBlock (wps->blockbuff, !(flags & OPEN_NO_CHECKSUM))) {
             wps->wphdr.block_samples = 0;
-            free (wps->blockbuff);
+            release_block_buffer (wpc, wps->blockbuff);
             wps->blockbuff = NULL;
             wpc->crc_errors++;
             continue;
@@ -178,7 +174,7 @@ WavpackContext *WavpackOpenFileInputEx64 (WavpackStreamReader64 *reader, void *w
         }
 
         if (!wps->wphdr.block_samples) {    // free blockbuff if we're going to loop again
-            free (wps->blockbuff);
+            release_block_buffer (wpc, wps->blockbuff);
             wps->blockbuff = NULL;
         }
 
@@ -233,6 +229,22 @@ WavpackContext *WavpackOpenFileInputEx64 (WavpackStreamReader64 *reader, void *w
             wpc->config.sample_rate = sample_rates [(wps->wphdr.flags & SRATE_MASK) >> SRATE_LSB];
     }
 
+#ifndef NO_SEEKING
+    if (flags & OPEN_SEEK_INDEX)
+        WavpackBuildSeekIndex (wpc);
+
+    // range reads are quietly unavailable if their (small) shared state can't be created
+
+    if (!(flags & OPEN_STREAMING) && wpc->reader->can_seek (wpc->wv_in))
+        init_range_readers (wpc);
+#endif
+
+    // if worker threads were requested, start them now for read-ahead decoding (if they
+    // can't be started we quietly use the regular decoder)
+
+    if ((flags & OPEN_THREADS_MASK) && !wpc->reduced_channels)
+        wpc->workers = workers_create ((flags & OPEN_THREADS_MASK) >> OPEN_THREADS_SHFT);
+
     return wpc;
 }
 
@@ -355,6 +367,17 @@ int unpack_init (WavpackContext *wpc)
     if (wps->wphdr.block_samples)
         wps->sample_index = GET_BLOCK_INDEX (wps->wphdr);
 
+#ifndef NO_SEEKING
+    // every initial block we see is added to the seek index, until it reaches a size that
+    // limits its memory use on long files with small blocks (this is always called on the
+    // application's thread with the file position(s) of the block's header still current)
+
+    if (!wpc->current_stream && wps->wphdr.block_samples && (wps->wphdr.flags & INITIAL_BLOCK) &&
+        !(wpc->open_flags & OPEN_STREAMING) && wpc->seek_index_count < MAX_DECODE_INDEX_ENTRIES)
+            seek_index_add (wpc, GET_BLOCK_INDEX (wps->wphdr), wps->wphdr.block_samples,
+                wpc->filepos, wps->block2buff ? wpc->file2pos : -1);
+#endif
+
     return TRUE;
 }
 
@@ -518,7 +541,7 @@ static int read_channel_identities (WavpackContext *wpc, WavpackMetadata *wpmd)
             return FALSE;
 
     if (!wpc->channel_identities) {
-        wpc->channel_identities = (unsigned char *)malloc (wpmd->byte_length + 1);
+        wpc->channel_identities = (unsigned char *)wp_malloc (wpmd->byte_length + 1);
         memcpy (wpc->channel_identities, wpmd->data, wpmd->byte_length);
         wpc->channel_identities [wpmd->byte_length] = 0;
     }
@@ -569,7 +592,7 @@ static int read_new_config_info (WavpackContext *wpc, WavpackMetadata *wpmd)
     wpc->file_format = wpc->config.qmode = wpc->channel_layout = 0;
 
     if (wpc->channel_reordering) {
-        free (wpc->channel_reordering);
+        wp_free (wpc->channel_reordering);
         wpc->channel_reordering = NULL;
     }
 
@@ -600,7 +623,7 @@ static int read_new_config_info (WavpackContext *wpc, WavpackMetadata *wpmd)
                     if (bytecnt > nchans)
                         return FALSE;
 
-                    wpc->channel_reordering = (unsigned char *)malloc (nchans);
+                    wpc->channel_reordering = (unsigned char *)wp_malloc (nchans);
 
                     // note that redundant reordering info is not stored, so we fill in the rest
 
@@ -657,7 +680,7 @@ static int read_sample_rate (WavpackContext *wpc, WavpackMetadata *wpmd)
 static int read_wrapper_data (WavpackContext *wpc, WavpackMetadata *wpmd)
 {
     if ((wpc->open_flags & OPEN_WRAPPER) && wpc->wrapper_bytes < MAX_WRAPPER_BYTES && wpmd->byte_length) {
-        wpc->wrapper_data = (unsigned char *)realloc (wpc->wrapper_data, wpc->wrapper_bytes + wpmd->byte_length);
+        wpc->wrapper_data = (unsigned char *)wp_realloc (wpc->wrapper_data, wpc->wrapper_bytes + wpmd->byte_length);
 	if (!wpc->wrapper_data)
 	    return FALSE;
         memcpy (wpc->wrapper_data + wpc->wrapper_bytes, wpmd->data, wpmd->byte_length);
@@ -814,6 +837,79 @@ static int process_metadata (WavpackContext *wpc, WavpackMetadata *wpmd)
     }
 }
 
+// Scan the metadata of the specified (complete) block for just the items that
+// describe the file rather than the audio, storing them in the context exactly
+// as process_metadata() does when a file is opened. This is used to get file
+// information without opening the file (see WavpackProbe()), so the context has
+// no streams. If "md5_only" is set, only an MD5 sum is read (for trailing blocks).
+// Returns FALSE if a configuration item is invalid.
+
+int read_file_metadata (WavpackContext *wpc, unsigned char *blockbuff, int md5_only)
+{
+    unsigned char *blockptr = blockbuff + sizeof (WavpackHeader);
+    WavpackMetadata wpmd;
+
+    while (read_metadata_buff (&wpmd, blockbuff, &blockptr)) {
+        if (md5_only && wpmd.id != ID_MD5_CHECKSUM && wpmd.id != ID_ALT_MD5_CHECKSUM)
+            continue;
+
+        switch (wpmd.id) {
+            case ID_CHANNEL_INFO:
+                if (!read_channel_info (wpc, &wpmd))
+                    return FALSE;
+
+                break;
+
+            case ID_CONFIG_BLOCK:
+                read_config_info (wpc, &wpmd);
+                break;
+
+            case ID_NEW_CONFIG_BLOCK:
+                if (!read_new_config_info (wpc, &wpmd))
+                    return FALSE;
+
+                break;
+
+            case ID_SAMPLE_RATE:
+                read_sample_rate (wpc, &wpmd);
+                break;
+
+            case ID_DSD_BLOCK:      // just the rate multiplier, see init_dsd_block()
+                if (wpmd.byte_length >= 2 && *(unsigned char *) wpmd.data <= 31)
+                    wpc->dsd_multiplier = 1U << *(unsigned char *) wpmd.data;
+
+                break;
+
+            case ID_ALT_MD5_CHECKSUM:
+                if (!(wpc->open_flags & OPEN_ALT_TYPES))
+                    break;
+
+            case ID_MD5_CHECKSUM:
+                if (wpmd.byte_length == 16) {
+                    memcpy (wpc->config.md5_checksum, wpmd.data, 16);
+                    wpc->config.flags |= CONFIG_MD5_CHECKSUM;
+                    wpc->config.md5_read = 1;
+                }
+
+                break;
+
+            case ID_ALT_EXTENSION:
+                if (wpmd.byte_length && wpmd.byte_length < sizeof (wpc->file_extension)) {
+                    memcpy (wpc->file_extension, wpmd.data, wpmd.byte_length);
+                    wpc->file_extension [wpmd.byte_length] = 0;
+                }
+
+                break;
+
+            case ID_BLOCK_CHECKSUM:
+                wpc->version_five = 1;
+                break;
+        }
+    }
+
+    return TRUE;
+}
+
 //////////////////////////////// bitstream management ///////////////////////////////
 
 // Open the specified BitStream and associate with the specified buffer.
@@ -846,10 +942,9 @@ uint32_t bs_close_read (Bitstream *bs)
 {
     uint32_t bytes_read;
 
-    if (bs->bc < sizeof (*(bs->ptr)) * 8)
-        bs->ptr++;
+    // any whole words still sitting in the shift register were read ahead and not consumed
 
-    bytes_read = (uint32_t)(bs->ptr - bs->buf) * sizeof (*(bs->ptr));
+    bytes_read = (uint32_t)(bs->ptr + 1 - bs->buf - bs->bc / (sizeof (*(bs->ptr)) * 8)) * sizeof (*(bs->ptr));
 
     if (!(bytes_read & 1))
         ++bytes_read;
@@ -1009,24 +1104,22 @@ int read_wvc_block (WavpackContext *wpc)
         compare_result = match_wvc_header (&wps->wphdr, &wphdr);
 
         if (!compare_result) {
-            wps->block2buff = (unsigned char *)malloc (wphdr.ckSize + 8);
-	    if (!wps->block2buff)
-	        return FALSE;
-
-            if (wpc->reader->read_bytes (wpc->wvc_in, wps->block2buff + 32, wphdr.ckSize - 24) !=
-                wphdr.ckSize - 24) {
-                    free (wps->block2buff);
-                    wps->block2buff = NULL;
-                    wps->wvc_skip = TRUE;
-                    wpc->crc_errors++;
-                    return FALSE;
-            }
+            int result = read_block_buffer (wpc, wpc->wvc_in, &orig_wphdr, &wps->block2buff);
 
-            memcpy (wps->block2buff, &orig_wphdr, 32);
+            if (result == 1)
+                return FALSE;
+
+            if (result == 2) {
+                release_block_buffer (wpc, wps->block2buff);
+                wps->block2buff = NULL;
+                wps->wvc_skip = TRUE;
+                wpc->crc_errors++;
+                return FALSE;
+            }
 
             // don't use corrupt blocks
             if (!WavpackVerifySingleBlock (wps->block2buff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
-                free (wps->block2buff);
+                release_block_buffer (wpc, wps->block2buff);
                 wps->block2buff = NULL;
                 wps->wvc_skip = TRUE;
                 wpc->crc_errors++;
@@ -1034,7 +1127,7 @@ int read_wvc_block (WavpackContext *wpc)
             }
 
             wps->wvc_skip = FALSE;
-            memcpy (wps->block2buff, &wphdr, 32);
+            store_block_header (wpc, &wps->block2buff, &wphdr);
             memcpy (&wps->wphdr, &wphdr, 32);
             return TRUE;
         }
@@ -1173,7 +1266,7 @@ static int seek_eof_information (WavpackContext *wpc, int64_t *final_index, int
             meta_id &= ID_UNIQUE;
 
             if (get_wrapper && (meta_id == ID_RIFF_TRAILER || (alt_types && meta_id == ID_ALT_TRAILER)) && meta_bc) {
-                wpc->wrapper_data = (unsigned char *)realloc (wpc->wrapper_data, wpc->wrapper_bytes + meta_bc);
+                wpc->wrapper_data = (unsigned char *)wp_realloc (wpc->wrapper_data, wpc->wrapper_bytes + meta_bc);
 
                 if (!wpc->wrapper_data) {
                     reader->set_pos_abs (id, restore_pos);
@@ -1207,6 +1300,123 @@ static int seek_eof_information (WavpackContext *wpc, int64_t *final_index, int
     }
 }
 
+#ifndef NO_SEEKING
+
+// Add the entries of a seek table stored by the encoder (see WavpackStoreSeekTable()) to
+// the seek index. The table is ignored if it does not make sense for this file (the
+// positions are verified again when they are used). Correction file positions are only
+// used if a correction file was opened.
+
+static void load_seek_table (WavpackContext *wpc, unsigned char *table, uint32_t bcount)
+{
+    int64_t file2len = wpc->wvc_in ? wpc->reader->get_length (wpc->wvc_in) : 0, next_index = 0;
+    uint32_t count = bcount / SEEK_INDEX_ENTRY_BYTES, i;
+    SeekIndexEntry *entries;
+
+    if (!count || bcount % SEEK_INDEX_ENTRY_BYTES ||
+        !(entries = (SeekIndexEntry *)wp_malloc (count * sizeof (SeekIndexEntry))))
+            return;
+
+    for (i = 0; i < count; ++i) {
+        SeekIndexEntry *entry = entries + i;
+
+        memcpy (entry, table + i * SEEK_INDEX_ENTRY_BYTES, SEEK_INDEX_ENTRY_BYTES);
+        WavpackLittleEndianToNative (entry, SeekIndexEntryFormat);
+        entry->block_index -= wpc->initial_index;
+
+        if (!entry->block_samples || entry->block_index < next_index ||
+            entry->block_index + entry->block_samples > wpc->total_samples ||
+            entry->filepos < 0 || entry->filepos > wpc->filelen - (int64_t) sizeof (WavpackHeader))
+                break;
+
+        if (entry->file2pos < 0 || entry->file2pos > file2len - (int64_t) sizeof (WavpackHeader))
+            entry->file2pos = -1;
+
+        next_index = entry->block_index + entry->block_samples;
+    }
+
+    if (i == count)
+        for (i = 0; i < count; ++i)
+            seek_index_add (wpc, entries [i].block_index, entries [i].block_samples, entries [i].filepos, entries [i].file2pos);
+
+    wp_free (entries);
+}
+
+// If the file has a seek table (which will be in one of the last blocks), read it into
+// the seek index. This is only attempted once, and only when a seek needs a block that's
+// not already indexed. To minimize the number of accesses (which may be expensive for
+// remote files) we read the end of the file with a single call and look for the table
+// there, rather than walking the blocks like seek_eof_information() does.
+
+#define SEEK_TABLE_SEARCH_BYTES 1048576
+
+void read_seek_table (WavpackContext *wpc)
+{
+    WavpackStreamReader64 *reader = wpc->reader;
+    unsigned char *buffer, *bp, *ep;
+    int64_t restore_pos, tail_bytes;
+
+    if (wpc->seek_table_read || !(wpc->config.flags & CONFIG_SEEK_TABLE) || wpc->stream3 ||
+        wpc->total_samples == -1 || (wpc->open_flags & OPEN_STREAMING) || !reader->can_seek (wpc->wv_in))
+            return;
+
+    wpc->seek_table_read = TRUE;
+    tail_bytes = wpc->filelen < SEEK_TABLE_SEARCH_BYTES ? wpc->filelen : SEEK_TABLE_SEARCH_BYTES;
+
+    if (tail_bytes < (int64_t) sizeof (WavpackHeader) || !(buffer = (unsigned char *)wp_malloc ((size_t) tail_bytes)))
+        return;
+
+    restore_pos = reader->get_pos (wpc->wv_in);
+
+    if (reader->set_pos_abs (wpc->wv_in, wpc->filelen - tail_bytes) ||
+        reader->read_bytes (wpc->wv_in, buffer, (int32_t) tail_bytes) != tail_bytes) {
+            reader->set_pos_abs (wpc->wv_in, restore_pos);
+            wp_free (buffer);
+            return;
+    }
+
+    reader->set_pos_abs (wpc->wv_in, restore_pos);
+    ep = buffer + tail_bytes;
+
+    // look for complete non-audio blocks that verify and contain a seek table (the blocks
+    // are copied so that they're aligned and their headers can be made native-endian)
+
+    for (bp = buffer; ep - bp >= (int) sizeof (WavpackHeader); bp++) {
+        unsigned char *blockbuff, *blockptr;
+        WavpackHeader wphdr;
+        WavpackMetadata wpmd;
+
+        if (*bp != 'w' || memcmp (bp, "wvpk", 4))
+            continue;
+
+        memcpy (&wphdr, bp, sizeof (WavpackHeader));
+        WavpackLittleEndianToNative (&wphdr, WavpackHeaderFormat);
+
+        if (wphdr.block_samples || (wphdr.ckSize & 1) || wphdr.ckSize < 24 || wphdr.ckSize + 8 > ep - bp ||
+            !(blockbuff = (unsigned char *)wp_malloc (wphdr.ckSize + 8)))
+                continue;
+
+        memcpy (blockbuff, bp, wphdr.ckSize + 8);
+        memcpy (blockbuff, &wphdr, sizeof (WavpackHeader));
+
+        if (WavpackVerifySingleBlock (blockbuff, TRUE)) {
+            blockptr = blockbuff + sizeof (WavpackHeader);
+
+            while (read_metadata_buff (&wpmd, blockbuff, &blockptr))
+                if (wpmd.id == ID_SEEK_TABLE && wpmd.data)
+                    load_seek_table (wpc, (unsigned char *) wpmd.data, wpmd.byte_length);
+
+            bp += wphdr.ckSize + 7;     // continue after this block
+        }
+
+        wp_free (blockbuff);
+    }
+
+    wp_free (buffer);
+}
+
+#endif
+
 // Quickly verify the referenced block. It is assumed that the WavPack header has been converted
 // to native endian format. If a block checksum is performed, that is done in little-endian
 // (file) format. It is also assumed that the caller has made sure that the block length
@@ -65,7 +65,7 @@ void pack_init (WavpackContext *wpc)
     }
 
     if (wpc->config.flags & CONFIG_DYNAMIC_SHAPING)
-        wps->dc.shaping_data = malloc (wpc->max_samples * sizeof (*wps->dc.shaping_data));
+        wps->dc.shaping_data = wp_malloc (wpc->max_samples * sizeof (*wps->dc.shaping_data));
 
     if (!wpc->config.xmode)
         wps->num_passes = 0;
@@ -106,7 +106,7 @@ static void write_decorr_terms (WavpackStream *wps, WavpackMetadata *wpmd)
     struct decorr_pass *dpp;
     char *byteptr;
 
-    byteptr = wpmd->data = malloc (tcount + 1);
+    byteptr = wpmd->data = wp_malloc (tcount + 1);
     wpmd->id = ID_DECORR_TERMS;
 
     for (dpp = wps->decorr_passes; tcount--; ++dpp)
@@ -126,7 +126,7 @@ static void write_decorr_weights (WavpackStream *wps, WavpackMetadata *wpmd)
     int tcount = wps->num_terms, i;
     char *byteptr;
 
-    byteptr = wpmd->data = malloc ((tcount * 2) + 1);
+    byteptr = wpmd->data = wp_malloc ((tcount * 2) + 1);
     wpmd->id = ID_DECORR_WEIGHTS;
 
     for (i = wps->num_terms - 1; i >= 0; --i)
@@ -167,7 +167,7 @@ static void write_decorr_samples (WavpackStream *wps, WavpackMetadata *wpmd)
     struct decorr_pass *dpp;
     unsigned char *byteptr;
 
-    byteptr = wpmd->data = malloc (256);
+    byteptr = wpmd->data = wp_malloc (256);
     wpmd->id = ID_DECORR_SAMPLES;
 
     for (dpp = wps->decorr_passes; tcount--; ++dpp)
@@ -236,7 +236,7 @@ static void write_shaping_info (WavpackStream *wps, WavpackMetadata *wpmd)
     char *byteptr;
     int temp;
 
-    byteptr = wpmd->data = malloc (12);
+    byteptr = wpmd->data = wp_malloc (12);
     wpmd->id = ID_SHAPING_WEIGHTS;
 
     wps->dc.error [0] = wp_exp2s (temp = wp_log2s (wps->dc.error [0]));
@@ -279,7 +279,7 @@ static void write_int32_info (WavpackStream *wps, WavpackMetadata *wpmd)
 {
     char *byteptr;
 
-    byteptr = wpmd->data = malloc (4);
+    byteptr = wpmd->data = wp_malloc (4);
     wpmd->id = ID_INT32_INFO;
     *byteptr++ = wps->int32_sent_bits;
     *byteptr++ = wps->int32_zeros;
@@ -292,7 +292,7 @@ static void write_float_info (WavpackStream *wps, WavpackMetadata *wpmd)
 {
     char *byteptr;
 
-    byteptr = wpmd->data = malloc (4);
+    byteptr = wpmd->data = wp_malloc (4);
     wpmd->id = ID_FLOAT_INFO;
     *byteptr++ = wps->float_flags;
     *byteptr++ = wps->float_shift;
@@ -309,7 +309,7 @@ static void write_float_info (WavpackStream *wps, WavpackMetadata *wpmd)
 static void write_channel_info (WavpackContext *wpc, WavpackMetadata *wpmd)
 {
     uint32_t mask = wpc->config.channel_mask;
-    char *byteptr = wpmd->data = malloc (8);
+    char *byteptr = wpmd->data = wp_malloc (8);
 
     wpmd->id = ID_CHANNEL_INFO;
 
@@ -345,7 +345,7 @@ static void write_channel_info (WavpackContext *wpc, WavpackMetadata *wpmd)
 static void write_channel_identities_info (WavpackContext *wpc, WavpackMetadata *wpmd)
 {
     wpmd->byte_length = (int) strlen ((char *) wpc->channel_identities);
-    wpmd->data = strdup ((char *) wpc->channel_identities);
+    wpmd->data = wp_strdup ((char *) wpc->channel_identities);
     wpmd->id = ID_CHANNEL_IDENTITIES;
 }
 
@@ -359,7 +359,7 @@ static void write_config_info (WavpackContext *wpc, WavpackMetadata *wpmd)
 {
     char *byteptr;
 
-    byteptr = wpmd->data = malloc (8);
+    byteptr = wpmd->data = wp_malloc (8);
     wpmd->id = ID_CONFIG_BLOCK;
     *byteptr++ = (char) (wpc->config.flags >> 8);
     *byteptr++ = (char) (wpc->config.flags >> 16);
@@ -383,7 +383,7 @@ static void write_config_info (WavpackContext *wpc, WavpackMetadata *wpmd)
 
 static void write_new_config_info (WavpackContext *wpc, WavpackMetadata *wpmd)
 {
-    char *byteptr = wpmd->data = malloc (260);
+    char *byteptr = wpmd->data = wp_malloc (260);
 
     wpmd->id = ID_NEW_CONFIG_BLOCK;
 
@@ -429,7 +429,7 @@ static void write_sample_rate (WavpackContext *wpc, WavpackMetadata *wpmd)
 {
     char *byteptr;
 
-    byteptr = wpmd->data = malloc (4);
+    byteptr = wpmd->data = wp_malloc (4);
     wpmd->id = ID_SAMPLE_RATE;
     *byteptr++ = (char) (wpc->config.sample_rate);
     *byteptr++ = (char) (wpc->config.sample_rate >> 8);
@@ -569,20 +569,20 @@ int pack_block (WavpackContext *wpc, int32_t *buffer)
         // if lossless we have to copy the data to use later...
 
         if ((!(flags & HYBRID_FLAG) || wpc->wvc_flag) && !(wpc->config.flags & CONFIG_SKIP_WVX)) {
-            orig_data = malloc (sizeof (f32) * ((flags & MONO_DATA) ? sample_count : sample_count * 2));
+            orig_data = wp_malloc (sizeof (f32) * ((flags & MONO_DATA) ? sample_count : sample_count * 2));
             memcpy (orig_data, buffer, sizeof (f32) * ((flags & MONO_DATA) ? sample_count : sample_count * 2));
 
             if (flags & FLOAT_DATA) {                                       // if lossless float data come here
                 wps->float_norm_exp = wpc->config.float_norm_exp;
 
                 if (!scan_float_data (wps, (f32 *) buffer, (flags & MONO_DATA) ? sample_count : sample_count * 2)) {
-                    free (orig_data);
+                    wp_free (orig_data);
                     orig_data = NULL;
                 }
             }
             else {                                                          // otherwise lossless > 24-bit integers
                 if (!scan_int32_data (wps, buffer, (flags & MONO_DATA) ? sample_count : sample_count * 2)) {
-                    free (orig_data);
+                    wp_free (orig_data);
                     orig_data = NULL;
                 }
             }
@@ -639,7 +639,7 @@ int pack_block (WavpackContext *wpc, int32_t *buffer)
         wps->wphdr.flags = sflags;
 
         if (orig_data)
-            free (orig_data);
+            wp_free (orig_data);
 
         return FALSE;
     }
@@ -677,7 +677,7 @@ int pack_block (WavpackContext *wpc, int32_t *buffer)
             send_int32_data (wps, orig_data, (flags & MONO_DATA) ? sample_count : sample_count * 2);
 
         data_count = bs_close_write (&wps->wvxbits);
-        free (orig_data);
+        wp_free (orig_data);
 
         if (data_count) {
             if (data_count != (uint32_t) -1) {
@@ -1045,7 +1045,7 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
             wpc->metacount--;
         }
 
-        free (wpc->metadata);
+        wp_free (wpc->metadata);
         wpc->metadata = NULL;
     }
 
@@ -1058,7 +1058,7 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
     saved_stream = *wps;
 
     if (repack_possible && !(flags & HYBRID_FLAG)) {
-        saved_buffer = malloc (sample_count * sizeof (int32_t) * (flags & MONO_DATA ? 1 : 2));
+        saved_buffer = wp_malloc (sample_count * sizeof (int32_t) * (flags & MONO_DATA ? 1 : 2));
         memcpy (saved_buffer, buffer, sample_count * sizeof (int32_t) * (flags & MONO_DATA ? 1 : 2));
     }
 
@@ -1460,7 +1460,7 @@ static int pack_samples (WavpackContext *wpc, int32_t *buffer)
             }
 
             if (saved_buffer)
-                free (saved_buffer);
+                wp_free (saved_buffer);
 
             break;
         }
@@ -1667,7 +1667,10 @@ uint32_t decorr_mono_buffer (int32_t *buffer, struct decorr_pass *decorr_passes,
 
 double WavpackGetEncodedNoise (WavpackContext *wpc, double *peak)
 {
-    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    WavpackStream *wps;
+
+    pack_finish_pending (wpc);
+    wps = wpc->streams [wpc->current_stream];
 
     if (peak)
         *peak = wps->dc.noise_max;
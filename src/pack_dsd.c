@@ -96,7 +96,7 @@ int pack_dsd_block (WavpackContext *wpc, int32_t *buffer)
             wpc->metacount--;
         }
 
-        free (wpc->metadata);
+        wp_free (wpc->metadata);
         wpc->metadata = NULL;
     }
 
@@ -320,10 +320,10 @@ static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samp
         history_bits = MAX_HISTORY_BITS;
 
     history_bins = 1 << history_bits;
-    histogram = malloc (sizeof (*histogram) * history_bins);
+    histogram = wp_malloc (sizeof (*histogram) * history_bins);
     memset (histogram, 0, sizeof (*histogram) * history_bins);
-    probabilities = malloc (sizeof (*probabilities) * history_bins);
-    summed_probabilities = malloc (sizeof (*summed_probabilities) * history_bins);
+    probabilities = wp_malloc (sizeof (*probabilities) * history_bins);
+    summed_probabilities = wp_malloc (sizeof (*summed_probabilities) * history_bins);
 
     bc = num_samples;
 
@@ -372,7 +372,7 @@ static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samp
         //     p0, max_sum, summed_probabilities [p0] [255], total_summed_probabilities);
     }
 
-    free (histogram);
+    wp_free (histogram);
     bp = buffer;
     bc = num_samples;
     *dp++ = 1;
@@ -432,8 +432,8 @@ static int encode_buffer_fast (WavpackStream *wps, int32_t *buffer, int num_samp
         low <<= 8;
     }
 
-    free (summed_probabilities);
-    free (probabilities);
+    wp_free (summed_probabilities);
+    wp_free (probabilities);
 
     if (dp < ep)
         return (int)(dp - destination);
@@ -519,7 +519,7 @@ static int encode_buffer_high (WavpackStream *wps, int32_t *buffer, int num_samp
 
     if (!wps->sample_index) {
         if (!wps->dsd.ptable)
-            wps->dsd.ptable = malloc (PTABLE_BINS * sizeof (*wps->dsd.ptable));
+            wps->dsd.ptable = wp_malloc (PTABLE_BINS * sizeof (*wps->dsd.ptable));
 
         init_ptable (wps->dsd.ptable, INITIAL_TERM, RATE_S);
 
@@ -32,7 +32,7 @@
 
 WavpackContext *WavpackOpenFileOutput (WavpackBlockOutput blockout, void *wv_id, void *wvc_id)
 {
-    WavpackContext *wpc = malloc (sizeof (WavpackContext));
+    WavpackContext *wpc = wp_malloc (sizeof (WavpackContext));
 
     if (!wpc)
         return NULL;
@@ -98,6 +98,7 @@ void WavpackSetFileInformation (WavpackContext *wpc, char *file_extension, unsig
 // o CONFIG_EXTRA_MODE          extra processing mode (slow!)
 // o CONFIG_SKIP_WVX            no wvx stream for floats & large ints
 // o CONFIG_MD5_CHECKSUM        specify if you plan to store MD5 signature
+// o CONFIG_SEEK_TABLE          specify if you plan to store a seek table
 // o CONFIG_CREATE_EXE          specify if you plan to prepend sfx module
 // o CONFIG_OPTIMIZE_MONO       detect and optimize for mono files posing as
 //                               stereo (uses a more recent stream format that
@@ -108,6 +109,14 @@ void WavpackSetFileInformation (WavpackContext *wpc, char *file_extension, unsig
 // config->block_samples        force samples per WavPack block (0 = use deflt)
 // config->float_norm_exp       select floating-point data (127 for +/-1.0)
 // config->xmode                extra mode processing value override
+// config->worker_threads       number of worker threads (0 = none, max = 15); each
+//                               block is encoded in the background while the next
+//                               one is collected, and the streams of multichannel
+//                               blocks (and the "extra" mode searches) are done in
+//                               parallel (output is identical); only one block is
+//                               ever being encoded, so more threads than streams
+//                               only help in "extra" mode (this field is at the
+//                               end of WavpackConfig, so clear the whole thing)
 
 // If the number of samples to be written is known then it should be passed
 // here. If the duration is not known then pass -1. In the case that the size
@@ -235,7 +244,7 @@ int WavpackSetConfiguration64 (WavpackContext *wpc, WavpackConfig *config, int64
         }
 
         // with DSD, very few PCM options work (or make sense), so only allow those that do
-        config->flags &= (CONFIG_HIGH_FLAG | CONFIG_MD5_CHECKSUM | CONFIG_PAIR_UNDEF_CHANS);
+        config->flags &= (CONFIG_HIGH_FLAG | CONFIG_MD5_CHECKSUM | CONFIG_PAIR_UNDEF_CHANS | CONFIG_SEEK_TABLE);
         config->float_norm_exp = config->xmode = 0;
 #else
         strcpy (wpc->error_message, "libwavpack not configured for DSD!");
@@ -252,6 +261,8 @@ int WavpackSetConfiguration64 (WavpackContext *wpc, WavpackConfig *config, int64
     wpc->config.bits_per_sample = config->bits_per_sample;
     wpc->config.bytes_per_sample = config->bytes_per_sample;
     wpc->config.block_samples = config->block_samples;
+    wpc->config.worker_threads = config->worker_threads < 0 ? 0 :
+        (config->worker_threads > MAX_WORKER_THREADS ? MAX_WORKER_THREADS : config->worker_threads);
     wpc->config.flags = config->flags;
     wpc->config.qmode = config->qmode;
 
@@ -350,7 +361,7 @@ int WavpackSetConfiguration64 (WavpackContext *wpc, WavpackConfig *config, int64
 
         for (i = 0; chan_ids [i]; i++)
             if (chan_ids [i] != 0xff) {
-                wpc->channel_identities = (unsigned char *) strdup ((char *) chan_ids);
+                wpc->channel_identities = (unsigned char *) wp_strdup ((char *) chan_ids);
                 break;
             }
     }
@@ -360,12 +371,12 @@ int WavpackSetConfiguration64 (WavpackContext *wpc, WavpackConfig *config, int64
     // channels will go in each stream.
 
     for (wpc->current_stream = 0; num_chans; wpc->current_stream++) {
-        WavpackStream *wps = malloc (sizeof (WavpackStream));
+        WavpackStream *wps = wp_malloc (sizeof (WavpackStream));
         unsigned char left_chan_id = 0, right_chan_id = 0;
         int pos, chans = 1;
 
         // allocate the stream and initialize the pointer to it
-        wpc->streams = realloc (wpc->streams, (wpc->current_stream + 1) * sizeof (wpc->streams [0]));
+        wpc->streams = wp_realloc (wpc->streams, (wpc->current_stream + 1) * sizeof (wpc->streams [0]));
         wpc->streams [wpc->current_stream] = wps;
         CLEAR (*wps);
 
@@ -481,7 +492,7 @@ int WavpackSetChannelLayout (WavpackContext *wpc, uint32_t layout_tag, const uns
     wpc->channel_layout = layout_tag;
 
     if (wpc->channel_reordering) {
-        free (wpc->channel_reordering);
+        wp_free (wpc->channel_reordering);
         wpc->channel_reordering = NULL;
     }
 
@@ -492,7 +503,7 @@ int WavpackSetChannelLayout (WavpackContext *wpc, uint32_t layout_tag, const uns
             if (reorder [i] < min_index)
                 min_index = reorder [i];
 
-        wpc->channel_reordering = malloc (nchans);
+        wpc->channel_reordering = wp_malloc (nchans);
 
         if (wpc->channel_reordering)
             for (i = 0; i < nchans; ++i)
@@ -502,6 +513,28 @@ int WavpackSetChannelLayout (WavpackContext *wpc, uint32_t layout_tag, const uns
     return TRUE;
 }
 
+// If worker threads have been requested, the encoder runs "pipelined". Because every block's
+// encoding depends on the state left by the previous block (decorrelation weights and history,
+// entropy medians, noise shaping, extra mode search results) the blocks themselves cannot be
+// encoded in parallel without changing the output. Instead, each block is encoded on a worker
+// thread while the caller continues to send samples for the next block, which are accumulated
+// into the second half of the (doubled) sample buffers. The worker operates on copies of the
+// context and the streams, so the caller never touches anything the worker is using, and the
+// copies are moved back (and the completed blocks are written, in order, on the caller's thread)
+// when the next block is ready to go. The resulting files are identical to single-threaded ones.
+
+typedef struct {
+    WorkerJob job;
+    WavpackContext cxt;
+    WavpackStream *streams, **stream_ptrs;
+    unsigned char *outbuff, *out2buff;
+    void *workers;
+    uint32_t buffer_size, max_blocksize, block_samples;
+    int pending, result;
+} PackPipeline;
+
+static PackPipeline *create_pack_pipeline (WavpackContext *wpc);
+
 // Prepare to actually pack samples by determining the size of the WavPack
 // blocks and allocating sample buffers and initializing each stream. Call
 // after WavpackSetConfiguration() and before WavpackPackSamples(). A return
@@ -560,10 +593,25 @@ int WavpackPackInit (WavpackContext *wpc)
     wpc->ave_block_samples = wpc->block_samples;
     wpc->max_samples = wpc->block_samples + (wpc->block_samples >> 1);
 
+    // if worker threads were requested (and can be started) we use the pipelined encoder,
+    // which never has more than one block being encoded (because each block depends on
+    // the state left by the previous one), but the streams of that block are encoded in
+    // parallel, so there's no point in starting more threads than there are streams
+    // (unless we're in "extra" mode, where the decorrelation searches are parallel too)
+
+    if (wpc->config.worker_threads && !wpc->workers)
+        wpc->workers = workers_create ((wpc->config.worker_threads < wpc->num_streams || (wpc->config.flags & CONFIG_EXTRA_MODE)) ?
+            wpc->config.worker_threads : wpc->num_streams);
+
+    if (wpc->workers && !(wpc->pack_pipeline = create_pack_pipeline (wpc))) {
+        strcpy (wpc->error_message, "can't allocate memory for worker threads!");
+        return FALSE;
+    }
+
     for (wpc->current_stream = 0; wpc->current_stream < wpc->num_streams; wpc->current_stream++) {
         WavpackStream *wps = wpc->streams [wpc->current_stream];
 
-        wps->sample_buffer = malloc (wpc->max_samples * (wps->wphdr.flags & MONO_FLAG ? 4 : 8));
+        wps->sample_buffer = wp_malloc (wpc->max_samples * (wps->wphdr.flags & MONO_FLAG ? 4 : 8) * (wpc->pack_pipeline ? 2 : 1));
 
 #ifdef ENABLE_DSD
         if (wps->wphdr.flags & DSD_FLAG)
@@ -587,16 +635,69 @@ int WavpackPackInit (WavpackContext *wpc)
 // WavPack blocks are send to the function provided in the initial call to
 // WavpackOpenFileOutput(). A return of FALSE indicates an error.
 
+#define SOURCE_INT32    0       // interleaved longs (the original WavpackPackSamples() format)
+#define SOURCE_INT16    1       // interleaved 16-bit integers
+#define SOURCE_INT24    2       // interleaved packed 24-bit little-endian integers
+#define SOURCE_FLOAT32  3       // interleaved 32-bit floats
+#define SOURCE_PLANAR   4       // array of pointers to each channel's longs
+
+static int pack_samples (WavpackContext *wpc, const void *source, int format, uint32_t sample_count);
+static void load_stream_channel (WavpackContext *wpc, int32_t *dptr, int dstride,
+    const void *source, int format, int chan, uint32_t index, uint32_t count);
 static int pack_streams (WavpackContext *wpc, uint32_t block_samples);
+static int pack_streams_submit (WavpackContext *wpc, uint32_t block_samples);
 static int create_riff_header (WavpackContext *wpc, int64_t total_samples, void *outbuffer);
 
 int WavpackPackSamples (WavpackContext *wpc, int32_t *sample_buffer, uint32_t sample_count)
 {
-    int nch = wpc->config.num_channels;
+    return pack_samples (wpc, sample_buffer, SOURCE_INT32, sample_count);
+}
+
+// These are alternatives to WavpackPackSamples() for applications that have their audio in another
+// format, which is converted here as it's copied into the streams' buffers (rather than requiring
+// the application to expand it into longs first). The formats are interleaved 16-bit integers
+// (native endian), packed 24-bit little-endian integers (3 bytes each), 32-bit floats, and planar
+// longs with a separate pointer for each channel. The integer formats are shifted to match the
+// configured bytes_per_sample (or scaled to +/-1.0 for floating point configurations). Floats are
+// stored directly for floating point configurations, otherwise they are assumed to be +/-1.0 and
+// are scaled, rounded and clipped to the configured integer size. Planar longs are handled exactly
+// like WavpackPackSamples() handles interleaved ones. None of the converted formats apply to DSD
+// audio.
+
+int WavpackPackSamplesInt16 (WavpackContext *wpc, const int16_t *sample_buffer, uint32_t sample_count)
+{
+    return pack_samples (wpc, sample_buffer, SOURCE_INT16, sample_count);
+}
+
+int WavpackPackSamplesInt24 (WavpackContext *wpc, const unsigned char *sample_buffer, uint32_t sample_count)
+{
+    return pack_samples (wpc, sample_buffer, SOURCE_INT24, sample_count);
+}
+
+int WavpackPackSamplesFloat32 (WavpackContext *wpc, const float *sample_buffer, uint32_t sample_count)
+{
+    return pack_samples (wpc, sample_buffer, SOURCE_FLOAT32, sample_count);
+}
+
+int WavpackPackSamplesPlanar (WavpackContext *wpc, int32_t **channels, uint32_t sample_count)
+{
+    return pack_samples (wpc, channels, SOURCE_PLANAR, sample_count);
+}
+
+static int pack_samples (WavpackContext *wpc, const void *source, int format, uint32_t sample_count)
+{
+    PackPipeline *pp = wpc->pack_pipeline;
+    uint32_t max_acc_samples = pp ? wpc->max_samples * 2 : wpc->max_samples;
+    uint32_t source_index = 0;
+
+    if (format != SOURCE_INT32 && format != SOURCE_PLANAR && (wpc->config.qmode & QMODE_DSD_AUDIO)) {
+        strcpy (wpc->error_message, "can't convert samples for DSD audio!");
+        return FALSE;
+    }
 
     while (sample_count) {
-        int32_t *source_pointer = sample_buffer;
         unsigned int samples_to_copy;
+        int chan = 0;
 
         if (!wpc->riff_header_added && !wpc->riff_header_created && !wpc->file_format) {
             char riff_header [128];
@@ -605,111 +706,140 @@ int WavpackPackSamples (WavpackContext *wpc, int32_t *sample_buffer, uint32_t sa
                 return FALSE;
         }
 
-        if (wpc->acc_samples + sample_count > wpc->max_samples)
-            samples_to_copy = wpc->max_samples - wpc->acc_samples;
+        if (wpc->acc_samples + sample_count > max_acc_samples)
+            samples_to_copy = max_acc_samples - wpc->acc_samples;
         else
             samples_to_copy = sample_count;
 
         for (wpc->current_stream = 0; wpc->current_stream < wpc->num_streams; wpc->current_stream++) {
             WavpackStream *wps = wpc->streams [wpc->current_stream];
-            int32_t *dptr, *sptr, cnt;
-
-            dptr = wps->sample_buffer + wpc->acc_samples * (wps->wphdr.flags & MONO_FLAG ? 1 : 2);
-            sptr = source_pointer;
-            cnt = samples_to_copy;
-
-            // This code used to just copy the 32-bit samples regardless of the actual size with the
-            // assumption that the caller had properly sign-extended the values (if they were smaller
-            // than 32 bits). However, several people have discovered that if the data isn't properly
-            // sign extended then ugly things happen (e.g. CRC errors that show up only on decode).
-            // To prevent this, we now explicitly sign-extend samples smaller than 32-bit when we
-            // copy, and the performance hit from doing this is very small (generally < 1%).
-
-            if (wps->wphdr.flags & MONO_FLAG) {
-                switch (wpc->config.bytes_per_sample) {
-                    case 1:
-                        while (cnt--) {
-                            *dptr++ = (signed char) *sptr;
-                            sptr += nch;
-                        }
 
-                        break;
+            if (wps->wphdr.flags & MONO_FLAG)
+                load_stream_channel (wpc, wps->sample_buffer + wpc->acc_samples, 1,
+                    source, format, chan++, source_index, samples_to_copy);
+            else {
+                int32_t *dptr = wps->sample_buffer + wpc->acc_samples * 2;
 
-                    case 2:
-                        while (cnt--) {
-                            *dptr++ = (int16_t) *sptr;
-                            sptr += nch;
-                        }
+                load_stream_channel (wpc, dptr, 2, source, format, chan++, source_index, samples_to_copy);
+                load_stream_channel (wpc, dptr + 1, 2, source, format, chan++, source_index, samples_to_copy);
+            }
+        }
 
-                        break;
+        source_index += samples_to_copy;
+        sample_count -= samples_to_copy;
 
-                    case 3:
-                        while (cnt--) {
-                            *dptr++ = (int32_t)((uint32_t)*sptr << 8) >> 8;
-                            sptr += nch;
-                        }
+        wpc->acc_samples += samples_to_copy;
 
-                        break;
+        // in pipelined mode, we only have to wait for the previous block when our buffers are
+        // full, and then we immediately start the next one (see comments at PackPipeline)
 
-                    default:
-                        while (cnt--) {
-                            *dptr++ = *sptr;
-                            sptr += nch;
-                        }
-                }
+        if (pp) {
+            if (wpc->acc_samples == max_acc_samples && !pack_finish_pending (wpc))
+                return FALSE;
 
-                source_pointer++;
-            }
-            else {
-                switch (wpc->config.bytes_per_sample) {
-                    case 1:
-                        while (cnt--) {
-                            *dptr++ = (signed char) sptr [0];
-                            *dptr++ = (signed char) sptr [1];
-                            sptr += nch;
-                        }
+            if (wpc->acc_samples >= wpc->max_samples && !pp->pending &&
+                !pack_streams_submit (wpc, wpc->block_samples))
+                    return FALSE;
+        }
+        else if (wpc->acc_samples == wpc->max_samples && !pack_streams (wpc, wpc->block_samples))
+            return FALSE;
+    }
 
-                        break;
+    return TRUE;
+}
 
-                    case 2:
-                        while (cnt--) {
-                            *dptr++ = (int16_t) sptr [0];
-                            *dptr++ = (int16_t) sptr [1];
-                            sptr += nch;
-                        }
+// Copy the specified channel of the source samples (starting at sample "index") into a stream's
+// sample buffer (with a stride of 1 for mono streams or 2 for stereo), converting to longs of the
+// configured size. Integer data is always sign-extended from the configured size; this used to
+// be left to the caller, but several people discovered that if the data isn't properly sign
+// extended then ugly things happen (e.g. CRC errors that show up only on decode). The loops are
+// kept simple enough for the compiler to vectorize.
 
-                        break;
+static void load_stream_channel (WavpackContext *wpc, int32_t *dptr, int dstride,
+    const void *source, int format, int chan, uint32_t index, uint32_t count)
+{
+    int nch = wpc->config.num_channels, bits = wpc->config.bytes_per_sample * 8;
+    int shift = 32 - bits;
+    uint32_t i;
 
-                    case 3:
-                        while (cnt--) {
-                            *dptr++ = (int32_t)((uint32_t)sptr [0] << 8) >> 8;
-                            *dptr++ = (int32_t)((uint32_t)sptr [1] << 8) >> 8;
-                            sptr += nch;
-                        }
+    switch (format) {
+        case SOURCE_INT32: {
+            const int32_t *sptr = (const int32_t *) source + (size_t) index * nch + chan;
 
-                        break;
+            for (i = 0; i < count; ++i)
+                dptr [i * dstride] = (int32_t)((uint32_t) sptr [(size_t) i * nch] << shift) >> shift;
 
-                    default:
-                        while (cnt--) {
-                            *dptr++ = sptr [0];
-                            *dptr++ = sptr [1];
-                            sptr += nch;
-                        }
+            break;
+        }
+
+        case SOURCE_PLANAR: {
+            const int32_t *sptr = ((int32_t * const *) source) [chan] + index;
+
+            for (i = 0; i < count; ++i)
+                dptr [i * dstride] = (int32_t)((uint32_t) sptr [i] << shift) >> shift;
+
+            break;
+        }
+
+        case SOURCE_INT16: {
+            const int16_t *sptr = (const int16_t *) source + (size_t) index * nch + chan;
+
+            if (wpc->config.flags & CONFIG_FLOAT_DATA)
+                for (i = 0; i < count; ++i) {
+                    float value = sptr [(size_t) i * nch] * (1.0f / 32768.0f);
+                    memcpy (dptr + i * dstride, &value, sizeof (float));
                 }
+            else if (bits >= 16)
+                for (i = 0; i < count; ++i)
+                    dptr [i * dstride] = (int32_t)((uint32_t) sptr [(size_t) i * nch] << (bits - 16));
+            else
+                for (i = 0; i < count; ++i)
+                    dptr [i * dstride] = sptr [(size_t) i * nch] >> (16 - bits);
+
+            break;
+        }
+
+        case SOURCE_INT24: {
+            const unsigned char *sptr = (const unsigned char *) source + ((size_t) index * nch + chan) * 3;
+
+            for (i = 0; i < count; ++i, sptr += nch * 3) {
+                int32_t value = (int32_t)((uint32_t) sptr [0] << 8 | (uint32_t) sptr [1] << 16 | (uint32_t) sptr [2] << 24);
 
-                source_pointer += 2;
+                if (wpc->config.flags & CONFIG_FLOAT_DATA) {
+                    float fvalue = (value >> 8) * (1.0f / 8388608.0f);
+                    memcpy (dptr + i * dstride, &fvalue, sizeof (float));
+                }
+                else
+                    dptr [i * dstride] = bits >= 24 ? (int32_t)((uint32_t)(value >> 8) << (bits - 24)) : value >> (32 - bits);
             }
+
+            break;
         }
 
-        sample_buffer += samples_to_copy * nch;
-        sample_count -= samples_to_copy;
+        case SOURCE_FLOAT32: {
+            const float *sptr = (const float *) source + (size_t) index * nch + chan;
 
-        if ((wpc->acc_samples += samples_to_copy) == wpc->max_samples &&
-            !pack_streams (wpc, wpc->block_samples))
-                return FALSE;
-    }
+            if (wpc->config.flags & CONFIG_FLOAT_DATA)
+                for (i = 0; i < count; ++i)
+                    memcpy (dptr + i * dstride, sptr + (size_t) i * nch, sizeof (float));
+            else {
+                float scale = (float)(1U << (bits - 1)), max_value = (float)((1U << (bits - 1)) - 1);
 
-    return TRUE;
+                for (i = 0; i < count; ++i) {
+                    float value = sptr [(size_t) i * nch] * scale;
+
+                    if (value >= max_value)
+                        dptr [i * dstride] = (int32_t)((1U << (bits - 1)) - 1);
+                    else if (value <= -scale)
+                        dptr [i * dstride] = (int32_t)(0U - (1U << (bits - 1)));
+                    else
+                        dptr [i * dstride] = (int32_t)(value < 0.0f ? value - 0.5f : value + 0.5f);
+                }
+            }
+
+            break;
+        }
+    }
 }
 
 // Flush all accumulated samples into WavPack blocks. This is normally called
@@ -721,10 +851,15 @@ int WavpackPackSamples (WavpackContext *wpc, int32_t *sample_buffer, uint32_t sa
 
 int WavpackFlushSamples (WavpackContext *wpc)
 {
+    if (!pack_finish_pending (wpc))
+        return FALSE;
+
     while (wpc->acc_samples) {
         uint32_t block_samples;
 
-        if (wpc->acc_samples > wpc->block_samples)
+        if (wpc->acc_samples >= wpc->max_samples)   // only possible when pipelined
+            block_samples = wpc->block_samples;
+        else if (wpc->acc_samples > wpc->block_samples)
             block_samples = wpc->acc_samples / 2;
         else
             block_samples = wpc->acc_samples;
@@ -759,9 +894,14 @@ int WavpackFlushSamples (WavpackContext *wpc)
 
 int WavpackAddWrapper (WavpackContext *wpc, void *data, uint32_t bcount)
 {
-    int64_t index = WavpackGetSampleIndex64 (wpc);
+    int64_t index;
     unsigned char meta_id;
 
+    if (!pack_finish_pending (wpc))
+        return FALSE;
+
+    index = WavpackGetSampleIndex64 (wpc);
+
     if (!index || index == -1) {
         wpc->riff_header_added = TRUE;
         meta_id = wpc->file_format ? ID_ALT_HEADER : ID_RIFF_HEADER;
@@ -785,6 +925,50 @@ int WavpackStoreMD5Sum (WavpackContext *wpc, unsigned char data [16])
     return add_to_metadata (wpc, data, 16, (wpc->config.qmode & 0xff) ? ID_ALT_MD5_CHECKSUM : ID_MD5_CHECKSUM);
 }
 
+// Store a table of the file positions of the blocks written so far, so that decoders can seek
+// directly to any block (without having to search for it). This requires that CONFIG_SEEK_TABLE
+// was specified (so that the block positions were recorded) and should be called after all the
+// audio samples have been flushed. The table goes into the final metadata block, and records
+// every block (or every nth block for very long files) assuming that the blocks are written
+// contiguously from the start of the file. A return of FALSE indicates an error.
+
+int WavpackStoreSeekTable (WavpackContext *wpc)
+{
+    int32_t stride, count, index;
+    unsigned char *table, *tp;
+    int result;
+
+    if (!(wpc->config.flags & CONFIG_SEEK_TABLE) || !pack_finish_pending (wpc))
+        return FALSE;
+
+    if (!wpc->seek_index_count)
+        return TRUE;
+
+    stride = (wpc->seek_index_count + MAX_SEEK_TABLE_ENTRIES - 1) / MAX_SEEK_TABLE_ENTRIES;
+    count = (wpc->seek_index_count + stride - 1) / stride;
+
+    if (!(tp = table = wp_malloc (count * SEEK_INDEX_ENTRY_BYTES)))
+        return FALSE;
+
+    for (index = 0; index < wpc->seek_index_count; index += stride) {
+        SeekIndexEntry entry = wpc->seek_index [index];
+
+        WavpackNativeToLittleEndian (&entry, SeekIndexEntryFormat);
+        memcpy (tp, &entry, SEEK_INDEX_ENTRY_BYTES);
+        tp += SEEK_INDEX_ENTRY_BYTES;
+    }
+
+    // make sure the table is not split between two metadata blocks
+
+    if (wpc->metabytes + count * SEEK_INDEX_ENTRY_BYTES > 1000000 && !write_metadata_block (wpc))
+        result = FALSE;
+    else
+        result = add_to_metadata (wpc, table, count * SEEK_INDEX_ENTRY_BYTES, ID_SEEK_TABLE);
+
+    wp_free (table);
+    return result;
+}
+
 #pragma pack(push,4)
 
 typedef struct {
@@ -927,11 +1111,13 @@ static int create_riff_header (WavpackContext *wpc, int64_t total_samples, void
 
 static int block_add_checksum (unsigned char *buffer_start, unsigned char *buffer_end, int bytes);
 
-static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
+// Calculate the size of the output buffer required for each stream to encode a block of the specified
+// number of samples. This includes room for all the pending metadata, which goes in the first block.
+
+static uint32_t block_buffer_size (WavpackContext *wpc, uint32_t block_samples)
 {
-    uint32_t max_blocksize, max_chans = 1, bcount;
-    unsigned char *outbuff, *outend, *out2buff, *out2end;
-    int result = TRUE, i;
+    uint32_t max_blocksize, max_chans = 1;
+    int i;
 
     // for calculating output (block) buffer size, first see if any streams are stereo
 
@@ -955,53 +1141,191 @@ static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
     max_blocksize += wpc->metabytes + 1024;     // finally, add metadata & another 1K margin
     max_blocksize += max_blocksize & 1;         // and make sure it's even so we detect overflow
 
-    out2buff = (wpc->wvc_flag) ? malloc (max_blocksize) : NULL;
-    out2end = out2buff + max_blocksize;
-    outbuff = malloc (max_blocksize);
-    outend = outbuff + max_blocksize;
-
-    for (wpc->current_stream = 0; wpc->current_stream < wpc->num_streams; wpc->current_stream++) {
-        WavpackStream *wps = wpc->streams [wpc->current_stream];
-        uint32_t flags = wps->wphdr.flags;
+    return max_blocksize;
+}
 
-        flags &= ~MAG_MASK;
-        flags += (1U << MAG_LSB) * ((flags & BYTES_STORED) * 8 + 7);
+// Encode one block from the context's current stream into the specified buffers (which hold
+// "max_blocksize" bytes for each stream). Note that the first stream may decide to encode fewer
+// samples than requested (see pack_block()), in which case the stream's block_samples is changed.
 
-        SET_BLOCK_INDEX (wps->wphdr, wps->sample_index);
-        wps->wphdr.block_samples = block_samples;
-        wps->wphdr.flags = flags;
-        wps->block2buff = out2buff;
-        wps->block2end = out2end;
-        wps->blockbuff = outbuff;
-        wps->blockend = outend;
+static int pack_stream_encode (WavpackContext *wpc, uint32_t block_samples, unsigned char *outbuff, unsigned char *out2buff, uint32_t max_blocksize)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream];
+    unsigned char *blockbuff = outbuff + (size_t) max_blocksize * wpc->current_stream;
+    unsigned char *block2buff = out2buff ? out2buff + (size_t) max_blocksize * wpc->current_stream : NULL;
+    uint32_t flags = wps->wphdr.flags;
+    int result;
+
+    flags &= ~MAG_MASK;
+    flags += (1U << MAG_LSB) * ((flags & BYTES_STORED) * 8 + 7);
+
+    SET_BLOCK_INDEX (wps->wphdr, wps->sample_index);
+    wps->wphdr.block_samples = block_samples;
+    wps->wphdr.flags = flags;
+    wps->block2buff = block2buff;
+    wps->block2end = block2buff + max_blocksize;
+    wps->blockbuff = blockbuff;
+    wps->blockend = blockbuff + max_blocksize;
 
 #ifdef ENABLE_DSD
-        if (flags & DSD_FLAG)
-            result = pack_dsd_block (wpc, wps->sample_buffer);
-        else
+    if (flags & DSD_FLAG)
+        result = pack_dsd_block (wpc, wps->sample_buffer);
+    else
 #endif
-            result = pack_block (wpc, wps->sample_buffer);
+        result = pack_block (wpc, wps->sample_buffer);
 
-        if (result) {
-            result = block_add_checksum (outbuff, outend, (flags & HYBRID_FLAG) ? 2 : 4);
+    if (result) {
+        result = block_add_checksum (blockbuff, blockbuff + max_blocksize, (flags & HYBRID_FLAG) ? 2 : 4);
+
+        if (result && block2buff)
+            result = block_add_checksum (block2buff, block2buff + max_blocksize, 2);
+    }
 
-            if (result && out2buff)
-                result = block_add_checksum (out2buff, out2end, 2);
+    wps->blockbuff = wps->block2buff = NULL;
+
+    if (!result)
+        strcpy (wpc->error_message, "output buffer overflowed!");
+
+    return result;
+}
+
+// Encoding one stream of a multichannel block on a worker thread. The context is a copy of
+// the original with "current_stream" set and no pending metadata (that goes in the first block).
+
+typedef struct {
+    WorkerJob job;
+    WavpackContext cxt;
+    unsigned char *outbuff, *out2buff;
+    uint32_t block_samples, max_blocksize;
+    int result;
+} StreamJob;
+
+static void pack_stream_job (void *param)
+{
+    StreamJob *sj = param;
+
+    sj->result = pack_stream_encode (&sj->cxt, sj->block_samples, sj->outbuff, sj->out2buff, sj->max_blocksize);
+}
+
+// Encode one block from each stream into the specified buffers (which hold "max_blocksize" bytes
+// for each stream). Note that the first stream may decide to encode fewer samples than requested,
+// in which case all the streams follow and the actual count is returned in "block_samples". This
+// is called either directly or on a worker thread (with a copy of the context). If a pool with
+// more than one worker thread is specified, the streams are encoded in parallel; this gives the
+// identical result because each stream has its own state and output buffer. The only dependency
+// is that the first stream must be completed first if it's able to change the block size.
+
+static int pack_streams_encode (WavpackContext *wpc, void *workers, uint32_t *block_samples, unsigned char *outbuff, unsigned char *out2buff, uint32_t max_blocksize)
+{
+    StreamJob *stream_jobs = NULL;
+    int result = TRUE, si;
+
+    wpc->extra_workers = workers;
+
+    if (wpc->num_streams > 1 && workers_count (workers) > 1)
+        stream_jobs = wp_malloc (wpc->num_streams * sizeof (StreamJob));
+
+    if (stream_jobs) {
+        int first_stream_done = FALSE;
+
+        // this covers the conditions in pack_block() that can shorten the first block
+
+        if ((wpc->config.flags & CONFIG_DYNAMIC_SHAPING) || wpc->block_boundary) {
+            wpc->current_stream = 0;
+            result = pack_stream_encode (wpc, *block_samples, outbuff, out2buff, max_blocksize);
+            *block_samples = wpc->streams [0]->wphdr.block_samples;
+            first_stream_done = TRUE;
         }
 
-        wps->blockbuff = wps->block2buff = NULL;
+        for (si = first_stream_done ? 1 : 0; result && si < wpc->num_streams; ++si) {
+            StreamJob *sj = stream_jobs + si;
 
-        if (wps->wphdr.block_samples != block_samples)
-            block_samples = wps->wphdr.block_samples;
+            sj->cxt = *wpc;
+            sj->cxt.current_stream = si;
 
-        if (!result) {
-            strcpy (wpc->error_message, "output buffer overflowed!");
-            break;
+            if (si) {
+                sj->cxt.metadata = NULL;
+                sj->cxt.metacount = sj->cxt.metabytes = 0;
+            }
+
+            sj->outbuff = outbuff;
+            sj->out2buff = out2buff;
+            sj->block_samples = *block_samples;
+            sj->max_blocksize = max_blocksize;
+            sj->job.function = pack_stream_job;
+            sj->job.param = sj;
+            workers_submit (workers, &sj->job);
+        }
+
+        // the first stream's copy has consumed the metadata, so we wait for all the jobs even
+        // if an error occurs and then report the first error (in stream order) like before
+
+        for (si = first_stream_done ? 1 : 0; result && si < wpc->num_streams; ++si)
+            workers_wait (workers, &stream_jobs [si].job);
+
+        for (si = first_stream_done ? 1 : 0; result && si < wpc->num_streams; ++si) {
+            StreamJob *sj = stream_jobs + si;
+
+            if (!si) {
+                wpc->metadata = sj->cxt.metadata;
+                wpc->metacount = sj->cxt.metacount;
+                wpc->metabytes = sj->cxt.metabytes;
+            }
+
+            if (sj->cxt.lossy_blocks)
+                wpc->lossy_blocks = TRUE;
+
+            if (!sj->result) {
+                strcpy (wpc->error_message, sj->cxt.error_message);
+                result = FALSE;
+            }
         }
 
-        bcount = ((WavpackHeader *) outbuff)->ckSize + 8;
-        WavpackNativeToLittleEndian ((WavpackHeader *) outbuff, WavpackHeaderFormat);
-        result = wpc->blockout (wpc->wv_out, outbuff, bcount);
+        wp_free (stream_jobs);
+        wpc->current_stream = 0;
+        return result;
+    }
+
+    for (wpc->current_stream = 0; wpc->current_stream < wpc->num_streams; wpc->current_stream++) {
+        WavpackStream *wps = wpc->streams [wpc->current_stream];
+
+        result = pack_stream_encode (wpc, *block_samples, outbuff, out2buff, max_blocksize);
+
+        if (wps->wphdr.block_samples != *block_samples)
+            *block_samples = wps->wphdr.block_samples;
+
+        if (!result)
+            break;
+    }
+
+    wpc->current_stream = 0;
+    return result;
+}
+
+// Write the blocks encoded by pack_streams_encode() in stream order, and then remove the samples
+// that were encoded from the sample buffers. This is always done on the caller's thread.
+
+static int pack_streams_output (WavpackContext *wpc, uint32_t block_samples, unsigned char *outbuff, unsigned char *out2buff, uint32_t max_blocksize)
+{
+    int result = TRUE, i;
+    uint32_t bcount;
+
+    for (i = 0; i < wpc->num_streams; i++) {
+        WavpackStream *wps = wpc->streams [i];
+        unsigned char *blockbuff = outbuff + (size_t) max_blocksize * i;
+        int chans = (wps->wphdr.flags & MONO_FLAG) ? 1 : 2;
+
+        bcount = ((WavpackHeader *) blockbuff)->ckSize + 8;
+
+        // when encoding, filepos and file2pos track the position of the next block written
+        // so that we can record where the blocks are for the seek table
+
+        if (!i && (wpc->config.flags & CONFIG_SEEK_TABLE))
+            seek_index_add (wpc, GET_BLOCK_INDEX (* (WavpackHeader *) blockbuff), block_samples,
+                wpc->filepos, out2buff ? wpc->file2pos : -1);
+
+        WavpackNativeToLittleEndian ((WavpackHeader *) blockbuff, WavpackHeaderFormat);
+        result = wpc->blockout (wpc->wv_out, blockbuff, bcount);
 
         if (!result) {
             strcpy (wpc->error_message, "can't write WavPack data, disk probably full!");
@@ -1009,11 +1333,14 @@ static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
         }
 
         wpc->filelen += bcount;
+        wpc->filepos += bcount;
 
         if (out2buff) {
-            bcount = ((WavpackHeader *) out2buff)->ckSize + 8;
-            WavpackNativeToLittleEndian ((WavpackHeader *) out2buff, WavpackHeaderFormat);
-            result = wpc->blockout (wpc->wvc_out, out2buff, bcount);
+            unsigned char *block2buff = out2buff + (size_t) max_blocksize * i;
+
+            bcount = ((WavpackHeader *) block2buff)->ckSize + 8;
+            WavpackNativeToLittleEndian ((WavpackHeader *) block2buff, WavpackHeaderFormat);
+            result = wpc->blockout (wpc->wvc_out, block2buff, bcount);
 
             if (!result) {
                 strcpy (wpc->error_message, "can't write WavPack data, disk probably full!");
@@ -1021,24 +1348,188 @@ static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
             }
 
             wpc->file2len += bcount;
+            wpc->file2pos += bcount;
         }
 
         if (wpc->acc_samples != block_samples)
-            memmove (wps->sample_buffer, wps->sample_buffer + block_samples * (flags & MONO_FLAG ? 1 : 2),
-                (wpc->acc_samples - block_samples) * sizeof (int32_t) * (flags & MONO_FLAG ? 1 : 2));
+            memmove (wps->sample_buffer, wps->sample_buffer + block_samples * chans,
+                (wpc->acc_samples - block_samples) * sizeof (int32_t) * chans);
     }
 
-    wpc->current_stream = 0;
     wpc->ave_block_samples = (wpc->ave_block_samples * 0x7 + block_samples + 0x4) >> 3;
     wpc->acc_samples -= block_samples;
-    free (outbuff);
+
+    return result;
+}
+
+static int pack_streams (WavpackContext *wpc, uint32_t block_samples)
+{
+    uint32_t max_blocksize = block_buffer_size (wpc, block_samples);
+    unsigned char *outbuff, *out2buff;
+    int result;
+
+    out2buff = (wpc->wvc_flag) ? wp_malloc ((size_t) max_blocksize * wpc->num_streams) : NULL;
+    outbuff = wp_malloc ((size_t) max_blocksize * wpc->num_streams);
+
+    result = pack_streams_encode (wpc, wpc->workers, &block_samples, outbuff, out2buff, max_blocksize);
+
+    if (result)
+        result = pack_streams_output (wpc, block_samples, outbuff, out2buff, max_blocksize);
+    else
+        wpc->acc_samples -= block_samples;
+
+    wp_free (outbuff);
 
     if (out2buff)
-        free (out2buff);
+        wp_free (out2buff);
 
     return result;
 }
 
+/////////////////////////////// pipelined encoding ////////////////////////////////
+
+static void pack_block_job (void *param)
+{
+    PackPipeline *pp = param;
+
+    pp->result = pack_streams_encode (&pp->cxt, pp->workers, &pp->block_samples, pp->outbuff, pp->out2buff, pp->max_blocksize);
+}
+
+static PackPipeline *create_pack_pipeline (WavpackContext *wpc)
+{
+    PackPipeline *pp = wp_calloc (1, sizeof (PackPipeline));
+    int i;
+
+    if (!pp)
+        return NULL;
+
+    pp->streams = wp_calloc (wpc->num_streams, sizeof (WavpackStream));
+    pp->stream_ptrs = wp_malloc (wpc->num_streams * sizeof (WavpackStream *));
+
+    if (!pp->streams || !pp->stream_ptrs) {
+        wp_free (pp->streams);
+        wp_free (pp->stream_ptrs);
+        wp_free (pp);
+        return NULL;
+    }
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        pp->stream_ptrs [i] = pp->streams + i;
+
+    pp->job.function = pack_block_job;
+    pp->job.param = pp;
+    return pp;
+}
+
+// Start encoding the next block on a worker thread. The worker gets copies of the context and all the
+// streams; the pending metadata is handed off to the copy so that it goes into this block.
+
+static int pack_streams_submit (WavpackContext *wpc, uint32_t block_samples)
+{
+    PackPipeline *pp = wpc->pack_pipeline;
+    uint32_t max_blocksize = block_buffer_size (wpc, block_samples);
+    size_t buffer_size = (size_t) max_blocksize * wpc->num_streams;
+    int i;
+
+    if (buffer_size > pp->buffer_size) {
+        wp_free (pp->outbuff);
+        wp_free (pp->out2buff);
+        pp->outbuff = wp_malloc (buffer_size);
+        pp->out2buff = (wpc->wvc_flag) ? wp_malloc (buffer_size) : NULL;
+        pp->buffer_size = (uint32_t) buffer_size;
+
+        if (!pp->outbuff || (wpc->wvc_flag && !pp->out2buff)) {
+            strcpy (wpc->error_message, "can't allocate memory for output buffers!");
+            pp->buffer_size = 0;
+            return FALSE;
+        }
+    }
+
+    pp->max_blocksize = max_blocksize;
+    pp->block_samples = block_samples;
+    pp->cxt = *wpc;
+    pp->cxt.streams = pp->stream_ptrs;
+    pp->cxt.workers = pp->cxt.pack_pipeline = pp->cxt.read_ahead = NULL;     // the copy must never wait on itself
+    pp->workers = wpc->workers;                                             // (but its streams may use the pool)
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        pp->streams [i] = *wpc->streams [i];
+
+    wpc->metadata = NULL;
+    wpc->metacount = 0;
+    wpc->metabytes = 0;
+
+    pp->pending = TRUE;
+    workers_submit (wpc->workers, &pp->job);
+    return TRUE;
+}
+
+// Wait for the block being encoded on the worker thread (if any) and move the updated stream state back
+// into the caller's context. Any metadata not consumed (because of an error) is simply discarded.
+
+static void pack_streams_collect (WavpackContext *wpc)
+{
+    PackPipeline *pp = wpc->pack_pipeline;
+    int i;
+
+    workers_wait (wpc->workers, &pp->job);
+    pp->pending = FALSE;
+
+    for (i = 0; i < wpc->num_streams; ++i)
+        *wpc->streams [i] = pp->streams [i];
+
+    if (pp->cxt.lossy_blocks)
+        wpc->lossy_blocks = TRUE;
+
+    if (pp->cxt.metadata) {
+        for (i = 0; i < pp->cxt.metacount; ++i)
+            free_metadata (pp->cxt.metadata + i);
+
+        wp_free (pp->cxt.metadata);
+        pp->cxt.metadata = NULL;
+    }
+}
+
+// Complete any block being encoded in the background and write it out. This must be done before anything
+// that depends on the encoder state or the order of the written blocks. A return of FALSE indicates an
+// error (from either encoding or writing the pending block).
+
+int pack_finish_pending (WavpackContext *wpc)
+{
+    PackPipeline *pp = wpc->pack_pipeline;
+
+    if (!pp || !pp->pending)
+        return TRUE;
+
+    pack_streams_collect (wpc);
+
+    if (!pp->result) {
+        strcpy (wpc->error_message, pp->cxt.error_message);
+        wpc->acc_samples -= pp->block_samples;
+        return FALSE;
+    }
+
+    return pack_streams_output (wpc, pp->block_samples, pp->outbuff, pp->out2buff, pp->max_blocksize);
+}
+
+// Free the pipelined encoding resources. A block still being encoded is waited for, but not written.
+
+void free_pack_pipeline (WavpackContext *wpc)
+{
+    PackPipeline *pp = wpc->pack_pipeline;
+
+    if (pp->pending)
+        pack_streams_collect (wpc);
+
+    wp_free (pp->outbuff);
+    wp_free (pp->out2buff);
+    wp_free (pp->stream_ptrs);
+    wp_free (pp->streams);
+    wp_free (pp);
+
+    wpc->pack_pipeline = NULL;
+}
+
 // Given the pointer to the first block written (to either a .wv or .wvc file),
 // update the block with the actual number of samples written. If the wav
 // header was generated by the library, then it is updated also. This should
@@ -1052,6 +1543,8 @@ void WavpackUpdateNumSamples (WavpackContext *wpc, void *first_block)
 {
     uint32_t wrapper_size;
 
+    pack_finish_pending (wpc);
+
     WavpackLittleEndianToNative (first_block, WavpackHeaderFormat);
     SET_TOTAL_SAMPLES (* (WavpackHeader *) first_block, WavpackGetSampleIndex64 (wpc));
 
@@ -1183,6 +1676,9 @@ static int add_to_metadata (WavpackContext *wpc, void *data, uint32_t bcount, un
     WavpackMetadata *mdp;
     unsigned char *src = data;
 
+    if (!pack_finish_pending (wpc))
+        return FALSE;
+
     while (bcount) {
         if (wpc->metacount) {
             uint32_t bc = bcount;
@@ -1193,7 +1689,7 @@ static int add_to_metadata (WavpackContext *wpc, void *data, uint32_t bcount, un
                 if (wpc->metabytes + bcount > 1000000)
                     bc = 1000000 - wpc->metabytes;
 
-                mdp->data = realloc (mdp->data, mdp->byte_length + bc);
+                mdp->data = wp_realloc (mdp->data, mdp->byte_length + bc);
                 memcpy ((char *) mdp->data + mdp->byte_length, src, bc);
                 mdp->byte_length += bc;
                 wpc->metabytes += bc;
@@ -1206,7 +1702,7 @@ static int add_to_metadata (WavpackContext *wpc, void *data, uint32_t bcount, un
         }
 
         if (bcount) {
-            wpc->metadata = realloc (wpc->metadata, (wpc->metacount + 1) * sizeof (WavpackMetadata));
+            wpc->metadata = wp_realloc (wpc->metadata, (wpc->metacount + 1) * sizeof (WavpackMetadata));
             mdp = wpc->metadata + wpc->metacount++;
             mdp->byte_length = 0;
             mdp->data = NULL;
@@ -1266,7 +1762,7 @@ static int write_metadata_block (WavpackContext *wpc)
         }
 
         // allocate 6 extra bytes for 4-byte checksum (which we add last)
-        wphdr = (WavpackHeader *) (block_buff = malloc (block_size + 6));
+        wphdr = (WavpackHeader *) (block_buff = wp_malloc (block_size + 6));
 
         CLEAR (*wphdr);
         memcpy (wphdr->ckID, "wvpk", 4);
@@ -1286,19 +1782,20 @@ static int write_metadata_block (WavpackContext *wpc)
             wpc->metacount--;
         }
 
-        free (wpc->metadata);
+        wp_free (wpc->metadata);
         wpc->metadata = NULL;
         // add a 4-byte checksum here (increases block size by 6)
         block_add_checksum ((unsigned char *) block_buff, (unsigned char *) block_buff + (block_size += 6), 4);
         WavpackNativeToLittleEndian ((WavpackHeader *) block_buff, WavpackHeaderFormat);
 
         if (!wpc->blockout (wpc->wv_out, block_buff, block_size)) {
-            free (block_buff);
+            wp_free (block_buff);
             strcpy (wpc->error_message, "can't write WavPack data, disk probably full!");
             return FALSE;
         }
 
-        free (block_buff);
+        wpc->filepos += block_size;
+        wp_free (block_buff);
     }
 
     return TRUE;
@@ -1307,7 +1804,7 @@ static int write_metadata_block (WavpackContext *wpc)
 void free_metadata (WavpackMetadata *wpmd)
 {
     if (wpmd->data) {
-        free (wpmd->data);
+        wp_free (wpmd->data);
         wpmd->data = NULL;
     }
 }
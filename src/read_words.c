@@ -55,6 +55,34 @@ static const char ones_count_table [] = {
 ///////////////////////////// executable code ////////////////////////////////
 
 static uint32_t __inline read_code (Bitstream *bs, uint32_t maxcode);
+static int32_t __inline read_value (Bitstream *bs, uint32_t low, uint32_t maxcode);
+
+#ifdef USE_CTZ_OPTIMIZATION
+
+// Count the ones at the bottom of the shift register, which must contain at least LIMIT_ONES + 1
+// bits. The result is limited to LIMIT_ONES + 1 (which indicates the end of the data) so that we
+// never count past the valid bits (and so that the bit scan always has a zero to find).
+
+static uint32_t __inline count_ones (Bitstream *bs)
+{
+#ifdef BITSTREAM_WIDE
+    uint64_t zeros = ~bs->sr | ((uint64_t) 1 << (LIMIT_ONES + 1));
+#ifdef _MSC_VER
+    unsigned long res; _BitScanForward64 (&res, zeros); return (uint32_t) res;
+#else
+    return __builtin_ctzll (zeros);
+#endif
+#else
+    uint32_t zeros = ~bs->sr | (1U << (LIMIT_ONES + 1));
+#ifdef _MSC_VER
+    unsigned long res; _BitScanForward (&res, (unsigned long) zeros); return (uint32_t) res;
+#else
+    return __builtin_ctz (zeros);
+#endif
+#endif
+}
+
+#endif
 
 // Read the next word from the bitstream "wvbits" and return the value. This
 // function can be used for hybrid or lossless streams, but since an
@@ -116,30 +144,17 @@ int32_t FASTCALL get_word (WavpackStream *wps, int chan, int32_t *correction)
         ones_count = wps->w.holding_zero = 0;
     else {
 #ifdef USE_CTZ_OPTIMIZATION
-        while (wps->wvbits.bc < LIMIT_ONES) {
-            if (++(wps->wvbits.ptr) == wps->wvbits.end)
-                wps->wvbits.wrap (&wps->wvbits);
-
-            wps->wvbits.sr |= *(wps->wvbits.ptr) << wps->wvbits.bc;
-            wps->wvbits.bc += sizeof (*(wps->wvbits.ptr)) * 8;
-        }
-
-#ifdef _MSC_VER
-        { unsigned long res; _BitScanForward (&res, (unsigned long)~wps->wvbits.sr); ones_count = (uint32_t) res; }
-#else
-        ones_count = __builtin_ctz (~wps->wvbits.sr);
-#endif
+        bs_fill (&wps->wvbits, LIMIT_ONES + 1);
+        ones_count = count_ones (&wps->wvbits);
 
         if (ones_count >= LIMIT_ONES) {
-            wps->wvbits.bc -= ones_count;
-            wps->wvbits.sr >>= ones_count;
-
-            for (; ones_count < (LIMIT_ONES + 1) && getbit (&wps->wvbits); ++ones_count);
-
             if (ones_count == (LIMIT_ONES + 1))
                 return WORD_EOF;
 
-            if (ones_count == LIMIT_ONES) {
+            wps->wvbits.bc -= LIMIT_ONES + 1;
+            wps->wvbits.sr >>= LIMIT_ONES + 1;
+
+            {
                 uint32_t mask;
                 int cbits;
 
@@ -395,50 +410,35 @@ int32_t get_words_lossless (WavpackStream *wps, int32_t *buffer, int32_t nsample
         }
 
 #ifdef USE_CTZ_OPTIMIZATION
-        while (bs->bc < LIMIT_ONES) {
-            if (++(bs->ptr) == bs->end)
-                bs->wrap (bs);
-
-            bs->sr |= *(bs->ptr) << bs->bc;
-            bs->bc += sizeof (*(bs->ptr)) * 8;
-        }
-
-#ifdef _MSC_VER
-        { unsigned long res; _BitScanForward (&res, (unsigned long)~wps->wvbits.sr); ones_count = (uint32_t) res; }
-#else
-        ones_count = __builtin_ctz (~wps->wvbits.sr);
-#endif
+        bs_fill (bs, LIMIT_ONES + 1);
+        ones_count = count_ones (bs);
 
         if (ones_count >= LIMIT_ONES) {
-            bs->bc -= ones_count;
-            bs->sr >>= ones_count;
-
-            for (; ones_count < (LIMIT_ONES + 1) && getbit (bs); ++ones_count);
+            uint32_t mask;
+            int cbits;
 
             if (ones_count == (LIMIT_ONES + 1))
                 break;
 
-            if (ones_count == LIMIT_ONES) {
-                uint32_t mask;
-                int cbits;
+            bs->bc -= LIMIT_ONES + 1;
+            bs->sr >>= LIMIT_ONES + 1;
 
-                for (cbits = 0; cbits < 33 && getbit (bs); ++cbits);
-
-                if (cbits == 33)
-                    break;
+            for (cbits = 0; cbits < 33 && getbit (bs); ++cbits);
 
-                if (cbits < 2)
-                    ones_count = cbits;
-                else {
-                    for (mask = 1, ones_count = 0; --cbits; mask <<= 1)
-                        if (getbit (bs))
-                            ones_count |= mask;
+            if (cbits == 33)
+                break;
 
-                    ones_count |= mask;
-                }
+            if (cbits < 2)
+                ones_count = cbits;
+            else {
+                for (mask = 1, ones_count = 0; --cbits; mask <<= 1)
+                    if (getbit (bs))
+                        ones_count |= mask;
 
-                ones_count += LIMIT_ONES;
+                ones_count |= mask;
             }
+
+            ones_count += LIMIT_ONES;
         }
         else {
             bs->bc -= ones_count + 1;
@@ -553,8 +553,7 @@ int32_t get_words_lossless (WavpackStream *wps, int32_t *buffer, int32_t nsample
             }
         }
 
-        low += read_code (bs, high - low);
-        buffer [csamples] = (getbit (bs)) ? ~low : low;
+        buffer [csamples] = read_value (bs, low, high - low);
     }
 
     return (wps->wphdr.flags & MONO_DATA) ? csamples : (csamples / 2);
@@ -568,7 +567,11 @@ int32_t get_words_lossless (WavpackStream *wps, int32_t *buffer, int32_t nsample
 
 static uint32_t __inline read_code (Bitstream *bs, uint32_t maxcode)
 {
+#ifdef BITSTREAM_WIDE
+    uint64_t local_sr;
+#else
     unsigned long local_sr;
+#endif
     uint32_t extras, code;
     int bitcount;
 
@@ -582,6 +585,10 @@ static uint32_t __inline read_code (Bitstream *bs, uint32_t maxcode)
     extras = (1 << bitcount) - maxcode - 1;
 #endif
 
+#ifdef BITSTREAM_WIDE
+    bs_fill (bs, bitcount);
+    local_sr = bs->sr;
+#else
     local_sr = bs->sr;
 
     while (bs->bc < bitcount) {
@@ -591,6 +598,7 @@ static uint32_t __inline read_code (Bitstream *bs, uint32_t maxcode)
         local_sr |= (long)*(bs->ptr) << bs->bc;
         bs->bc += sizeof (*(bs->ptr)) * 8;
     }
+#endif
 
 #ifdef USE_BITMASK_TABLES
     if ((code = local_sr & bitmask [bitcount - 1]) >= extras)
@@ -612,3 +620,54 @@ static uint32_t __inline read_code (Bitstream *bs, uint32_t maxcode)
 
     return code;
 }
+
+// Read a code from 0 to maxcode (exactly like read_code()) followed by a sign bit and return the
+// signed value with "low" added to the code (this is how every sample ends in the lossless case).
+// We make sure that there are enough bits in the shift register for both the code and the sign
+// with a single refill and then we consume them all at once. With the 32-bit shift register this
+// can only be done for codes of less than 16 bits (the vast majority); longer codes are read the
+// regular way.
+
+static int32_t __inline read_value (Bitstream *bs, uint32_t low, uint32_t maxcode)
+{
+#ifdef BITSTREAM_WIDE
+    uint64_t sr;
+#else
+    uint32_t sr;
+#endif
+    uint32_t extras, code = 0;
+    int bitcount = 0;
+
+#ifndef BITSTREAM_WIDE
+    if (maxcode >= 0x8000) {
+        low += read_code (bs, maxcode);
+        return getbit (bs) ? ~low : low;
+    }
+#endif
+
+    if (maxcode)
+        bitcount = count_bits (maxcode);
+
+    bs_fill (bs, bitcount + 1);
+    sr = bs->sr;
+
+    if (bitcount) {
+#ifdef USE_BITMASK_TABLES
+        extras = bitset [bitcount] - maxcode - 1;
+
+        if ((code = sr & bitmask [bitcount - 1]) >= extras)
+#else
+        extras = (1 << bitcount) - maxcode - 1;
+
+        if ((code = sr & ((1 << (bitcount - 1)) - 1)) >= extras)
+#endif
+            code = (code << 1) - extras + ((sr >> (bitcount - 1)) & 1);
+        else
+            bitcount--;
+    }
+
+    low += code;
+    bs->bc -= bitcount + 1;
+    bs->sr = sr >> (bitcount + 1);
+    return ((sr >> bitcount) & 1) ? ~low : low;
+}
@@ -59,7 +59,7 @@ int load_tag (WavpackContext *wpc)
                 if (m_tag->ape_tag_hdr.version == 2000 && m_tag->ape_tag_hdr.item_count &&
                     m_tag->ape_tag_hdr.length > (int) sizeof (m_tag->ape_tag_hdr) &&
                     m_tag->ape_tag_hdr.length <= APE_TAG_MAX_LENGTH &&
-                    (m_tag->ape_tag_data = (unsigned char *)malloc (m_tag->ape_tag_hdr.length)) != NULL) {
+                    (m_tag->ape_tag_data = (unsigned char *)wp_malloc (m_tag->ape_tag_hdr.length)) != NULL) {
 
                         ape_tag_items = m_tag->ape_tag_hdr.item_count;
                         ape_tag_length = m_tag->ape_tag_hdr.length;
@@ -86,7 +86,7 @@ int load_tag (WavpackContext *wpc)
                             if (m_tag->ape_tag_hdr.flags & APE_TAG_CONTAINS_HEADER) {
                                 if (wpc->reader->read_bytes (wpc->wv_in, &m_tag->ape_tag_hdr, sizeof (APE_Tag_Hdr)) !=
                                     sizeof (APE_Tag_Hdr) || strncmp (m_tag->ape_tag_hdr.ID, "APETAGEX", 8)) {
-                                        free (m_tag->ape_tag_data);
+                                        wp_free (m_tag->ape_tag_data);
                                         CLEAR (*m_tag);
                                         return FALSE;       // something's wrong...
                                 }
@@ -95,7 +95,7 @@ int load_tag (WavpackContext *wpc)
 
                                 if (m_tag->ape_tag_hdr.version != 2000 || m_tag->ape_tag_hdr.item_count != ape_tag_items ||
                                     m_tag->ape_tag_hdr.length != ape_tag_length) {
-                                        free (m_tag->ape_tag_data);
+                                        wp_free (m_tag->ape_tag_data);
                                         CLEAR (*m_tag);
                                         return FALSE;       // something's wrong...
                                 }
@@ -104,7 +104,7 @@ int load_tag (WavpackContext *wpc)
 
                         if (wpc->reader->read_bytes (wpc->wv_in, m_tag->ape_tag_data,
                             ape_tag_length - sizeof (APE_Tag_Hdr)) != ape_tag_length - sizeof (APE_Tag_Hdr)) {
-                                free (m_tag->ape_tag_data);
+                                wp_free (m_tag->ape_tag_data);
                                 CLEAR (*m_tag);
                                 return FALSE;       // something's wrong...
                         }
@@ -173,7 +173,7 @@ int editable_tag (M_Tag *m_tag)
 void free_tag (M_Tag *m_tag)
 {
     if (m_tag->ape_tag_data) {
-        free (m_tag->ape_tag_data);
+        wp_free (m_tag->ape_tag_data);
         m_tag->ape_tag_data = NULL;
     }
 }
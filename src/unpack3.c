@@ -307,7 +307,7 @@ int32_t unpack_samples3 (WavpackContext *wpc, int32_t *buffer, uint32_t sample_c
     if (!wps->index_points [points_index].saved) {
 
         if (!wps->unpack_data)
-            wps->unpack_data = (unsigned char *) malloc (256 * (wps->unpack_size = unpack_size (wps)));
+            wps->unpack_data = (unsigned char *) wp_malloc (256 * (wps->unpack_size = unpack_size (wps)));
 
         wps->index_points [points_index].sample_index = wps->sample_index;
         unpack_save (wps, wps->unpack_data + points_index * wps->unpack_size);
@@ -1174,11 +1174,11 @@ int32_t unpack_samples3 (WavpackContext *wpc, int32_t *buffer, uint32_t sample_c
             wpc->crc_errors++;
 
         if (wpc->open_flags & OPEN_WRAPPER) {
-            unsigned char *temp = (unsigned char *)malloc (1024);
+            unsigned char *temp = (unsigned char *)wp_malloc (1024);
             uint32_t bcount;
 
             if (bs_unused_bytes (&wps->wvbits)) {
-                wpc->wrapper_data = (unsigned char *)realloc (wpc->wrapper_data, wpc->wrapper_bytes + bs_unused_bytes (&wps->wvbits));
+                wpc->wrapper_data = (unsigned char *)wp_realloc (wpc->wrapper_data, wpc->wrapper_bytes + bs_unused_bytes (&wps->wvbits));
                 memcpy (wpc->wrapper_data + wpc->wrapper_bytes, bs_unused_data (&wps->wvbits), bs_unused_bytes (&wps->wvbits));
                 wpc->wrapper_bytes += bs_unused_bytes (&wps->wvbits);
             }
@@ -1189,12 +1189,12 @@ int32_t unpack_samples3 (WavpackContext *wpc, int32_t *buffer, uint32_t sample_c
                 if (!bcount)
                     break;
 
-                wpc->wrapper_data = (unsigned char *)realloc (wpc->wrapper_data, wpc->wrapper_bytes + bcount);
+                wpc->wrapper_data = (unsigned char *)wp_realloc (wpc->wrapper_data, wpc->wrapper_bytes + bcount);
                 memcpy (wpc->wrapper_data + wpc->wrapper_bytes, temp, bcount);
                 wpc->wrapper_bytes += bcount;
             }
 
-            free (temp);
+            wp_free (temp);
 
             if (wpc->wrapper_bytes > 16) {
                 int c;
@@ -1206,7 +1206,7 @@ int32_t unpack_samples3 (WavpackContext *wpc, int32_t *buffer, uint32_t sample_c
                     wpc->wrapper_bytes -= 16;
                 }
                 else {
-                    free (wpc->wrapper_data);
+                    wp_free (wpc->wrapper_data);
                     wpc->wrapper_data = NULL;
                     wpc->wrapper_bytes = 0;
                 }
@@ -1669,7 +1669,7 @@ static int bs_open_read3 (Bitstream3 *bs, WavpackStreamReader64 *reader, void *i
     bs->fpos = (bs->reader = reader)->get_pos (bs->id = id);
 
     if (!bs->buf)
-        bs->buf = (unsigned char *) malloc (bs->bufsiz);
+        bs->buf = (unsigned char *) wp_malloc (bs->bufsiz);
 
     bs->end = bs->buf + bs->bufsiz;
     bs->ptr = bs->end - 1;
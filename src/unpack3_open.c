@@ -41,7 +41,7 @@ WavpackContext *open_file3 (WavpackContext *wpc, char *error)
     WaveHeader3 wavhdr;
 
     CLEAR (wavhdr);
-    wpc->stream3 = wps = (WavpackStream3 *) malloc (sizeof (WavpackStream3));
+    wpc->stream3 = wps = (WavpackStream3 *) wp_malloc (sizeof (WavpackStream3));
     CLEAR (*wps);
 
     if (wpc->reader->read_bytes (wpc->wv_in, &RiffChunkHeader, sizeof (RiffChunkHeader)) !=
@@ -53,7 +53,7 @@ WavpackContext *open_file3 (WavpackContext *wpc, char *error)
     if (!strncmp (RiffChunkHeader.ckID, "RIFF", 4) && !strncmp (RiffChunkHeader.formType, "WAVE", 4)) {
 
         if (wpc->open_flags & OPEN_WRAPPER) {
-            wpc->wrapper_data = (unsigned char *)malloc (wpc->wrapper_bytes = sizeof (RiffChunkHeader));
+            wpc->wrapper_data = (unsigned char *)wp_malloc (wpc->wrapper_bytes = sizeof (RiffChunkHeader));
             memcpy (wpc->wrapper_data, &RiffChunkHeader, sizeof (RiffChunkHeader));
         }
 
@@ -71,7 +71,7 @@ WavpackContext *open_file3 (WavpackContext *wpc, char *error)
             }
             else {
                 if (wpc->open_flags & OPEN_WRAPPER) {
-                    wpc->wrapper_data = (unsigned char *)realloc (wpc->wrapper_data, wpc->wrapper_bytes + sizeof (ChunkHeader));
+                    wpc->wrapper_data = (unsigned char *)wp_realloc (wpc->wrapper_data, wpc->wrapper_bytes + sizeof (ChunkHeader));
                     memcpy (wpc->wrapper_data + wpc->wrapper_bytes, &ChunkHeader, sizeof (ChunkHeader));
                     wpc->wrapper_bytes += sizeof (ChunkHeader);
                 }
@@ -86,7 +86,7 @@ WavpackContext *open_file3 (WavpackContext *wpc, char *error)
                             return WavpackCloseFile (wpc);
                     }
                     else if (wpc->open_flags & OPEN_WRAPPER) {
-                        wpc->wrapper_data = (unsigned char *)realloc (wpc->wrapper_data, wpc->wrapper_bytes + sizeof (wavhdr));
+                        wpc->wrapper_data = (unsigned char *)wp_realloc (wpc->wrapper_data, wpc->wrapper_bytes + sizeof (wavhdr));
                         memcpy (wpc->wrapper_data + wpc->wrapper_bytes, &wavhdr, sizeof (wavhdr));
                         wpc->wrapper_bytes += sizeof (wavhdr);
                     }
@@ -102,14 +102,14 @@ WavpackContext *open_file3 (WavpackContext *wpc, char *error)
                         }
 
                         if (wpc->open_flags & OPEN_WRAPPER) {
-                            wpc->wrapper_data = (unsigned char *)realloc (wpc->wrapper_data, wpc->wrapper_bytes + bytes_to_skip);
+                            wpc->wrapper_data = (unsigned char *)wp_realloc (wpc->wrapper_data, wpc->wrapper_bytes + bytes_to_skip);
                             wpc->reader->read_bytes (wpc->wv_in, wpc->wrapper_data + wpc->wrapper_bytes, bytes_to_skip);
                             wpc->wrapper_bytes += bytes_to_skip;
                         }
                         else {
-                            unsigned char *temp = (unsigned char *)malloc (bytes_to_skip);
+                            unsigned char *temp = (unsigned char *)wp_malloc (bytes_to_skip);
                             wpc->reader->read_bytes (wpc->wv_in, temp, bytes_to_skip);
-                            free (temp);
+                            wp_free (temp);
                         }
                     }
                 }
@@ -124,14 +124,14 @@ WavpackContext *open_file3 (WavpackContext *wpc, char *error)
                     }
 
                     if (wpc->open_flags & OPEN_WRAPPER) {
-                        wpc->wrapper_data = (unsigned char *)realloc (wpc->wrapper_data, wpc->wrapper_bytes + bytes_to_skip);
+                        wpc->wrapper_data = (unsigned char *)wp_realloc (wpc->wrapper_data, wpc->wrapper_bytes + bytes_to_skip);
                         wpc->reader->read_bytes (wpc->wv_in, wpc->wrapper_data + wpc->wrapper_bytes, bytes_to_skip);
                         wpc->wrapper_bytes += bytes_to_skip;
                     }
                     else {
-                        unsigned char *temp = (unsigned char *)malloc (bytes_to_skip);
+                        unsigned char *temp = (unsigned char *)wp_malloc (bytes_to_skip);
                         wpc->reader->read_bytes (wpc->wv_in, temp, bytes_to_skip);
-                        free (temp);
+                        wp_free (temp);
                     }
                 }
             }
@@ -274,15 +274,15 @@ void free_stream3 (WavpackContext *wpc)
     if (wps) {
 #ifndef NO_SEEKING
         if (wps->unpack_data)
-            free (wps->unpack_data);
+            wp_free (wps->unpack_data);
 #endif
         if ((wps->wphdr.flags & WVC_FLAG) && wps->wvcbits.buf)
-            free (wps->wvcbits.buf);
+            wp_free (wps->wvcbits.buf);
 
         if (wps->wvbits.buf)
-            free (wps->wvbits.buf);
+            wp_free (wps->wvbits.buf);
 
-        free (wps);
+        wp_free (wps);
     }
 }
 
@@ -50,7 +50,7 @@ int seek_sample3 (WavpackContext *wpc, uint32_t desired_index)
         }
 
     if (desired_index > wps->sample_index) {
-        int32_t *buffer = (int32_t *) malloc (1024 * (wps->wphdr.flags & MONO_FLAG ? 4 : 8));
+        int32_t *buffer = (int32_t *) wp_malloc (1024 * (wps->wphdr.flags & MONO_FLAG ? 4 : 8));
         uint32_t samples_to_skip = desired_index - wps->sample_index;
 
         while (1) {
@@ -66,7 +66,7 @@ int seek_sample3 (WavpackContext *wpc, uint32_t desired_index)
             }
         }
 
-        free (buffer);
+        wp_free (buffer);
 
         if (samples_to_skip)
             return FALSE;
@@ -79,8 +79,14 @@ int32_t unpack_dsd_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sampl
             int total_samples = sample_count * ((flags & MONO_DATA) ? 1 : 2);
             int32_t *bptr = buffer;
 
-            if (wps->dsd.endptr - wps->dsd.byteptr < total_samples)
-                total_samples = (int)(wps->dsd.endptr - wps->dsd.byteptr);
+            // a short block leaves the rest of the buffer at zero (which used to be done by the caller)
+
+            if (wps->dsd.endptr - wps->dsd.byteptr < total_samples) {
+                int bytes_left = (int)(wps->dsd.endptr - wps->dsd.byteptr);
+
+                memset (buffer + bytes_left, 0, (total_samples - bytes_left) * sizeof (int32_t));
+                total_samples = bytes_left;
+            }
 
             while (total_samples--)
                 wps->crc += (wps->crc << 1) + (*bptr++ = *wps->dsd.byteptr++);
@@ -145,11 +151,11 @@ static int init_dsd_block_fast (WavpackStream *wps, WavpackMetadata *wpmd)
     wps->dsd.history_bins = 1 << history_bits;
 
     free_dsd_tables (wps);
-    lb_ptr = wps->dsd.lookup_buffer = (unsigned char *)malloc (wps->dsd.history_bins * MAX_BYTES_PER_BIN);
-    wps->dsd.value_lookup = (unsigned char **)malloc (sizeof (*wps->dsd.value_lookup) * wps->dsd.history_bins);
+    lb_ptr = wps->dsd.lookup_buffer = (unsigned char *)wp_malloc (wps->dsd.history_bins * MAX_BYTES_PER_BIN);
+    wps->dsd.value_lookup = (unsigned char **)wp_malloc (sizeof (*wps->dsd.value_lookup) * wps->dsd.history_bins);
     memset (wps->dsd.value_lookup, 0, sizeof (*wps->dsd.value_lookup) * wps->dsd.history_bins);
-    wps->dsd.summed_probabilities = (uint16_t (*)[256])malloc (sizeof (*wps->dsd.summed_probabilities) * wps->dsd.history_bins);
-    wps->dsd.probabilities = (unsigned char (*)[256])malloc (sizeof (*wps->dsd.probabilities) * wps->dsd.history_bins);
+    wps->dsd.summed_probabilities = (uint16_t (*)[256])wp_malloc (sizeof (*wps->dsd.summed_probabilities) * wps->dsd.history_bins);
+    wps->dsd.probabilities = (unsigned char (*)[256])wp_malloc (sizeof (*wps->dsd.probabilities) * wps->dsd.history_bins);
 
     max_probability = *wps->dsd.byteptr++;
 
@@ -323,7 +329,7 @@ static int init_dsd_block_high (WavpackStream *wps, WavpackMetadata *wpmd)
         return FALSE;
 
     if (!wps->dsd.ptable)
-        wps->dsd.ptable = (int32_t *)malloc (PTABLE_BINS * sizeof (*wps->dsd.ptable));
+        wps->dsd.ptable = (int32_t *)wp_malloc (PTABLE_BINS * sizeof (*wps->dsd.ptable));
 
     init_ptable (wps->dsd.ptable, rate_i, rate_s);
 
@@ -503,7 +509,7 @@ typedef struct {
 
 void *decimate_dsd_init (int num_channels)
 {
-    DecimationContext *context = (DecimationContext *)malloc (sizeof (DecimationContext));
+    DecimationContext *context = (DecimationContext *)wp_malloc (sizeof (DecimationContext));
     double filter_sum = 0, filter_scale;
     int skipped_terms, i, j;
 
@@ -512,10 +518,10 @@ void *decimate_dsd_init (int num_channels)
 
     memset (context, 0, sizeof (*context));
     context->num_channels = num_channels;
-    context->chans = (DecimationChannel *)malloc (num_channels * sizeof (DecimationChannel));
+    context->chans = (DecimationChannel *)wp_malloc (num_channels * sizeof (DecimationChannel));
 
     if (!context->chans) {
-        free (context);
+        wp_free (context);
         return NULL;
     }
 
@@ -616,9 +622,9 @@ void decimate_dsd_destroy (void *decimate_context)
         return;
 
     if (context->chans)
-        free (context->chans);
+        wp_free (context->chans);
 
-    free (context);
+    wp_free (context);
 }
 
 #endif      // ENABLE_DSD
@@ -0,0 +1,335 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** WAVPACK ****                            //
+//                  Hybrid Lossless Wavefile Compressor                   //
+//              Copyright (c) 1998 - 2024 David Bryant.                   //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// unpack_range.c
+
+// This module provides WavpackReadRange(), which decodes an arbitrary range of
+// samples from an open file and may be called from any number of threads at
+// once on the same context. Each call borrows a "cursor" from a pool kept in
+// the context. A cursor is a private copy of the context with its own streams
+// and decoder state, and its reader accesses the shared file one read at a time
+// (under a lock, at explicit positions) so that only the file access is
+// serialized and never the decoding. Cursors are returned to the pool where
+// they stopped, so a thread reading consecutive ranges never has to seek.
+
+#ifndef NO_SEEKING
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "wavpack_local.h"
+
+struct range_readers;
+
+typedef struct {
+    struct range_readers *shared;
+    void *id;                           // the context's own file id
+    int64_t position;                   // this cursor's position in that file
+} RangeFile;
+
+typedef struct range_cursor {
+    struct range_cursor *next;
+    WavpackContext *wpc;
+    RangeFile wv, wvc;
+    int positioned;                     // the cursor's sample index is valid
+} RangeCursor;
+
+typedef struct range_readers {
+    WavpackStreamReader64 *reader;      // the context's reader (only used under the lock)
+    RangeCursor *idle;
+    void *mutex;
+} RangeReaders;
+
+///////////////////////////// cursor file reader ////////////////////////////////
+
+// Because the context's regular decoder (and its reader) assume that nobody else
+// moves the file position, we put it back after each access. With stdio this is
+// usually a seek within the buffer that was just read, and so is very cheap.
+
+static int32_t range_read_bytes (void *id, void *data, int32_t bcount)
+{
+    RangeFile *file = (RangeFile *) id;
+    WavpackStreamReader64 *reader = file->shared->reader;
+    int32_t bytes_read = 0;
+    int64_t saved_pos;
+
+    workers_mutex_lock (file->shared->mutex);
+    saved_pos = reader->get_pos (file->id);
+
+    if (saved_pos == file->position || !reader->set_pos_abs (file->id, file->position)) {
+        bytes_read = reader->read_bytes (file->id, data, bcount);
+        reader->set_pos_abs (file->id, saved_pos);
+    }
+
+    workers_mutex_unlock (file->shared->mutex);
+
+    if (bytes_read > 0)
+        file->position += bytes_read;
+
+    return bytes_read;
+}
+
+static int64_t range_get_pos (void *id)
+{
+    return ((RangeFile *) id)->position;
+}
+
+static int range_set_pos_abs (void *id, int64_t pos)
+{
+    ((RangeFile *) id)->position = pos;
+    return 0;
+}
+
+static int64_t range_get_length (void *id)
+{
+    RangeFile *file = (RangeFile *) id;
+    int64_t length;
+
+    workers_mutex_lock (file->shared->mutex);
+    length = file->shared->reader->get_length (file->id);
+    workers_mutex_unlock (file->shared->mutex);
+
+    return length;
+}
+
+static int range_set_pos_rel (void *id, int64_t delta, int mode)
+{
+    RangeFile *file = (RangeFile *) id;
+
+    if (mode == SEEK_SET)
+        file->position = delta;
+    else if (mode == SEEK_CUR)
+        file->position += delta;
+    else if (mode == SEEK_END)
+        file->position = range_get_length (id) + delta;
+    else
+        return -1;
+
+    return 0;
+}
+
+static int range_push_back_byte (void *id, int c)
+{
+    ((RangeFile *) id)->position--;
+    return c;
+}
+
+static int range_can_seek (void *id)
+{
+    return 1;       // range reads are only enabled for seekable files
+}
+
+static WavpackStreamReader64 range_reader = {
+    range_read_bytes, NULL, range_get_pos, range_set_pos_abs, range_set_pos_rel,
+    range_push_back_byte, range_get_length, range_can_seek, NULL, NULL
+};
+
+///////////////////////////// cursor management ////////////////////////////////
+
+// Enable WavpackReadRange() on a newly opened file. This is done at open time
+// (rather than on the first call) so that the calls themselves never have to
+// create shared state. Returns FALSE if the memory or the lock is not available.
+
+int init_range_readers (WavpackContext *wpc)
+{
+    RangeReaders *rr = (RangeReaders *)wp_calloc (1, sizeof (RangeReaders));
+
+    if (!rr)
+        return FALSE;
+
+#ifdef ENABLE_THREADS
+    if (!(rr->mutex = workers_mutex_create ())) {
+        wp_free (rr);
+        return FALSE;
+    }
+#endif
+
+    rr->reader = wpc->reader;
+    wpc->range_readers = rr;
+    return TRUE;
+}
+
+void free_range_readers (WavpackContext *wpc)
+{
+    RangeReaders *rr = (RangeReaders *) wpc->range_readers;
+    RangeCursor *cursor;
+
+    while ((cursor = rr->idle) != NULL) {
+        rr->idle = cursor->next;
+        WavpackCloseFile (cursor->wpc);
+        wp_free (cursor);
+    }
+
+    workers_mutex_destroy (rr->mutex);
+    wp_free (rr);
+    wpc->range_readers = NULL;
+}
+
+// Create a new cursor from the context. This must be called with the lock held
+// because the seek table may be read and the seek index is copied (the copy is
+// private to the cursor, so that the cursors never modify shared state). Items
+// that are only needed to answer queries about the file (like the wrapper, tags
+// and channel information) are left to the original context.
+
+static RangeCursor *create_cursor (WavpackContext *wpc, RangeReaders *rr)
+{
+    RangeCursor *cursor = (RangeCursor *)wp_calloc (1, sizeof (RangeCursor));
+    WavpackContext *cxt;
+
+    if (!cursor || !(cursor->wpc = cxt = (WavpackContext *)wp_malloc (sizeof (WavpackContext)))) {
+        wp_free (cursor);
+        return NULL;
+    }
+
+    read_seek_table (wpc);
+
+    *cxt = *wpc;
+    cxt->reader = &range_reader;
+    cxt->open_flags &= ~(OPEN_WRAPPER | OPEN_THREADS_MASK);
+    cursor->wv.shared = cursor->wvc.shared = rr;
+    cursor->wv.id = wpc->wv_in;
+    cxt->wv_in = &cursor->wv;
+
+    if (wpc->wvc_in) {
+        cursor->wvc.id = wpc->wvc_in;
+        cxt->wvc_in = &cursor->wvc;
+    }
+
+    cxt->metadata = NULL;
+    cxt->metacount = 0;
+    cxt->wrapper_data = NULL;
+    cxt->wrapper_bytes = 0;
+    CLEAR (cxt->m_tag);
+    cxt->streams = NULL;
+    cxt->num_streams = 0;
+    cxt->stream3 = NULL;
+    cxt->channel_reordering = cxt->channel_identities = NULL;
+    cxt->decimation_context = NULL;
+    cxt->close_callback = NULL;
+    cxt->workers = cxt->pack_pipeline = cxt->extra_workers = cxt->read_ahead = cxt->range_readers = NULL;
+    cxt->cache_frame = NULL;
+    cxt->convert_buffer = cxt->temp_buffer = NULL;
+    cxt->temp_buffer_size = 0;
+    cxt->num_spare_buffers = cxt->num_spare_streams = 0;
+    cxt->seek_index = NULL;
+    cxt->seek_index_count = cxt->seek_index_size = 0;
+
+    // from here on the cursor's context owns everything it points to, so on failure
+    // it can simply be closed
+
+    if (wpc->seek_index_count) {
+        cxt->seek_index = (SeekIndexEntry *)wp_malloc (wpc->seek_index_count * sizeof (SeekIndexEntry));
+
+        if (cxt->seek_index) {
+            memcpy (cxt->seek_index, wpc->seek_index, wpc->seek_index_count * sizeof (SeekIndexEntry));
+            cxt->seek_index_count = cxt->seek_index_size = wpc->seek_index_count;
+        }
+    }
+
+#ifdef ENABLE_DSD
+    if (wpc->decimation_context && !(cxt->decimation_context = decimate_dsd_init (wpc->reduced_channels ?
+        wpc->reduced_channels : wpc->config.num_channels))) {
+            WavpackCloseFile (cxt);
+            wp_free (cursor);
+            return NULL;
+    }
+#endif
+
+    cxt->streams = (WavpackStream **)wp_malloc (sizeof (cxt->streams [0]));
+
+    if (!cxt->streams || !(cxt->streams [0] = (WavpackStream *)wp_malloc (sizeof (WavpackStream)))) {
+        WavpackCloseFile (cxt);
+        wp_free (cursor);
+        return NULL;
+    }
+
+    cxt->num_streams = 1;
+    CLEAR (*cxt->streams [0]);
+    return cursor;
+}
+
+// Take a cursor from the pool, preferring one that stopped exactly where this
+// read starts, or create a new one if none are idle.
+
+static RangeCursor *get_cursor (WavpackContext *wpc, RangeReaders *rr, int64_t start_sample)
+{
+    RangeCursor **link, *cursor;
+
+    workers_mutex_lock (rr->mutex);
+
+    for (link = &rr->idle; *link; link = &(*link)->next)
+        if ((*link)->positioned && WavpackGetSampleIndex64 ((*link)->wpc) == start_sample)
+            break;
+
+    if (!*link)
+        link = &rr->idle;
+
+    if ((cursor = *link) != NULL)
+        *link = cursor->next;
+    else
+        cursor = create_cursor (wpc, rr);
+
+    workers_mutex_unlock (rr->mutex);
+    return cursor;
+}
+
+static void put_cursor (RangeReaders *rr, RangeCursor *cursor)
+{
+    workers_mutex_lock (rr->mutex);
+    cursor->next = rr->idle;
+    rr->idle = cursor;
+    workers_mutex_unlock (rr->mutex);
+}
+
+///////////////////////////// executable code ////////////////////////////////
+
+// Decode "sample_count" samples starting at "start_sample" into "buffer" (in the
+// same format as WavpackUnpackSamples()) and return the number of samples actually
+// decoded, which is only less than requested at the end of the file (or on error).
+// This may be called from any number of threads at once for the same context
+// (with any ranges, including overlapping ones), but the context's regular
+// decoding functions (e.g., WavpackUnpackSamples() and WavpackSeekSample()) must
+// not be used while range reads are in progress. Functions that just return
+// information about the file may be used at any time.
+//
+// Every concurrent call needs its own decoder, so the first calls made by each
+// thread are somewhat more expensive. Each decoder starts with a copy of the seek
+// index, so opening with OPEN_SEEK_INDEX (or loading an index) makes the first
+// range reads much faster. Range reads are not available for files opened with
+// OPEN_STREAMING, for unseekable files, or for pre-4.0 files.
+
+uint32_t WavpackReadRange (WavpackContext *wpc, int64_t start_sample, uint32_t sample_count, int32_t *buffer)
+{
+    RangeReaders *rr = (RangeReaders *) wpc->range_readers;
+    RangeCursor *cursor;
+    uint32_t samples;
+
+    if (!rr || start_sample < 0 || start_sample >= wpc->total_samples || !sample_count)
+        return 0;
+
+    if (!(cursor = get_cursor (wpc, rr, start_sample)))
+        return 0;
+
+    // a failed seek leaves a decoder unusable, so in that case we just discard it
+
+    if ((!cursor->positioned || WavpackGetSampleIndex64 (cursor->wpc) != start_sample) &&
+        !WavpackSeekSample64 (cursor->wpc, start_sample)) {
+            WavpackCloseFile (cursor->wpc);
+            wp_free (cursor);
+            return 0;
+    }
+
+    samples = WavpackUnpackSamples (cursor->wpc, buffer, sample_count);
+    cursor->positioned = TRUE;
+    put_cursor (rr, cursor);
+
+    return samples;
+}
+
+#endif
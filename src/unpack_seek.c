@@ -21,6 +21,8 @@
 ///////////////////////////// executable code ////////////////////////////////
 
 static int64_t find_sample (WavpackContext *wpc, void *infile, int64_t header_pos, int64_t sample);
+static int retry_without_index (WavpackContext *wpc, WavpackHeader *wphdr, int64_t sample);
+static int seek_cached_frame (WavpackContext *wpc, int64_t sample);
 
 // Seek to the specified sample index, returning TRUE on success. Note that
 // files generated with version 4.0 or newer will seek almost immediately.
@@ -39,6 +41,7 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
 {
     WavpackStream *wps = wpc->streams ? wpc->streams [wpc->current_stream = 0] : NULL;
     uint32_t bcount, samples_to_skip, samples_to_decode = 0;
+    int64_t seek_sample = sample;
     int32_t *buffer;
 
     if (wpc->total_samples == -1 || sample >= wpc->total_samples ||
@@ -51,6 +54,14 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
         return seek_sample3 (wpc, (uint32_t) sample);
 #endif
 
+    if (wpc->read_ahead)
+        discard_read_ahead (wpc);
+
+    if (wpc->block_cache && !wpc->decimation_context)
+        return seek_cached_frame (wpc, sample);
+
+    block_cache_release (wpc);
+
 #ifdef ENABLE_DSD
     if (wpc->decimation_context) {      // the decimation code needs some context to be sample accurate
         if (sample < 16) {
@@ -68,6 +79,7 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
         sample >= GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples) {
 
             free_streams (wpc);
+            read_seek_table (wpc);
             wpc->filepos = find_sample (wpc, wpc->wv_in, wpc->filepos, sample);
 
             if (wpc->filepos == -1)
@@ -86,29 +98,27 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
         wpc->reader->read_bytes (wpc->wv_in, &wps->wphdr, sizeof (WavpackHeader));
         WavpackLittleEndianToNative (&wps->wphdr, WavpackHeaderFormat);
 
+        if (retry_without_index (wpc, &wps->wphdr, sample))
+            return WavpackSeekSample64 (wpc, seek_sample);
+
         if ((wps->wphdr.ckSize & 1) || wps->wphdr.ckSize < 24 || wps->wphdr.ckSize >= 1024 * 1024) {
             free_streams (wpc);
             return FALSE;
         }
 
-        wps->blockbuff = (unsigned char *)malloc (wps->wphdr.ckSize + 8);
-        memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
-
-        if (wpc->reader->read_bytes (wpc->wv_in, wps->blockbuff + sizeof (WavpackHeader), wps->wphdr.ckSize - 24) !=
-            wps->wphdr.ckSize - 24) {
-                free_streams (wpc);
-                return FALSE;
+        if (read_block_buffer (wpc, wpc->wv_in, &wps->wphdr, &wps->blockbuff)) {
+            free_streams (wpc);
+            return FALSE;
         }
 
         // render corrupt blocks harmless
         if (!WavpackVerifySingleBlock (wps->blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
             wps->wphdr.ckSize = sizeof (WavpackHeader) - 8;
             wps->wphdr.block_samples = 0;
-            memcpy (wps->blockbuff, &wps->wphdr, 32);
         }
 
         SET_BLOCK_INDEX (wps->wphdr, GET_BLOCK_INDEX (wps->wphdr) - wpc->initial_index);
-        memcpy (wps->blockbuff, &wps->wphdr, sizeof (WavpackHeader));
+        store_block_header (wpc, &wps->blockbuff, &wps->wphdr);
         wps->init_done = FALSE;
 
         if (wpc->wvc_flag) {
@@ -116,29 +126,27 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
             wpc->reader->read_bytes (wpc->wvc_in, &wps->wphdr, sizeof (WavpackHeader));
             WavpackLittleEndianToNative (&wps->wphdr, WavpackHeaderFormat);
 
+            if (retry_without_index (wpc, &wps->wphdr, sample))
+                return WavpackSeekSample64 (wpc, seek_sample);
+
             if ((wps->wphdr.ckSize & 1) || wps->wphdr.ckSize < 24 || wps->wphdr.ckSize >= 1024 * 1024) {
                 free_streams (wpc);
                 return FALSE;
             }
 
-            wps->block2buff = (unsigned char *)malloc (wps->wphdr.ckSize + 8);
-            memcpy (wps->block2buff, &wps->wphdr, sizeof (WavpackHeader));
-
-            if (wpc->reader->read_bytes (wpc->wvc_in, wps->block2buff + sizeof (WavpackHeader), wps->wphdr.ckSize - 24) !=
-                wps->wphdr.ckSize - 24) {
-                    free_streams (wpc);
-                    return FALSE;
+            if (read_block_buffer (wpc, wpc->wvc_in, &wps->wphdr, &wps->block2buff)) {
+                free_streams (wpc);
+                return FALSE;
             }
 
             // render corrupt blocks harmless
             if (!WavpackVerifySingleBlock (wps->block2buff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
                 wps->wphdr.ckSize = sizeof (WavpackHeader) - 8;
                 wps->wphdr.block_samples = 0;
-                memcpy (wps->block2buff, &wps->wphdr, 32);
             }
 
             SET_BLOCK_INDEX (wps->wphdr, GET_BLOCK_INDEX (wps->wphdr) - wpc->initial_index);
-            memcpy (wps->block2buff, &wps->wphdr, sizeof (WavpackHeader));
+            store_block_header (wpc, &wps->block2buff, &wps->wphdr);
         }
 
         if (!wps->init_done && !unpack_init (wpc)) {
@@ -157,9 +165,8 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
                 return FALSE;
             }
 
-            wpc->streams = (WavpackStream **)realloc (wpc->streams, (wpc->num_streams + 1) * sizeof (wpc->streams [0]));
-            wps = wpc->streams [wpc->num_streams++] = (WavpackStream *)malloc (sizeof (WavpackStream));
-            CLEAR (*wps);
+            wpc->streams = (WavpackStream **)wp_realloc (wpc->streams, (wpc->num_streams + 1) * sizeof (wpc->streams [0]));
+            wps = wpc->streams [wpc->num_streams++] = get_spare_stream (wpc);
             bcount = read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr);
 
             if (bcount == (uint32_t) -1) {
@@ -167,20 +174,16 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
                 return FALSE;
             }
 
-            wps->blockbuff = (unsigned char *)malloc (wps->wphdr.ckSize + 8);
-            memcpy (wps->blockbuff, &wps->wphdr, 32);
-
-            if (wpc->reader->read_bytes (wpc->wv_in, wps->blockbuff + 32, wps->wphdr.ckSize - 24) !=
-                wps->wphdr.ckSize - 24) {
-                    free_streams (wpc);
-                    return FALSE;
+            if (read_block_buffer (wpc, wpc->wv_in, &wps->wphdr, &wps->blockbuff)) {
+                free_streams (wpc);
+                return FALSE;
             }
 
             // render corrupt blocks harmless
             if (!WavpackVerifySingleBlock (wps->blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
                 wps->wphdr.ckSize = sizeof (WavpackHeader) - 8;
                 wps->wphdr.block_samples = 0;
-                memcpy (wps->blockbuff, &wps->wphdr, 32);
+                store_block_header (wpc, &wps->blockbuff, &wps->wphdr);
             }
 
             wps->init_done = FALSE;
@@ -217,7 +220,7 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
     }
 
     if (samples_to_skip) {
-        buffer = (int32_t *)malloc (samples_to_skip * 8);
+        buffer = (int32_t *)wp_malloc (samples_to_skip * 8);
 
         for (wpc->current_stream = 0; wpc->current_stream < wpc->num_streams; wpc->current_stream++)
 #ifdef ENABLE_DSD
@@ -227,7 +230,7 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
 #endif
                 unpack_samples (wpc, buffer, samples_to_skip);
 
-        free (buffer);
+        wp_free (buffer);
     }
 
     wpc->current_stream = 0;
@@ -237,11 +240,11 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
         decimate_dsd_reset (wpc->decimation_context);
 
     if (samples_to_decode) {
-        buffer = (int32_t *)calloc (1, samples_to_decode * wpc->config.num_channels * 4);
+        buffer = (int32_t *)wp_calloc (1, samples_to_decode * wpc->config.num_channels * 4);
 
         if (buffer) {
             WavpackUnpackSamples (wpc, buffer, samples_to_decode);
-            free (buffer);
+            wp_free (buffer);
         }
     }
 #endif
@@ -249,6 +252,182 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
     return TRUE;
 }
 
+// Seek when a block cache is attached (see block_cache.c). If the seek index tells us
+// which frame the sample is in and that frame is cached, we just start returning audio
+// from it (without any file access). Otherwise we do a regular seek to the start of the
+// frame (finding it with a regular seek to the sample if it's not indexed) and decode
+// the whole frame into the cache, so that later seeks into it won't miss.
+
+static int seek_uncached (WavpackContext *wpc, int64_t sample)
+{
+    void *block_cache = wpc->block_cache;
+    int result;
+
+    block_cache_release (wpc);
+    wpc->block_cache = NULL;
+    result = WavpackSeekSample64 (wpc, sample);
+    wpc->block_cache = block_cache;
+    return result;
+}
+
+static int seek_cached_frame (WavpackContext *wpc, int64_t sample)
+{
+    CachedFrame *frame = (CachedFrame *) wpc->cache_frame;
+    int64_t frame_start = -1;
+    int32_t index;
+
+    if (frame && sample >= frame->block_index && sample < frame->block_index + frame->num_samples) {
+        wpc->streams [0]->sample_index = sample;
+        return TRUE;
+    }
+
+    block_cache_release (wpc);
+    read_seek_table (wpc);
+    index = seek_index_find (wpc, sample);
+
+    if (index >= 0 && sample < wpc->seek_index [index].block_index + wpc->seek_index [index].block_samples) {
+        if ((frame = block_cache_lookup (wpc, wpc->seek_index [index].block_index)) != NULL) {
+            use_cached_frame (wpc, frame, sample, TRUE);
+            return TRUE;
+        }
+
+        if (!seek_uncached (wpc, frame_start = wpc->seek_index [index].block_index))
+            return FALSE;
+    }
+    else if (!seek_uncached (wpc, sample))
+        return FALSE;
+    else if (GET_BLOCK_INDEX (wpc->streams [0]->wphdr) < sample &&
+        !seek_uncached (wpc, GET_BLOCK_INDEX (wpc->streams [0]->wphdr)))
+            return FALSE;
+
+    if ((frame = load_cached_frame (wpc, frame_start == -1)) != NULL &&
+        sample >= frame->block_index && sample < frame->block_index + frame->num_samples) {
+            wpc->streams [0]->sample_index = sample;
+            return TRUE;
+    }
+
+    return seek_uncached (wpc, sample);
+}
+
+// The seek index maps sample indexes to the file positions of the blocks (actually
+// multichannel sequences) containing them. It is filled in as blocks are read
+// during decoding and seeking (only up to MAX_DECODE_INDEX_ENTRIES, so that just
+// playing a long file with small blocks doesn't use much memory), by scanning the
+// whole file with WavpackBuildSeekIndex(), from the seek table stored at the end
+// of the file by the encoder (if present), or from a file saved earlier (see
+// open_filename.c).
+// Once a block is in the index, seeking to any sample it contains requires no
+// searching at all, and the indexed blocks around an unknown area limit the
+// search to the area between them.
+
+// Check the header of the block that a seek is about to read. If the seek index is in use
+// and the header is not the initial block containing the desired sample then the index
+// is wrong (it may have come from an incorrect seek table, or a saved index for another
+// version of the file) so we discard it and return TRUE to have the seek done again by
+// searching. Otherwise the seek proceeds (and any other problems are caught there).
+
+static int retry_without_index (WavpackContext *wpc, WavpackHeader *wphdr, int64_t sample)
+{
+    int64_t block_index = GET_BLOCK_INDEX (*wphdr) - wpc->initial_index;
+
+    if (!wpc->seek_index_count || (!strncmp (wphdr->ckID, "wvpk", 4) && (wphdr->flags & INITIAL_BLOCK) &&
+        sample >= block_index && sample < block_index + wphdr->block_samples))
+            return FALSE;
+
+    wpc->seek_index_count = 0;
+    wpc->seek_table_read = TRUE;
+    free_streams (wpc);
+    CLEAR (*wphdr);
+    return TRUE;
+}
+
+// Scan the entire file (or correction file) for initial blocks, skipping over the
+// block contents, and add them to the index (or fill in their correction file
+// positions). Only the headers are checked, but the blocks are fully verified when
+// they are actually read, and any block that does not follow the previous one is
+// ignored.
+
+static void scan_blocks (WavpackContext *wpc, void *infile, int correction)
+{
+    int64_t filepos = 0, next_index = 0;
+    WavpackHeader wphdr;
+    uint32_t bcount;
+
+    if (wpc->reader->set_pos_abs (infile, 0))
+        return;
+
+    while ((bcount = read_next_header (wpc->reader, infile, &wphdr)) != (uint32_t) -1) {
+        int64_t block_index = GET_BLOCK_INDEX (wphdr) - wpc->initial_index;
+
+        filepos += bcount;
+
+        if (wphdr.block_samples && (wphdr.flags & INITIAL_BLOCK) && block_index >= next_index &&
+            block_index + wphdr.block_samples <= wpc->total_samples) {
+                if (correction) {
+                    int32_t index = seek_index_find (wpc, block_index);
+
+                    if (index >= 0 && wpc->seek_index [index].block_index == block_index &&
+                        wpc->seek_index [index].block_samples == wphdr.block_samples)
+                            wpc->seek_index [index].file2pos = filepos;
+                }
+                else
+                    seek_index_add (wpc, block_index, wphdr.block_samples, filepos, -1);
+
+                next_index = block_index + wphdr.block_samples;
+        }
+
+        if (wpc->reader->set_pos_rel (infile, wphdr.ckSize - 24, SEEK_CUR))
+            break;
+
+        filepos += wphdr.ckSize + 8;
+    }
+}
+
+// Build the complete seek index for the open file by reading every block header,
+// so that all subsequent seeks go directly to the correct block. This is normally
+// done at open time with OPEN_SEEK_INDEX, but may be called at any time (the
+// current decoding position is not affected). Returns FALSE if the file is not
+// seekable (or the total number of samples is not known).
+
+int WavpackBuildSeekIndex (WavpackContext *wpc)
+{
+    int64_t wv_pos, wvc_pos;
+
+    if (!wpc || wpc->stream3 || !wpc->reader || wpc->total_samples == -1 ||
+        !wpc->reader->can_seek (wpc->wv_in) || (wpc->open_flags & OPEN_STREAMING) ||
+        (wpc->wvc_flag && !wpc->reader->can_seek (wpc->wvc_in)))
+            return FALSE;
+
+    wv_pos = wpc->reader->get_pos (wpc->wv_in);
+    scan_blocks (wpc, wpc->wv_in, FALSE);
+    wpc->reader->set_pos_abs (wpc->wv_in, wv_pos);
+
+    if (wpc->wvc_flag) {
+        wvc_pos = wpc->reader->get_pos (wpc->wvc_in);
+        scan_blocks (wpc, wpc->wvc_in, TRUE);
+        wpc->reader->set_pos_abs (wpc->wvc_in, wvc_pos);
+    }
+
+    return TRUE;
+}
+
+// Return the file position of the block containing the specified sample if it is in
+// the seek index, or -1 if it is not. The first sample of the block and the number of
+// samples it contains are also returned (if the pointers are not NULL).
+
+int64_t WavpackLookupSeekIndex (WavpackContext *wpc, int64_t sample, int64_t *block_index, uint32_t *block_samples)
+{
+    int32_t index = wpc ? seek_index_find (wpc, sample) : -1;
+
+    if (index < 0 || sample >= wpc->seek_index [index].block_index + wpc->seek_index [index].block_samples)
+        return -1;
+
+    if (block_index) *block_index = wpc->seek_index [index].block_index;
+    if (block_samples) *block_samples = wpc->seek_index [index].block_samples;
+
+    return wpc->seek_index [index].filepos;
+}
+
 // Find a valid WavPack header, searching either from the current file position
 // (or from the specified position if not -1) and store it (endian corrected)
 // at the specified pointer. The return value is the exact file position of the
@@ -260,10 +439,10 @@ int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample)
 
 static int64_t find_header (WavpackStreamReader64 *reader, void *id, int64_t filepos, WavpackHeader *wphdr)
 {
-    unsigned char *buffer = (unsigned char *)malloc (BUFSIZE), *sp = buffer, *ep = buffer;
+    unsigned char *buffer = (unsigned char *)wp_malloc (BUFSIZE), *sp = buffer, *ep = buffer;
 
     if (filepos != (uint32_t) -1 && reader->set_pos_abs (id, filepos)) {
-        free (buffer);
+        wp_free (buffer);
         return -1;
     }
 
@@ -279,7 +458,7 @@ static int64_t find_header (WavpackStreamReader64 *reader, void *id, int64_t fil
         else {
             if (sp > ep)
                 if (reader->set_pos_rel (id, (int32_t)(sp - ep), SEEK_CUR)) {
-                    free (buffer);
+                    wp_free (buffer);
                     return -1;
                 }
 
@@ -290,7 +469,7 @@ static int64_t find_header (WavpackStreamReader64 *reader, void *id, int64_t fil
         ep += reader->read_bytes (id, ep, BUFSIZE - bleft);
 
         if (ep - sp < 32) {
-            free (buffer);
+            wp_free (buffer);
             return -1;
         }
 
@@ -302,7 +481,7 @@ static int64_t find_header (WavpackStreamReader64 *reader, void *id, int64_t fil
                     WavpackLittleEndianToNative (wphdr, WavpackHeaderFormat);
 
                     if (wphdr->block_samples && (wphdr->flags & INITIAL_BLOCK)) {
-                        free (buffer);
+                        wp_free (buffer);
                         return reader->get_pos (id) - (ep - sp + 4);
                     }
 
@@ -318,7 +497,8 @@ static int64_t find_header (WavpackStreamReader64 *reader, void *id, int64_t fil
 // assume that it is the file position of the valid header image contained in
 // the first stream and we can limit our search to either the portion above
 // or below that point. If a .wvc file is being used, then this must be called
-// for that file also.
+// for that file also. Any blocks in the seek index are used first, either to
+// return the position immediately or to narrow the search.
 
 static int64_t find_sample (WavpackContext *wpc, void *infile, int64_t header_pos, int64_t sample)
 {
@@ -344,6 +524,37 @@ static int64_t find_sample (WavpackContext *wpc, void *infile, int64_t header_po
             return header_pos;
     }
 
+    if (wpc->seek_index_count) {
+        int32_t index = seek_index_find (wpc, sample);
+        SeekIndexEntry *entry;
+        int64_t entry_pos;
+
+        if (index >= 0) {
+            entry = wpc->seek_index + index;
+            entry_pos = infile == wpc->wv_in ? entry->filepos : entry->file2pos;
+
+            if (entry_pos != -1) {
+                if (sample < entry->block_index + entry->block_samples)
+                    return entry_pos;
+
+                if (entry->block_index >= sample_pos1) {
+                    sample_pos1 = entry->block_index;
+                    file_pos1 = entry_pos;
+                }
+            }
+        }
+
+        if (++index < wpc->seek_index_count) {
+            entry = wpc->seek_index + index;
+            entry_pos = infile == wpc->wv_in ? entry->filepos : entry->file2pos;
+
+            if (entry_pos != -1 && entry->block_index <= sample_pos2) {
+                sample_pos2 = entry->block_index;
+                file_pos2 = entry_pos;
+            }
+        }
+    }
+
     while (1) {
         double bytes_per_sample;
         int64_t seek_pos;
@@ -20,6 +20,32 @@
 
 ///////////////////////////// executable code ////////////////////////////////
 
+// The decoders store the samples they return through one of these, which describes the
+// caller's buffer and the format that the samples are converted to as they are stored
+// there. The audio is always decoded (and interleaved) as 32-bit integers, so for that
+// format the samples are simply copied (or even decoded right into the caller's buffer).
+
+#define OUTPUT_INT32    0       // right-justified 32-bit integers (WavpackUnpackSamples())
+#define OUTPUT_INT16    1       // 16-bit integers
+#define OUTPUT_INT24    2       // packed 24-bit little-endian integers (3 bytes each)
+#define OUTPUT_FLOAT32  3       // 32-bit floats normalized to +/-1.0
+#define OUTPUT_PLANAR   4       // 32-bit integers in a separate buffer for each channel
+
+typedef struct {
+    void *buffer;                       // caller's interleaved buffer (or array of channel buffers)
+    uint32_t index;                     // complete samples stored there so far
+    int format, num_channels, value_bytes;
+    int float_data, shift, delta_exp;   // float source, integer shift (right), float exponent adjustment
+    float scale;                        // integer to float scaling
+} UnpackOutput;
+
+static void init_output (WavpackContext *wpc, UnpackOutput *out, int format, void *buffer);
+static uint32_t unpack_output (WavpackContext *wpc, UnpackOutput *out, uint32_t samples);
+static uint32_t unpack_samples_serial (WavpackContext *wpc, UnpackOutput *out, uint32_t samples);
+static uint32_t unpack_samples_threaded (WavpackContext *wpc, UnpackOutput *out, uint32_t samples);
+static uint32_t unpack_samples_cached (WavpackContext *wpc, UnpackOutput *out, uint32_t samples);
+static int create_read_ahead (WavpackContext *wpc);
+
 // Unpack the specified number of samples from the current file position.
 // Note that "samples" here refers to "complete" samples, which would be
 // 2 longs for stereo files or even more for multichannel files, so the
@@ -36,378 +62,1538 @@
 
 uint32_t WavpackUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint32_t samples)
 {
-    WavpackStream *wps = wpc->streams ? wpc->streams [wpc->current_stream = 0] : NULL;
-    int num_channels = wpc->config.num_channels, file_done = FALSE;
-    uint32_t bcount, samples_unpacked = 0, samples_to_unpack;
-    int32_t *bptr = buffer;
-
-    memset (buffer, 0, num_channels * samples * sizeof (int32_t));
+    uint32_t samples_unpacked;
+    UnpackOutput out;
 
 #ifdef ENABLE_LEGACY
-    if (wpc->stream3)
+    if (wpc->stream3) {
+        memset (buffer, 0, wpc->config.num_channels * samples * sizeof (int32_t));
         return unpack_samples3 (wpc, buffer, samples);
+    }
 #endif
 
-    while (samples) {
+    init_output (wpc, &out, OUTPUT_INT32, buffer);
+    samples_unpacked = unpack_output (wpc, &out, samples);
 
-        // if the current block has no audio, or it's not the first block of a multichannel
-        // sequence, or the sample we're on is past the last sample in this block...we need
-        // to free up the streams and read the next block
+#ifdef ENABLE_DSD
+    if (wpc->decimation_context)
+        decimate_dsd_run (wpc->decimation_context, buffer, samples_unpacked);
+#endif
 
-        if (!wps->wphdr.block_samples || !(wps->wphdr.flags & INITIAL_BLOCK) ||
-            wps->sample_index >= GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples) {
+    return samples_unpacked;
+}
 
-                int64_t nexthdrpos;
+// If worker threads are available (and we're not reducing the channel count) then
+// we decode using read-ahead, otherwise we use the regular serial decoder (or the
+// block cache, if there is one).
 
-                if (wpc->wrapper_bytes >= MAX_WRAPPER_BYTES)
-                    break;
+static uint32_t unpack_output (WavpackContext *wpc, UnpackOutput *out, uint32_t samples)
+{
+    if (wpc->workers && !wpc->reduced_channels && (wpc->read_ahead || create_read_ahead (wpc)))
+        return unpack_samples_threaded (wpc, out, samples);
+#ifndef NO_SEEKING
+    else if (wpc->block_cache)
+        return unpack_samples_cached (wpc, out, samples);
+#endif
+    else
+        return unpack_samples_serial (wpc, out, samples);
+}
 
-                free_streams (wpc);
-                nexthdrpos = wpc->reader->get_pos (wpc->wv_in);
-                bcount = read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr);
+// These are alternatives to WavpackUnpackSamples() that return the audio in the final formats that
+// most applications actually want: interleaved 16-bit integers, packed 24-bit little-endian
+// integers (3 bytes each), or 32-bit floats normalized to +/-1.0. Integer sources are shifted to
+// the requested width (truncating, which is lossless when the source has no more bits than the
+// destination) and floating-point sources are rounded and clipped to the integer formats. As
+// with WavpackUnpackSamples(), "samples" refers to complete samples (so the required memory at
+// "buffer" is 2, 3 or 4 * samples * num_channels bytes, where num_channels comes from
+// WavpackGetReducedChannels()) and the number of samples actually unpacked is returned. Native
+// DSD audio can not be returned this way (open with OPEN_DSD_AS_PCM instead).
+//
+// The samples are converted as the decoder stores them into the caller's buffer (in the same
+// loops that interleave the channels), so no intermediate 32-bit buffer or second pass over the
+// audio is needed. Only DSD audio decimated to PCM and legacy files (which are both produced
+// in 32-bit form by a final pass of their own) are still decoded a chunk at a time into a
+// buffer kept with the context and then converted.
+
+#define CONVERT_BUFFER_VALUES 16384     // 32-bit values decoded at once for the fallback (64K)
+
+static uint32_t unpack_converted (WavpackContext *wpc, int format, void *buffer, uint32_t samples);
+static int native_dsd (WavpackContext *wpc);
+
+uint32_t WavpackUnpackSamplesInt16 (WavpackContext *wpc, int16_t *buffer, uint32_t samples)
+{
+    return native_dsd (wpc) ? 0 : unpack_converted (wpc, OUTPUT_INT16, buffer, samples);
+}
 
-                if (bcount == (uint32_t) -1)
-                    break;
+uint32_t WavpackUnpackSamplesInt24 (WavpackContext *wpc, unsigned char *buffer, uint32_t samples)
+{
+    return native_dsd (wpc) ? 0 : unpack_converted (wpc, OUTPUT_INT24, buffer, samples);
+}
 
-                wpc->filepos = nexthdrpos + bcount;
+uint32_t WavpackUnpackSamplesFloat32 (WavpackContext *wpc, float *buffer, uint32_t samples)
+{
+    return native_dsd (wpc) ? 0 : unpack_converted (wpc, OUTPUT_FLOAT32, buffer, samples);
+}
 
-                // allocate the memory for the entire raw block and read it in
+// This is another alternative to WavpackUnpackSamples() that returns the samples in planar form
+// (i.e., non-interleaved) for applications that keep each channel in its own buffer. The
+// "channels" array contains a pointer for each channel (the count comes from
+// WavpackGetReducedChannels()), each with room for the requested number of samples. The audio
+// is identical to what WavpackUnpackSamples() returns (including native DSD bytes) and the
+// number of samples actually unpacked is returned. Like the conversions above, the channels
+// are stored directly into their buffers by the decoder instead of being interleaved first.
 
-                wps->blockbuff = (unsigned char *)malloc (wps->wphdr.ckSize + 8);
+uint32_t WavpackUnpackSamplesPlanar (WavpackContext *wpc, int32_t **channels, uint32_t samples)
+{
+    return unpack_converted (wpc, OUTPUT_PLANAR, channels, samples);
+}
 
-                if (!wps->blockbuff)
-                    break;
+static uint32_t unpack_convert_chunk (WavpackContext *wpc, uint32_t samples);
+static void store_values (const UnpackOutput *out, const int32_t *src, uint32_t count);
 
-                memcpy (wps->blockbuff, &wps->wphdr, 32);
+// Unpack the samples in the specified output format. Normally the decoder stores them into the
+// caller's buffer directly, otherwise they come from WavpackUnpackSamples() a chunk at a time.
 
-                if (wpc->reader->read_bytes (wpc->wv_in, wps->blockbuff + 32, wps->wphdr.ckSize - 24) !=
-                    wps->wphdr.ckSize - 24) {
-                        strcpy (wpc->error_message, "can't read all of last block!");
-                        wps->wphdr.block_samples = 0;
-                        wps->wphdr.ckSize = 24;
-                        break;
-                }
+static uint32_t unpack_converted (WavpackContext *wpc, int format, void *buffer, uint32_t samples)
+{
+    UnpackOutput out;
+    uint32_t count;
 
-                // render corrupt blocks harmless
-                if (!WavpackVerifySingleBlock (wps->blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
-                    wps->wphdr.ckSize = sizeof (WavpackHeader) - 8;
-                    wps->wphdr.block_samples = 0;
-                    memcpy (wps->blockbuff, &wps->wphdr, 32);
-                }
+    init_output (wpc, &out, format, buffer);
 
-                // potentially adjusting block_index must be done AFTER verifying block
+    if (!wpc->stream3 && !wpc->decimation_context)
+        return unpack_output (wpc, &out, samples);
 
-                if (wpc->open_flags & OPEN_STREAMING)
-                    SET_BLOCK_INDEX (wps->wphdr, wps->sample_index = 0);
-                else
-                    SET_BLOCK_INDEX (wps->wphdr, GET_BLOCK_INDEX (wps->wphdr) - wpc->initial_index);
+    while (out.index < samples && (count = unpack_convert_chunk (wpc, samples - out.index))) {
+        store_values (&out, wpc->convert_buffer, count * out.num_channels);
+        out.index += count;
+    }
 
-                memcpy (wps->blockbuff, &wps->wphdr, 32);
-                wps->init_done = FALSE;     // we have not yet called unpack_init() for this block
+    return out.index;
+}
 
-                // if this block has audio, but not the sample index we were expecting, flag an error
+// Unpack up to the specified number of samples (limited to what will fit in the conversion
+// buffer, which is allocated here on first use) and return the number actually unpacked.
 
-                if (wps->wphdr.block_samples && wps->sample_index != GET_BLOCK_INDEX (wps->wphdr))
-                    wpc->crc_errors++;
+static uint32_t unpack_convert_chunk (WavpackContext *wpc, uint32_t samples)
+{
+    int num_channels = wpc->config.num_channels;
+    uint32_t chunk_samples = CONVERT_BUFFER_VALUES / num_channels;
 
-                // if this block has audio, and we're in hybrid lossless mode, read the matching wvc block
+    if (!chunk_samples)
+        chunk_samples = 1;
 
-                if (wps->wphdr.block_samples && wpc->wvc_flag)
-                    read_wvc_block (wpc);
+    if (!wpc->convert_buffer) {
+        wpc->convert_buffer = (int32_t *)wp_malloc (chunk_samples * num_channels * sizeof (int32_t));
 
-                // if the block does NOT have any audio, call unpack_init() to process non-audio stuff
+        if (!wpc->convert_buffer) {
+            strcpy (wpc->error_message, "can't allocate conversion buffer!");
+            return 0;
+        }
+    }
 
-                if (!wps->wphdr.block_samples) {
-                    if (!wps->init_done && !unpack_init (wpc))
-                        wpc->crc_errors++;
+    return WavpackUnpackSamples (wpc, wpc->convert_buffer, samples < chunk_samples ? samples : chunk_samples);
+}
 
-                    wps->init_done = TRUE;
-                }
+// Native DSD audio (bytes) can't be converted to any of the PCM formats.
+
+static int native_dsd (WavpackContext *wpc)
+{
+    if ((wpc->config.qmode & QMODE_DSD_AUDIO) && !wpc->decimation_context) {
+        strcpy (wpc->error_message, "can't convert native DSD audio!");
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+///////////////////////////// output conversion //////////////////////////////
+
+// Set up an output descriptor for the caller's buffer, with the conversion parameters
+// for the specified format taken from the file's configuration.
+
+static void init_output (WavpackContext *wpc, UnpackOutput *out, int format, void *buffer)
+{
+    int bits = wpc->config.bytes_per_sample * 8;
+
+    out->buffer = buffer;
+    out->index = 0;
+    out->format = format;
+    out->num_channels = WavpackGetReducedChannels (wpc);
+    out->value_bytes = format == OUTPUT_INT16 ? 2 : format == OUTPUT_INT24 ? 3 : 4;
+    out->float_data = (wpc->config.flags & CONFIG_FLOAT_DATA) ? TRUE : FALSE;
+    out->delta_exp = out->float_data ? 127 - WavpackGetFloatNormExp (wpc) : 0;
+    out->shift = format == OUTPUT_INT16 ? bits - 16 : format == OUTPUT_INT24 ? bits - 24 : 0;
+    out->scale = bits ? 1.0f / (float)(1U << (bits - 1)) : 1.0f;
+}
+
+// Return the floating-point value with its exponent adjusted exactly like
+// WavpackFloatNormalize() would do it.
+
+static float normalize_float (f32 value, int delta_exp)
+{
+    float fvalue;
+    int exp;
+
+    if (delta_exp) {
+        if ((exp = get_exponent (value)) == 0 || exp + delta_exp <= 0)
+            value = 0;
+        else if (exp == 255 || (exp += delta_exp) >= 255) {
+            set_exponent (value, 255);
+            set_mantissa (value, 0);
         }
+        else
+            set_exponent (value, exp);
+    }
 
-        // if the current block has no audio, or it's not the first block of a multichannel
-        // sequence, or the sample we're on is past the last sample in this block...we need
-        // to loop back and read the next block
+    memcpy (&fvalue, &value, sizeof (fvalue));
+    return fvalue;
+}
 
-        if (!wps->wphdr.block_samples || !(wps->wphdr.flags & INITIAL_BLOCK) ||
-            wps->sample_index >= GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples)
-                continue;
+// Scale a normalized floating-point value to an integer of the specified full scale
+// (i.e., 32768 or 8388608), rounding and clipping.
 
-        // There seems to be some missing data, like a block was corrupted or something.
-        // If it's not too much data, just fill in with silence here and loop back.
+static int32_t float_to_int (float value, float full_scale)
+{
+    value *= full_scale;
 
-        if (wps->sample_index < GET_BLOCK_INDEX (wps->wphdr)) {
-            int32_t zvalue = (wps->wphdr.flags & DSD_FLAG) ? 0x55 : 0;
+    return value >= full_scale - 1.0f ? (int32_t) full_scale - 1 : value <= -full_scale ? (int32_t) -full_scale :
+        (int32_t)(value < 0.0f ? value - 0.5f : value + 0.5f);
+}
 
-            samples_to_unpack = (uint32_t) (GET_BLOCK_INDEX (wps->wphdr) - wps->sample_index);
+// Convert "count" 32-bit decoded values (taken "src_stride" values apart) to the output
+// format and store them at "dst" ("dst_stride" values apart).
 
-            if (!samples_to_unpack || samples_to_unpack > 262144) {
-                strcpy (wpc->error_message, "discontinuity found, aborting file!");
-                wps->wphdr.block_samples = 0;
-                wps->wphdr.ckSize = 24;
-                break;
-            }
+static void convert_values (const UnpackOutput *out, void *dst, int dst_stride, const int32_t *src, int src_stride, uint32_t count)
+{
+    int shift = out->shift, delta_exp = out->delta_exp;
+    uint32_t i;
 
-            if (samples_to_unpack > samples)
-                samples_to_unpack = samples;
+    switch (out->format) {
+        case OUTPUT_INT32:
+        case OUTPUT_PLANAR: {
+            int32_t *dptr = (int32_t *) dst;
 
-            wps->sample_index += samples_to_unpack;
-            samples_unpacked += samples_to_unpack;
-            samples -= samples_to_unpack;
+            for (i = 0; i < count; ++i, dptr += dst_stride, src += src_stride)
+                *dptr = *src;
 
-            samples_to_unpack *= (wpc->reduced_channels ? wpc->reduced_channels : num_channels);
+            break;
+        }
 
-            while (samples_to_unpack--)
-                *bptr++ = zvalue;
+        case OUTPUT_INT16: {
+            int16_t *dptr = (int16_t *) dst;
 
-            continue;
+            if (out->float_data)
+                for (i = 0; i < count; ++i, dptr += dst_stride, src += src_stride)
+                    *dptr = (int16_t) float_to_int (normalize_float (*src, delta_exp), 32768.0f);
+            else if (shift > 0)
+                for (i = 0; i < count; ++i, dptr += dst_stride, src += src_stride)
+                    *dptr = (int16_t)(*src >> shift);
+            else
+                for (i = 0; i < count; ++i, dptr += dst_stride, src += src_stride)
+                    *dptr = (int16_t)(*src << -shift);
+
+            break;
         }
 
-        // calculate number of samples to process from this block, then initialize the decoder for
-        // this block if we haven't already
+        case OUTPUT_INT24: {
+            unsigned char *dptr = (unsigned char *) dst;
+            int32_t value;
 
-        samples_to_unpack = (uint32_t) (GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples - wps->sample_index);
+            for (i = 0; i < count; ++i, dptr += dst_stride * 3, src += src_stride) {
+                if (out->float_data)
+                    value = float_to_int (normalize_float (*src, delta_exp), 8388608.0f);
+                else if (shift > 0)
+                    value = *src >> shift;
+                else
+                    value = *src << -shift;
 
-        if (samples_to_unpack > samples)
-            samples_to_unpack = samples;
+                dptr [0] = (unsigned char) value;
+                dptr [1] = (unsigned char)(value >> 8);
+                dptr [2] = (unsigned char)(value >> 16);
+            }
 
-        if (!wps->init_done && !unpack_init (wpc))
-            wpc->crc_errors++;
+            break;
+        }
 
-        wps->init_done = TRUE;
+        case OUTPUT_FLOAT32: {
+            float *dptr = (float *) dst, scale = out->scale;
 
-        // if this block is not the final block of a multichannel sequence (and we're not truncating
-        // to stereo), then enter this conditional block...otherwise we just unpack the samples directly
+            if (out->float_data)
+                for (i = 0; i < count; ++i, dptr += dst_stride, src += src_stride)
+                    *dptr = normalize_float (*src, delta_exp);
+            else
+                for (i = 0; i < count; ++i, dptr += dst_stride, src += src_stride)
+                    *dptr = (float) *src * scale;
 
-        if (!wpc->reduced_channels && !(wps->wphdr.flags & FINAL_BLOCK)) {
-            int32_t *temp_buffer = (int32_t *)calloc (1, samples_to_unpack * 8), *src, *dst;
-            int offset = 0;     // offset to next channel in sequence (0 to num_channels - 1)
-            uint32_t samcnt;
+            break;
+        }
+    }
+}
 
-            // since we are getting samples from multiple bocks in a multichannel sequence, we must
-            // allocate a temporary buffer to unpack to so that we can re-interleave the samples
+// Store "count" values of one channel (taken "src_stride" values apart) at the output's
+// current position.
 
-            if (!temp_buffer)
-                break;
+static void store_channel (const UnpackOutput *out, int chan, const int32_t *src, int src_stride, uint32_t count)
+{
+    if (out->format == OUTPUT_PLANAR)
+        convert_values (out, ((int32_t **) out->buffer) [chan] + out->index, 1, src, src_stride, count);
+    else {
+        uint32_t index = out->index * out->num_channels + chan;
 
-            // loop through all the streams...
+        convert_values (out, (char *) out->buffer + index * out->value_bytes, out->num_channels, src, src_stride, count);
+    }
+}
 
-            while (1) {
+// Store "count" consecutive 32-bit values (normally complete interleaved samples) at the
+// output's current position. For planar output they are dealt out to the channels.
 
-                // if the stream has not been allocated and corresponding block read, do that here...
+static void store_values (const UnpackOutput *out, const int32_t *src, uint32_t count)
+{
+    int num_channels = out->num_channels, chan;
 
-                if (wpc->current_stream == wpc->num_streams) {
-                    wpc->streams = (WavpackStream **)realloc (wpc->streams, (wpc->num_streams + 1) * sizeof (wpc->streams [0]));
+    if (out->format == OUTPUT_PLANAR)
+        for (chan = 0; chan < num_channels && (uint32_t) chan < count; ++chan)
+            store_channel (out, chan, src + chan, num_channels, (count - chan + num_channels - 1) / num_channels);
+    else {
+        char *dst = (char *) out->buffer + out->index * num_channels * out->value_bytes;
 
-                    if (!wpc->streams)
-                        break;
+        if (out->format == OUTPUT_INT32)
+            memcpy (dst, src, count * sizeof (int32_t));
+        else
+            convert_values (out, dst, 1, src, 1, count);
+    }
+}
 
-                    wps = wpc->streams [wpc->num_streams++] = (WavpackStream *)malloc (sizeof (WavpackStream));
+// Fill the specified number of 32-bit values with silence (which is 0x55 for DSD audio).
 
-                    if (!wps)
-                        break;
+static void fill_silence (int32_t *dst, uint32_t count, int dsd)
+{
+    if (dsd)
+        while (count--)
+            *dst++ = 0x55;
+    else
+        memset (dst, 0, count * sizeof (int32_t));
+}
 
-                    CLEAR (*wps);
-                    bcount = read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr);
+// Store silence for "count" complete samples starting at the specified position of the output.
 
-                    if (bcount == (uint32_t) -1) {
-                        wpc->streams [0]->wphdr.block_samples = 0;
-                        wpc->streams [0]->wphdr.ckSize = 24;
-                        file_done = TRUE;
-                        break;
-                    }
+static void store_silence (const UnpackOutput *out, uint32_t index, uint32_t count, int dsd)
+{
+    int num_channels = out->num_channels, chan;
 
-                    wps->blockbuff = (unsigned char *)malloc (wps->wphdr.ckSize + 8);
+    if (out->format == OUTPUT_PLANAR)
+        for (chan = 0; chan < num_channels; ++chan)
+            fill_silence (((int32_t **) out->buffer) [chan] + index, count, dsd);
+    else {
+        char *dst = (char *) out->buffer + index * num_channels * out->value_bytes;
 
-                    if (!wps->blockbuff)
-                        break;
+        if (out->format == OUTPUT_INT32)
+            fill_silence ((int32_t *) dst, count * num_channels, dsd);
+        else
+            memset (dst, 0, count * num_channels * out->value_bytes);
+    }
+}
 
-                    memcpy (wps->blockbuff, &wps->wphdr, 32);
+/////////////////////////// multichannel sequences ///////////////////////////
 
-                    if (wpc->reader->read_bytes (wpc->wv_in, wps->blockbuff + 32, wps->wphdr.ckSize - 24) !=
-                        wps->wphdr.ckSize - 24) {
-                            wpc->streams [0]->wphdr.block_samples = 0;
-                            wpc->streams [0]->wphdr.ckSize = 24;
-                            file_done = TRUE;
-                            break;
-                    }
+// These functions read and decode the blocks of a multichannel sequence (a "frame") and
+// handle the errors and gaps between them. They are shared by the serial decoder (which
+// calls them for each chunk of samples the application asks for) and the read-ahead
+// decoder (which calls them once for each frame, decoding it on a worker thread).
 
-                    // render corrupt blocks harmless
-                    if (!WavpackVerifySingleBlock (wps->blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
-                        wps->wphdr.ckSize = sizeof (WavpackHeader) - 8;
-                        wps->wphdr.block_samples = 0;
-                        memcpy (wps->blockbuff, &wps->wphdr, 32);
-                    }
+typedef struct {
+    WorkerJob job;
+    WavpackContext cxt;                     // copy of frame's context with "current_stream" set
+    int32_t *buffer;
+    uint32_t sample_count;
+} StreamJob;
 
-                    // potentially adjusting block_index must be done AFTER verifying block
+// Read the next WavPack block from the file into the specified stream and prepare it
+// for decoding. Returns 0 on success, 1 if no more headers could be found (or there's
+// no memory for the block), or 2 if the block could not be completely read. If
+// "filepos" is not NULL, the file position of the header is stored.
 
-                    if (wpc->open_flags & OPEN_STREAMING)
-                        SET_BLOCK_INDEX (wps->wphdr, wps->sample_index = 0);
-                    else
-                        SET_BLOCK_INDEX (wps->wphdr, GET_BLOCK_INDEX (wps->wphdr) - wpc->initial_index);
+static int read_stream_block (WavpackContext *wpc, WavpackStream *wps, int64_t *filepos)
+{
+    int64_t nexthdrpos = wpc->reader->get_pos (wpc->wv_in);
+    uint32_t bcount = read_next_header (wpc->reader, wpc->wv_in, &wps->wphdr);
+    int result;
 
-                    memcpy (wps->blockbuff, &wps->wphdr, 32);
+    if (bcount == (uint32_t) -1)
+        return 1;
 
-                    // if this block has audio, and we're in hybrid lossless mode, read the matching wvc block
+    if (filepos)
+        *filepos = nexthdrpos + bcount;
 
-                    if (wpc->wvc_flag)
-                        read_wvc_block (wpc);
+    // allocate the memory for the entire raw block and read it in
 
-                    // initialize the unpacker for this block
+    if ((result = read_block_buffer (wpc, wpc->wv_in, &wps->wphdr, &wps->blockbuff)) != 0)
+        return result;
 
-                    if (!unpack_init (wpc))
-                        wpc->crc_errors++;
+    // render corrupt blocks harmless
+    if (!WavpackVerifySingleBlock (wps->blockbuff, !(wpc->open_flags & OPEN_NO_CHECKSUM))) {
+        wps->wphdr.ckSize = sizeof (WavpackHeader) - 8;
+        wps->wphdr.block_samples = 0;
+    }
 
-                    wps->init_done = TRUE;
-                }
-                else
-                    wps = wpc->streams [wpc->current_stream];
+    // potentially adjusting block_index must be done AFTER verifying block
 
-                // unpack the correct number of samples (either mono or stereo) into the temp buffer
+    if (wpc->open_flags & OPEN_STREAMING)
+        SET_BLOCK_INDEX (wps->wphdr, wps->sample_index = 0);
+    else
+        SET_BLOCK_INDEX (wps->wphdr, GET_BLOCK_INDEX (wps->wphdr) - wpc->initial_index);
 
-#ifdef ENABLE_DSD
-                if (wps->wphdr.flags & DSD_FLAG)
-                    unpack_dsd_samples (wpc, src = temp_buffer, samples_to_unpack);
-                else
-#endif
-                    unpack_samples (wpc, src = temp_buffer, samples_to_unpack);
+    store_block_header (wpc, &wps->blockbuff, &wps->wphdr);
+    wps->init_done = FALSE;     // we have not yet called unpack_init() for this block
+    return 0;
+}
 
-                samcnt = samples_to_unpack;
-                dst = bptr + offset;
+// With the first block of a multichannel sequence loaded and initialized, read (if not
+// already loaded) and initialize the rest of the sequence's blocks, and return the number
+// of streams that are to be decoded. The errors that must be flagged for every chunk of
+// samples decoded from this sequence (a stereo block with room for only one channel, or
+// a short sequence) are added to "chunk_errors", and "file_done" is set if we ran out of
+// file in the middle of the sequence. The context's stream array may be reallocated.
 
-                // if the block is mono, copy the samples from the single channel into the destination
-                // using num_channels as the stride
+static int load_sequence_streams (WavpackContext *wpc, uint32_t *chunk_errors, int *file_done)
+{
+    int num_channels = wpc->config.num_channels, offset = 0, num_decode = 0;
+    WavpackStream *wps = wpc->streams [0];
 
-                if (wps->wphdr.flags & MONO_FLAG) {
-                    while (samcnt--) {
-                        dst [0] = *src++;
-                        dst += num_channels;
-                    }
+    // if this block is the final block of a multichannel sequence (or we're truncating
+    // to stereo) then we decode just this one stream, but we must catch the situation
+    // where we have only one channel but run into a stereo block
 
-                    offset++;
-                }
+    if (wpc->reduced_channels || (wps->wphdr.flags & FINAL_BLOCK)) {
+        if (!(wps->wphdr.flags & MONO_FLAG) && (num_channels == 1 || wpc->reduced_channels == 1))
+            (*chunk_errors)++;
 
-                // if the block is stereo, and we don't have room for two more channels, just copy one
-                // and flag an error
+        return 1;
+    }
 
-                else if (offset == num_channels - 1) {
-                    while (samcnt--) {
-                        dst [0] = src [0];
-                        dst += num_channels;
-                        src += 2;
-                    }
+    for (wpc->current_stream = 0;; wpc->current_stream++) {
 
-                    wpc->crc_errors++;
-                    offset++;
-                }
+        // if the stream has not been allocated and corresponding block read, do that here...
 
-                // otherwise copy the stereo samples into the destination
+        if (wpc->current_stream == wpc->num_streams) {
+            WavpackStream **streams = (WavpackStream **)wp_realloc (wpc->streams, (wpc->num_streams + 1) * sizeof (wpc->streams [0]));
 
-                else {
-                    while (samcnt--) {
-                        dst [0] = *src++;
-                        dst [1] = *src++;
-                        dst += num_channels;
-                    }
+            if (!streams)
+                break;
 
-                    offset += 2;
-                }
+            wpc->streams = streams;
 
-                // check several clues that we're done with this set of blocks and exit if we are; else do next stream
+            if (!(wps = get_spare_stream (wpc)))
+                break;
 
-                if ((wps->wphdr.flags & FINAL_BLOCK) || wpc->current_stream == wpc->max_streams - 1 || offset == num_channels)
-                    break;
-                else
-                    wpc->current_stream++;
+            wpc->streams [wpc->num_streams++] = wps;
+
+            if (read_stream_block (wpc, wps, NULL)) {
+                *file_done = TRUE;
+                break;
             }
 
-            // if we didn't get all the channels we expected, mute the buffer and flag an error
+            // if we're in hybrid lossless mode, read the matching wvc block
 
-            if (offset != num_channels) {
-                if (wps->wphdr.flags & DSD_FLAG) {
-                    int samples_to_zero = samples_to_unpack * num_channels;
-                    int32_t *zptr = bptr;
+            if (wpc->wvc_flag)
+                read_wvc_block (wpc);
 
-                    while (samples_to_zero--)
-                        *zptr++ = 0x55;
-                }
-                else
-                    memset (bptr, 0, samples_to_unpack * num_channels * 4);
+            // initialize the unpacker for this block
 
+            if (!unpack_init (wpc))
                 wpc->crc_errors++;
-            }
-
-            // go back to the first stream (we're going to leave them all loaded for now because they might have more samples)
-            // and free the temp buffer
 
-            wps = wpc->streams [wpc->current_stream = 0];
-            free (temp_buffer);
+            wps->init_done = TRUE;
         }
-        // catch the error situation where we have only one channel but run into a stereo block
-        // (this avoids overwriting the caller's buffer)
-        else if (!(wps->wphdr.flags & MONO_FLAG) && (num_channels == 1 || wpc->reduced_channels == 1)) {
-            memset (bptr, 0, samples_to_unpack * sizeof (*bptr));
-            wps->sample_index += samples_to_unpack;
-            wpc->crc_errors++;
+        else
+            wps = wpc->streams [wpc->current_stream];
+
+        num_decode++;
+
+        // a stereo block with room for only one more channel is decoded, but is an error
+
+        if (wps->wphdr.flags & MONO_FLAG)
+            offset++;
+        else if (offset == num_channels - 1) {
+            (*chunk_errors)++;
+            offset++;
         }
-#ifdef ENABLE_DSD
-        else if (wps->wphdr.flags & DSD_FLAG)
-            unpack_dsd_samples (wpc, bptr, samples_to_unpack);
-#endif
         else
-            unpack_samples (wpc, bptr, samples_to_unpack);
+            offset += 2;
 
-        if (file_done) {
-            strcpy (wpc->error_message, "can't read all of last block!");
+        // check several clues that we're done with this set of blocks and exit if we are; else do next stream
+
+        if ((wps->wphdr.flags & FINAL_BLOCK) || wpc->current_stream == wpc->max_streams - 1 || offset == num_channels)
             break;
-        }
+    }
 
-        if (wpc->reduced_channels)
-            bptr += samples_to_unpack * wpc->reduced_channels;
-        else
-            bptr += samples_to_unpack * num_channels;
+    // if we didn't get all the channels we expected, the samples will be muted
 
-        samples_unpacked += samples_to_unpack;
-        samples -= samples_to_unpack;
+    if (offset != num_channels)
+        (*chunk_errors)++;
 
-        // if we just finished a block, check for a calculated crc error
-        // (and back up the streams a little if possible in case we passed a header)
+    wpc->current_stream = 0;
+    return num_decode;
+}
 
-        if (wps->sample_index == GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples) {
-            if (check_crc_error (wpc)) {
-                int32_t *zptr = bptr, zvalue = (wps->wphdr.flags & DSD_FLAG) ? 0x55 : 0;
-                uint32_t samples_to_zero = wps->wphdr.block_samples;
+// Decode the specified number of samples from the context's current stream.
 
-                if (samples_to_zero > samples_to_unpack)
-                    samples_to_zero = samples_to_unpack;
+static void unpack_stream_samples (WavpackContext *wpc, int32_t *buffer, uint32_t sample_count)
+{
+#ifdef ENABLE_DSD
+    if (wpc->streams [wpc->current_stream]->wphdr.flags & DSD_FLAG)
+        unpack_dsd_samples (wpc, buffer, sample_count);
+    else
+#endif
+        unpack_samples (wpc, buffer, sample_count);
+}
 
-                samples_to_zero *= (wpc->reduced_channels ? wpc->reduced_channels : num_channels);
+// Decode a single stream of a multichannel sequence (executed on a worker thread).
 
-                while (samples_to_zero--)
-                    *--zptr = zvalue;
+static void decode_stream (void *param)
+{
+    StreamJob *sj = (StreamJob *) param;
 
-                if (wps->blockbuff && wpc->reader->can_seek (wpc->wv_in)) {
-                    int32_t rseek = ((WavpackHeader *) wps->blockbuff)->ckSize / 3;
-                    wpc->reader->set_pos_rel (wpc->wv_in, (rseek > 16384) ? -16384 : -rseek, SEEK_CUR);
-                }
+    unpack_stream_samples (&sj->cxt, sj->buffer, sj->sample_count);
+}
 
-                if (wpc->wvc_flag && wps->block2buff && wpc->reader->can_seek (wpc->wvc_in)) {
-                    int32_t rseek = ((WavpackHeader *) wps->block2buff)->ckSize / 3;
-                    wpc->reader->set_pos_rel (wpc->wvc_in, (rseek > 16384) ? -16384 : -rseek, SEEK_CUR);
-                }
+// Decode the specified number of samples from the first "num_decode" streams of the loaded
+// multichannel sequence (see load_sequence_streams()) and store them interleaved at the
+// output's current position (which is not advanced here). The temp buffer holds the
+// samples of one stream at a time, unless "stream_jobs" is not NULL, in which case all
+// the streams except the first are decoded in parallel by the workers (each into its own
+// slice of the temp buffer) and then stored in order. A single stream is decoded right
+// into the output if that holds 32-bit integers, otherwise it also goes through the temp
+// buffer (so that must always be supplied unless the output format is OUTPUT_INT32).
+
+static void unpack_sequence (WavpackContext *wpc, UnpackOutput *out, int32_t *temp_buffer, uint32_t sample_count,
+    int num_decode, void *workers, StreamJob *stream_jobs)
+{
+    WavpackStream *wps = wpc->streams [wpc->current_stream = 0];
+    int out_channels = out->num_channels;
 
-                wpc->crc_errors++;
+    if (!wpc->reduced_channels && !(wps->wphdr.flags & FINAL_BLOCK)) {
+        int offset = 0;     // offset to next channel in sequence (0 to num_channels - 1)
+
+        // if we can, start all the streams except the first decoding on the other workers
+
+        if (stream_jobs && num_decode > 1) {
+            int si;
+
+            for (si = 1; si < num_decode; ++si) {
+                StreamJob *sj = stream_jobs + si;
+
+                sj->cxt = *wpc;
+                sj->cxt.current_stream = si;
+                sj->buffer = temp_buffer + si * sample_count * 2;
+                sj->sample_count = sample_count;
+                sj->job.function = decode_stream;
+                sj->job.param = sj;
+                workers_submit (workers, &sj->job);
             }
         }
 
-        if (wpc->total_samples != -1 && wps->sample_index == wpc->total_samples)
-            break;
+        for (; wpc->current_stream < num_decode; wpc->current_stream++) {
+            int32_t *src = temp_buffer;
+
+            wps = wpc->streams [wpc->current_stream];
+
+            if (stream_jobs && wpc->current_stream) {
+                src += wpc->current_stream * sample_count * 2;
+                workers_wait (workers, &stream_jobs [wpc->current_stream].job);
+            }
+            else
+                unpack_stream_samples (wpc, src, sample_count);
+
+            // if the block is mono, store the samples from the single channel into the output
+
+            if (wps->wphdr.flags & MONO_FLAG) {
+                store_channel (out, offset, src, 1, sample_count);
+                offset++;
+            }
+
+            // if the block is stereo, and we don't have room for two more channels, just store one
+
+            else if (offset == out_channels - 1) {
+                store_channel (out, offset, src, 2, sample_count);
+                offset++;
+            }
+
+            // otherwise store the stereo samples into the output
+
+            else {
+                store_channel (out, offset, src, 2, sample_count);
+                store_channel (out, offset + 1, src + 1, 2, sample_count);
+                offset += 2;
+            }
+        }
+
+        // if we didn't get all the channels we expected, mute the output
+
+        if (offset != out_channels)
+            store_silence (out, out->index, sample_count, wps->wphdr.flags & DSD_FLAG);
+    }
+    // a stereo block with only one channel is an error (this avoids overwriting the caller's buffer)
+    else if (!(wps->wphdr.flags & MONO_FLAG) && out_channels == 1) {
+        store_silence (out, out->index, sample_count, FALSE);
+        wps->sample_index += sample_count;
     }
+    else {
+        int block_channels = (wps->wphdr.flags & MONO_FLAG) ? 1 : 2;
 
-#ifdef ENABLE_DSD
-    if (wpc->decimation_context)
-        decimate_dsd_run (wpc->decimation_context, buffer, samples_unpacked);
-#endif
+        // if the block does not fill every channel then the remainder must be zero (the
+        // caller's buffer is not cleared in advance)
+
+        if (block_channels != out_channels)
+            store_silence (out, out->index, sample_count, FALSE);
+
+        // the samples of the block are stored consecutively (not spread over the channels)
+
+        if (out->format == OUTPUT_INT32)
+            unpack_stream_samples (wpc, (int32_t *) out->buffer + out->index * out_channels, sample_count);
+        else {
+            unpack_stream_samples (wpc, temp_buffer, sample_count);
+            store_values (out, temp_buffer, sample_count * block_channels);
+        }
+    }
+
+    wpc->current_stream = 0;
+}
+
+// There seems to be some missing data before the sequence starting at "start_index", like a
+// block was corrupted or something. If it's not too much data, fill in (up to the specified
+// number of samples of) it with silence and return the number of samples filled. Otherwise
+// return zero to abort the file.
+
+static uint32_t fill_missing_samples (WavpackContext *wpc, UnpackOutput *out, uint32_t samples, int64_t start_index, int dsd)
+{
+    WavpackStream *wps = wpc->streams [0];
+    uint32_t samples_to_fill = (uint32_t) (start_index - wps->sample_index);
+
+    if (!samples_to_fill || samples_to_fill > 262144) {
+        strcpy (wpc->error_message, "discontinuity found, aborting file!");
+        wps->wphdr.block_samples = 0;
+        wps->wphdr.ckSize = 24;
+        return 0;
+    }
+
+    if (samples_to_fill > samples)
+        samples_to_fill = samples;
+
+    wps->sample_index += samples_to_fill;
+    store_silence (out, out->index, samples_to_fill, dsd);
+    return samples_to_fill;
+}
+
+// A crc error was detected at the end of a sequence, so mute the samples of its last block
+// that were just returned (up to "samples_returned" of them, ending at the output's current
+// position) and flag it.
+
+static void mute_crc_error (WavpackContext *wpc, UnpackOutput *out, uint32_t samples_returned)
+{
+    WavpackStream *wps = wpc->streams [0];
+    uint32_t samples_to_zero = wps->wphdr.block_samples;
+
+    if (samples_to_zero > samples_returned)
+        samples_to_zero = samples_returned;
+
+    store_silence (out, out->index - samples_to_zero, samples_to_zero, wps->wphdr.flags & DSD_FLAG);
+    wpc->crc_errors++;
+}
+
+// After a crc error, back up the file(s) a little if possible in case we passed a header.
+
+static void back_up_files (WavpackContext *wpc)
+{
+    WavpackStream *wps = wpc->streams [0];
+
+    if (wps->blockbuff && wpc->reader->can_seek (wpc->wv_in)) {
+        int32_t rseek = ((WavpackHeader *) wps->blockbuff)->ckSize / 3;
+        wpc->reader->set_pos_rel (wpc->wv_in, (rseek > 16384) ? -16384 : -rseek, SEEK_CUR);
+    }
+
+    if (wpc->wvc_flag && wps->block2buff && wpc->reader->can_seek (wpc->wvc_in)) {
+        int32_t rseek = ((WavpackHeader *) wps->block2buff)->ckSize / 3;
+        wpc->reader->set_pos_rel (wpc->wvc_in, (rseek > 16384) ? -16384 : -rseek, SEEK_CUR);
+    }
+}
+
+///////////////////////////// serial decoding ////////////////////////////////
+
+// This is the regular (single-threaded) decoder that reads, decodes, and
+// interleaves the blocks one at a time as the samples are requested.
+
+static uint32_t unpack_samples_serial (WavpackContext *wpc, UnpackOutput *out, uint32_t samples)
+{
+    WavpackStream *wps = wpc->streams ? wpc->streams [wpc->current_stream = 0] : NULL;
+    uint32_t samples_unpacked = 0, samples_to_unpack;
+    int file_done = FALSE, result, num_decode;
+
+    while (samples) {
+
+        // if the current block has no audio, or it's not the first block of a multichannel
+        // sequence, or the sample we're on is past the last sample in this block...we need
+        // to free up the streams and read the next block
+
+        if (!wps->wphdr.block_samples || !(wps->wphdr.flags & INITIAL_BLOCK) ||
+            wps->sample_index >= GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples) {
+
+                if (wpc->wrapper_bytes >= MAX_WRAPPER_BYTES)
+                    break;
+
+                free_streams (wpc);
+                result = read_stream_block (wpc, wps, &wpc->filepos);
+
+                if (result == 1)
+                    break;
+
+                if (result == 2) {
+                    strcpy (wpc->error_message, "can't read all of last block!");
+                    wps->wphdr.block_samples = 0;
+                    wps->wphdr.ckSize = 24;
+                    break;
+                }
+
+                // if this block has audio, but not the sample index we were expecting, flag an error
+
+                if (wps->wphdr.block_samples && wps->sample_index != GET_BLOCK_INDEX (wps->wphdr))
+                    wpc->crc_errors++;
+
+                // if this block has audio, and we're in hybrid lossless mode, read the matching wvc block
+
+                if (wps->wphdr.block_samples && wpc->wvc_flag)
+                    read_wvc_block (wpc);
+
+                // if the block does NOT have any audio, call unpack_init() to process non-audio stuff
+
+                if (!wps->wphdr.block_samples) {
+                    if (!wps->init_done && !unpack_init (wpc))
+                        wpc->crc_errors++;
+
+                    wps->init_done = TRUE;
+                }
+        }
+
+        // if the current block has no audio, or it's not the first block of a multichannel
+        // sequence, or the sample we're on is past the last sample in this block...we need
+        // to loop back and read the next block
+
+        if (!wps->wphdr.block_samples || !(wps->wphdr.flags & INITIAL_BLOCK) ||
+            wps->sample_index >= GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples)
+                continue;
+
+        // if there's some missing data, fill it in with silence and loop back
+
+        if (wps->sample_index < GET_BLOCK_INDEX (wps->wphdr)) {
+            if (!(samples_to_unpack = fill_missing_samples (wpc, out, samples, GET_BLOCK_INDEX (wps->wphdr), wps->wphdr.flags & DSD_FLAG)))
+                break;
+
+            out->index += samples_to_unpack;
+            samples_unpacked += samples_to_unpack;
+            samples -= samples_to_unpack;
+            continue;
+        }
+
+        // calculate number of samples to process from this block, then initialize the decoder for
+        // this block if we haven't already
+
+        samples_to_unpack = (uint32_t) (GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples - wps->sample_index);
+
+        if (samples_to_unpack > samples)
+            samples_to_unpack = samples;
+
+        if (!wps->init_done && !unpack_init (wpc))
+            wpc->crc_errors++;
+
+        wps->init_done = TRUE;
+
+        // load the rest of the multichannel sequence (we're going to leave the streams loaded
+        // because they might have more samples), and stop if it was cut short
+
+        num_decode = load_sequence_streams (wpc, &wpc->crc_errors, &file_done);
+        wps = wpc->streams [0];
+
+        if (file_done) {
+            strcpy (wpc->error_message, "can't read all of last block!");
+            wps->sample_index += samples_to_unpack;
+            wps->wphdr.block_samples = 0;
+            wps->wphdr.ckSize = 24;
+            break;
+        }
+
+        // since we might be getting samples from multiple blocks, we must have a temporary buffer
+        // to unpack to so that we can re-interleave the samples (or convert them if that's not
+        // done by the decoder itself), which is kept in the context and only grows
+
+        if (((!wpc->reduced_channels && !(wps->wphdr.flags & FINAL_BLOCK)) || out->format != OUTPUT_INT32) &&
+            wpc->temp_buffer_size < samples_to_unpack * 2) {
+            wp_free (wpc->temp_buffer);
+            wpc->temp_buffer = (int32_t *)wp_malloc (samples_to_unpack * 8);
+            wpc->temp_buffer_size = wpc->temp_buffer ? samples_to_unpack * 2 : 0;
+
+            if (!wpc->temp_buffer)
+                break;
+        }
+
+        unpack_sequence (wpc, out, wpc->temp_buffer, samples_to_unpack, num_decode, NULL, NULL);
+
+        out->index += samples_to_unpack;
+        samples_unpacked += samples_to_unpack;
+        samples -= samples_to_unpack;
+
+        // if we just finished a block, check for a calculated crc error
+
+        if (wps->sample_index == GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples && check_crc_error (wpc)) {
+            mute_crc_error (wpc, out, samples_to_unpack);
+            back_up_files (wpc);
+        }
+
+        if (wpc->total_samples != -1 && wps->sample_index == wpc->total_samples)
+            break;
+    }
+
+    return samples_unpacked;
+}
+
+#ifndef NO_SEEKING
+
+///////////////////////////// cached decoding ////////////////////////////////
+
+// When a block cache is attached (see block_cache.c) the audio is returned a frame
+// at a time from the cache. When we reach the start of a frame that's not cached,
+// the serial decoder decodes the whole frame into a new cache entry, which we then
+// return from like any other. Frames that can't be handled this way (because we're
+// not at their start, they're preceded by non-audio blocks, or there's a
+// discontinuity) are simply passed through from the serial decoder.
+
+static uint32_t unpack_samples_cached (WavpackContext *wpc, UnpackOutput *out, uint32_t samples)
+{
+    uint32_t samples_unpacked = 0, samples_to_unpack;
+
+    while (samples) {
+        WavpackStream *wps = wpc->streams [wpc->current_stream = 0];
+        CachedFrame *frame = (CachedFrame *) wpc->cache_frame;
+
+        if (frame || (frame = load_cached_frame (wpc, TRUE)) != NULL) {
+            wps = wpc->streams [0];
+            samples_to_unpack = (uint32_t) (frame->block_index + frame->num_samples - wps->sample_index);
+
+            if (samples_to_unpack > samples)
+                samples_to_unpack = samples;
+
+            store_values (out, frame->samples + (wps->sample_index - frame->block_index) * out->num_channels,
+                samples_to_unpack * out->num_channels);
+
+            out->index += samples_to_unpack;
+
+            if ((wps->sample_index += samples_to_unpack) == frame->block_index + frame->num_samples)
+                block_cache_release (wpc);
+        }
+        else {
+            // decode to the end of the loaded block, or else just one sample (which will load the next one)
+
+            if (wps->blockbuff && wps->wphdr.block_samples && (wps->wphdr.flags & INITIAL_BLOCK) &&
+                wps->sample_index < GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples)
+                    samples_to_unpack = (uint32_t) (GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples - wps->sample_index);
+            else
+                samples_to_unpack = 1;
+
+            if (samples_to_unpack > samples)
+                samples_to_unpack = samples;
+
+            if (!(samples_to_unpack = unpack_samples_serial (wpc, out, samples_to_unpack)))
+                break;
+
+            wps = wpc->streams [0];
+        }
+
+        samples_unpacked += samples_to_unpack;
+        samples -= samples_to_unpack;
+
+        if (wpc->total_samples != -1 && wps->sample_index == wpc->total_samples)
+            break;
+    }
+
+    return samples_unpacked;
+}
+
+// If the decoder is at the start of a frame (either with its first block loaded and
+// nothing decoded yet, or between frames with the next one starting at the expected
+// sample) then look it up in the cache (if "lookup" is set) and, if it's not there,
+// decode the whole frame and insert it. The frame returned becomes the one that the
+// context is returning audio from, and NULL is returned if the decoder is not at the
+// start of a frame (or there's no memory). A frame that is not decoded cleanly is not
+// cached, but is still returned (so that the errors are counted, and the file read,
+// exactly as the serial decoder would do it, although a block with a crc error is
+// always muted entirely here instead of just the part returned by the last call).
+
+CachedFrame *load_cached_frame (WavpackContext *wpc, int lookup)
+{
+    WavpackStream *wps = wpc->streams [0];
+    uint32_t block_samples, samples_decoded, crc_errors = wpc->crc_errors;
+    int64_t block_index;
+    CachedFrame *frame;
+    UnpackOutput out;
+
+    if (wps->blockbuff) {
+        if (!wps->wphdr.block_samples || !(wps->wphdr.flags & INITIAL_BLOCK) || wps->sample_index != GET_BLOCK_INDEX (wps->wphdr))
+            return NULL;
+
+        block_index = GET_BLOCK_INDEX (wps->wphdr);
+        block_samples = wps->wphdr.block_samples;
+    }
+    else {
+        int64_t pos = wpc->reader->get_pos (wpc->wv_in);
+        WavpackHeader wphdr;
+        uint32_t bcount;
+
+        if (wpc->wrapper_bytes >= MAX_WRAPPER_BYTES)
+            return NULL;
+
+        bcount = read_next_header (wpc->reader, wpc->wv_in, &wphdr);
+        wpc->reader->set_pos_abs (wpc->wv_in, pos);
+
+        if (bcount == (uint32_t) -1 || !wphdr.block_samples || !(wphdr.flags & INITIAL_BLOCK) ||
+            GET_BLOCK_INDEX (wphdr) - wpc->initial_index != wps->sample_index)
+                return NULL;
+
+        block_index = wps->sample_index;
+        block_samples = wphdr.block_samples;
+    }
+
+    if (lookup && (frame = block_cache_lookup (wpc, block_index)) != NULL) {
+        use_cached_frame (wpc, frame, block_index, TRUE);
+        return frame;
+    }
+
+    if (!(frame = block_cache_alloc (wpc, block_samples)))
+        return NULL;
+
+    init_output (wpc, &out, OUTPUT_INT32, frame->samples);
+    samples_decoded = unpack_samples_serial (wpc, &out, block_samples);
+    wps = wpc->streams [0];
+
+    if (!samples_decoded) {
+        wpc->cache_frame = frame;       // (just to free it)
+        block_cache_release (wpc);
+        return NULL;
+    }
+
+    frame->block_index = block_index;
+    frame->num_samples = samples_decoded;
+    frame->wphdr = wps->wphdr;
+    frame->filepos = wpc->filepos;
+    frame->file2pos = wpc->file2pos;
+    frame->endpos = wpc->reader->get_pos (wpc->wv_in);
+    frame->end2pos = wpc->wvc_flag ? wpc->reader->get_pos (wpc->wvc_in) : -1;
+
+    // the decoder has already moved past the frame, so the files are left where they are (and
+    // if the frame was not decoded cleanly, so are the streams, because it might end before
+    // the loaded block does and then the serial decoder must continue with that block)
+
+    if (samples_decoded == block_samples && wpc->crc_errors == crc_errors && wps->wphdr.block_samples == block_samples &&
+        GET_BLOCK_INDEX (wps->wphdr) == block_index)
+            use_cached_frame (wpc, block_cache_insert (wpc, frame), block_index, FALSE);
+    else {
+        wpc->cache_frame = frame;
+        wps->sample_index = block_index;
+    }
+
+    return frame;
+}
+
+#endif
+
+///////////////////////////// read-ahead decoding ////////////////////////////////
+
+// When the file is opened with worker threads (see OPEN_THREADS_MASK) we read
+// ahead of the application, a "frame" at a time (a frame being the complete
+// set of blocks for one multichannel sequence), and each frame is decoded and
+// interleaved in its entirety on a worker thread. All file access and metadata
+// processing still happens here on the caller's thread and in file order, and
+// the frames are handed back in order, so the application sees exactly what
+// the serial decoder would have returned (including for damaged files), which
+// is ensured by using the same functions to read and decode the blocks. The
+// only blocks not decoded this way are those already loaded (after opening or
+// seeking) which are "adopted" as the first frame and finished on a worker.
+// If there are multiple worker threads, the streams of a multichannel frame
+// are also decoded concurrently (each into its own slice of the temp buffer)
+// and then interleaved in stream order once they are all complete.
+
+typedef struct decode_frame {
+    WorkerJob job;
+    WavpackContext cxt;                     // copy of context for decoding on worker thread
+    WavpackStream **streams;
+    StreamJob *stream_jobs;                 // jobs for decoding streams in parallel
+    void *workers;                          // pool to use for that (NULL to decode serially)
+    int num_streams, num_decode, num_stream_jobs, end_of_file, file_done, adopted, checked;
+    uint32_t flags, num_samples, buffer_size, temp_buffer_size, wrapper_bytes, errors, chunk_errors, crc_error;
+    int64_t start_index, filepos, file2pos, startpos, start2pos;
+    int32_t *buffer, *temp_buffer;
+    struct decode_frame *next;
+} DecodeFrame;
+
+typedef struct {
+    DecodeFrame *head, *tail, *active, *spare;
+    int num_frames, max_frames;
+    int64_t next_index;
+} ReadAhead;
+
+static int create_read_ahead (WavpackContext *wpc)
+{
+    ReadAhead *rq = (ReadAhead *)wp_calloc (1, sizeof (ReadAhead));
+
+    if (!rq)
+        return FALSE;
+
+    rq->max_frames = workers_count (wpc->workers) * 2;
+    wpc->read_ahead = rq;
+    return TRUE;
+}
+
+// Get an empty frame (from the spare list, if possible) with a single clear stream.
+
+static DecodeFrame *get_frame (ReadAhead *rq)
+{
+    DecodeFrame *frame = rq->spare;
+
+    if (frame)
+        rq->spare = frame->next;
+    else {
+        frame = (DecodeFrame *)wp_calloc (1, sizeof (DecodeFrame));
+
+        if (!frame)
+            return NULL;
+
+        frame->streams = (WavpackStream **)wp_malloc (sizeof (frame->streams [0]));
+        frame->streams [0] = (WavpackStream *)wp_malloc (sizeof (WavpackStream));
+
+        if (!frame->streams || !frame->streams [0]) {
+            if (frame->streams)
+                wp_free (frame->streams);
+
+            wp_free (frame);
+            return NULL;
+        }
+
+        frame->num_streams = 1;
+    }
+
+    CLEAR (*frame->streams [0]);
+    frame->end_of_file = frame->file_done = frame->adopted = frame->checked = FALSE;
+    frame->errors = frame->chunk_errors = frame->crc_error = 0;
+    frame->num_samples = 0;
+    frame->job.state = JOB_IDLE;
+    frame->next = NULL;
+    return frame;
+}
+
+// Free the raw blocks and extra streams of a frame and put it on the spare list.
+
+static void release_frame (WavpackContext *wpc, ReadAhead *rq, DecodeFrame *frame)
+{
+    while (frame->num_streams) {
+        free_single_stream (wpc, frame->streams [--frame->num_streams]);
+
+        if (frame->num_streams)
+            release_stream (wpc, frame->streams [frame->num_streams]);
+    }
+
+    frame->num_streams = 1;
+    frame->next = rq->spare;
+    rq->spare = frame;
+}
+
+static void free_frame (DecodeFrame *frame)
+{
+    wp_free (frame->streams [0]);
+    wp_free (frame->streams);
+
+    if (frame->buffer)
+        wp_free (frame->buffer);
+
+    if (frame->temp_buffer)
+        wp_free (frame->temp_buffer);
+
+    if (frame->stream_jobs)
+        wp_free (frame->stream_jobs);
+
+    wp_free (frame);
+}
+
+// Read the next frame from the file. Any blocks without audio (or that are not
+// the first block of a multichannel sequence) are processed or skipped here just
+// like the serial decoder would. This is also used to complete an adopted frame.
+// Errors encountered here are stored in the frame and only added to the context's
+// count once the frame is reached by the application (because the frame might be
+// discarded and read again).
+
+static void read_frame (WavpackContext *wpc, ReadAhead *rq, DecodeFrame *frame)
+{
+    WavpackStream **streams = wpc->streams, *wps = frame->streams [0];
+    int64_t filepos = wpc->filepos, file2pos = wpc->file2pos;
+    uint32_t crc_errors = wpc->crc_errors;
+    int num_streams = wpc->num_streams;
+
+    wpc->streams = frame->streams;
+    wpc->num_streams = frame->num_streams;
+    wpc->current_stream = 0;
+
+    if (!frame->adopted) {
+        frame->startpos = wpc->reader->get_pos (wpc->wv_in);
+        frame->start2pos = wpc->wvc_flag ? wpc->reader->get_pos (wpc->wvc_in) : 0;
+        frame->wrapper_bytes = wpc->wrapper_bytes;
+
+        while (1) {
+            if (wpc->wrapper_bytes >= MAX_WRAPPER_BYTES) {
+                frame->end_of_file = 1;
+                break;
+            }
+
+            free_single_stream (wpc, wps);
+            CLEAR (*wps);
+
+            if ((frame->end_of_file = read_stream_block (wpc, wps, &wpc->filepos)))
+                break;
+
+            // orphaned blocks are checked against the expected index here (the
+            // first blocks of sequences are checked when they are reached)
+
+            if (wps->wphdr.block_samples && !(wps->wphdr.flags & INITIAL_BLOCK) &&
+                !(wpc->open_flags & OPEN_STREAMING) && rq->next_index != GET_BLOCK_INDEX (wps->wphdr))
+                wpc->crc_errors++;
+
+            if (wps->wphdr.block_samples && wpc->wvc_flag)
+                read_wvc_block (wpc);
+
+            if (!wps->wphdr.block_samples) {
+                if (!unpack_init (wpc))
+                    wpc->crc_errors++;
+
+                wps->init_done = TRUE;
+            }
+            else if (wps->wphdr.flags & INITIAL_BLOCK)
+                break;
+        }
+
+        if (!frame->end_of_file) {
+            frame->filepos = wpc->filepos;
+            frame->file2pos = wpc->file2pos;
+            frame->start_index = GET_BLOCK_INDEX (wps->wphdr);
+            frame->num_samples = wps->wphdr.block_samples;
+
+            if (!unpack_init (wpc))
+                wpc->crc_errors++;
+
+            wps->init_done = TRUE;
+        }
+    }
+
+    if (!frame->end_of_file) {
+        frame->flags = wps->wphdr.flags;
+        frame->num_decode = load_sequence_streams (wpc, &frame->chunk_errors, &frame->file_done);
+        frame->streams = wpc->streams;
+        frame->num_streams = wpc->num_streams;
+        rq->next_index = frame->start_index + frame->num_samples;
+    }
+
+    frame->errors += wpc->crc_errors - crc_errors;
+    wpc->crc_errors = crc_errors;
+    wpc->filepos = filepos;
+    wpc->file2pos = file2pos;
+    wpc->streams = streams;
+    wpc->num_streams = num_streams;
+    wpc->current_stream = 0;
+}
+
+// Take the block that's currently loaded in the context (and that the serial decoder
+// would continue decoding) and make it the first frame of the read-ahead queue. We
+// simply swap the stream arrays so that the context keeps a clear stream with only
+// the header and sample index of the adopted block.
+
+static DecodeFrame *adopt_frame (WavpackContext *wpc, ReadAhead *rq)
+{
+    DecodeFrame *frame = get_frame (rq);
+    WavpackStream **streams, *wps;
+
+    if (!frame)
+        return NULL;
+
+    streams = frame->streams;
+    frame->streams = wpc->streams;
+    frame->num_streams = wpc->num_streams;
+    wpc->streams = streams;
+    wpc->num_streams = 1;
+
+    wps = frame->streams [0];
+    memcpy (&wpc->streams [0]->wphdr, &wps->wphdr, sizeof (WavpackHeader));
+    wpc->streams [0]->sample_index = wps->sample_index;
+
+    frame->adopted = frame->checked = TRUE;
+    frame->start_index = wps->sample_index;
+    frame->num_samples = (uint32_t) (GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples - wps->sample_index);
+    frame->filepos = wpc->filepos;
+    frame->file2pos = wpc->file2pos;
+    frame->startpos = wpc->reader->get_pos (wpc->wv_in);
+    frame->start2pos = wpc->wvc_flag ? wpc->reader->get_pos (wpc->wvc_in) : 0;
+    frame->wrapper_bytes = wpc->wrapper_bytes;
+    read_frame (wpc, rq, frame);
+    return frame;
+}
+
+// Decode the entire frame into its buffer (using the frame's copy of the context),
+// interleaving the streams exactly like the serial decoder. This is the function
+// that's executed on the worker threads.
+
+static void decode_frame (void *param)
+{
+    DecodeFrame *frame = (DecodeFrame *) param;
+    WavpackContext *wpc = &frame->cxt;
+    UnpackOutput out;
+
+    init_output (wpc, &out, OUTPUT_INT32, frame->buffer);
+    unpack_sequence (wpc, &out, frame->temp_buffer, frame->num_samples,
+        frame->num_decode, frame->workers, frame->workers ? frame->stream_jobs : NULL);
+
+    frame->crc_error = check_crc_error (wpc);
+}
+
+// Add the frame to the end of the queue and, if it contains audio to decode,
+// submit it to the worker threads. If the buffers can't be allocated the frame
+// is simply treated like the end of the file.
+
+static void queue_frame (WavpackContext *wpc, ReadAhead *rq, DecodeFrame *frame)
+{
+    if (rq->tail)
+        rq->tail = rq->tail->next = frame;
+    else
+        rq->head = rq->tail = frame;
+
+    rq->num_frames++;
+
+    if (frame->end_of_file || frame->file_done)
+        return;
+
+    if (frame->buffer_size < frame->num_samples * wpc->config.num_channels) {
+        if (frame->buffer)
+            wp_free (frame->buffer);
+
+        frame->buffer = (int32_t *)wp_malloc ((frame->buffer_size = frame->num_samples * wpc->config.num_channels) * sizeof (int32_t));
+    }
+
+    // with more than one worker thread, the streams of a multichannel frame are decoded in parallel
+    // and so each stream needs its own job and slice of the temp buffer (if we can't allocate the
+    // jobs we just decode the streams one at a time)
+
+    frame->workers = NULL;
+
+    if (frame->num_streams > 1 && workers_count (wpc->workers) > 1) {
+        if (frame->num_stream_jobs < frame->num_streams) {
+            if (frame->stream_jobs)
+                wp_free (frame->stream_jobs);
+
+            frame->stream_jobs = (StreamJob *)wp_malloc ((frame->num_stream_jobs = frame->num_streams) * sizeof (StreamJob));
+
+            if (!frame->stream_jobs)
+                frame->num_stream_jobs = 0;
+        }
+
+        if (frame->stream_jobs)
+            frame->workers = wpc->workers;
+    }
+
+    if (!(frame->flags & FINAL_BLOCK)) {
+        uint32_t temp_buffer_size = frame->num_samples * 2 * (frame->workers ? frame->num_streams : 1);
+
+        if (frame->temp_buffer_size < temp_buffer_size) {
+            if (frame->temp_buffer)
+                wp_free (frame->temp_buffer);
+
+            frame->temp_buffer = (int32_t *)wp_malloc ((frame->temp_buffer_size = temp_buffer_size) * sizeof (int32_t));
+        }
+    }
+
+    if (!frame->buffer || (!(frame->flags & FINAL_BLOCK) && !frame->temp_buffer)) {
+        frame->buffer_size = frame->temp_buffer_size = 0;
+        frame->end_of_file = 1;
+        return;
+    }
+
+    frame->cxt = *wpc;
+    frame->cxt.streams = frame->streams;
+    frame->cxt.num_streams = frame->num_streams;
+    frame->cxt.current_stream = 0;
+    frame->cxt.workers = frame->cxt.pack_pipeline = frame->cxt.read_ahead = NULL;
+    frame->job.function = decode_frame;
+    frame->job.param = frame;
+    workers_submit (wpc->workers, &frame->job);
+}
+
+// Read ahead (and start decoding) frames until the queue is full. We stop at
+// the end of the audio so that trailing metadata (like the RIFF trailer) is
+// only read when the application asks for it, like the serial decoder.
+
+static void fill_read_ahead (WavpackContext *wpc, ReadAhead *rq)
+{
+    WavpackStream *wps = wpc->streams [0];
+    DecodeFrame *frame;
+
+    if (!rq->head) {
+        rq->next_index = wps->sample_index;
+
+        if (wps->blockbuff && wps->init_done && wps->wphdr.block_samples && (wps->wphdr.flags & INITIAL_BLOCK) &&
+            wps->sample_index >= GET_BLOCK_INDEX (wps->wphdr) &&
+            wps->sample_index < GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples &&
+            (frame = adopt_frame (wpc, rq)) != NULL)
+                queue_frame (wpc, rq, frame);
+    }
+
+    while (!rq->head || (rq->num_frames < rq->max_frames && !rq->tail->end_of_file &&
+        (wpc->total_samples == -1 || rq->next_index < wpc->total_samples))) {
+            if (!(frame = get_frame (rq)))
+                break;
+
+            read_frame (wpc, rq, frame);
+            queue_frame (wpc, rq, frame);
+    }
+}
+
+// Make the frame at the head of the queue the active one. Once it has been decoded
+// its streams are moved into the context (so that seeking and the other functions
+// that look at the current block work normally) and the sample index is backed up
+// to the start of the frame to track the samples returned to the application.
+
+static void activate_frame (WavpackContext *wpc, ReadAhead *rq)
+{
+    DecodeFrame *frame = rq->head;
+    WavpackStream **streams;
+
+    workers_wait (wpc->workers, &frame->job);
+
+    if (!(rq->head = frame->next))
+        rq->tail = NULL;
+
+    rq->num_frames--;
+    free_streams (wpc);
+    streams = wpc->streams;
+    wpc->streams = frame->streams;
+    wpc->num_streams = frame->num_streams;
+    frame->streams = streams;
+    frame->num_streams = 1;
+
+    wpc->streams [0]->sample_index = frame->start_index;
+    wpc->filepos = frame->filepos;
+    wpc->file2pos = frame->file2pos;
+    rq->active = frame;
+}
+
+// Discard all the frames in the queue (not including the active one) and restore
+// the file position(s) to the start of the first discarded frame.
+
+static void discard_frames (WavpackContext *wpc, ReadAhead *rq)
+{
+    DecodeFrame *frame = rq->head;
+
+    if (!frame)
+        return;
+
+    wpc->reader->set_pos_abs (wpc->wv_in, frame->startpos);
+
+    if (wpc->wvc_flag)
+        wpc->reader->set_pos_abs (wpc->wvc_in, frame->start2pos);
+
+    if (wpc->wrapper_bytes > frame->wrapper_bytes)
+        wpc->wrapper_bytes = frame->wrapper_bytes;
+
+    while ((frame = rq->head) != NULL) {
+        workers_wait (wpc->workers, &frame->job);
+        rq->head = frame->next;
+        release_frame (wpc, rq, frame);
+    }
+
+    rq->tail = NULL;
+    rq->num_frames = 0;
+}
+
+// Discard all read-ahead state, leaving the context as if the serial decoder had
+// just finished decoding the current block. This is required before seeking.
+
+void discard_read_ahead (WavpackContext *wpc)
+{
+    ReadAhead *rq = wpc->read_ahead;
+
+    discard_frames (wpc, rq);
+
+    if (rq->active) {
+        WavpackStream *wps = wpc->streams [0];
+
+        wps->sample_index = GET_BLOCK_INDEX (wps->wphdr) + wps->wphdr.block_samples;
+        release_frame (wpc, rq, rq->active);
+        rq->active = NULL;
+    }
+}
+
+void free_read_ahead (WavpackContext *wpc)
+{
+    ReadAhead *rq = wpc->read_ahead;
+    DecodeFrame *frame;
+
+    while ((frame = rq->head) != NULL) {
+        workers_wait (wpc->workers, &frame->job);
+        rq->head = frame->next;
+        release_frame (wpc, rq, frame);
+    }
+
+    if (rq->active)
+        release_frame (wpc, rq, rq->active);
+
+    while ((frame = rq->spare) != NULL) {
+        rq->spare = frame->next;
+        free_frame (frame);
+    }
+
+    wp_free (rq);
+    wpc->read_ahead = NULL;
+}
+
+// This is the read-ahead equivalent of unpack_samples_serial(), handing out the
+// samples of the decoded frames while reproducing exactly the serial decoder's
+// handling of missing blocks, discontinuities, and crc errors.
+
+static uint32_t unpack_samples_threaded (WavpackContext *wpc, UnpackOutput *out, uint32_t samples)
+{
+    int num_channels = wpc->config.num_channels;
+    uint32_t samples_unpacked = 0, samples_to_unpack;
+    ReadAhead *rq = wpc->read_ahead;
+
+    while (samples) {
+        WavpackStream *wps = wpc->streams [wpc->current_stream = 0];
+        DecodeFrame *frame = rq->active;
+
+        if (!frame) {
+            // filling the queue may adopt the loaded block (and its streams) as the first
+            // frame, so we must not touch the previous stream pointer after this
+
+            fill_read_ahead (wpc, rq);
+            wps = wpc->streams [0];
+
+            if (!(frame = rq->head))
+                break;
+
+            if (!frame->checked) {
+                wpc->crc_errors += frame->errors;
+
+                if (wpc->open_flags & OPEN_STREAMING)
+                    wps->sample_index = 0;
+                else if (!frame->end_of_file && wps->sample_index != frame->start_index)
+                    wpc->crc_errors++;
+
+                frame->checked = TRUE;
+            }
+
+            if (frame->end_of_file) {
+                if (frame->end_of_file == 2) {
+                    strcpy (wpc->error_message, "can't read all of last block!");
+                    wps->wphdr.block_samples = 0;
+                    wps->wphdr.ckSize = 24;
+                }
+
+                rq->head = frame->next;
+                rq->tail = NULL;                // end-of-file is always the last frame
+                rq->num_frames--;
+                release_frame (wpc, rq, frame);
+                break;
+            }
+
+            // if this frame is behind us, discard it and go on to the next one
+
+            if (wps->sample_index >= frame->start_index + frame->num_samples) {
+                rq->head = frame->next;
+
+                if (!rq->head)
+                    rq->tail = NULL;
+
+                rq->num_frames--;
+                workers_wait (wpc->workers, &frame->job);
+                release_frame (wpc, rq, frame);
+                continue;
+            }
+
+            // There seems to be some missing data, like a block was corrupted or something.
+            // If it's not too much data, just fill in with silence here and loop back.
+
+            if (wps->sample_index < frame->start_index) {
+                if (!(samples_to_unpack = fill_missing_samples (wpc, out, samples, frame->start_index, frame->flags & DSD_FLAG))) {
+                    rq->head = frame->next;
+
+                    if (!rq->head)
+                        rq->tail = NULL;
+
+                    rq->num_frames--;
+                    workers_wait (wpc->workers, &frame->job);
+                    release_frame (wpc, rq, frame);
+                    break;
+                }
+
+                out->index += samples_to_unpack;
+                samples_unpacked += samples_to_unpack;
+                samples -= samples_to_unpack;
+                continue;
+            }
+
+            activate_frame (wpc, rq);
+            wps = wpc->streams [0];
+        }
+
+        samples_to_unpack = (uint32_t) (frame->start_index + frame->num_samples - wps->sample_index);
+
+        if (samples_to_unpack > samples)
+            samples_to_unpack = samples;
+
+        wpc->crc_errors += frame->chunk_errors;
+
+        // a multichannel sequence that was cut short means we're done with this file
+
+        if (frame->file_done) {
+            wps->sample_index += samples_to_unpack;
+            wps->wphdr.block_samples = 0;
+            wps->wphdr.ckSize = 24;
+            release_frame (wpc, rq, frame);
+            rq->active = NULL;
+            strcpy (wpc->error_message, "can't read all of last block!");
+            break;
+        }
+
+        store_values (out, frame->buffer + (wps->sample_index - frame->start_index) * num_channels,
+            samples_to_unpack * num_channels);
+
+        wps->sample_index += samples_to_unpack;
+        out->index += samples_to_unpack;
+        samples_unpacked += samples_to_unpack;
+        samples -= samples_to_unpack;
+
+        // if we just finished a frame, check for a calculated crc error (and back up the
+        // file a little if possible in case we passed a header, which means discarding any
+        // frames that were read ahead because they will be read again)
+
+        if (wps->sample_index == frame->start_index + frame->num_samples) {
+            if (frame->crc_error) {
+                mute_crc_error (wpc, out, samples_to_unpack);
+
+                if (wpc->reader->can_seek (wpc->wv_in) && (!wpc->wvc_flag || wpc->reader->can_seek (wpc->wvc_in))) {
+                    discard_frames (wpc, rq);
+                    back_up_files (wpc);
+                }
+            }
+
+            release_frame (wpc, rq, frame);
+            rq->active = NULL;
+        }
+
+        if (wpc->total_samples != -1 && wps->sample_index == wpc->total_samples)
+            break;
+    }
 
     return samples_unpacked;
 }
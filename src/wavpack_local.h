@@ -14,7 +14,6 @@
 #include "wavpack.h"
 
 #if defined(_WIN32)
-#define strdup(x) _strdup(x)
 #define FASTCALL __fastcall
 #else
 #define FASTCALL
@@ -25,6 +24,10 @@
     (defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__))
 #define BITSTREAM_SHORTS    // use 16-bit "shorts" for reading/writing bitstreams (instead of chars)
                             //  (only works on little-endian machines)
+#if defined(_WIN64) || (defined(__SIZEOF_POINTER__) && __SIZEOF_POINTER__ == 8)
+#define BITSTREAM_WIDE      // use a 64-bit shift register for reading bitstreams that is refilled
+                            //  with unaligned 64-bit loads (only on 64-bit machines, with shorts)
+#endif
 #endif
 
 #include <sys/types.h>
@@ -66,6 +69,7 @@ typedef int32_t f32;
 #define set_sign(f,v)       (f) ^= (((f) ^ ((uint32_t)(v) << 31)) & 0x80000000)
 
 #include <stdio.h>
+#include <string.h>
 
 #define FALSE 0
 #define TRUE 1
@@ -176,10 +180,15 @@ typedef struct bs {
 #endif
     void (*wrap)(struct bs *bs);
     int error, bc;
+#ifdef BITSTREAM_WIDE
+    uint64_t sr;
+#else
     uint32_t sr;
+#endif
 } Bitstream;
 
 #define MAX_WRAPPER_BYTES 16777216
+#define MAX_SPARE_BUFFERS 64
 #define NEW_MAX_STREAMS 4096
 #define OLD_MAX_STREAMS 8
 #define MAX_NTERMS 16
@@ -232,7 +241,7 @@ typedef struct {
 
     int64_t sample_index;
     int bits, num_terms, mute_error, joint_stereo, false_stereo, shift;
-    int num_decorrs, num_passes, best_decorr, mask_decorr;
+    int num_decorrs, num_passes, best_decorr, mask_decorr, extra_flags;
     uint32_t crc, crc_x, crc_wvx;
     Bitstream wvbits, wvcbits, wvxbits;
     int init_done, wvc_skip;
@@ -273,6 +282,40 @@ typedef struct {
 
 /////////////////////////////// WavPack Context ///////////////////////////////
 
+// One entry of the seek index that maps sample indexes to file positions. Each
+// entry describes the first block of a multichannel sequence (with block_index
+// already adjusted by the initial_index); file2pos is -1 if the position of the
+// matching correction block is not known. Entries are stored in files (in both the
+// seek table written by the encoder and saved index files) as 28-byte records.
+
+typedef struct {
+    int64_t block_index, filepos, file2pos;
+    uint32_t block_samples;
+} SeekIndexEntry;
+
+#define SeekIndexEntryFormat "DDDL"
+#define SEEK_INDEX_ENTRY_BYTES 28
+#define MAX_SEEK_TABLE_ENTRIES 8192     // encoder stores every nth block beyond this
+#define MAX_SEEK_INDEX_ENTRIES 0x1000000 // limit for a scanned, stored or loaded index
+#define MAX_DECODE_INDEX_ENTRIES 0x10000 // blocks recorded while decoding (2 MB)
+
+// A decoded frame (the complete set of blocks for one multichannel sequence) in the
+// block cache (see block_cache.c). The file positions are those of the first block of
+// the frame and just past its last block (the correction file positions are only
+// valid when the file is decoded with one). The header is the first block's (native
+// endian and with block_index adjusted by the initial_index) and the samples follow
+// the structure in the same allocation.
+
+typedef struct cached_frame {
+    struct cached_frame *hash_next, *lru_prev, *lru_next;
+    int64_t block_index, filepos, file2pos, endpos, end2pos;
+    uint32_t file_num, num_samples, ref_count;
+    int in_cache;
+    size_t bytes;
+    WavpackHeader wphdr;
+    int32_t *samples;
+} CachedFrame;
+
 // This internal structure holds everything required to encode or decode WavPack
 // files. It is recommended that direct access to this structure be minimized
 // and the provided utilities used instead.
@@ -312,6 +355,28 @@ struct WavpackContext {
 
     void (*close_callback)(void *wpc);
     char error_message [80];
+
+    void *workers, *pack_pipeline;      // worker thread pool (see workers.c) and block encode in progress
+    void *extra_workers;                // pool for "extra" mode searches (also valid in worker copies)
+    void *read_ahead;                   // blocks being read and decoded ahead by worker threads
+    int32_t *convert_buffer;            // decoded chunk for the unpack functions' conversion fallback
+    int32_t *temp_buffer;               // serial decoder's buffer for re-interleaving multichannel blocks
+    uint32_t temp_buffer_size;
+
+    // raw block buffers and extra streams released during decoding are kept here for reuse
+    void *spare_buffers [MAX_SPARE_BUFFERS];
+    WavpackStream *spare_streams [MAX_SPARE_BUFFERS];
+    int num_spare_buffers, num_spare_streams;
+
+    // sample-to-file-position index of the blocks seen so far (sorted by block_index)
+    SeekIndexEntry *seek_index;
+    int32_t seek_index_count, seek_index_size;
+    int seek_table_read;                // seek table at end of file already read (or not to be used)
+
+    void *range_readers;                // pool of decoders for WavpackReadRange() (see unpack_range.c)
+
+    void *block_cache, *cache_frame;    // shared cache of decoded frames and the one being returned
+    uint32_t cache_file;                // number of this file (and its decoding options) in the cache
 };
 
 //////////////////////// function prototypes and macros //////////////////////
@@ -423,6 +488,69 @@ int get_version3 (WavpackContext *wpc);
 #define bs_is_open(bs) ((bs)->ptr != NULL)
 uint32_t bs_close_read (Bitstream *bs);
 
+// Add at least one more "short" (or char) of data to the shift register of a bitstream being
+// read. With the 64-bit shift register we normally add as many shorts as will fit (1 to 3) with
+// a single unaligned load, but near the end of the buffer we go one at a time (so that we never
+// read past the end, and so that wrap() gets called at the right time). Note that in this case
+// there can be data bits above "bc" in the shift register, but they are always the correct
+// bits for those positions, so the next refill just ORs the same bits in again. In all cases
+// the shift register will never overflow as long as no more than 48 bits are requested.
+
+#ifdef BITSTREAM_WIDE
+static __inline void bs_refill (Bitstream *bs)
+{
+    if (bs->end - bs->ptr > 4) {
+        uint64_t next;
+
+        memcpy (&next, bs->ptr + 1, sizeof (next));
+        bs->sr |= next << bs->bc;
+        bs->ptr += (63 - bs->bc) >> 4;
+        bs->bc += ((63 - bs->bc) >> 4) << 4;
+    }
+    else {
+        if (++(bs->ptr) == bs->end)
+            bs->wrap (bs);
+
+        bs->sr |= (uint64_t)*(bs->ptr) << bs->bc;
+        bs->bc += sizeof (*(bs->ptr)) * 8;
+    }
+}
+#else
+static __inline void bs_refill (Bitstream *bs)
+{
+    if (++(bs->ptr) == bs->end)
+        bs->wrap (bs);
+
+    bs->sr |= (uint32_t)*(bs->ptr) << bs->bc;
+    bs->bc += sizeof (*(bs->ptr)) * 8;
+}
+#endif
+
+#define bs_fill(bs, nbits) do { \
+    while ((bs)->bc < (nbits)) \
+        bs_refill (bs); \
+} while (0)
+
+#ifdef BITSTREAM_WIDE
+
+#define getbit(bs) ( \
+    (((bs)->bc) ? \
+        ((bs)->bc--, (bs)->sr & 1) : \
+            (bs_refill (bs), (bs)->bc--, (bs)->sr & 1) \
+    ) ? \
+        ((bs)->sr >>= 1, 1) : \
+        ((bs)->sr >>= 1, 0) \
+)
+
+#define getbits(value, nbits, bs) do { \
+    bs_fill (bs, nbits); \
+    *(value) = (uint32_t) (bs)->sr; \
+    (bs)->bc -= (nbits); \
+    (bs)->sr >>= (nbits); \
+} while (0)
+
+#else
+
 #define getbit(bs) ( \
     (((bs)->bc) ? \
         ((bs)->bc--, (bs)->sr & 1) : \
@@ -449,6 +577,8 @@ uint32_t bs_close_read (Bitstream *bs);
     } \
 } while (0)
 
+#endif
+
 #define putbit(bit, bs) do { if (bit) (bs)->sr |= (1U << (bs)->bc); \
     if (++((bs)->bc) == sizeof (*((bs)->ptr)) * 8) { \
         *((bs)->ptr) = (bs)->sr; \
@@ -549,11 +679,23 @@ int32_t wp_exp2s (int log);
 int FASTCALL wp_log2 (uint32_t avalue);
 
 #ifdef OPT_ASM_X86
-#define LOG2BUFFER log2buffer_x86
+#define LOG2BUFFER_ASM log2buffer_x86
 #elif defined(OPT_ASM_X64) && (defined (_WIN64) || defined(__CYGWIN__) || defined(__MINGW64__) || defined(__midipix__))
-#define LOG2BUFFER log2buffer_x64win
+#define LOG2BUFFER_ASM log2buffer_x64win
 #elif defined(OPT_ASM_X64)
-#define LOG2BUFFER log2buffer_x64
+#define LOG2BUFFER_ASM log2buffer_x64
+#endif
+
+// On x86 and x64 we also have an AVX2 version of log2buffer() (if the compiler can build it)
+// that is selected at runtime when the CPU supports it, otherwise the assembly one is used
+
+#if defined(LOG2BUFFER_ASM) && ((defined(__clang__) && !defined(_MSC_VER)) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) || (defined(_MSC_VER) && _MSC_VER >= 1700))
+#define OPT_AVX2
+#define LOG2BUFFER log2buffer_dispatch
+uint32_t LOG2BUFFER_ASM (int32_t *samples, uint32_t num_samples, int limit);
+int cpu_has_feature_avx2 (void);
+#elif defined(LOG2BUFFER_ASM)
+#define LOG2BUFFER LOG2BUFFER_ASM
 #else
 #define LOG2BUFFER log2buffer
 #endif
@@ -568,11 +710,21 @@ int restore_weight (signed char weight);
 void WavpackFloatNormalize (int32_t *values, int32_t num_values, int delta_exp);
 
 /////////////////////////// high-level unpacking API and support ////////////////////////////
-// modules: open_utils.c, unpack_utils.c, unpack_seek.c, unpack_floats.c
+// modules: open_utils.c, unpack_utils.c, unpack_seek.c, unpack_range.c, unpack_floats.c
 
 WavpackContext *WavpackOpenFileInputEx64 (WavpackStreamReader64 *reader, void *wv_id, void *wvc_id, char *error, int flags, int norm_offset);
 WavpackContext *WavpackOpenFileInputEx (WavpackStreamReader *reader, void *wv_id, void *wvc_id, char *error, int flags, int norm_offset);
 WavpackContext *WavpackOpenFileInput (const char *infilename, char *error, int flags, int norm_offset);
+WavpackContext *WavpackOpenFileInputMemory (const void *wv_data, size_t wv_size, const void *wvc_data, size_t wvc_size,
+    char *error, int flags, int norm_offset);
+WavpackContext *WavpackOpenFileInputFd (int wv_fd, int wvc_fd, char *error, int flags, int norm_offset);
+WavpackContext *WavpackOpenFileInputPrefetch (WavpackStreamReader64 *reader, void *wv_id, void *wvc_id,
+    char *error, int flags, int norm_offset, int depth, int32_t buffer_size);
+WavpackContext *WavpackOpenFileInputRemote (WavpackRemoteReader *reader, void *wv_id, void *wvc_id,
+    char *error, int flags, int norm_offset, int num_pages, int32_t page_size);
+int WavpackProbe (const char *filename, WavpackProbeInfo *info, char *error, int flags);
+int WavpackProbeEx64 (WavpackStreamReader64 *reader, void *id, WavpackProbeInfo *info, char *error, int flags);
+int WavpackProbeBatch (const char **filenames, int count, WavpackProbeInfo *info, int flags, int num_threads);
 
 #define OPEN_WVC        0x1     // open/read "correction" file
 #define OPEN_TAGS       0x2     // read ID3v1 / APEv2 tags (seekable file)
@@ -592,6 +744,10 @@ WavpackContext *WavpackOpenFileInput (const char *infilename, char *error, int f
 #define OPEN_ALT_TYPES  0x400   // application is aware of alternate file types & qmode
                                 // (just affects retrieving wrappers & MD5 checksums)
 #define OPEN_NO_CHECKSUM 0x800  // don't verify block checksums before decoding
+#define OPEN_THREADS_SHFT 12   // specify number of additional worker threads here for
+#define OPEN_THREADS_MASK 0xF000 // decode; 0 to disable, otherwise 1-15 added threads
+#define OPEN_SEEK_INDEX 0x10000 // scan the whole file on open to build the seek index
+#define OPEN_MMAP       0x20000 // map the file(s) into memory and decode blocks in place
 
 int WavpackGetMode (WavpackContext *wpc);
 
@@ -600,11 +756,22 @@ int WavpackGetVersion (WavpackContext *wpc);
 uint32_t WavpackUnpackSamples (WavpackContext *wpc, int32_t *buffer, uint32_t samples);
 int WavpackSeekSample (WavpackContext *wpc, uint32_t sample);
 int WavpackSeekSample64 (WavpackContext *wpc, int64_t sample);
+int WavpackBuildSeekIndex (WavpackContext *wpc);
+int64_t WavpackLookupSeekIndex (WavpackContext *wpc, int64_t sample, int64_t *block_index, uint32_t *block_samples);
+int WavpackSaveSeekIndex (WavpackContext *wpc, const char *filename);
+int WavpackLoadSeekIndex (WavpackContext *wpc, const char *filename);
+void read_seek_table (WavpackContext *wpc);
+uint32_t WavpackReadRange (WavpackContext *wpc, int64_t start_sample, uint32_t sample_count, int32_t *buffer);
+int init_range_readers (WavpackContext *wpc);
+void free_range_readers (WavpackContext *wpc);
 int WavpackGetMD5Sum (WavpackContext *wpc, unsigned char data [16]);
 
 int WavpackVerifySingleBlock (unsigned char *buffer, int verify_checksum);
 uint32_t read_next_header (WavpackStreamReader64 *reader, void *id, WavpackHeader *wphdr);
+int read_file_metadata (WavpackContext *wpc, unsigned char *blockbuff, int md5_only);
 int read_wvc_block (WavpackContext *wpc);
+void discard_read_ahead (WavpackContext *wpc);
+void free_read_ahead (WavpackContext *wpc);
 
 /////////////////////////// high-level packing API and support ////////////////////////////
 // modules: pack_utils.c, pack_floats.c
@@ -617,10 +784,68 @@ int WavpackAddWrapper (WavpackContext *wpc, void *data, uint32_t bcount);
 int WavpackPackSamples (WavpackContext *wpc, int32_t *sample_buffer, uint32_t sample_count);
 int WavpackFlushSamples (WavpackContext *wpc);
 int WavpackStoreMD5Sum (WavpackContext *wpc, unsigned char data [16]);
+int WavpackStoreSeekTable (WavpackContext *wpc);
 void WavpackSeekTrailingWrapper (WavpackContext *wpc);
 void WavpackUpdateNumSamples (WavpackContext *wpc, void *first_block);
 void *WavpackGetWrapperLocation (void *first_block, uint32_t *size);
 
+int pack_finish_pending (WavpackContext *wpc);
+void free_pack_pipeline (WavpackContext *wpc);
+
+/////////////////////////////////// worker threads ////////////////////////////////////
+// module: workers.c
+
+#define MAX_WORKER_THREADS 15
+
+typedef struct worker_job {
+    void (*function)(void *param);
+    void *param;
+    struct worker_job *next;
+    volatile int state;
+} WorkerJob;
+
+#define JOB_IDLE    0
+#define JOB_QUEUED  1
+#define JOB_RUNNING 2
+#define JOB_DONE    3
+
+void *workers_create (int num_threads);
+void workers_destroy (void *workers);
+int workers_count (void *workers);
+void workers_submit (void *workers, WorkerJob *job);
+void workers_wait (void *workers, WorkerJob *job);
+void *workers_mutex_create (void);
+void workers_mutex_destroy (void *mutex);
+void workers_mutex_lock (void *mutex);
+void workers_mutex_unlock (void *mutex);
+
+/////////////////////////////////// decoded block cache ////////////////////////////////////
+// modules: block_cache.c, unpack_utils.c
+
+CachedFrame *block_cache_lookup (WavpackContext *wpc, int64_t block_index);
+CachedFrame *block_cache_alloc (WavpackContext *wpc, uint32_t num_samples);
+CachedFrame *block_cache_insert (WavpackContext *wpc, CachedFrame *frame);
+void block_cache_release (WavpackContext *wpc);
+void use_cached_frame (WavpackContext *wpc, CachedFrame *frame, int64_t sample, int reposition);
+CachedFrame *load_cached_frame (WavpackContext *wpc, int lookup);
+
+/////////////////////////////////// memory file reader ////////////////////////////////////
+// module: open_memory.c
+
+extern WavpackStreamReader64 memory_reader;
+void *open_memory_file (const void *data, int64_t size, void (*release) (void *data, int64_t size));
+unsigned char *memory_block (WavpackContext *wpc, void *id, WavpackHeader *wphdr);
+int is_memory_block (WavpackContext *wpc, unsigned char *buffer);
+
+/////////////////////////////////// memory allocation ////////////////////////////////////
+// module: memory_utils.c
+
+void *wp_malloc (size_t size);
+void *wp_calloc (size_t num, size_t size);
+void *wp_realloc (void *ptr, size_t size);
+void wp_free (void *ptr);
+char *wp_strdup (const char *string);
+
 /////////////////////////////////// common utilities ////////////////////////////////////
 // module: common_utils.c
 
@@ -659,6 +884,16 @@ void WavpackNativeToBigEndian (void *data, char *format);
 void install_close_callback (WavpackContext *wpc, void cb_func (void *wpc));
 void free_dsd_tables (WavpackStream *wps);
 void free_streams (WavpackContext *wpc);
+void free_single_stream (WavpackContext *wpc, WavpackStream *wps);
+unsigned char *get_block_buffer (WavpackContext *wpc, uint32_t size);
+void release_block_buffer (WavpackContext *wpc, unsigned char *buffer);
+int read_block_buffer (WavpackContext *wpc, void *id, WavpackHeader *wphdr, unsigned char **buffer);
+void store_block_header (WavpackContext *wpc, unsigned char **buffer, WavpackHeader *wphdr);
+WavpackStream *get_spare_stream (WavpackContext *wpc);
+void release_stream (WavpackContext *wpc, WavpackStream *wps);
+void free_spare_buffers (WavpackContext *wpc);
+int32_t seek_index_find (WavpackContext *wpc, int64_t sample);
+void seek_index_add (WavpackContext *wpc, int64_t block_index, uint32_t block_samples, int64_t filepos, int64_t file2pos);
 
 /////////////////////////////////// tag utilities ////////////////////////////////////
 // modules: tags.c, tag_utils.c
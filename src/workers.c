@@ -0,0 +1,344 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** WAVPACK ****                            //
+//                  Hybrid Lossless Wavefile Compressor                   //
+//              Copyright (c) 1998 - 2024 David Bryant.                   //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// workers.c
+
+// This module provides a simple pool of worker threads that the encoder and
+// decoder use to run independent pieces of work concurrently. Jobs are queued
+// in FIFO order and the caller waits for each job individually. If a job is
+// still waiting in the queue when the caller needs its result, the caller just
+// runs it directly, so a pool with busy (or no) threads can never deadlock.
+// If the library is built without ENABLE_THREADS, or the pool could not be
+// created, all jobs are simply executed inline when they are submitted.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavpack_local.h"
+
+#ifdef ENABLE_THREADS
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+
+typedef HANDLE wp_thread_t;
+typedef CRITICAL_SECTION wp_mutex_t;
+typedef CONDITION_VARIABLE wp_cond_t;
+
+#define wp_mutex_init(m)        InitializeCriticalSection (m)
+#define wp_mutex_destroy(m)     DeleteCriticalSection (m)
+#define wp_mutex_lock(m)        EnterCriticalSection (m)
+#define wp_mutex_unlock(m)      LeaveCriticalSection (m)
+#define wp_cond_init(c)         InitializeConditionVariable (c)
+#define wp_cond_destroy(c)
+#define wp_cond_wait(c,m)       SleepConditionVariableCS (c, m, INFINITE)
+#define wp_cond_signal(c)       WakeConditionVariable (c)
+#define wp_cond_broadcast(c)    WakeAllConditionVariable (c)
+#else
+#include <pthread.h>
+
+typedef pthread_t wp_thread_t;
+typedef pthread_mutex_t wp_mutex_t;
+typedef pthread_cond_t wp_cond_t;
+
+#define wp_mutex_init(m)        pthread_mutex_init (m, NULL)
+#define wp_mutex_destroy(m)     pthread_mutex_destroy (m)
+#define wp_mutex_lock(m)        pthread_mutex_lock (m)
+#define wp_mutex_unlock(m)      pthread_mutex_unlock (m)
+#define wp_cond_init(c)         pthread_cond_init (c, NULL)
+#define wp_cond_destroy(c)      pthread_cond_destroy (c)
+#define wp_cond_wait(c,m)       pthread_cond_wait (c, m)
+#define wp_cond_signal(c)       pthread_cond_signal (c)
+#define wp_cond_broadcast(c)    pthread_cond_broadcast (c)
+#endif
+
+typedef struct {
+    wp_mutex_t mutex;
+    wp_cond_t job_queued, job_done;
+    WorkerJob *head, *tail;
+    int num_threads, shutdown;
+    wp_thread_t *threads;
+} WorkerPool;
+
+static void run_job (WorkerPool *pool, WorkerJob *job)
+{
+    job->function (job->param);
+
+    wp_mutex_lock (&pool->mutex);
+    job->state = JOB_DONE;
+    wp_cond_broadcast (&pool->job_done);
+    wp_mutex_unlock (&pool->mutex);
+}
+
+#ifdef _WIN32
+static unsigned __stdcall worker_thread (void *param)
+#else
+static void *worker_thread (void *param)
+#endif
+{
+    WorkerPool *pool = param;
+
+    while (1) {
+        WorkerJob *job;
+
+        wp_mutex_lock (&pool->mutex);
+
+        while (!pool->head && !pool->shutdown)
+            wp_cond_wait (&pool->job_queued, &pool->mutex);
+
+        if (!pool->head) {
+            wp_mutex_unlock (&pool->mutex);
+            break;
+        }
+
+        job = pool->head;
+
+        if (!(pool->head = job->next))
+            pool->tail = NULL;
+
+        job->state = JOB_RUNNING;
+        wp_mutex_unlock (&pool->mutex);
+        run_job (pool, job);
+    }
+
+    return 0;
+}
+
+// Create a pool of the specified number of worker threads. A NULL return
+// indicates that no threads could be started, in which case the caller may
+// still pass the NULL pool to the other functions and all jobs will simply
+// be executed inline.
+
+void *workers_create (int num_threads)
+{
+    WorkerPool *pool;
+
+    if (num_threads <= 0 || !(pool = wp_calloc (1, sizeof (WorkerPool))))
+        return NULL;
+
+    if (!(pool->threads = wp_malloc (num_threads * sizeof (wp_thread_t)))) {
+        wp_free (pool);
+        return NULL;
+    }
+
+    wp_mutex_init (&pool->mutex);
+    wp_cond_init (&pool->job_queued);
+    wp_cond_init (&pool->job_done);
+
+    while (pool->num_threads < num_threads) {
+#ifdef _WIN32
+        wp_thread_t thread = (HANDLE) _beginthreadex (NULL, 0, worker_thread, pool, 0, NULL);
+
+        if (!thread)
+            break;
+#else
+        wp_thread_t thread;
+
+        if (pthread_create (&thread, NULL, worker_thread, pool))
+            break;
+#endif
+        pool->threads [pool->num_threads++] = thread;
+    }
+
+    if (!pool->num_threads) {
+        workers_destroy (pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+// Stop and join all the threads in the pool and free it. Any jobs still in the
+// queue are executed first, but normally the caller has already waited for all
+// the jobs it has submitted.
+
+void workers_destroy (void *workers)
+{
+    WorkerPool *pool = workers;
+    int i;
+
+    if (!pool)
+        return;
+
+    wp_mutex_lock (&pool->mutex);
+    pool->shutdown = TRUE;
+    wp_cond_broadcast (&pool->job_queued);
+    wp_mutex_unlock (&pool->mutex);
+
+    for (i = 0; i < pool->num_threads; ++i) {
+#ifdef _WIN32
+        WaitForSingleObject (pool->threads [i], INFINITE);
+        CloseHandle (pool->threads [i]);
+#else
+        pthread_join (pool->threads [i], NULL);
+#endif
+    }
+
+    wp_cond_destroy (&pool->job_done);
+    wp_cond_destroy (&pool->job_queued);
+    wp_mutex_destroy (&pool->mutex);
+    wp_free (pool->threads);
+    wp_free (pool);
+}
+
+// Return the number of threads actually running in the pool (0 for NULL pool).
+
+int workers_count (void *workers)
+{
+    return workers ? ((WorkerPool *) workers)->num_threads : 0;
+}
+
+// Queue the specified job to be run on the next available worker thread. The
+// "function" and "param" fields of the job must be filled in by the caller and
+// the job structure must remain valid until workers_wait() returns for it.
+
+void workers_submit (void *workers, WorkerJob *job)
+{
+    WorkerPool *pool = workers;
+
+    if (!pool) {
+        job->state = JOB_RUNNING;
+        job->function (job->param);
+        job->state = JOB_DONE;
+        return;
+    }
+
+    job->next = NULL;
+    wp_mutex_lock (&pool->mutex);
+    job->state = JOB_QUEUED;
+
+    if (pool->tail)
+        pool->tail = pool->tail->next = job;
+    else
+        pool->head = pool->tail = job;
+
+    wp_cond_signal (&pool->job_queued);
+    wp_mutex_unlock (&pool->mutex);
+}
+
+// Wait for the specified job to complete. If no worker thread has picked up
+// the job yet, it's removed from the queue and executed here instead.
+
+void workers_wait (void *workers, WorkerJob *job)
+{
+    WorkerPool *pool = workers;
+
+    if (!pool)
+        return;
+
+    wp_mutex_lock (&pool->mutex);
+
+    if (job->state == JOB_IDLE) {
+        wp_mutex_unlock (&pool->mutex);
+        return;
+    }
+
+    if (job->state == JOB_QUEUED) {
+        WorkerJob **jpp = &pool->head, *prev = NULL;
+
+        while (*jpp != job) {
+            prev = *jpp;
+            jpp = &prev->next;
+        }
+
+        if (!(*jpp = job->next))
+            pool->tail = prev;
+
+        job->state = JOB_RUNNING;
+        wp_mutex_unlock (&pool->mutex);
+        run_job (pool, job);
+        return;
+    }
+
+    while (job->state != JOB_DONE)
+        wp_cond_wait (&pool->job_done, &pool->mutex);
+
+    wp_mutex_unlock (&pool->mutex);
+}
+
+// A plain mutex for other modules that need to serialize access to shared state
+// (the arena allocator, the block cache, the range readers, the prefetch reader
+// and the batch prober). This is allocated from the C runtime because it's used
+// to implement the library's own allocator.
+
+void *workers_mutex_create (void)
+{
+    wp_mutex_t *mutex = malloc (sizeof (wp_mutex_t));
+
+    if (mutex)
+        wp_mutex_init (mutex);
+
+    return mutex;
+}
+
+void workers_mutex_destroy (void *mutex)
+{
+    if (mutex) {
+        wp_mutex_destroy ((wp_mutex_t *) mutex);
+        free (mutex);
+    }
+}
+
+void workers_mutex_lock (void *mutex)
+{
+    if (mutex)
+        wp_mutex_lock ((wp_mutex_t *) mutex);
+}
+
+void workers_mutex_unlock (void *mutex)
+{
+    if (mutex)
+        wp_mutex_unlock ((wp_mutex_t *) mutex);
+}
+
+#else
+
+void *workers_create (int num_threads)
+{
+    return NULL;
+}
+
+void workers_destroy (void *workers)
+{
+}
+
+int workers_count (void *workers)
+{
+    return 0;
+}
+
+void workers_submit (void *workers, WorkerJob *job)
+{
+    job->state = JOB_RUNNING;
+    job->function (job->param);
+    job->state = JOB_DONE;
+}
+
+void workers_wait (void *workers, WorkerJob *job)
+{
+}
+
+void *workers_mutex_create (void)
+{
+    return NULL;
+}
+
+void workers_mutex_destroy (void *mutex)
+{
+}
+
+void workers_mutex_lock (void *mutex)
+{
+}
+
+void workers_mutex_unlock (void *mutex)
+{
+}
+
+#endif
@@ -101,7 +101,7 @@ void write_entropy_vars (WavpackStream *wps, WavpackMetadata *wpmd)
     unsigned char *byteptr;
     int temp;
 
-    byteptr = wpmd->data = malloc (12);
+    byteptr = wpmd->data = wp_malloc (12);
     wpmd->id = ID_ENTROPY_VARS;
 
     *byteptr++ = temp = wp_log2 (wps->w.c [0].median [0]);
@@ -137,7 +137,7 @@ void write_hybrid_profile (WavpackStream *wps, WavpackMetadata *wpmd)
     int temp;
 
     word_set_bitrate (wps);
-    byteptr = wpmd->data = malloc (512);
+    byteptr = wpmd->data = wp_malloc (512);
     wpmd->id = ID_HYBRID_PROFILE;
 
     if (wps->wphdr.flags & HYBRID_BITRATE) {